@@ -0,0 +1,125 @@
+// directory update benchmark: lock-server locking against versioned
+// compare-and-swap puts, with several clients creating and removing
+// files in one shared directory
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <string>
+
+#include "yfs_client.h"
+
+static std::string extent_dst, lock_dst;
+static int nops = 200;
+
+struct client {
+  pthread_t th;
+  int n;
+  bool cas;
+  yfs_client::inum dir;
+  int errors;
+};
+
+static void *
+client_thread(void *x)
+{
+  client *c = (client *) x;
+  yfs_client yfs(extent_dst, lock_dst, c->cas);
+  for (int i = 0; i < nops; i++) {
+    char name[64];
+    sprintf(name, "c%d-%d", c->n, i);
+    yfs_client::inum f;
+    if (yfs.createnode(c->dir, name, f) != yfs_client::OK)
+      c->errors++;
+    if (yfs.unlink(c->dir, name) != yfs_client::OK)
+      c->errors++;
+  }
+  return 0;
+}
+
+// ops per second for nclients each creating and unlinking nops files
+static double
+measure(bool cas, int nclients, int &errors)
+{
+  yfs_client yfs(extent_dst, lock_dst, cas);
+  char name[64];
+  sprintf(name, "dir_bench.%d.%d.%d", getpid(), cas, nclients);
+  yfs_client::inum dir;
+  if (yfs.createdir(1, name, dir) != yfs_client::OK) {
+    fprintf(stderr, "dir_bench: cannot create %s\n", name);
+    exit(1);
+  }
+
+  client *cs = new client[nclients];
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < nclients; i++) {
+    cs[i].n = i;
+    cs[i].cas = cas;
+    cs[i].dir = dir;
+    cs[i].errors = 0;
+    assert(pthread_create(&cs[i].th, NULL, client_thread, &cs[i]) == 0);
+  }
+  errors = 0;
+  for (int i = 0; i < nclients; i++) {
+    assert(pthread_join(cs[i].th, NULL) == 0);
+    errors += cs[i].errors;
+  }
+  gettimeofday(&end, NULL);
+  delete [] cs;
+  yfs.unlink(1, name);
+
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  return 2.0 * nclients * nops / secs;
+}
+
+static void
+usage(const char *p)
+{
+  fprintf(stderr, "Usage: %s [-c max clients] [-n creates per client] "
+      "extent_server[,extent_server...] lock_server\n", p);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxclients = 8;
+  int ch;
+  while ((ch = getopt(argc, argv, "c:n:")) != -1) {
+    switch (ch) {
+      case 'c': maxclients = atoi(optarg); break;
+      case 'n': nops = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || maxclients < 1 || nops < 1)
+    usage(argv[0]);
+  extent_dst = argv[optind];
+  lock_dst = argv[optind + 1];
+
+  // yfs_client narrates every call on stdout; keep it for the results
+  FILE *out = fdopen(dup(1), "w");
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, 1);
+  close(null);
+  setvbuf(out, NULL, _IONBF, 0);
+
+  fprintf(out, "%d creates and unlinks per client in one directory\n", nops);
+  fprintf(out, "%8s %16s %16s %8s\n", "clients", "locked ops/s", "cas ops/s",
+      "speedup");
+  for (int n = 1; n <= maxclients; n *= 2) {
+    int lerr, cerr;
+    double locked = measure(false, n, lerr);
+    double cas = measure(true, n, cerr);
+    fprintf(out, "%8d %16.0f %16.0f %7.2fx", n, locked, cas, cas / locked);
+    if (lerr || cerr)
+      fprintf(out, "  (%d/%d errors)", lerr, cerr);
+    fprintf(out, "\n");
+  }
+  return 0;
+}
@@ -0,0 +1,352 @@
+// extent storage backends
+
+#include "extent_backend.h"
+#include "extent_log.h"
+#include "extent_block.h"
+#include "extent_slab.h"
+#include "extent_tier.h"
+#include "extent_dedup.h"
+#include "extent_compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// with EXTENT_MEM_MB set, an in-memory backend keeps that many
+// megabytes and spills the rest to a file, EXTENT_SPILL (by default
+// /tmp/extent_spill.<pid>) of EXTENT_SPILL_MB (default 4096). the
+// file is unlinked as soon as it is open; its contents die with the
+// server like the rest of memory.
+static extent_backend *
+budgeted(extent_backend *hot)
+{
+  char *env = getenv("EXTENT_MEM_MB");
+  if (env == NULL || atoi(env) <= 0)
+    return hot;
+  unsigned long long budget = (unsigned long long) atoi(env) << 20;
+  int mb = 4096;
+  env = getenv("EXTENT_SPILL_MB");
+  if (env != NULL && atoi(env) > 0)
+    mb = atoi(env);
+  char path[256];
+  env = getenv("EXTENT_SPILL");
+  if (env != NULL && *env != '\0')
+    snprintf(path, sizeof(path), "%s", env);
+  else
+    snprintf(path, sizeof(path), "/tmp/extent_spill.%d", (int) getpid());
+  unlink(path);
+  extent_backend *cold = new block_backend(path, (unsigned long long) mb << 20,
+                                           true, false);
+  unlink(path);
+  return new tier_backend(hot, cold, budget);
+}
+
+static extent_backend *
+build(const char *spec)
+{
+  if (spec == NULL || *spec == '\0' || strcmp(spec, "slab") == 0) {
+    // EXTENT_SNAPSHOT names the snapshot file, restored at startup;
+    // EXTENT_SNAPSHOT_SECS takes one that often as well as on request
+    char *file = getenv("EXTENT_SNAPSHOT");
+    char *env = getenv("EXTENT_SNAPSHOT_SECS");
+    return budgeted(new slab_backend(file ? file : "", env ? atoi(env) : 0));
+  }
+  if (strcmp(spec, "mem") == 0)
+    return budgeted(new mem_backend());
+  if (strcmp(spec, "dedup") == 0)
+    return budgeted(new dedup_backend());
+
+  if (strncmp(spec, "log:", 4) == 0 && spec[4] != '\0') {
+    // EXTENT_LOG_SEGMENT_MB sizes the segment files, EXTENT_LOG_SYNC=0
+    // acknowledges puts before they reach the disk
+    int segmb = 64;
+    bool sync = true;
+    char *env = getenv("EXTENT_LOG_SEGMENT_MB");
+    if (env != NULL && atoi(env) > 0)
+      segmb = atoi(env);
+    env = getenv("EXTENT_LOG_SYNC");
+    if (env != NULL)
+      sync = atoi(env) != 0;
+    return new log_backend(spec + 4, (unsigned long long) segmb << 20, sync);
+  }
+
+  if (strncmp(spec, "block:", 6) == 0 && spec[6] != '\0') {
+    // EXTENT_BLOCK_MB sizes a new block file, EXTENT_BLOCK_SYNC=1 waits
+    // for fdatasync, EXTENT_BLOCK_IO=pread goes through the page cache
+    // instead of O_DIRECT and io_uring
+    int mb = 1024;
+    bool sync = false, direct = true;
+    char *env = getenv("EXTENT_BLOCK_MB");
+    if (env != NULL && atoi(env) > 0)
+      mb = atoi(env);
+    env = getenv("EXTENT_BLOCK_SYNC");
+    if (env != NULL)
+      sync = atoi(env) != 0;
+    env = getenv("EXTENT_BLOCK_IO");
+    if (env != NULL && strcmp(env, "pread") == 0)
+      direct = false;
+    return new block_backend(spec + 6, (unsigned long long) mb << 20, direct,
+                             sync);
+  }
+
+  fprintf(stderr, "extent_backend: unknown backend %s\n", spec);
+  return NULL;
+}
+
+// EXTENT_COMPRESS=<bytes> compresses extents of at least that size
+// on their way into whichever backend
+extent_backend *
+extent_backend::create(const char *spec)
+{
+  extent_backend *b = build(spec);
+  char *env = getenv("EXTENT_COMPRESS");
+  if (b == NULL || env == NULL || atoi(env) <= 0)
+    return b;
+  return new compress_backend(b, atoi(env));
+}
+
+namespace {
+  // the splice shared by the default and in-memory writes
+  void splice(extent_entry &e, bool found, unsigned int off,
+              const std::string &data, bool append,
+              unsigned long long version)
+  {
+    unsigned int now = time(NULL);
+    if (!found)
+      e.a.atime = now;
+    if (append)
+      off = e.data.size();
+    if (e.data.size() < off + data.size())
+      e.data.resize(off + data.size(), '\0');
+    e.data.replace(off, data.size(), data);
+    e.a.size = e.data.size();
+    e.a.mtime = now;
+    e.a.ctime = now;
+    e.a.version = version;
+  }
+
+  bool too_big(unsigned int off, const std::string &data)
+  {
+    return (unsigned long long) off + data.size() > extent_protocol::maxextent;
+  }
+
+  // the cut or fill shared by the default and in-memory resizes
+  void cut(extent_entry &e, bool found, unsigned int size,
+           unsigned long long version)
+  {
+    unsigned int now = time(NULL);
+    if (!found)
+      e.a.atime = now;
+    e.data.resize(size, '\0');
+    e.a.size = size;
+    e.a.mtime = now;
+    e.a.ctime = now;
+    e.a.version = version;
+  }
+}
+
+void
+extent_backend::stats(std::string &out)
+{
+  out.clear();
+}
+
+int
+extent_backend::snapshot()
+{
+  return extent_protocol::IOERR;
+}
+
+int
+extent_backend::read(extent_protocol::extentid_t id, unsigned int off,
+                     unsigned int len, std::string &buf)
+{
+  extent_entry e;
+  int r = get(id, e);
+  if (r != extent_protocol::OK)
+    return r;
+  if (off < e.data.size())
+    buf = e.data.substr(off, len);
+  else
+    buf.clear();
+  return extent_protocol::OK;
+}
+
+int
+extent_backend::write(extent_protocol::extentid_t id, unsigned int off,
+                      const std::string &data, bool append,
+                      unsigned long long version, extent_protocol::attr &a)
+{
+  extent_entry e;
+  int r = get(id, e);
+  if (r != extent_protocol::OK && r != extent_protocol::NOENT)
+    return r;
+  if (too_big(append ? e.data.size() : off, data))
+    return extent_protocol::FBIG;
+  splice(e, r == extent_protocol::OK, off, data, append, version);
+  r = put(id, e);
+  if (r == extent_protocol::OK)
+    a = e.a;
+  return r;
+}
+
+int
+extent_backend::resize(extent_protocol::extentid_t id, unsigned int size,
+                       bool create, unsigned long long version,
+                       extent_protocol::attr &a)
+{
+  extent_entry e;
+  int r = get(id, e);
+  if (r != extent_protocol::OK && !(r == extent_protocol::NOENT && create))
+    return r;
+  cut(e, r == extent_protocol::OK, size, version);
+  r = put(id, e);
+  if (r == extent_protocol::OK)
+    a = e.a;
+  return r;
+}
+
+int
+extent_backend::copy(extent_protocol::extentid_t src,
+                     extent_protocol::extentid_t dst, unsigned long long version,
+                     extent_protocol::attr &a)
+{
+  extent_entry e;
+  int r = get(src, e);
+  if (r != extent_protocol::OK)
+    return r;
+  e.a.mtime = e.a.ctime = time(NULL);
+  e.a.version = version;
+  r = put(dst, e);
+  if (r == extent_protocol::OK)
+    a = e.a;
+  return r;
+}
+
+int
+mem_backend::get(extent_protocol::extentid_t id, extent_entry &e)
+{
+  return store.get(id, e) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+namespace {
+  struct copy_attr {
+    copy_attr(extent_protocol::attr &xa) : a(xa) {}
+    void operator()(const extent_entry &e) { a = e.a; }
+    extent_protocol::attr &a;
+  };
+}
+
+int
+mem_backend::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
+{
+  copy_attr f(a);
+  return store.peek(id, f) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int
+mem_backend::put(extent_protocol::extentid_t id, const extent_entry &e)
+{
+  store.put(id, e);
+  return extent_protocol::OK;
+}
+
+int
+mem_backend::remove(extent_protocol::extentid_t id)
+{
+  return store.remove(id) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+void
+mem_backend::ids(std::vector<extent_protocol::extentid_t> &ids)
+{
+  store.keys(ids);
+}
+
+namespace {
+  struct read_range {
+    read_range(unsigned int xoff, unsigned int xlen, std::string &xbuf)
+      : off(xoff), len(xlen), buf(xbuf) {}
+    void operator()(const extent_entry &e) {
+      if (off < e.data.size())
+        buf.assign(e.data, off, len);
+      else
+        buf.clear();
+    }
+    unsigned int off, len;
+    std::string &buf;
+  };
+
+  struct write_range {
+    write_range(unsigned int xoff, const std::string &xdata, bool xappend,
+                unsigned long long xversion)
+      : off(xoff), data(xdata), append(xappend), fbig(false),
+        version(xversion) {}
+    bool operator()(extent_entry &e, bool found) {
+      if (too_big(append ? e.data.size() : off, data)) {
+        fbig = true;
+        return false;
+      }
+      splice(e, found, off, data, append, version);
+      a = e.a;
+      return true;
+    }
+    unsigned int off;
+    const std::string &data;
+    bool append, fbig;
+    unsigned long long version;
+    extent_protocol::attr a;
+  };
+
+  struct resize_to {
+    resize_to(unsigned int xsize, bool xcreate, unsigned long long xversion)
+      : size(xsize), create(xcreate), version(xversion), found(false) {}
+    bool operator()(extent_entry &e, bool xfound) {
+      found = xfound;
+      if (!found && !create)
+        return false;
+      cut(e, found, size, version);
+      a = e.a;
+      return true;
+    }
+    unsigned int size;
+    bool create;
+    unsigned long long version;
+    bool found;
+    extent_protocol::attr a;
+  };
+}
+
+int
+mem_backend::read(extent_protocol::extentid_t id, unsigned int off,
+                  unsigned int len, std::string &buf)
+{
+  read_range f(off, len, buf);
+  return store.peek(id, f) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int
+mem_backend::write(extent_protocol::extentid_t id, unsigned int off,
+                   const std::string &data, bool append,
+                   unsigned long long version, extent_protocol::attr &a)
+{
+  write_range f(off, data, append, version);
+  store.update(id, f);
+  if (f.fbig)
+    return extent_protocol::FBIG;
+  a = f.a;
+  return extent_protocol::OK;
+}
+
+int
+mem_backend::resize(extent_protocol::extentid_t id, unsigned int size,
+                    bool create, unsigned long long version,
+                    extent_protocol::attr &a)
+{
+  resize_to f(size, create, version);
+  if (!store.update(id, f))
+    return extent_protocol::NOENT;
+  a = f.a;
+  return extent_protocol::OK;
+}
@@ -0,0 +1,96 @@
+// where extent_server keeps its extents
+
+#ifndef extent_backend_h
+#define extent_backend_h
+
+#include <string>
+#include <vector>
+#include "extent_protocol.h"
+#include "extent_store.h"
+
+// every call returns an extent_protocol status (OK, NOENT or IOERR,
+// or FBIG where an extent would grow past its limit or the backend
+// has no room left for it) and may be made from any number of threads
+// at once
+class extent_backend {
+ public:
+  virtual ~extent_backend() {}
+
+  virtual int get(extent_protocol::extentid_t id, extent_entry &e) = 0;
+  virtual int getattr(extent_protocol::extentid_t id, 
+                      extent_protocol::attr &a) = 0;
+  // returns once the extent is as durable as the backend makes it
+  virtual int put(extent_protocol::extentid_t id, const extent_entry &e) = 0;
+  virtual int remove(extent_protocol::extentid_t id) = 0;
+  virtual void ids(std::vector<extent_protocol::extentid_t> &ids) = 0;
+
+  // byte-range access. read returns up to len bytes from off, fewer at
+  // the end of the extent. write stores data at off, zero-filling any
+  // gap and creating the extent if it is absent; with append set, off
+  // is ignored and data goes at the end. the extent takes on version,
+  // and a is its attr after the call. the defaults are get, splice and
+  // put, so callers must not run two writes to the same id at once.
+  virtual int read(extent_protocol::extentid_t id, unsigned int off,
+                   unsigned int len, std::string &buf);
+  virtual int write(extent_protocol::extentid_t id, unsigned int off,
+                    const std::string &data, bool append,
+                    unsigned long long version, extent_protocol::attr &a);
+  // cut or zero-fill id's data to size, as of version, creating it
+  // empty first if it is absent and create is set (NOENT if not); a is
+  // its attr after. the default is get, resize and put, with the same
+  // caveat as write.
+  virtual int resize(extent_protocol::extentid_t id, unsigned int size,
+                     bool create, unsigned long long version,
+                     extent_protocol::attr &a);
+  // make dst a copy of src's data at version, replacing whatever dst
+  // held; a is dst's attr after. a backend that can share or move the
+  // data without going through an extent_entry does so; the default
+  // is get and put.
+  virtual int copy(extent_protocol::extentid_t src,
+                   extent_protocol::extentid_t dst, unsigned long long version,
+                   extent_protocol::attr &a);
+
+  // a human-readable account of what the backend holds; empty if it
+  // keeps none
+  virtual void stats(std::string &out);
+  // start writing a point-in-time copy of every extent somewhere it
+  // can be restored from at startup, without holding up other calls.
+  // OK once one is under way, IOERR if the backend has nowhere to put
+  // it or cannot take one (the default).
+  virtual int snapshot();
+
+  // builds the backend named by spec, as found in EXTENT_BACKEND:
+  //   slab         extents packed into size-classed slabs in memory
+  //                (the default); snapshots to EXTENT_SNAPSHOT, if set
+  //   mem          extents in memory, each in its own heap string
+  //   dedup        extents in memory, identical data stored once
+  // any of these spills to disk beyond EXTENT_MEM_MB, if set
+  //   log:<dir>    log-structured segment files in dir
+  //   block:<file> contiguous block runs in one preallocated file
+  // and any of them compresses extents of EXTENT_COMPRESS bytes or
+  // more, if set
+  // returns NULL for a spec it does not understand
+  static extent_backend *create(const char *spec);
+};
+
+class mem_backend : public extent_backend {
+ public:
+  int get(extent_protocol::extentid_t id, extent_entry &e);
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int put(extent_protocol::extentid_t id, const extent_entry &e);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &ids);
+  // in place under the shard lock, without copying the extent
+  int read(extent_protocol::extentid_t id, unsigned int off,
+           unsigned int len, std::string &buf);
+  int write(extent_protocol::extentid_t id, unsigned int off,
+            const std::string &data, bool append, unsigned long long version,
+            extent_protocol::attr &a);
+  int resize(extent_protocol::extentid_t id, unsigned int size, bool create,
+             unsigned long long version, extent_protocol::attr &a);
+
+ private:
+  extent_store store;
+};
+
+#endif
@@ -0,0 +1,888 @@
+// multithreaded get/put benchmark for the extent store, and with -c
+// or -x, self-checks of the extent backends and of shard rebalancing
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <map>
+#include <string>
+
+#include "extent_store.h"
+#include "extent_block.h"
+#include "extent_slab.h"
+#include "extent_log.h"
+#include "extent_tier.h"
+#include "extent_dedup.h"
+#include "extent_compress.h"
+#include "extent_hot.h"
+#include "extent_hash.h"
+#include "extent_client.h"
+#include "rpc/slock.h"
+
+// what extent_server used to do: one std::map behind one mutex
+class map_store {
+ public:
+  map_store() { assert(pthread_mutex_init(&m, 0) == 0); }
+  bool get(extent_protocol::extentid_t id, extent_entry &e) {
+    ScopedLock ml(&m);
+    std::map<extent_protocol::extentid_t, extent_entry>::iterator i = s.find(id);
+    if (i == s.end())
+      return false;
+    e = i->second;
+    return true;
+  }
+  void put(extent_protocol::extentid_t id, const extent_entry &e) {
+    ScopedLock ml(&m);
+    s[id] = e;
+  }
+ private:
+  pthread_mutex_t m;
+  std::map<extent_protocol::extentid_t, extent_entry> s;
+};
+
+static int nkeys = 100000;
+static int valsz = 64;
+static int readpct = 90;
+static int seconds = 1;
+static volatile bool stop;
+
+struct worker {
+  pthread_t th;
+  int seed;
+  unsigned long long ops;
+  void *store;
+  int kind;
+};
+
+enum { MAP, SHARDED, BACKEND };
+
+template<class S> static void
+run(S *s, worker *w)
+{
+  unsigned int seed = w->seed;
+  extent_entry e;
+  e.data = std::string(valsz, 'x');
+  while (!stop) {
+    // inode-like ids in the low bits, block numbers in the high bits
+    unsigned long long r = rand_r(&seed) % nkeys;
+    extent_protocol::extentid_t id = ((r % 16) << 32) | (r / 16);
+    if ((int) (rand_r(&seed) % 100) < readpct) {
+      extent_entry got;
+      s->get(id, got);
+    } else {
+      e.a.size = valsz;
+      s->put(id, e);
+    }
+    w->ops++;
+  }
+}
+
+static void *
+worker_thread(void *x)
+{
+  worker *w = (worker *) x;
+  if (w->kind == SHARDED)
+    run((extent_store *) w->store, w);
+  else if (w->kind == BACKEND)
+    run((extent_backend *) w->store, w);
+  else
+    run((map_store *) w->store, w);
+  return 0;
+}
+
+template<class S> static double
+measure(S *s, int kind, int nthreads)
+{
+  extent_entry e;
+  e.data = std::string(valsz, 'x');
+  for (int r = 0; r < nkeys; r++)
+    s->put(((unsigned long long) (r % 16) << 32) | (r / 16), e);
+
+  worker *ws = new worker[nthreads];
+  stop = false;
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < nthreads; i++) {
+    ws[i].seed = i + 1;
+    ws[i].ops = 0;
+    ws[i].store = s;
+    ws[i].kind = kind;
+    assert(pthread_create(&ws[i].th, NULL, worker_thread, &ws[i]) == 0);
+  }
+  sleep(seconds);
+  stop = true;
+  unsigned long long ops = 0;
+  for (int i = 0; i < nthreads; i++) {
+    assert(pthread_join(ws[i].th, NULL) == 0);
+    ops += ws[i].ops;
+  }
+  gettimeofday(&end, NULL);
+  delete [] ws;
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  return ops / secs;
+}
+
+// the block backend over O_DIRECT and io_uring against the same file
+// read and written with pread/pwrite through the page cache. each
+// backend gets a fresh file sized for the key set.
+static int
+block_bench(const char *file, int maxthreads)
+{
+  unsigned long long blocks = (64 + valsz + 4095) / 4096;
+  unsigned long long size = (nkeys * blocks * 2 + 1024) * 4096;
+  printf("%8s %16s %16s %8s\n", "threads", "pread ops/s", "io_uring ops/s",
+      "speedup");
+  for (int n = 1; n <= maxthreads; n *= 2) {
+    double ops[2];
+    for (int direct = 0; direct < 2; direct++) {
+      unlink(file);
+      block_backend *b = new block_backend(file, size, direct, false);
+      ops[direct] = measure((extent_backend *) b, BACKEND, n);
+      delete b;
+    }
+    printf("%8d %16.0f %16.0f %7.2fx\n", n, ops[0], ops[1], ops[1] / ops[0]);
+  }
+  unlink(file);
+  return 0;
+}
+
+static unsigned long long
+rss()
+{
+  unsigned long long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%llu %llu", &pages, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  return resident * getpagesize();
+}
+
+// resident memory of one backend holding the key set, then after
+// three quarters of it is removed, then after compaction. runs in a
+// child so each backend starts from a fresh heap.
+static void
+memory_one(const char *spec)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    waitpid(pid, NULL, 0);
+    return;
+  }
+  extent_backend *b = extent_backend::create(spec);
+  unsigned long long base = rss();
+  extent_entry e;
+  e.data = std::string(valsz, 'x');
+  for (int r = 0; r < nkeys; r++)
+    b->put(((unsigned long long) (r % 16) << 32) | (r / 16), e);
+  unsigned long long filled = rss() - base;
+  unsigned long long payload = (unsigned long long) nkeys * valsz;
+  for (int r = 0; r < nkeys; r++) {
+    if (r % 4 != 0)
+      b->remove(((unsigned long long) (r % 16) << 32) | (r / 16));
+  }
+  unsigned long long removed = rss() - base;
+  slab_backend *sb = dynamic_cast<slab_backend *>(b);
+  if (sb != NULL)
+    sb->compact();
+  unsigned long long compacted = rss() - base;
+  printf("%8s %12llu %12llu %9.1f%% %12llu %12llu\n", spec, payload, filled,
+      payload ? 100.0 * (filled - payload) / payload : 0.0, removed,
+      compacted);
+  if (sb != NULL) {
+    std::string st;
+    sb->stats(st);
+    printf("\n%s", st.c_str());
+  }
+  fflush(stdout);
+  _exit(0);
+}
+
+static int
+memory_bench()
+{
+  printf("%8s %12s %12s %10s %12s %12s\n", "backend", "payload", "resident",
+      "overhead", "3/4 removed", "compacted");
+  memory_one("mem");
+  memory_one("slab");
+  return 0;
+}
+
+typedef std::map<extent_protocol::extentid_t, std::string> model;
+
+static std::string
+pattern(unsigned int seed, unsigned int len)
+{
+  std::string s(len, '\0');
+  for (unsigned int j = 0; j < len; j++)
+    s[j] = (char) (seed * 31 + j * 7 + j / 13);
+  return s;
+}
+
+static void
+put_data(extent_backend *b, extent_protocol::extentid_t id,
+         const std::string &data, unsigned long long version)
+{
+  extent_entry e;
+  e.data = data;
+  e.a.size = data.size();
+  e.a.atime = e.a.mtime = e.a.ctime = time(NULL);
+  e.a.version = version;
+  assert(b->put(id, e) == extent_protocol::OK);
+}
+
+// a fixed mix of puts of assorted sizes, overwrites and removes,
+// made to b (unless NULL) and to m alike
+static void
+churn(extent_backend *b, model &m, int n)
+{
+  unsigned int seed = 1;
+  for (int i = 0; i < n; i++) {
+    unsigned int f = rand_r(&seed) % (n / 8 + 1);
+    extent_protocol::extentid_t id =
+      ((unsigned long long) (i % 5) << 32) | (0x80000000ULL + f);
+    if (rand_r(&seed) % 8 == 0) {
+      if (b != NULL)
+        assert(b->remove(id) != extent_protocol::IOERR);
+      m.erase(id);
+      continue;
+    }
+    unsigned int len = rand_r(&seed) % 3 == 0 ? rand_r(&seed) % 9000 :
+      rand_r(&seed) % 300;
+    std::string data = pattern(i, len);
+    if (b != NULL)
+      put_data(b, id, data, i + 1);
+    m[id] = data;
+  }
+}
+
+// b holds exactly what m does
+static void
+verify(extent_backend *b, const model &m)
+{
+  std::vector<extent_protocol::extentid_t> ids;
+  b->ids(ids);
+  assert(ids.size() == m.size());
+  for (model::const_iterator it = m.begin(); it != m.end(); it++) {
+    extent_entry e;
+    assert(b->get(it->first, e) == extent_protocol::OK);
+    assert(e.data == it->second && e.a.size == it->second.size());
+  }
+}
+
+static void
+hash_check()
+{
+  printf("hash_check\n");
+  const char *v = "123456789";
+  assert(crc32(0, v, 9) == 0xcbf43926);
+  assert(crc32(crc32(0, v, 4), v + 4, 5) == crc32(0, v, 9));
+  printf("   -- crc32 of the check string, whole and in parts .. ok\n");
+  std::map<unsigned long long, int> seen;
+  for (unsigned long long k = 0; k < 100000; k++)
+    assert(seen.insert(std::make_pair(fmix64(k), 1)).second);
+  printf("   -- fmix64 without collisions over 100000 keys .. ok\n");
+  printf("hash_check OK\n");
+}
+
+// a backend on a file or directory that must come back as it was
+// when the process died without closing it
+static void
+crash_check(extent_backend *(*open)(const std::string &),
+            const std::string &path)
+{
+  model m;
+  churn(NULL, m, 2000);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    model mine;
+    churn(open(path), mine, 2000);
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0);
+  extent_backend *b = open(path);
+  verify(b, m);
+  printf("   -- %lu extents after a crash .. ok\n", m.size());
+  delete b;
+  b = open(path);
+  verify(b, m);
+  printf("   -- %lu extents after a clean close .. ok\n", m.size());
+  delete b;
+}
+
+static extent_backend *
+open_log(const std::string &dir)
+{
+  return new log_backend(dir, 256 << 10, true);
+}
+
+static extent_backend *
+open_block(const std::string &file)
+{
+  return new block_backend(file, 32 << 20, false, true);
+}
+
+// the log backend survives a crash, and a record torn by one at the
+// end of the last segment is cut off
+static void
+log_check(const std::string &scratch)
+{
+  printf("log_check\n");
+  std::string dir = scratch + "/log";
+  assert(mkdir(dir.c_str(), 0755) == 0);
+  crash_check(open_log, dir);
+
+  model m;
+  churn(NULL, m, 2000);
+  std::string last;
+  DIR *d = opendir(dir.c_str());
+  assert(d != NULL);
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    if (strncmp(de->d_name, "seg.", 4) == 0 && de->d_name > last)
+      last = de->d_name;
+  }
+  closedir(d);
+  assert(!last.empty());
+  int fd = open((dir + "/" + last).c_str(), O_WRONLY | O_APPEND);
+  assert(fd >= 0);
+  std::string junk(100, 'Z');
+  assert(write(fd, junk.data(), junk.size()) == (ssize_t) junk.size());
+  close(fd);
+  extent_backend *b = open_log(dir);
+  verify(b, m);
+  put_data(b, 1, "after", 1);
+  delete b;
+  b = open_log(dir);
+  m[1] = "after";
+  verify(b, m);
+  delete b;
+  printf("   -- torn record at the end of %s cut off .. ok\n", last.c_str());
+  printf("log_check OK\n");
+}
+
+static void
+block_check(const std::string &scratch)
+{
+  printf("block_check\n");
+  crash_check(open_block, scratch + "/blocks");
+  printf("block_check OK\n");
+}
+
+// slab contents survive removes, compaction and copies
+static void
+slab_check()
+{
+  printf("slab_check\n");
+  slab_backend *b = new slab_backend();
+  model m;
+  churn(b, m, 4000);
+  verify(b, m);
+  model::iterator it = m.begin();
+  for (int i = 0; it != m.end(); i++) {
+    if (i % 4 == 0) {
+      it++;
+      continue;
+    }
+    assert(b->remove(it->first) == extent_protocol::OK);
+    m.erase(it++);
+  }
+  unsigned long long moved = b->compact();
+  verify(b, m);
+  printf("   -- %lu extents intact after compaction moved %llu .. ok\n",
+         m.size(), moved);
+  extent_protocol::extentid_t src = m.begin()->first, dst = 7;
+  extent_protocol::attr a;
+  assert(b->copy(src, dst, 99, a) == extent_protocol::OK);
+  assert(a.size == m[src].size() && a.version == 99);
+  m[dst] = m[src];
+  b->compact();
+  verify(b, m);
+  printf("   -- copy .. ok\n");
+  delete b;
+  printf("slab_check OK\n");
+}
+
+// each writer puts its own SNAPIDS ids in turn, over and over, each
+// time with the next generation, until stop
+enum { SNAPWRITERS = 4, SNAPIDS = 1000 };
+static slab_backend *snapb;
+
+static void *
+snapshot_load(void *x)
+{
+  int base = (long) x * SNAPIDS;
+  for (int gen = 1; !stop; gen++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", gen);
+    for (int i = 0; i < SNAPIDS; i++)
+      put_data(snapb, base + i, buf, gen);
+  }
+  return 0;
+}
+
+// a snapshot restores what the store held when it was taken, and a
+// damaged one is refused
+static void
+snapshot_check(const std::string &scratch)
+{
+  printf("snapshot_check\n");
+  std::string file = scratch + "/snap";
+  slab_backend *b = new slab_backend(file);
+  model m;
+  churn(b, m, 3000);
+  assert(b->snapshot() == extent_protocol::OK);
+  struct stat sb;
+  for (int i = 0; i < 500 && stat(file.c_str(), &sb) != 0; i++)
+    usleep(10000);
+  assert(stat(file.c_str(), &sb) == 0);
+  // changes after the snapshot stay out of it
+  put_data(b, m.begin()->first, "later", 1);
+  assert(b->remove(m.rbegin()->first) == extent_protocol::OK);
+  delete b;
+  b = new slab_backend(file);
+  verify(b, m);
+  delete b;
+  printf("   -- %lu extents restored .. ok\n", m.size());
+
+  assert(truncate(file.c_str(), sb.st_size - 5) == 0);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    new slab_backend(file);
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 1);
+  printf("   -- truncated snapshot refused .. ok\n");
+
+  // at any one instant each writer has left its ids up to some point
+  // at one generation and the rest at the one before, and a snapshot
+  // taken while they run has to show the same
+  assert(unlink(file.c_str()) == 0);
+  for (int round = 0; round < 20; round++) {
+    b = snapb = new slab_backend(file);
+    for (int i = 0; i < SNAPWRITERS * SNAPIDS; i++)
+      put_data(b, i, "0", 0);
+    stop = false;
+    pthread_t th[SNAPWRITERS];
+    for (long w = 0; w < SNAPWRITERS; w++)
+      assert(pthread_create(&th[w], NULL, snapshot_load, (void *) w) == 0);
+    usleep(20000);
+    assert(b->snapshot() == extent_protocol::OK);
+    for (int i = 0; i < 500 && stat(file.c_str(), &sb) != 0; i++)
+      usleep(10000);
+    assert(stat(file.c_str(), &sb) == 0);
+    stop = true;
+    for (int w = 0; w < SNAPWRITERS; w++)
+      assert(pthread_join(th[w], NULL) == 0);
+    delete b;
+    b = new slab_backend(file);
+    int first = -1, last = -1;
+    for (int i = 0; i < SNAPWRITERS * SNAPIDS; i++) {
+      extent_entry e;
+      assert(b->get(i, e) == extent_protocol::OK);
+      int gen = atoi(e.data.c_str());
+      if (i % SNAPIDS == 0)
+        first = last = gen;
+      // the newer generation first, then the older
+      assert(gen == first ? last == first : gen == first - 1);
+      last = gen;
+    }
+    delete b;
+    assert(unlink(file.c_str()) == 0);
+  }
+  printf("   -- snapshots taken under a steady stream of puts .. ok\n");
+  printf("snapshot_check OK\n");
+}
+
+// 2Q: a working set touched twice survives a scan larger than the
+// budget, and everything spilled reads back
+static void
+tier_check()
+{
+  printf("tier_check\n");
+  mem_backend *hot = new mem_backend();
+  // 64 extents of 1000 bytes, with the tier's overhead for each
+  tier_backend *b = new tier_backend(hot, new mem_backend(), 64 * 1064);
+  model m;
+  for (int i = 0; i < 16; i++) {
+    std::string d = pattern(i, 1000);
+    put_data(b, 0x80000000ULL + i, d, i + 1);
+    m[0x80000000ULL + i] = d;
+  }
+  // a short scan pushes the working set out, and reading it back while
+  // it is remembered moves it to the frequent list; a long one then
+  // has to pass it by
+  for (int pass = 0; pass < 2; pass++) {
+    int n = pass == 0 ? 64 : 400;
+    for (int i = 0; i < n; i++) {
+      extent_protocol::extentid_t id = 0x80010000ULL + pass * 1000 + i;
+      std::string d = pattern(id, 1000);
+      put_data(b, id, d, i + 1);
+      m[id] = d;
+    }
+    if (pass == 0) {
+      for (int i = 0; i < 16; i++) {
+        extent_protocol::attr a;
+        assert(hot->getattr(0x80000000ULL + i, a) == extent_protocol::NOENT);
+        extent_entry e;
+        assert(b->get(0x80000000ULL + i, e) == extent_protocol::OK);
+      }
+    }
+  }
+  for (int i = 0; i < 16; i++) {
+    extent_protocol::attr a;
+    assert(hot->getattr(0x80000000ULL + i, a) == extent_protocol::OK);
+  }
+  printf("   -- working set kept in memory through a scan .. ok\n");
+  std::vector<extent_protocol::extentid_t> ids;
+  hot->ids(ids);
+  assert(ids.size() <= 64);
+  verify(b, m);
+  printf("   -- %lu extents read back over a %lu extent budget .. ok\n",
+         m.size(), ids.size());
+  delete b;
+  printf("tier_check OK\n");
+}
+
+static unsigned long long
+stat_of(extent_backend *b, const char *name)
+{
+  std::string st;
+  b->stats(st);
+  const char *p = strstr(st.c_str(), name);
+  unsigned long long n = 0;
+  assert(p != NULL && sscanf(p + strlen(name), "%llu", &n) == 1);
+  return n;
+}
+
+// identical data is stored once, and stays while any extent holds it
+static void
+dedup_check()
+{
+  printf("dedup_check\n");
+  dedup_backend *b = new dedup_backend();
+  model m;
+  std::string shared = pattern(1, 4096);
+  for (int i = 0; i < 100; i++) {
+    put_data(b, i, shared, 1);
+    m[i] = shared;
+  }
+  for (int i = 100; i < 110; i++) {
+    put_data(b, i, pattern(i, 4096), 1);
+    m[i] = pattern(i, 4096);
+  }
+  assert(stat_of(b, "payloads ") == 11);
+  printf("   -- 110 extents in 11 payloads .. ok\n");
+  for (int i = 0; i < 99; i++) {
+    if (i % 2 == 0) {
+      assert(b->remove(i) == extent_protocol::OK);
+      m.erase(i);
+    } else {
+      put_data(b, i, pattern(i, 100), 2);
+      m[i] = pattern(i, 100);
+    }
+  }
+  verify(b, m);
+  printf("   -- shared data kept for the last holder .. ok\n");
+  delete b;
+  printf("dedup_check OK\n");
+}
+
+// the LZ codec round-trips whatever it is given, and incompressible
+// files do not stop the others being compressed
+static void
+compress_check()
+{
+  printf("compress_check\n");
+  mem_backend *under = new mem_backend();
+  compress_backend *b = new compress_backend(under, 64);
+  model m;
+  std::vector<std::string> cases;
+  cases.push_back("");
+  cases.push_back("short");
+  cases.push_back(std::string(100000, 'a'));
+  cases.push_back(std::string("\xfeyz\x01Z\x10\0\0\0", 9) + std::string(200, 'q'));
+  cases.push_back(std::string("\xfeyz\x01", 4));
+  std::string text;
+  for (int i = 0; text.size() < 8000; i++) {
+    char line[64];
+    snprintf(line, sizeof(line), "line %d of some text that repeats\n", i % 37);
+    text += line;
+  }
+  cases.push_back(text);
+  unsigned int seed = 7;
+  std::string noise(8000, '\0');
+  for (unsigned int i = 0; i < noise.size(); i++)
+    noise[i] = (char) rand_r(&seed);
+  cases.push_back(noise);
+  for (unsigned int i = 0; i < cases.size(); i++) {
+    put_data(b, 0x80000000ULL + i, cases[i], 1);
+    m[0x80000000ULL + i] = cases[i];
+  }
+  verify(b, m);
+  extent_entry e;
+  assert(under->get(0x80000000ULL + 5, e) == extent_protocol::OK);
+  assert(e.data.size() < text.size() / 2);
+  printf("   -- %lu awkward extents round-trip .. ok\n", cases.size());
+
+  // one file of noise, then text in another
+  for (int i = 0; i < 50; i++) {
+    for (unsigned int j = 0; j < noise.size(); j++)
+      noise[j] = (char) rand_r(&seed);
+    put_data(b, ((unsigned long long) i << 32) | 0x80000100ULL, noise, 1);
+  }
+  for (int i = 0; i < 20; i++)
+    put_data(b, ((unsigned long long) i << 32) | 0x80000200ULL, text, 1);
+  for (int i = 0; i < 20; i++) {
+    assert(under->get(((unsigned long long) i << 32) | 0x80000200ULL, e) ==
+           extent_protocol::OK);
+    assert(e.data.size() < text.size() / 2);
+  }
+  printf("   -- a file of noise leaves another compressed .. ok\n");
+  delete b;
+  printf("compress_check OK\n");
+}
+
+// resize cuts and zero-fills in every backend
+static void
+resize_check(const std::string &scratch)
+{
+  printf("resize_check\n");
+  std::string logdir = scratch + "/resize";
+  assert(mkdir(logdir.c_str(), 0755) == 0);
+  const char *names[] = { "mem", "slab", "dedup", "log", "block", "compress",
+                          "tier" };
+  extent_backend *bs[] = {
+    new mem_backend(), new slab_backend(), new dedup_backend(),
+    new log_backend(logdir, 1 << 20, false),
+    new block_backend(scratch + "/resize.blk", 4 << 20, false, false),
+    new compress_backend(new mem_backend(), 64),
+    new tier_backend(new mem_backend(), new mem_backend(), 4000),
+  };
+  for (unsigned int i = 0; i < sizeof(bs) / sizeof(bs[0]); i++) {
+    extent_backend *b = bs[i];
+    std::string d(3000, 'r');
+    put_data(b, 1, d, 1);
+    extent_protocol::attr a;
+    assert(b->resize(1, 1000, false, 2, a) == extent_protocol::OK);
+    assert(a.size == 1000 && a.version == 2);
+    extent_entry e;
+    assert(b->get(1, e) == extent_protocol::OK && e.data == d.substr(0, 1000));
+    assert(b->resize(1, 2500, false, 3, a) == extent_protocol::OK);
+    assert(b->get(1, e) == extent_protocol::OK && e.a.version == 3 &&
+           e.data == d.substr(0, 1000) + std::string(1500, '\0'));
+    assert(b->resize(2, 10, false, 4, a) == extent_protocol::NOENT);
+    assert(b->resize(2, 10, true, 4, a) == extent_protocol::OK);
+    assert(b->get(2, e) == extent_protocol::OK &&
+           e.data == std::string(10, '\0'));
+    printf("   -- %s .. ok\n", names[i]);
+    delete b;
+  }
+  printf("resize_check OK\n");
+}
+
+// the heavy keys of a skewed stream are listed with bounds that hold
+static void
+topk_check()
+{
+  printf("topk_check\n");
+  topk t(64, 1024);
+  std::map<unsigned long long, unsigned long long> truth;
+  unsigned int seed = 3;
+  unsigned long long sum = 0;
+  for (int i = 0; i < 200000; i++) {
+    unsigned long long key, w = 1 + rand_r(&seed) % 4;
+    if (i % 4 == 0)
+      key = 1 + rand_r(&seed) % 8;
+    else
+      key = 1000 + rand_r(&seed) % 50000;
+    t.add(key, w);
+    truth[key] += w;
+    sum += w;
+  }
+  assert(t.total() == sum);
+  std::vector<topk::item> top;
+  t.top(8, top);
+  assert(top.size() == 8);
+  for (unsigned int i = 0; i < top.size(); i++) {
+    assert(top[i].key >= 1 && top[i].key <= 8);
+    unsigned long long c = truth[top[i].key];
+    assert(top[i].least <= c && c <= top[i].count);
+    assert(i == 0 || top[i].count <= top[i - 1].count);
+  }
+  printf("   -- the 8 heavy keys of 50008, within their bounds .. ok\n");
+  printf("topk_check OK\n");
+}
+
+static int
+check(const char *dir)
+{
+  std::string scratch = std::string(dir) + "/extent_check.XXXXXX";
+  if (mkdtemp(&scratch[0]) == NULL) {
+    perror(dir);
+    return 1;
+  }
+  hash_check();
+  log_check(scratch);
+  block_check(scratch);
+  slab_check();
+  snapshot_check(scratch);
+  tier_check();
+  dedup_check();
+  compress_check();
+  resize_check(scratch);
+  topk_check();
+  std::string rm = "rm -rf " + scratch;
+  if (system(rm.c_str()) != 0)
+    fprintf(stderr, "cannot remove %s\n", scratch.c_str());
+  printf("extent_bench: passed all checks successfully\n");
+  return 0;
+}
+
+// rebalancing onto a new shard under load, as seen by a client that
+// never heard of it; shards names running extent servers that the
+// shard at add then joins
+static extent_client *adder, *other;
+static int gens[300];
+
+static extent_protocol::extentid_t
+block_id(int f, int b)
+{
+  return ((unsigned long long) b << 32) | (0x80000000ULL + f);
+}
+
+static void *
+rebalance_load(void *)
+{
+  unsigned int seed = 5;
+  while (!stop) {
+    int f = rand_r(&seed) % 300, b = rand_r(&seed) % 4;
+    std::string got;
+    assert(other->get(block_id(f, b), got) == extent_protocol::OK);
+    assert(got == pattern(f * 4 + b + 1000 * (b == 0 ? gens[f] : 0), 700));
+    if (b == 0) {
+      gens[f]++;
+      assert(other->put(block_id(f, 0), pattern(f * 4 + 1000 * gens[f], 700)) ==
+             extent_protocol::OK);
+    }
+  }
+  return 0;
+}
+
+static int
+rebalance_check(const char *shards, const char *add)
+{
+  printf("rebalance_check\n");
+  adder = new extent_client(shards);
+  other = new extent_client(shards);
+  for (int f = 0; f < 300; f++)
+    for (int b = 0; b < 4; b++)
+      assert(adder->put(block_id(f, b), pattern(f * 4 + b, 700)) ==
+             extent_protocol::OK);
+  stop = false;
+  pthread_t th;
+  assert(pthread_create(&th, NULL, rebalance_load, NULL) == 0);
+  usleep(100000);
+  assert(adder->add_shard(add) == extent_protocol::OK);
+  while (adder->rebalancing_now())
+    usleep(10000);
+  usleep(100000);
+  stop = true;
+  assert(pthread_join(th, NULL) == 0);
+  printf("   -- reads and writes through another client while moving .. ok\n");
+
+  std::string fresh = std::string(shards) + "," + add;
+  extent_client *clients[] = { adder, other, new extent_client(fresh) };
+  for (int c = 0; c < 3; c++) {
+    for (int f = 0; f < 300; f++) {
+      for (int b = 0; b < 4; b++) {
+        std::string got;
+        assert(clients[c]->get(block_id(f, b), got) == extent_protocol::OK);
+        assert(got == pattern(f * 4 + b + 1000 * (b == 0 ? gens[f] : 0), 700));
+      }
+      extent_protocol::filestat st;
+      assert(clients[c]->stat(block_id(f, 0), st) == extent_protocol::OK);
+      assert(st.nblocks == 4 && st.size == 3 * 1024 + 700);
+    }
+  }
+  printf("   -- every block where each client looks afterwards .. ok\n");
+  printf("rebalance_check OK\n");
+  return 0;
+}
+
+static void
+usage(const char *p)
+{
+  fprintf(stderr, "Usage: %s [-t max threads] [-k keys] [-v value bytes] "
+      "[-r read %%] [-s seconds per run] [-b block file] [-m]\n"
+      "       %s -c scratch dir\n"
+      "       %s -x host:port,... -a host:port\n", p, p, p);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxthreads = 8;
+  const char *blockfile = NULL;
+  bool memory = false;
+  const char *checkdir = NULL, *shards = NULL, *add = NULL;
+  int ch;
+  while ((ch = getopt(argc, argv, "t:k:v:r:s:b:mc:x:a:")) != -1) {
+    switch (ch) {
+      case 't': maxthreads = atoi(optarg); break;
+      case 'k': nkeys = atoi(optarg); break;
+      case 'v': valsz = atoi(optarg); break;
+      case 'r': readpct = atoi(optarg); break;
+      case 's': seconds = atoi(optarg); break;
+      case 'b': blockfile = optarg; break;
+      case 'm': memory = true; break;
+      case 'c': checkdir = optarg; break;
+      case 'x': shards = optarg; break;
+      case 'a': add = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (maxthreads < 1 || nkeys < 1 || valsz < 0 || seconds < 1 ||
+      (shards == NULL) != (add == NULL))
+    usage(argv[0]);
+  setvbuf(stdout, NULL, _IONBF, 0);
+  if (checkdir != NULL)
+    return check(checkdir);
+  if (shards != NULL)
+    return rebalance_check(shards, add);
+
+  printf("%d keys, %d byte values, %d%% gets, %ds per run\n",
+      nkeys, valsz, readpct, seconds);
+  if (blockfile != NULL)
+    return block_bench(blockfile, maxthreads);
+  if (memory)
+    return memory_bench();
+  printf("%8s %16s %16s %8s\n", "threads", "map+mutex ops/s", "sharded ops/s",
+      "speedup");
+  for (int n = 1; n <= maxthreads; n *= 2) {
+    map_store *m = new map_store();
+    double base = measure(m, MAP, n);
+    delete m;
+    extent_store *s = new extent_store();
+    double sharded = measure(s, SHARDED, n);
+    delete s;
+    printf("%8d %16.0f %16.0f %7.2fx\n", n, base, sharded, sharded / base);
+  }
+  return 0;
+}
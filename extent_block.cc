@@ -0,0 +1,685 @@
+// block-file extent backend
+
+#include "extent_block.h"
+#include "extent_hash.h"
+#include "rpc/slock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define BLOCK 4096
+#define HDR_MAGIC 0x7966626b // "yfbk"
+// largest single read or write handed to the i/o engine; bigger runs
+// are split so the device sees them in parallel
+#define IO_CHUNK (256 << 10)
+// blocks read per request while scanning at startup
+#define SCAN_BLOCKS 256
+
+// the head of an extent's first block, data follows it
+struct blk_hdr {
+  unsigned int magic;
+  unsigned int hcrc; // of the rest of the header
+  unsigned long long id;
+  unsigned long long seq;
+  unsigned int len;
+  unsigned int dcrc; // of the data
+  unsigned int atime;
+  unsigned int mtime;
+  unsigned int ctime;
+  unsigned int size;
+  unsigned long long version;
+};
+
+static unsigned int
+hdr_crc(const blk_hdr &h)
+{
+  const char *p = (const char *) &h;
+  return crc32(0, p + 2*sizeof(unsigned int), sizeof(h) - 2*sizeof(unsigned int));
+}
+
+static unsigned long long
+blocks_for(unsigned long long len)
+{
+  return (sizeof(blk_hdr) + len + BLOCK - 1) / BLOCK;
+}
+
+bool
+pread_io::run(req *reqs, int n)
+{
+  bool ok = true;
+  for (int i = 0; i < n; i++) {
+    req &r = reqs[i];
+    if (r.op == SYNC) {
+      ok = fdatasync(fd_) == 0 && ok;
+      continue;
+    }
+    unsigned long done = 0;
+    while (done < r.len) {
+      ssize_t k = r.op == READ ?
+        pread(fd_, r.buf + done, r.len - done, r.off + done) :
+        pwrite(fd_, r.buf + done, r.len - done, r.off + done);
+      if (k < 0 && errno == EINTR)
+        continue;
+      if (k <= 0) {
+        ok = false;
+        break;
+      }
+      done += k;
+    }
+  }
+  return ok;
+}
+
+// one run() call: the reaper counts its requests down
+struct uring_io::waiter {
+  waiter(int n) : pending(n), ok(true) {
+    assert(pthread_mutex_init(&m, NULL) == 0);
+    assert(pthread_cond_init(&c, NULL) == 0);
+  }
+  ~waiter() {
+    assert(pthread_mutex_destroy(&m) == 0);
+    assert(pthread_cond_destroy(&c) == 0);
+  }
+  int pending;
+  bool ok;
+  pthread_mutex_t m;
+  pthread_cond_t c;
+};
+
+// a completion for this waiter tells the reaper to exit
+static char reaper_stop;
+
+static void *
+reaperthread(void *x)
+{
+  uring_io *u = (uring_io *) x;
+  u->reaper();
+  return 0;
+}
+
+uring_io *
+uring_io::create(int fd, unsigned int depth)
+{
+  uring_io *u = new uring_io(fd, -1);
+  if (!u->setup(depth)) {
+    delete u;
+    return NULL;
+  }
+  return u;
+}
+
+uring_io::uring_io(int fd, int ring)
+  : fd_(fd), ring_(ring), entries_(0), inflight_(0), sq_ptr_(MAP_FAILED),
+    cq_ptr_(MAP_FAILED), sq_sz_(0), cq_sz_(0), sqes_(NULL), th_(0)
+{
+  assert(pthread_mutex_init(&m_, NULL) == 0);
+  assert(pthread_cond_init(&room_c_, NULL) == 0);
+}
+
+bool
+uring_io::setup(unsigned int depth)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring_ = syscall(__NR_io_uring_setup, depth, &p);
+  if (ring_ < 0)
+    return false;
+  entries_ = p.sq_entries;
+
+  sq_sz_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_sz_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cq_sz_ > sq_sz_)
+    sq_sz_ = cq_sz_;
+  sq_ptr_ = mmap(0, sq_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ring_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED)
+    return false;
+  if (single) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(0, cq_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED)
+      return false;
+  }
+  void *sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return false;
+  sqes_ = (struct io_uring_sqe *) sqes;
+
+  char *sq = (char *) sq_ptr_;
+  sq_head_ = (unsigned *) (sq + p.sq_off.head);
+  sq_tail_ = (unsigned *) (sq + p.sq_off.tail);
+  sq_mask_ = (unsigned *) (sq + p.sq_off.ring_mask);
+  sq_array_ = (unsigned *) (sq + p.sq_off.array);
+  char *cq = (char *) cq_ptr_;
+  cq_head_ = (unsigned *) (cq + p.cq_off.head);
+  cq_tail_ = (unsigned *) (cq + p.cq_off.tail);
+  cq_mask_ = (unsigned *) (cq + p.cq_off.ring_mask);
+  cqes_ = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  int r = pthread_create(&th_, NULL, &reaperthread, (void *) this);
+  assert (r == 0);
+  return true;
+}
+
+uring_io::~uring_io()
+{
+  if (th_) {
+    req r;
+    memset(&r, 0, sizeof(r));
+    r.op = -1;
+    submit(r, (waiter *) &reaper_stop);
+    assert(pthread_join(th_, NULL) == 0);
+  }
+  if (sqes_)
+    munmap(sqes_, entries_ * sizeof(struct io_uring_sqe));
+  if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+    munmap(cq_ptr_, cq_sz_);
+  if (sq_ptr_ != MAP_FAILED)
+    munmap(sq_ptr_, sq_sz_);
+  if (ring_ >= 0)
+    close(ring_);
+}
+
+// queue one request, waiting while the ring is full
+void
+uring_io::submit(const req &r, waiter *w)
+{
+  ScopedLock ml(&m_);
+  while (inflight_ >= entries_)
+    assert(pthread_cond_wait(&room_c_, &m_) == 0);
+  inflight_++;
+
+  unsigned tail = *sq_tail_;
+  unsigned idx = tail & *sq_mask_;
+  struct io_uring_sqe *sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = fd_;
+  sqe->user_data = (unsigned long long) w;
+  if (r.op == READ || r.op == WRITE) {
+    sqe->opcode = r.op == READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->addr = (unsigned long long) r.buf;
+    sqe->len = r.len;
+    sqe->off = r.off;
+  } else if (r.op == SYNC) {
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  } else {
+    sqe->opcode = IORING_OP_NOP;
+  }
+  sq_array_[idx] = idx;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+  while (syscall(__NR_io_uring_enter, ring_, 1, 0, 0, NULL, 0) < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      perror("uring_io::submit");
+      abort();
+    }
+  }
+}
+
+bool
+uring_io::run(req *reqs, int n)
+{
+  waiter w(n);
+  for (int i = 0; i < n; i++)
+    submit(reqs[i], &w);
+  ScopedLock wl(&w.m);
+  while (w.pending > 0)
+    assert(pthread_cond_wait(&w.c, &w.m) == 0);
+  return w.ok;
+}
+
+void
+uring_io::reaper()
+{
+  while (1) {
+    int r = syscall(__NR_io_uring_enter, ring_, 0, 1, IORING_ENTER_GETEVENTS,
+                    NULL, 0);
+    if (r < 0 && errno != EINTR) {
+      perror("uring_io::reaper");
+      abort();
+    }
+
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    bool stop = false;
+    unsigned done = 0;
+    for (; head != tail; head++, done++) {
+      struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+      waiter *w = (waiter *) cqe->user_data;
+      if ((char *) w == &reaper_stop) {
+        stop = true;
+        continue;
+      }
+      ScopedLock wl(&w->m);
+      if (cqe->res < 0)
+        w->ok = false;
+      if (--w->pending == 0)
+        assert(pthread_cond_signal(&w->c) == 0);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+    if (done) {
+      ScopedLock ml(&m_);
+      inflight_ -= done;
+      assert(pthread_cond_broadcast(&room_c_) == 0);
+    }
+    if (stop)
+      return;
+  }
+}
+
+block_bitmap::block_bitmap(unsigned long long nblocks)
+  : bits_((nblocks + 63) / 64), nblocks_(nblocks), hint_(0), used_(0)
+{
+  assert(pthread_mutex_init(&m_, NULL) == 0);
+  // the tail of the last word never exists
+  for (unsigned long long b = nblocks; b < bits_.size() * 64; b++)
+    bits_[b / 64] |= 1ULL << (b % 64);
+}
+
+long long
+block_bitmap::alloc(unsigned long long n)
+{
+  ScopedLock ml(&m_);
+  if (n == 0 || n > nblocks_ - used_)
+    return -1;
+  unsigned long long b = hint_, runstart = hint_, run = 0, seen = 0;
+  while (seen < nblocks_ + n) {
+    if (b >= nblocks_) {
+      // runs do not wrap around the end of the file
+      b = 0;
+      run = 0;
+    }
+    if (run == 0 && b % 64 == 0 && bits_[b / 64] == ~0ULL) {
+      b += 64;
+      seen += 64;
+      continue;
+    }
+    if (isset(b)) {
+      run = 0;
+    } else {
+      if (run == 0)
+        runstart = b;
+      if (++run == n) {
+        for (unsigned long long k = runstart; k < runstart + n; k++)
+          bits_[k / 64] |= 1ULL << (k % 64);
+        used_ += n;
+        hint_ = runstart + n;
+        return runstart;
+      }
+    }
+    b++;
+    seen++;
+  }
+  return -1;
+}
+
+void
+block_bitmap::free(unsigned long long start, unsigned long long n)
+{
+  ScopedLock ml(&m_);
+  for (unsigned long long k = start; k < start + n; k++) {
+    assert(isset(k));
+    bits_[k / 64] &= ~(1ULL << (k % 64));
+  }
+  used_ -= n;
+}
+
+void
+block_bitmap::mark(unsigned long long start, unsigned long long n)
+{
+  ScopedLock ml(&m_);
+  for (unsigned long long k = start; k < start + n; k++) {
+    assert(!isset(k));
+    bits_[k / 64] |= 1ULL << (k % 64);
+  }
+  used_ += n;
+}
+
+unsigned long long
+block_bitmap::used()
+{
+  ScopedLock ml(&m_);
+  return used_;
+}
+
+block_backend::block_backend(std::string path, unsigned long long size,
+                             bool direct, bool sync)
+  : fd_(-1), direct_(direct), sync_(sync), io_(NULL), seq_(0)
+{
+  assert(pthread_mutex_init(&seq_m_, NULL) == 0);
+  assert(pthread_rwlock_init(&grace_l_, NULL) == 0);
+
+  int flags = O_RDWR | O_CREAT;
+  if (direct_) {
+    fd_ = open(path.c_str(), flags | O_DIRECT, 0644);
+    if (fd_ < 0 && errno == EINVAL) {
+      fprintf(stderr, "block_backend: %s does not support O_DIRECT\n",
+              path.c_str());
+      direct_ = false;
+    }
+  }
+  if (fd_ < 0)
+    fd_ = open(path.c_str(), flags, 0644);
+  struct stat st;
+  if (fd_ < 0 || fstat(fd_, &st) < 0) {
+    perror("block_backend");
+    exit(1);
+  }
+  if ((unsigned long long) st.st_size < size) {
+    if (posix_fallocate(fd_, 0, size) != 0 && ftruncate(fd_, size) < 0) {
+      perror("block_backend: cannot size the block file");
+      exit(1);
+    }
+  } else {
+    size = st.st_size;
+  }
+  nblocks_ = size / BLOCK;
+
+  if (direct_)
+    io_ = uring_io::create(fd_, 128);
+  if (io_ == NULL)
+    io_ = new pread_io(fd_);
+  bitmap_ = new block_bitmap(nblocks_);
+
+  scan();
+  printf("block_backend: %s: %llu blocks, %llu in use by %llu extents, %s%s\n",
+         path.c_str(), nblocks_, bitmap_->used(),
+         (unsigned long long) index_.size(), io_->name(),
+         direct_ ? " O_DIRECT" : "");
+}
+
+block_backend::~block_backend()
+{
+  delete io_;
+  delete bitmap_;
+  close(fd_);
+}
+
+char *
+block_backend::getbuf(unsigned long long nblocks)
+{
+  void *p;
+  if (posix_memalign(&p, BLOCK, nblocks * BLOCK) != 0)
+    return NULL;
+  return (char *) p;
+}
+
+// read or write nblocks from start, split into IO_CHUNK requests
+bool
+block_backend::io(int op, char *buf, unsigned long long start,
+                  unsigned long long nblocks)
+{
+  unsigned long long len = nblocks * BLOCK;
+  int n = (len + IO_CHUNK - 1) / IO_CHUNK;
+  std::vector<block_io::req> reqs(n + 1);
+  for (int i = 0; i < n; i++) {
+    unsigned long long o = (unsigned long long) i * IO_CHUNK;
+    reqs[i].op = op;
+    reqs[i].buf = buf + o;
+    reqs[i].len = len - o < IO_CHUNK ? len - o : IO_CHUNK;
+    reqs[i].off = start * BLOCK + o;
+  }
+  if (!io_->run(&reqs[0], n))
+    return false;
+  if (op == block_io::WRITE && sync_) {
+    reqs[0].op = block_io::SYNC;
+    return io_->run(&reqs[0], 1);
+  }
+  return true;
+}
+
+// zero the header block at start so the run no longer names an extent
+bool
+block_backend::wipe(unsigned long long start)
+{
+  char *buf = getbuf(1);
+  if (buf == NULL)
+    return false;
+  memset(buf, 0, BLOCK);
+  bool ok = io(block_io::WRITE, buf, start, 1);
+  ::free(buf);
+  return ok;
+}
+
+// give r's blocks back once no get() can still be reading them
+void
+block_backend::release(const run &r)
+{
+  assert(pthread_rwlock_wrlock(&grace_l_) == 0);
+  assert(pthread_rwlock_unlock(&grace_l_) == 0);
+  bitmap_->free(r.start, r.nblocks);
+}
+
+int
+block_backend::get(extent_protocol::extentid_t id, extent_entry &e)
+{
+  assert(pthread_rwlock_rdlock(&grace_l_) == 0);
+  int ret;
+  run r;
+  char *buf = NULL;
+  while (1) {
+    ::free(buf);
+    buf = NULL;
+    if (!index_.get(id, r)) {
+      ret = extent_protocol::NOENT;
+      break;
+    }
+    if ((buf = getbuf(r.nblocks)) == NULL ||
+        !io(block_io::READ, buf, r.start, r.nblocks)) {
+      ret = extent_protocol::IOERR;
+      break;
+    }
+    blk_hdr h;
+    memcpy(&h, buf, sizeof(h));
+    const char *data = buf + sizeof(h);
+    if (h.magic == HDR_MAGIC && h.id == id && h.seq == r.seq &&
+        h.len == r.len && h.dcrc == crc32(0, data, h.len)) {
+      e.data.assign(data, h.len);
+      e.a = r.a;
+      ret = extent_protocol::OK;
+      break;
+    }
+    // a put may have replaced the run and wiped it while we read
+    run now;
+    if (index_.get(id, now) && now.seq != r.seq)
+      continue;
+    fprintf(stderr, "block_backend::get: bad extent %llu at block %llu\n",
+            id, r.start);
+    ret = extent_protocol::IOERR;
+    break;
+  }
+  assert(pthread_rwlock_unlock(&grace_l_) == 0);
+  ::free(buf);
+  return ret;
+}
+
+int
+block_backend::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
+{
+  run r;
+  if (!index_.get(id, r))
+    return extent_protocol::NOENT;
+  a = r.a;
+  return extent_protocol::OK;
+}
+
+namespace {
+  // installs a run unless the index already holds a newer one, and
+  // hands back whichever run lost
+  struct newer_run {
+    newer_run(const block_backend::run &xr) : r(xr), lost(false) {}
+    bool operator()(block_backend::run &cur, bool found) {
+      if (found && cur.seq > r.seq) {
+        lost = true;
+        return false;
+      }
+      if (found) {
+        std::swap(cur, r);
+        lost = true;
+      } else {
+        cur = r;
+      }
+      return true;
+    }
+    block_backend::run r;
+    bool lost;
+  };
+}
+
+int
+block_backend::put(extent_protocol::extentid_t id, const extent_entry &e)
+{
+  run r;
+  r.len = e.data.size();
+  r.nblocks = blocks_for(r.len);
+  r.a = e.a;
+  long long start = bitmap_->alloc(r.nblocks);
+  if (start < 0) {
+    fprintf(stderr, "block_backend::put: no room for %u bytes\n", r.len);
+    return extent_protocol::FBIG;
+  }
+  r.start = start;
+  {
+    ScopedLock sl(&seq_m_);
+    r.seq = ++seq_;
+  }
+
+  char *buf = getbuf(r.nblocks);
+  if (buf == NULL) {
+    bitmap_->free(r.start, r.nblocks);
+    return extent_protocol::IOERR;
+  }
+  blk_hdr h;
+  h.magic = HDR_MAGIC;
+  h.id = id;
+  h.seq = r.seq;
+  h.len = r.len;
+  h.dcrc = crc32(0, e.data.data(), r.len);
+  h.atime = e.a.atime;
+  h.mtime = e.a.mtime;
+  h.ctime = e.a.ctime;
+  h.size = e.a.size;
+  h.version = e.a.version;
+  h.hcrc = hdr_crc(h);
+  memcpy(buf, &h, sizeof(h));
+  memcpy(buf + sizeof(h), e.data.data(), r.len);
+  memset(buf + sizeof(h) + r.len, 0, r.nblocks * BLOCK - sizeof(h) - r.len);
+  bool ok = io(block_io::WRITE, buf, r.start, r.nblocks);
+  ::free(buf);
+  if (!ok) {
+    bitmap_->free(r.start, r.nblocks);
+    return extent_protocol::IOERR;
+  }
+
+  newer_run f(r);
+  index_.update(id, f);
+  if (f.lost) {
+    // the older copy must stop naming id before its blocks are reused
+    if (!wipe(f.r.start))
+      return extent_protocol::IOERR;
+    release(f.r);
+  }
+  return extent_protocol::OK;
+}
+
+int
+block_backend::remove(extent_protocol::extentid_t id)
+{
+  run r;
+  if (!index_.remove(id, &r))
+    return extent_protocol::NOENT;
+  if (!wipe(r.start))
+    return extent_protocol::IOERR;
+  release(r);
+  return extent_protocol::OK;
+}
+
+void
+block_backend::ids(std::vector<extent_protocol::extentid_t> &ids)
+{
+  index_.keys(ids);
+}
+
+// rebuild the index and bitmap from the headers on disk. where a crash
+// left two copies of an extent, the one with the higher sequence number
+// is kept and the other wiped.
+void
+block_backend::scan()
+{
+  char *buf = getbuf(SCAN_BLOCKS);
+  assert(buf);
+  std::vector<run> stale;
+  unsigned long long b = 0;
+  while (b < nblocks_) {
+    unsigned long long n = nblocks_ - b < SCAN_BLOCKS ? nblocks_ - b : SCAN_BLOCKS;
+    if (!io(block_io::READ, buf, b, n)) {
+      fprintf(stderr, "block_backend::scan: read error at block %llu\n", b);
+      b += n;
+      continue;
+    }
+    unsigned long long next = b + n;
+    for (unsigned long long k = 0; k < n; k++) {
+      blk_hdr h;
+      memcpy(&h, buf + k * BLOCK, sizeof(h));
+      if (h.magic != HDR_MAGIC || h.hcrc != hdr_crc(h))
+        continue;
+      run r;
+      r.start = b + k;
+      r.len = h.len;
+      r.nblocks = blocks_for(h.len);
+      r.seq = h.seq;
+      r.a.atime = h.atime;
+      r.a.mtime = h.mtime;
+      r.a.ctime = h.ctime;
+      r.a.size = h.size;
+      r.a.version = h.version;
+      if (r.start + r.nblocks > nblocks_)
+        continue;
+
+      // check the data; a torn write leaves a header without it
+      char *ebuf = getbuf(r.nblocks);
+      bool ok = ebuf && io(block_io::READ, ebuf, r.start, r.nblocks) &&
+        crc32(0, ebuf + sizeof(h), h.len) == h.dcrc;
+      ::free(ebuf);
+      if (!ok)
+        continue;
+
+      bitmap_->mark(r.start, r.nblocks);
+      if (h.seq > seq_)
+        seq_ = h.seq;
+      newer_run f(r);
+      index_.update(h.id, f);
+      if (f.lost)
+        stale.push_back(f.r);
+
+      // resume after this extent
+      if (r.start + r.nblocks > b + n) {
+        next = r.start + r.nblocks;
+        break;
+      }
+      k += r.nblocks - 1;
+    }
+    b = next;
+  }
+  ::free(buf);
+
+  for (unsigned int i = 0; i < stale.size(); i++) {
+    wipe(stale[i].start);
+    bitmap_->free(stale[i].start, stale[i].nblocks);
+  }
+}
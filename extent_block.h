@@ -0,0 +1,154 @@
+// block-file extent backend
+
+#ifndef extent_block_h
+#define extent_block_h
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "extent_backend.h"
+#include "extent_store.h"
+
+// how block_backend moves blocks in and out of its file
+class block_io {
+ public:
+  enum { READ, WRITE, SYNC };
+  struct req {
+    int op;
+    char *buf;
+    unsigned long len;
+    unsigned long long off;
+  };
+  virtual ~block_io() {}
+  // perform every request, concurrently if the engine can; returns
+  // once all of them have finished, false if any failed
+  virtual bool run(req *reqs, int n) = 0;
+  virtual const char *name() = 0;
+};
+
+// plain pread/pwrite/fdatasync, one request after the other
+class pread_io : public block_io {
+ public:
+  pread_io(int fd) : fd_(fd) {}
+  bool run(req *reqs, int n);
+  const char *name() { return "pread"; }
+ private:
+  int fd_;
+};
+
+// io_uring driven with the raw system calls. any thread may call run();
+// its requests go into one shared submission ring, and a reaper thread
+// hands completions back, so a handful of dispatch threads keep many
+// requests in flight.
+class uring_io : public block_io {
+ public:
+  // NULL if the kernel has no io_uring
+  static uring_io *create(int fd, unsigned int depth);
+  ~uring_io();
+  bool run(req *reqs, int n);
+  const char *name() { return "io_uring"; }
+  void reaper();
+
+ private:
+  struct waiter;
+
+  uring_io(int fd, int ring);
+  bool setup(unsigned int depth);
+  void submit(const req &r, waiter *w);
+
+  int fd_;
+  int ring_;
+  unsigned int entries_;
+  unsigned int inflight_;
+
+  // ring mappings, see io_uring_setup(2)
+  void *sq_ptr_, *cq_ptr_;
+  size_t sq_sz_, cq_sz_;
+  unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+  unsigned *cq_head_, *cq_tail_, *cq_mask_;
+  struct io_uring_sqe *sqes_;
+  struct io_uring_cqe *cqes_;
+
+  pthread_mutex_t m_; // protects the submission ring and inflight_
+  pthread_cond_t room_c_;
+  pthread_t th_;
+};
+
+// contiguous-run allocator over a bitmap of blocks
+class block_bitmap {
+ public:
+  block_bitmap(unsigned long long nblocks);
+  // first fit from where the last allocation ended; -1 if no run of n
+  // free blocks exists
+  long long alloc(unsigned long long n);
+  void free(unsigned long long start, unsigned long long n);
+  void mark(unsigned long long start, unsigned long long n);
+  unsigned long long used();
+
+ private:
+  std::vector<unsigned long long> bits_;
+  unsigned long long nblocks_;
+  unsigned long long hint_;
+  unsigned long long used_;
+  pthread_mutex_t m_;
+
+  bool isset(unsigned long long b) { return bits_[b / 64] >> (b % 64) & 1; }
+};
+
+// extents live in one large preallocated file, each in a contiguous run
+// of 4K blocks whose first block starts with a header naming it. an
+// allocation bitmap tracks free blocks and an in-memory index maps
+// extent ids to their runs; both are rebuilt at startup by scanning
+// the headers. a put writes the new copy to fresh blocks before the old
+// copy's header is wiped, and headers carry a sequence number, so after
+// a crash the newest complete copy wins.
+class block_backend : public extent_backend {
+ public:
+  // with direct set the file is opened O_DIRECT and served through
+  // io_uring; otherwise it goes through the page cache with pread
+  block_backend(std::string path, unsigned long long size, bool direct,
+                bool sync);
+  ~block_backend();
+
+  int get(extent_protocol::extentid_t id, extent_entry &e);
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int put(extent_protocol::extentid_t id, const extent_entry &e);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &ids);
+
+  const char *io_name() { return io_->name(); }
+
+  struct run {
+    unsigned long long start; // first block
+    unsigned long long nblocks;
+    unsigned long long seq;
+    unsigned int len;
+    extent_protocol::attr a;
+  };
+
+ private:
+  int fd_;
+  bool direct_;
+  const bool sync_;
+  unsigned long long nblocks_;
+  block_io *io_;
+  block_bitmap *bitmap_;
+  extent_table<run> index_;
+
+  pthread_mutex_t seq_m_;
+  unsigned long long seq_;
+
+  // get() holds the read side while it reads a run; blocks are only
+  // freed after the write side has been taken once, so no read can
+  // still be looking at them
+  pthread_rwlock_t grace_l_;
+
+  char *getbuf(unsigned long long nblocks);
+  bool io(int op, char *buf, unsigned long long start,
+          unsigned long long nblocks);
+  bool wipe(unsigned long long start);
+  void release(const run &r);
+  void scan();
+};
+
+#endif
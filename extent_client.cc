@@ -3,27 +3,352 @@
 #include "extent_client.h"
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <arpa/inet.h>
 
 // The calls assume that the caller holds a lock on the extent
 
 extent_client::extent_client(std::string dst)
+{
+  assert(pthread_rwlock_init(&map_l, NULL) == 0);
+  assert(pthread_mutex_init(&refresh_m, NULL) == 0);
+  assert(pthread_mutex_init(&conns_m, NULL) == 0);
+
+  std::vector<std::string> names;
+  std::istringstream is(dst);
+  std::string one;
+  while (std::getline(is, one, ',')) {
+    if (!one.empty())
+      names.push_back(name_of(one));
+  }
+  unsigned int stripe = 0;
+  char *env = getenv("EXTENT_STRIPE_BLOCKS");
+  if (env != NULL && atoi(env) > 0)
+    stripe = atoi(env);
+
+  extent_protocol::shardmap m;
+  fetch(names, m);
+  if (m.epoch == 0 && names.size() > 1) {
+    // servers that have never been given a map get their first from
+    // the first client to list them together; another client that
+    // races this one with the same list sets the same map
+    extent_protocol::shardmap first;
+    first.epoch = 1;
+    first.stripe = stripe;
+    first.shards = names;
+    for (unsigned int i = 0; i < names.size(); i++) {
+      int x;
+      rpcc *c = conn(names[i]);
+      if (c != NULL)
+        c->call(extent_protocol::setmap, first, names[i], x);
+    }
+    fetch(names, m);
+  }
+  if (m.epoch == 0) {
+    // a lone server, which takes every call
+    m.stripe = stripe;
+    m.shards = names;
+    m.old.clear();
+  }
+  install(m);
+}
+
+// a server's name in the shard map: its address, so that every client
+// and server writes it the same way however it was given
+std::string
+extent_client::name_of(const std::string &dst)
 {
   sockaddr_in dstsock;
   make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
-  if (cl->bind() != 0) {
-    printf("extent_client: bind failed\n");
+  char name[64];
+  snprintf(name, sizeof(name), "%s:%d", inet_ntoa(dstsock.sin_addr),
+           ntohs(dstsock.sin_port));
+  return name;
+}
+
+// the connection to the server name, kept once it binds; NULL if it
+// cannot be reached now
+rpcc *
+extent_client::conn(const std::string &name)
+{
+  ScopedLock cl(&conns_m);
+  std::map<std::string, rpcc *>::iterator it = conns.find(name);
+  if (it != conns.end())
+    return it->second;
+  sockaddr_in dstsock;
+  make_sockaddr(name.c_str(), &dstsock);
+  rpcc *c = new rpcc(dstsock);
+  if (c->bind() != 0) {
+    printf("extent_client: bind to %s failed\n", name.c_str());
+    delete c;
+    return NULL;
+  }
+  conns[name] = c;
+  return c;
+}
+
+// the map of the highest epoch that any of names has; false if none
+// of them could be asked
+bool
+extent_client::fetch(const std::vector<std::string> &names,
+                     extent_protocol::shardmap &m)
+{
+  bool any = false;
+  m.epoch = 0;
+  m.stripe = 0;
+  m.shards.clear();
+  m.old.clear();
+  for (unsigned int i = 0; i < names.size(); i++) {
+    extent_protocol::shardmap one;
+    rpcc *c = conn(names[i]);
+    if (c == NULL ||
+        c->call(extent_protocol::getmap, 0, one) != extent_protocol::OK)
+      continue;
+    any = true;
+    if (one.epoch > m.epoch)
+      m = one;
+  }
+  return any;
+}
+
+void
+extent_client::install(const extent_protocol::shardmap &m)
+{
+  std::vector<rpcc *> cls;
+  for (unsigned int i = 0; i < m.shards.size(); i++)
+    cls.push_back(conn(m.shards[i]));
+  assert(pthread_rwlock_wrlock(&map_l) == 0);
+  map = m;
+  shards = cls;
+  ring.build(map.shards);
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+}
+
+// fetch the map from the shards if the one held is still at epoch;
+// whether it is newer now
+bool
+extent_client::refresh(unsigned long long epoch)
+{
+  ScopedLock rl(&refresh_m);
+  assert(pthread_rwlock_rdlock(&map_l) == 0);
+  unsigned long long cur = map.epoch;
+  std::vector<std::string> names = map.shards;
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  if (cur > epoch)
+    return true;
+  extent_protocol::shardmap m;
+  if (!fetch(names, m) || m.epoch <= cur)
+    return false;
+  install(m);
+  return true;
+}
+
+// whether the map is still at epoch after a call that went to every
+// shard, or has to be made again. the first shard is asked: a shard
+// being added gets its map to the first before it takes anything.
+bool
+extent_client::unchanged(unsigned long long epoch)
+{
+  assert(pthread_rwlock_rdlock(&map_l) == 0);
+  rpcc *first = shards[0];
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  extent_protocol::shardmap m;
+  if (first == NULL ||
+      first->call(extent_protocol::getmap, 0, m) != extent_protocol::OK ||
+      m.epoch <= epoch)
+    return true;
+  refresh(epoch);
+  return false;
+}
+
+unsigned int
+extent_client::stripe()
+{
+  assert(pthread_rwlock_rdlock(&map_l) == 0);
+  unsigned int r = map.stripe;
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  return r;
+}
+
+extent_client::shard_ref::shard_ref(extent_client *xec,
+                                    extent_protocol::extentid_t xeid)
+  : ec(xec), eid(xeid), tries(0)
+{
+  route();
+}
+
+void
+extent_client::shard_ref::route()
+{
+  assert(pthread_rwlock_rdlock(&ec->map_l) == 0);
+  epoch = ec->map.epoch;
+  n = ec->shards.size();
+  cl = n == 1 ? ec->shards[0] :
+    ec->shards[ec->ring.owner(extent_ring::key_of(eid, ec->map.stripe))];
+  assert(pthread_rwlock_unlock(&ec->map_l) == 0);
+}
+
+bool
+extent_client::shard_ref::stale(extent_protocol::status &ret)
+{
+  if (ret != extent_protocol::WRONGSHARD)
+    return false;
+  if (++tries > 100) {
+    printf("extent_client: no shard takes %llu\n", eid);
+    ret = extent_protocol::IOERR;
+    return false;
+  }
+  // the servers may not all have the new map yet
+  if (!ec->refresh(epoch))
+    usleep(10000 * std::min(tries, 10));
+  route();
+  return true;
+}
+
+// the shards of the map; RPCERR if one of them could not be reached
+extent_protocol::status
+extent_client::all(std::vector<rpcc *> &cls)
+{
+  assert(pthread_rwlock_rdlock(&map_l) == 0);
+  cls = shards;
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  if (std::find(cls.begin(), cls.end(), (rpcc *) NULL) != cls.end())
+    return extent_protocol::RPCERR;
+  return extent_protocol::OK;
+}
+
+// "shard i (ip:port):" over a shard's part of an answer, if there are
+// n > 1 parts
+std::string
+extent_client::label(unsigned int i, unsigned int n)
+{
+  if (n == 1)
+    return "";
+  assert(pthread_rwlock_rdlock(&map_l) == 0);
+  char buf[96];
+  snprintf(buf, sizeof(buf), "shard %u (%s):\n", i,
+           i < map.shards.size() ? map.shards[i].c_str() : "?");
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  return buf;
+}
+
+// the shards to ask about file f, and the epoch of the map they are
+// from. while the shard added last is being moved in, it first takes
+// all of f that is due to it, so that no block of f is in two places
+// or moves while they are asked.
+extent_protocol::status
+extent_client::spread(extent_protocol::extentid_t f, std::vector<rpcc *> &cls,
+                      unsigned long long &epoch)
+{
+  for (int tries = 1; tries <= 100; tries++) {
+    assert(pthread_rwlock_rdlock(&map_l) == 0);
+    epoch = map.epoch;
+    cls = shards;
+    bool moving = !map.old.empty();
+    assert(pthread_rwlock_unlock(&map_l) == 0);
+    if (std::find(cls.begin(), cls.end(), (rpcc *) NULL) != cls.end())
+      return extent_protocol::RPCERR;
+    if (!moving)
+      return extent_protocol::OK;
+    int x;
+    extent_protocol::status ret =
+      cls.back()->call(extent_protocol::pullfile, f, epoch, x);
+    if (ret != extent_protocol::WRONGSHARD)
+      return ret;
+    if (!refresh(epoch))
+      usleep(10000 * std::min(tries, 10));
   }
+  return extent_protocol::IOERR;
 }
 
 extent_protocol::status
-extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
+extent_client::add_shard(std::string dst)
+{
+  std::string name = name_of(dst);
+  assert(pthread_rwlock_rdlock(&map_l) == 0);
+  unsigned long long epoch = map.epoch;
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  refresh(epoch);
+  assert(pthread_rwlock_rdlock(&map_l) == 0);
+  extent_protocol::shardmap m = map;
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  if (!m.old.empty() ||
+      std::find(m.shards.begin(), m.shards.end(), name) != m.shards.end())
+    return extent_protocol::IOERR;
+
+  extent_protocol::shardmap n = m;
+  n.epoch = m.epoch + 1;
+  n.old = m.shards;
+  n.shards.push_back(name);
+  rpcc *c = conn(name);
+  if (c == NULL)
+    return extent_protocol::RPCERR;
+  int x;
+  extent_protocol::status ret = c->call(extent_protocol::setmap, n, name, x);
+  if (ret == extent_protocol::CONFLICT)
+    return extent_protocol::IOERR;
+  if (ret != extent_protocol::OK)
+    return ret < 0 ? extent_protocol::RPCERR : ret;
+  refresh(m.epoch);
+  return extent_protocol::OK;
+}
+
+bool
+extent_client::rebalancing_now()
+{
+  assert(pthread_rwlock_rdlock(&map_l) == 0);
+  unsigned long long epoch = map.epoch;
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  refresh(epoch);
+  assert(pthread_rwlock_rdlock(&map_l) == 0);
+  bool r = !map.old.empty();
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  return r;
+}
+
+extent_protocol::status
+extent_client::get(extent_protocol::extentid_t eid, std::string &buf,
+                   extent_protocol::attr *a)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::get, eid, buf);
+  shard_ref cl(this, eid);
+  if (a == NULL) {
+    do {
+      ret = cl.call(extent_protocol::get, eid, buf);
+    } while (cl.stale(ret));
+    return ret;
+  }
+  extent_protocol::content c;
+  do {
+    ret = cl.call(extent_protocol::getwithattr, eid, c);
+  } while (cl.stale(ret));
+  if (ret == extent_protocol::OK) {
+    buf.swap(c.data);
+    *a = c.a;
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::getifchanged(extent_protocol::extentid_t eid,
+                            unsigned long long version, std::string &buf,
+                            extent_protocol::attr *a)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  shard_ref cl(this, eid);
+  extent_protocol::content c;
+  do {
+    ret = cl.call(extent_protocol::getifchanged, eid, version, c);
+  } while (cl.stale(ret));
+  if (ret == extent_protocol::OK)
+    buf.swap(c.data);
+  if ((ret == extent_protocol::OK || ret == extent_protocol::NOTMODIFIED) &&
+      a != NULL)
+    *a = c.a;
   return ret;
 }
 
@@ -32,17 +357,44 @@ extent_client::getattr(extent_protocol::extentid_t eid,
 		       extent_protocol::attr &attr)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::getattr, eid, attr);
+  shard_ref cl(this, eid);
+  do {
+    ret = cl.call(extent_protocol::getattr, eid, attr);
+  } while (cl.stale(ret));
   return ret;
 }
 
 
 extent_protocol::status
-extent_client::put(extent_protocol::extentid_t eid, std::string buf)
+extent_client::put(extent_protocol::extentid_t eid, std::string buf,
+                   extent_protocol::attr *a)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  int r;
-  ret = cl->call(extent_protocol::put, eid, buf, r);
+  shard_ref cl(this, eid);
+  extent_protocol::attr r;
+  do {
+    ret = cl.call(extent_protocol::put, eid, buf, r);
+  } while (cl.stale(ret));
+  if (ret == extent_protocol::OK && a != NULL)
+    *a = r;
+  return ret;
+}
+
+extent_protocol::status
+extent_client::putifversion(extent_protocol::extentid_t eid,
+                            unsigned long long version, std::string buf,
+                            std::string &cur, extent_protocol::attr &a)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  shard_ref cl(this, eid);
+  extent_protocol::content c;
+  do {
+    ret = cl.call(extent_protocol::putifversion, eid, version, buf, c);
+  } while (cl.stale(ret));
+  if (ret == extent_protocol::CONFLICT)
+    cur.swap(c.data);
+  if (ret == extent_protocol::OK || ret == extent_protocol::CONFLICT)
+    a = c.a;
   return ret;
 }
 
@@ -50,9 +402,559 @@ extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret = extent_protocol::OK;
+  shard_ref cl(this, eid);
   int r;
-  ret = cl->call(extent_protocol::remove, eid, r);
+  do {
+    ret = cl.call(extent_protocol::remove, eid, r);
+  } while (cl.stale(ret));
   return ret;
 }
 
+extent_protocol::status
+extent_client::setattr(extent_protocol::extentid_t eid,
+                       extent_protocol::attr attr, extent_protocol::attr *a)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  shard_ref cl(this, eid);
+  extent_protocol::attr r;
+  do {
+    ret = cl.call(extent_protocol::setattr, eid, attr, r);
+  } while (cl.stale(ret));
+  if (ret == extent_protocol::OK && a != NULL)
+    *a = r;
+  return ret;
+}
+
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, unsigned int off,
+                    unsigned int len, std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  shard_ref cl(this, eid);
+  do {
+    ret = cl.call(extent_protocol::read, eid, off, len, buf);
+  } while (cl.stale(ret));
+  return ret;
+}
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, unsigned int off,
+                     std::string buf, extent_protocol::attr *a)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  shard_ref cl(this, eid);
+  extent_protocol::attr r;
+  do {
+    ret = cl.call(extent_protocol::write, eid, off, buf, r);
+  } while (cl.stale(ret));
+  if (ret == extent_protocol::OK && a != NULL)
+    *a = r;
+  return ret;
+}
+
+extent_protocol::status
+extent_client::append(extent_protocol::extentid_t eid, std::string buf,
+                      extent_protocol::attr *a)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  shard_ref cl(this, eid);
+  extent_protocol::attr r;
+  do {
+    ret = cl.call(extent_protocol::append, eid, buf, r);
+  } while (cl.stale(ret));
+  if (ret == extent_protocol::OK && a != NULL)
+    *a = r;
+  return ret;
+}
 
+// with striping, the blocks of a file are spread over the shards and
+// the calls on the whole file below are put together from theirs;
+// this is done even with only one shard, since another can come in
+// at any time
+extent_protocol::status
+extent_client::stat(extent_protocol::extentid_t eid,
+                    extent_protocol::filestat &st)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  if (stripe() == 0) {
+    shard_ref cl(this, eid);
+    do {
+      ret = cl.call(extent_protocol::stat, eid, st);
+    } while (cl.stale(ret));
+    return ret;
+  }
+
+  extent_protocol::extentid_t f = extent_protocol::file_of(eid);
+  unsigned long long epoch;
+  bool found;
+  do {
+    std::vector<rpcc *> cls;
+    ret = spread(f, cls, epoch);
+    if (ret != extent_protocol::OK)
+      return ret;
+    found = false;
+    st.size = 0;
+    st.nblocks = 0;
+    for (unsigned int i = 0; i < cls.size(); i++) {
+      extent_protocol::filestat s;
+      ret = cls[i]->call(extent_protocol::stat, f, s);
+      if (ret == extent_protocol::NOENT)
+        continue;
+      if (ret != extent_protocol::OK)
+        return ret;
+      found = true;
+      st.size = std::max(st.size, s.size);
+      st.nblocks += s.nblocks;
+    }
+  } while (!unchanged(epoch));
+  return found ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid,
+                        unsigned long long size, extent_protocol::filestat *st)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::filestat r;
+  if (stripe() == 0) {
+    shard_ref cl(this, eid);
+    do {
+      ret = cl.call(extent_protocol::truncate, eid, size, r);
+    } while (cl.stale(ret));
+    if (ret == extent_protocol::OK && st != NULL)
+      *st = r;
+    return ret;
+  }
+
+  // as extent_server::truncate does it, over every shard
+  extent_protocol::extentid_t f = extent_protocol::file_of(eid);
+  unsigned long long last = size == 0 ? 0 : (size - 1) / extent_protocol::blocksize;
+  if (last > 0xffffffffULL)
+    return extent_protocol::FBIG;
+  ret = stat(f, r);
+  if (ret != extent_protocol::OK)
+    return ret;
+  std::vector<extent_protocol::extentid_t> ids;
+  ret = blocks(f, ids);
+  if (ret != extent_protocol::OK)
+    return ret;
+  for (unsigned int i = 0; i < ids.size(); i++) {
+    if ((ids[i] >> 32) <= last)
+      continue;
+    ret = remove(ids[i]);
+    if (ret != extent_protocol::OK && ret != extent_protocol::NOENT)
+      return ret;
+  }
+  extent_protocol::extentid_t lid = (last << 32) | f;
+  extent_protocol::attr a = extent_protocol::attr();
+  a.size = size - last * extent_protocol::blocksize;
+  ret = setattr(lid, a);
+  if (ret == extent_protocol::NOENT)
+    ret = put(lid, std::string(a.size, '\0'));
+  if (ret == extent_protocol::OK && st != NULL)
+    ret = stat(f, *st);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::readfile(extent_protocol::extentid_t eid,
+                        unsigned long long off, unsigned int len,
+                        std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  if (stripe() == 0) {
+    shard_ref cl(this, eid);
+    if (len <= (unsigned int) rpc_const::stream_chunk) {
+      do {
+        ret = cl.call(extent_protocol::readfile, eid, off, len, buf);
+      } while (cl.stale(ret));
+      return ret;
+    }
+    // a shard that has come in since ends the stream WRONGSHARD, and
+    // it goes on from there on the shard the file is on now
+    buf.clear();
+    do {
+      ret = readstream(cl.rpc(), eid, off + buf.size(), len - buf.size(), buf);
+    } while (cl.stale(ret));
+    return ret;
+  }
+
+  // a run at a time from its shard, which reads short, or NOENT, past
+  // the last of the file it has
+  extent_protocol::extentid_t f = extent_protocol::file_of(eid);
+  extent_protocol::filestat st;
+  ret = stat(f, st);
+  if (ret != extent_protocol::OK)
+    return ret;
+  buf.clear();
+  if (off >= st.size)
+    return extent_protocol::OK;
+  if (len > st.size - off)
+    len = st.size - off;
+  unsigned long long run =
+    (unsigned long long) stripe() * extent_protocol::blocksize;
+  while (buf.size() < len) {
+    unsigned long long pos = off + buf.size();
+    unsigned int want = std::min((unsigned long long) len - buf.size(),
+                                 (pos / run + 1) * run - pos);
+    want = std::min(want, (unsigned int) rpc_const::stream_chunk);
+    std::string part;
+    {
+      shard_ref cl(this, ((pos / extent_protocol::blocksize) << 32) | f);
+      do {
+        ret = cl.call(extent_protocol::readfile, f, pos, want, part);
+      } while (cl.stale(ret));
+    }
+    if (ret != extent_protocol::OK && ret != extent_protocol::NOENT)
+      return ret;
+    buf += part;
+    buf.resize(buf.size() + want - part.size(), '\0');
+  }
+  return extent_protocol::OK;
+}
+
+// append to buf what a readstream of len bytes from off on cl gives
+extent_protocol::status
+extent_client::readstream(rpcc *cl, extent_protocol::extentid_t eid,
+                          unsigned long long off, unsigned long long len,
+                          std::string &buf)
+{
+  if (cl == NULL)
+    return extent_protocol::RPCERR;
+  std::ostringstream arg;
+  arg << eid << " " << off << " " << len;
+  int sid;
+  if (cl->stream_open(extent_protocol::readstream, arg.str(), sid) != 0)
+    return extent_protocol::RPCERR;
+  bool eof = false;
+  while (!eof) {
+    std::string chunk;
+    if (cl->stream_read(sid, chunk, eof) != 0) {
+      cl->stream_close(sid);
+      return extent_protocol::RPCERR;
+    }
+    buf += chunk;
+  }
+  int r = cl->stream_close(sid);
+  return r < 0 ? extent_protocol::RPCERR : (extent_protocol::status) r;
+}
+
+// writestream buf from done on, at off + done, on cl; done is left
+// past the last chunk the server took
+extent_protocol::status
+extent_client::writestream(rpcc *cl, extent_protocol::extentid_t eid,
+                           unsigned long long off, const std::string &buf,
+                           size_t &done)
+{
+  if (cl == NULL)
+    return extent_protocol::RPCERR;
+  std::ostringstream arg;
+  arg << eid << " " << off + done;
+  int sid;
+  if (cl->stream_open(extent_protocol::writestream, arg.str(), sid) != 0)
+    return extent_protocol::RPCERR;
+  while (done < buf.size()) {
+    size_t n = std::min(buf.size() - done, (size_t) rpc_const::stream_chunk);
+    int r = cl->stream_write(sid, buf.substr(done, n));
+    if (r != 0) {
+      cl->stream_close(sid);
+      return r < 0 ? extent_protocol::RPCERR : (extent_protocol::status) r;
+    }
+    done += n;
+  }
+  int r = cl->stream_close(sid);
+  return r < 0 ? extent_protocol::RPCERR : (extent_protocol::status) r;
+}
+
+extent_protocol::status
+extent_client::writefile(extent_protocol::extentid_t eid,
+                         unsigned long long off, const std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::extentid_t f = extent_protocol::file_of(eid);
+  unsigned long long bs = extent_protocol::blocksize;
+  if (buf.size() > 0 && (off + buf.size() - 1) / bs > 0xffffffffULL)
+    return extent_protocol::FBIG;
+  // a stream takes three calls, so it is only worth it from four
+  // blocks on
+  if (stripe() == 0 && buf.size() > 0 &&
+      (off + buf.size() - 1) / bs - off / bs >= 3) {
+    // a chunk the server turns away WRONGSHARD is written again whole
+    // on the shard the file is on now; its blocks that did get
+    // written are only written over with the same bytes
+    shard_ref cl(this, eid);
+    size_t done = 0;
+    do {
+      ret = writestream(cl.rpc(), eid, off, buf, done);
+    } while (cl.stale(ret));
+    return ret;
+  }
+
+  // each block from the shard it is on
+  size_t done = 0;
+  while (done < buf.size()) {
+    unsigned long long pos = off + done;
+    unsigned long long b = pos / bs;
+    size_t n = std::min((unsigned long long) buf.size() - done,
+                        bs - pos % bs);
+    ret = write((b << 32) | f, pos % bs, buf.substr(done, n));
+    if (ret != extent_protocol::OK)
+      return ret;
+    done += n;
+  }
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::clone(extent_protocol::extentid_t src,
+                     extent_protocol::extentid_t dst,
+                     extent_protocol::filestat *st)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::filestat r;
+  if (stripe() == 0) {
+    // a shard that has come in since makes the call WRONGSHARD
+    shard_ref cl(this, src);
+    while (cl.nshards() == 1) {
+      ret = cl.call(extent_protocol::clone, src, dst, r);
+      if (cl.stale(ret))
+        continue;
+      if (ret == extent_protocol::OK && st != NULL)
+        *st = r;
+      return ret;
+    }
+  }
+  ret = copy(src, dst, r);
+  if (ret == extent_protocol::OK && st != NULL)
+    *st = r;
+  return ret;
+}
+
+// the ids of the blocks file f has on any shard, in block order
+extent_protocol::status
+extent_client::blocks(extent_protocol::extentid_t f,
+                      std::vector<extent_protocol::extentid_t> &out)
+{
+  unsigned long long epoch;
+  do {
+    std::vector<rpcc *> cls;
+    extent_protocol::status ret = spread(f, cls, epoch);
+    if (ret != extent_protocol::OK)
+      return ret;
+    out.clear();
+    for (unsigned int i = 0; i < cls.size(); i++) {
+      std::vector<extent_protocol::extentid_t> ids;
+      ret = cls[i]->call(extent_protocol::listblocks, f, ids);
+      if (ret != extent_protocol::OK)
+        return ret;
+      out.insert(out.end(), ids.begin(), ids.end());
+    }
+  } while (!unchanged(epoch));
+  std::sort(out.begin(), out.end());
+  return extent_protocol::OK;
+}
+
+// extent_server::clone done from here, for files whose blocks are on
+// different shards. the data passes through the client.
+extent_protocol::status
+extent_client::copy(extent_protocol::extentid_t src,
+                    extent_protocol::extentid_t dst,
+                    extent_protocol::filestat &st)
+{
+  extent_protocol::extentid_t f = extent_protocol::file_of(src);
+  extent_protocol::extentid_t g = extent_protocol::file_of(dst);
+  std::vector<extent_protocol::extentid_t> from, old;
+  extent_protocol::status r = blocks(f, from);
+  if (r != extent_protocol::OK)
+    return r;
+  if (from.empty())
+    return extent_protocol::NOENT;
+  if (f == g)
+    return stat(f, st);
+  r = blocks(g, old);
+  if (r != extent_protocol::OK)
+    return r;
+
+  std::set<extent_protocol::extentid_t> copied;
+  for (unsigned int i = 0; i < from.size(); i++) {
+    extent_protocol::extentid_t id = (from[i] & ~0xffffffffULL) | g;
+    std::string buf;
+    r = get(from[i], buf);
+    if (r == extent_protocol::NOENT)
+      continue; // src lost the block meanwhile
+    if (r == extent_protocol::OK)
+      r = put(id, buf);
+    if (r != extent_protocol::OK)
+      return r;
+    copied.insert(id);
+  }
+  for (unsigned int i = 0; i < old.size(); i++)
+    if (copied.count(old[i]) == 0)
+      remove(old[i]);
+  return stat(g, st);
+}
+
+extent_protocol::status
+extent_client::removetree(extent_protocol::extentid_t eid,
+                          extent_protocol::reclaimed &rec)
+{
+  rec.files = 0;
+  rec.extents = 0;
+  rec.bytes = 0;
+  std::set<extent_protocol::extentid_t> seen;
+  return removetree1(extent_protocol::file_of(eid), rec, seen);
+}
+
+// a directory's children may be on other shards than it is, so with
+// more than one they are removed from here before it is
+extent_protocol::status
+extent_client::removetree1(extent_protocol::extentid_t f,
+                           extent_protocol::reclaimed &rec,
+                           std::set<extent_protocol::extentid_t> &seen)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::reclaimed r;
+  if (!seen.insert(f).second)
+    return extent_protocol::OK;
+  if (stripe() == 0) {
+    shard_ref cl(this, f);
+    while (cl.nshards() == 1) {
+      ret = cl.call(extent_protocol::removetree, f, r);
+      if (cl.stale(ret))
+        continue;
+      rec.files += r.files;
+      rec.extents += r.extents;
+      rec.bytes += r.bytes;
+      return ret;
+    }
+  }
+
+  if (extent_protocol::is_dir(f)) {
+    std::string buf;
+    ret = get(f, buf);
+    if (ret != extent_protocol::OK)
+      return ret;
+    std::istringstream is(buf);
+    extent_protocol::extentid_t self, child;
+    std::string name;
+    is >> self;
+    while (is >> child >> name) {
+      ret = removetree1(extent_protocol::file_of(child), rec, seen);
+      if (ret != extent_protocol::OK && ret != extent_protocol::NOENT)
+        return ret;
+    }
+  }
+
+  // f alone is left, on its shard or, striped, on any of them
+  if (stripe() == 0) {
+    shard_ref cl(this, f);
+    do {
+      ret = cl.call(extent_protocol::removetree, f, r);
+    } while (cl.stale(ret));
+    if (ret == extent_protocol::OK) {
+      rec.files += r.files;
+      rec.extents += r.extents;
+      rec.bytes += r.bytes;
+    }
+    return ret;
+  }
+  // a block removed in a round that has to be made again is NOENT
+  // in the next
+  bool found = false;
+  unsigned long long epoch;
+  do {
+    std::vector<rpcc *> cls;
+    ret = spread(f, cls, epoch);
+    if (ret != extent_protocol::OK)
+      return ret;
+    for (unsigned int i = 0; i < cls.size(); i++) {
+      ret = cls[i]->call(extent_protocol::removetree, f, r);
+      if (ret == extent_protocol::NOENT)
+        continue;
+      if (ret != extent_protocol::OK)
+        return ret;
+      found = true;
+      rec.extents += r.extents;
+      rec.bytes += r.bytes;
+    }
+  } while (!unchanged(epoch));
+  if (!found)
+    return extent_protocol::NOENT;
+  rec.files++;
+  return extent_protocol::OK;
+}
+
+// the calls on the servers themselves go to every shard, and their
+// answers are labelled by shard when there is more than one
+extent_protocol::status
+extent_client::report(std::string &out)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::vector<rpcc *> cls;
+  ret = all(cls);
+  if (ret != extent_protocol::OK)
+    return ret;
+  out.clear();
+  for (unsigned int i = 0; i < cls.size(); i++) {
+    std::string part;
+    ret = cls[i]->call(extent_protocol::report, 0, part);
+    if (ret != extent_protocol::OK)
+      return ret;
+    out += label(i, cls.size()) + part;
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::snapshot()
+{
+  std::vector<rpcc *> cls;
+  extent_protocol::status ret = all(cls);
+  if (ret != extent_protocol::OK)
+    return ret;
+  for (unsigned int i = 0; i < cls.size(); i++) {
+    int r;
+    extent_protocol::status sret = cls[i]->call(extent_protocol::snapshot, 0, r);
+    if (ret == extent_protocol::OK)
+      ret = sret;
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::hotspots(unsigned int n, std::string &out)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::vector<rpcc *> cls;
+  ret = all(cls);
+  if (ret != extent_protocol::OK)
+    return ret;
+  out.clear();
+  for (unsigned int i = 0; i < cls.size(); i++) {
+    std::string part;
+    ret = cls[i]->call(extent_protocol::hotspots, n, part);
+    if (ret != extent_protocol::OK)
+      return ret;
+    out += label(i, cls.size()) + part;
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::qosstats(std::string &out)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::vector<rpcc *> cls;
+  ret = all(cls);
+  if (ret != extent_protocol::OK)
+    return ret;
+  out.clear();
+  for (unsigned int i = 0; i < cls.size(); i++) {
+    std::string part;
+    ret = cls[i]->call(rpc_const::qos_stats, 0, part);
+    if (ret != extent_protocol::OK)
+      return ret;
+    out += label(i, cls.size()) + part;
+  }
+  return ret;
+}
@@ -4,24 +4,194 @@
 #define extent_client_h
 
 #include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <pthread.h>
 #include "extent_protocol.h"
+#include "extent_ring.h"
 #include "rpc.h"
 
+// dst names one extent server, or several, comma separated, that
+// share the extents between them as shards. the servers keep the
+// shard map, and any one of them will do to find the rest. an
+// extent's shard comes from a consistent hash ring of its file (the
+// low 32 bits of its id), so the blocks of a file stay together and
+// the calls on whole files go to one server. EXTENT_STRIPE_BLOCKS=n,
+// when the map is first set, places each run of n blocks of a file on
+// its own instead, and the calls on whole files then go to every
+// shard and are put together here.
+//
+// add_shard() takes a new server into the map online; the new server
+// moves its share of the extents over in the background. a server
+// answers WRONGSHARD to a call on an extent that its map places
+// elsewhere, and the call is then made again with the map as the
+// servers have it now, so every client sees every extent throughout.
 class extent_client {
  private:
-  rpcc *cl;
+  // the shard map, as last fetched, with a connection to each of its
+  // shards (NULL where one could not be reached; calls to it fail with
+  // RPCERR until a newer map is installed) and their ring. calls route
+  // by it under map_l, but hold nothing across the call itself.
+  extent_protocol::shardmap map;
+  std::vector<rpcc *> shards;
+  extent_ring ring;
+  pthread_rwlock_t map_l;
+  // serializes fetching a new map
+  pthread_mutex_t refresh_m;
+  // every server connected to, by name
+  pthread_mutex_t conns_m;
+  std::map<std::string, rpcc *> conns;
+
+  // a call's shard, and whether to make the call again elsewhere
+  class shard_ref {
+   public:
+    shard_ref(extent_client *ec, extent_protocol::extentid_t eid);
+    // cl->call, or RPCERR if the shard cannot be reached
+    template<class R, class A1>
+      int call(unsigned int proc, const A1 &a1, R &r) {
+        return cl == NULL ? extent_protocol::RPCERR : cl->call(proc, a1, r);
+      }
+    template<class R, class A1, class A2>
+      int call(unsigned int proc, const A1 &a1, const A2 &a2, R &r) {
+        return cl == NULL ? extent_protocol::RPCERR :
+          cl->call(proc, a1, a2, r);
+      }
+    template<class R, class A1, class A2, class A3>
+      int call(unsigned int proc, const A1 &a1, const A2 &a2, const A3 &a3,
+               R &r) {
+        return cl == NULL ? extent_protocol::RPCERR :
+          cl->call(proc, a1, a2, a3, r);
+      }
+    // the shard's connection, for streamed calls; NULL if it cannot
+    // be reached
+    rpcc *rpc() { return cl; }
+    unsigned int nshards() { return n; }
+    // false, leaving ret alone, unless ret is WRONGSHARD; then re-route
+    // by a newer map and say to go again, or give up with IOERR if no
+    // map places eid where it is taken
+    bool stale(extent_protocol::status &ret);
+   private:
+    void route();
+    extent_client *ec;
+    extent_protocol::extentid_t eid;
+    rpcc *cl;
+    unsigned int n;
+    unsigned long long epoch;
+    int tries;
+  };
+
+  rpcc *conn(const std::string &name);
+  static std::string name_of(const std::string &dst);
+  bool fetch(const std::vector<std::string> &names,
+             extent_protocol::shardmap &m);
+  void install(const extent_protocol::shardmap &m);
+  bool refresh(unsigned long long epoch);
+  bool unchanged(unsigned long long epoch);
+  unsigned int stripe();
+  extent_protocol::status all(std::vector<rpcc *> &cls);
+  std::string label(unsigned int i, unsigned int n);
+  extent_protocol::status spread(extent_protocol::extentid_t f,
+                                 std::vector<rpcc *> &cls,
+                                 unsigned long long &epoch);
+  extent_protocol::status blocks(extent_protocol::extentid_t f,
+                                 std::vector<extent_protocol::extentid_t> &out);
+  extent_protocol::status copy(extent_protocol::extentid_t src,
+                               extent_protocol::extentid_t dst,
+                               extent_protocol::filestat &st);
+  extent_protocol::status readstream(rpcc *cl, extent_protocol::extentid_t eid,
+                                     unsigned long long off,
+                                     unsigned long long len, std::string &buf);
+  extent_protocol::status writestream(rpcc *cl, extent_protocol::extentid_t eid,
+                                      unsigned long long off,
+                                      const std::string &buf, size_t &done);
+  extent_protocol::status removetree1(extent_protocol::extentid_t f,
+                                      extent_protocol::reclaimed &rec,
+                                      std::set<extent_protocol::extentid_t> &seen);
 
  public:
   extent_client(std::string dst);
 
+  // where a is non-NULL, the calls below also fill in the extent's
+  // attr, as read with the data or as left by the change, from the
+  // same reply
   extent_protocol::status get(extent_protocol::extentid_t eid, 
-			      std::string &buf);
+			      std::string &buf, extent_protocol::attr *a = NULL);
+  // NOTMODIFIED, leaving buf alone, if eid is still at version
+  extent_protocol::status getifchanged(extent_protocol::extentid_t eid,
+                                       unsigned long long version,
+                                       std::string &buf,
+                                       extent_protocol::attr *a = NULL);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				  extent_protocol::attr &a);
   extent_protocol::status setattr(extent_protocol::extentid_t eid, 
-                  extent_protocol::attr a);  
-  extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+                  extent_protocol::attr attr, extent_protocol::attr *a = NULL);
+  extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf,
+                              extent_protocol::attr *a = NULL);
+  // put only if eid is still at version (0: does not exist yet). on
+  // CONFLICT, cur and a hold what is there instead; on OK, a is the
+  // attr of the new contents
+  extent_protocol::status putifversion(extent_protocol::extentid_t eid,
+                                       unsigned long long version,
+                                       std::string buf, std::string &cur,
+                                       extent_protocol::attr &a);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  // up to len bytes from off; short at the end of the extent
+  extent_protocol::status read(extent_protocol::extentid_t eid,
+                               unsigned int off, unsigned int len,
+                               std::string &buf);
+  // write buf at off, or at the end for append
+  extent_protocol::status write(extent_protocol::extentid_t eid,
+                                unsigned int off, std::string buf,
+                                extent_protocol::attr *a = NULL);
+  extent_protocol::status append(extent_protocol::extentid_t eid,
+                                 std::string buf,
+                                 extent_protocol::attr *a = NULL);
+  // total size and block count of the file eid belongs to
+  extent_protocol::status stat(extent_protocol::extentid_t eid,
+                               extent_protocol::filestat &st);
+  // set the size of the file eid belongs to; growing it leaves a hole
+  extent_protocol::status truncate(extent_protocol::extentid_t eid,
+                                   unsigned long long size,
+                                   extent_protocol::filestat *st = NULL);
+  // up to len bytes of the file eid belongs to from off, holes reading
+  // as zeros; short only at the end of the file. readfile and writefile
+  // stream transfers of more than rpc_const::stream_chunk bytes, so
+  // they are not bound by the largest message rpc takes
+  extent_protocol::status readfile(extent_protocol::extentid_t eid,
+                                   unsigned long long off, unsigned int len,
+                                   std::string &buf);
+  // write buf into the file eid belongs to from off, across as many
+  // blocks as it takes
+  extent_protocol::status writefile(extent_protocol::extentid_t eid,
+                                    unsigned long long off,
+                                    const std::string &buf);
+  // make the file dst belongs to a copy of src's without the data
+  // passing through the client
+  extent_protocol::status clone(extent_protocol::extentid_t src,
+                                extent_protocol::extentid_t dst,
+                                extent_protocol::filestat *st = NULL);
+  // remove a file's extents, or a directory and everything under it,
+  // in one call; rec says what went
+  extent_protocol::status removetree(extent_protocol::extentid_t eid,
+                                     extent_protocol::reclaimed &rec);
+  // the server's account of its backend, as text
+  extent_protocol::status report(std::string &out);
+  // start a snapshot of the server's extents; IOERR if it cannot
+  extent_protocol::status snapshot();
+  // the n extents and clients the server has seen the most calls and
+  // bytes from, as text
+  extent_protocol::status hotspots(unsigned int n, std::string &out);
+  // the server's per-client rate limiting counters, as text
+  extent_protocol::status qosstats(std::string &out);
+
+  // add the server at dst as one more shard and have it start moving
+  // its share of the extents over. IOERR while an earlier one is still
+  // being moved in, or if another was added at the same time; RPCERR
+  // if dst or the first of the shards cannot be reached
+  extent_protocol::status add_shard(std::string dst);
+  // whether extents are still being moved to the last shard added
+  bool rebalancing_now();
 };
 
 #endif 
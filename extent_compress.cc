@@ -0,0 +1,372 @@
+// transparent compression of extent payloads over another backend
+
+#include "extent_compress.h"
+#include "extent_hash.h"
+#include "rpc/slock.h"
+#include <stdio.h>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+
+// a stored extent that starts with MAGIC is followed by a mode byte
+// and the uncompressed length, 4 bytes little-endian
+static const char MAGIC[4] = { '\xfe', 'y', 'z', '\x01' };
+enum { HDR = 9 };
+enum { MODE_LZ = 'Z', MODE_RAW = 'R' };
+
+namespace {
+  unsigned long long cpu_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  bool has_header(const std::string &s)
+  {
+    return s.size() >= HDR && memcmp(s.data(), MAGIC, sizeof(MAGIC)) == 0;
+  }
+
+  unsigned int header_len(const std::string &s)
+  {
+    const unsigned char *p = (const unsigned char *) s.data() + 5;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+  }
+
+  void put_header(std::string &out, char mode, unsigned int len)
+  {
+    out.assign(MAGIC, sizeof(MAGIC));
+    out += mode;
+    for (int i = 0; i < 4; i++)
+      out += (char) (len >> (8 * i));
+  }
+
+  void put_count(std::string &out, unsigned int n)
+  {
+    for (; n >= 255; n -= 255)
+      out += (char) 255;
+    out += (char) n;
+  }
+
+  // LZ77 in the manner of LZ4: a run of sequences, each a token byte
+  // (literal count in the high nibble, match length less 4 in the
+  // low, 15 meaning more follows in bytes of up to 255), the
+  // literals, and then a 2-byte offset back to the match. the last
+  // sequence has literals only. matches are found through a 4K-entry
+  // hash table of 4-byte prefixes, last occurrence wins.
+  void lz_compress(const char *src, unsigned int n, std::string &out)
+  {
+    enum { HBITS = 12 };
+    int table[1 << HBITS];
+    memset(table, -1, sizeof(table));
+    unsigned int anchor = 0, i = 0;
+    unsigned int limit = n > 12 ? n - 12 : 0;
+    while (i < limit) {
+      unsigned int seq;
+      memcpy(&seq, src + i, 4);
+      unsigned int h = (seq * 2654435761U) >> (32 - HBITS);
+      int cand = table[h];
+      table[h] = i;
+      if (cand < 0 || i - cand > 65535 || memcmp(src + cand, src + i, 4) != 0) {
+        i++;
+        continue;
+      }
+      unsigned int m = 4;
+      while (i + m < n && src[cand + m] == src[i + m])
+        m++;
+      unsigned int lits = i - anchor, ml = m - 4;
+      out += (char) (((lits < 15 ? lits : 15) << 4) | (ml < 15 ? ml : 15));
+      if (lits >= 15)
+        put_count(out, lits - 15);
+      out.append(src + anchor, lits);
+      unsigned int off = i - cand;
+      out += (char) off;
+      out += (char) (off >> 8);
+      if (ml >= 15)
+        put_count(out, ml - 15);
+      i += m;
+      anchor = i;
+    }
+    if (anchor < n) {
+      unsigned int lits = n - anchor;
+      out += (char) ((lits < 15 ? lits : 15) << 4);
+      if (lits >= 15)
+        put_count(out, lits - 15);
+      out.append(src + anchor, lits);
+    }
+  }
+
+  bool get_count(const unsigned char *&ip, const unsigned char *end,
+                 unsigned int &n)
+  {
+    unsigned char c;
+    do {
+      if (ip == end)
+        return false;
+      c = *ip++;
+      n += c;
+    } while (c == 255);
+    return true;
+  }
+
+  // false if src is not a well-formed encoding of exactly n bytes
+  bool lz_decompress(const char *src, unsigned int len, unsigned int n,
+                     std::string &out)
+  {
+    out.resize(n);
+    char *op = &out[0];
+    unsigned int pos = 0;
+    const unsigned char *ip = (const unsigned char *) src, *end = ip + len;
+    while (ip < end) {
+      unsigned int token = *ip++;
+      unsigned int lits = token >> 4, ml = token & 15;
+      if (lits == 15 && !get_count(ip, end, lits))
+        return false;
+      if (lits > (unsigned int) (end - ip) || lits > n - pos)
+        return false;
+      memcpy(op + pos, ip, lits);
+      ip += lits;
+      pos += lits;
+      if (ip == end)
+        break;
+      if (end - ip < 2)
+        return false;
+      unsigned int off = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (ml == 15 && !get_count(ip, end, ml))
+        return false;
+      ml += 4;
+      if (off == 0 || off > pos || ml > n - pos)
+        return false;
+      // byte at a time: the match may overlap what it is copying
+      for (unsigned int k = 0; k < ml; k++, pos++)
+        op[pos] = op[pos - off];
+    }
+    return pos == n;
+  }
+}
+
+compress_backend::compress_backend(extent_backend *b, unsigned int threshold)
+  : b_(b), threshold_(threshold < HDR ? HDR : threshold), small_(0),
+    bypassed_(0), tried_(0), compressed_(0), in_(0), out_(0), decoded_(0),
+    compress_ns_(0), decompress_ns_(0)
+{
+  assert(pthread_mutex_init(&m_, NULL) == 0);
+  memset(adapt_, 0, sizeof(adapt_));
+}
+
+compress_backend::~compress_backend()
+{
+  delete b_;
+}
+
+// the backoff state id's file shares; m_ is held
+compress_backend::adapt &
+compress_backend::adapt_of(extent_protocol::extentid_t id)
+{
+  return adapt_[fmix64(extent_protocol::file_of(id)) % ADAPT];
+}
+
+// whether a put to id should try compressing, by how the last few of
+// its file went
+bool
+compress_backend::attempt(extent_protocol::extentid_t id)
+{
+  ScopedLock ml(&m_);
+  adapt &ad = adapt_of(id);
+  if (ad.skip == 0)
+    return true;
+  ad.skip--;
+  bypassed_++;
+  return false;
+}
+
+void
+compress_backend::encode(extent_protocol::extentid_t id,
+                         const std::string &data, std::string &out)
+{
+  if (data.size() < threshold_ || !attempt(id)) {
+    if (data.size() < threshold_) {
+      ScopedLock ml(&m_);
+      small_++;
+    }
+    if (has_header(data)) {
+      put_header(out, MODE_RAW, data.size());
+      out += data;
+    } else {
+      out = data;
+    }
+    return;
+  }
+
+  unsigned long long start = cpu_ns();
+  std::string z;
+  z.reserve(HDR + data.size());
+  put_header(z, MODE_LZ, data.size());
+  lz_compress(data.data(), data.size(), z);
+  unsigned long long took = cpu_ns() - start;
+  bool worth = z.size() <= data.size() - data.size() / 8;
+  if (worth) {
+    out.swap(z);
+  } else if (has_header(data)) {
+    put_header(out, MODE_RAW, data.size());
+    out += data;
+  } else {
+    out = data;
+  }
+
+  ScopedLock ml(&m_);
+  adapt &ad = adapt_of(id);
+  if (worth) {
+    ad.backoff = 0;
+  } else {
+    ad.backoff = ad.backoff == 0 ? 1 : std::min(ad.backoff * 2, 256U);
+    ad.skip = ad.backoff;
+  }
+  tried_++;
+  if (worth)
+    compressed_++;
+  in_ += data.size();
+  out_ += out.size();
+  compress_ns_ += took;
+}
+
+int
+compress_backend::decode(const std::string &stored, std::string &data)
+{
+  if (!has_header(stored)) {
+    data = stored;
+    return extent_protocol::OK;
+  }
+  unsigned int len = header_len(stored);
+  if (stored[4] == MODE_RAW) {
+    data.assign(stored, HDR, std::string::npos);
+    return data.size() == len ? extent_protocol::OK : extent_protocol::IOERR;
+  }
+  unsigned long long start = cpu_ns();
+  bool ok = stored[4] == MODE_LZ &&
+    lz_decompress(stored.data() + HDR, stored.size() - HDR, len, data);
+  unsigned long long took = cpu_ns() - start;
+  ScopedLock ml(&m_);
+  decoded_++;
+  decompress_ns_ += took;
+  return ok ? extent_protocol::OK : extent_protocol::IOERR;
+}
+
+int
+compress_backend::get(extent_protocol::extentid_t id, extent_entry &e)
+{
+  extent_entry s;
+  int r = b_->get(id, s);
+  if (r != extent_protocol::OK)
+    return r;
+  r = decode(s.data, e.data);
+  if (r != extent_protocol::OK) {
+    fprintf(stderr, "compress_backend: extent %llu does not decode\n", id);
+    return r;
+  }
+  e.a = s.a;
+  e.a.size = e.data.size();
+  return extent_protocol::OK;
+}
+
+int
+compress_backend::getattr(extent_protocol::extentid_t id,
+                          extent_protocol::attr &a)
+{
+  int r = b_->getattr(id, a);
+  if (r != extent_protocol::OK || a.size < HDR)
+    return r;
+  std::string h;
+  r = b_->read(id, 0, HDR, h);
+  if (r == extent_protocol::OK && has_header(h))
+    a.size = header_len(h);
+  return r;
+}
+
+int
+compress_backend::put(extent_protocol::extentid_t id, const extent_entry &e)
+{
+  extent_entry s;
+  s.a = e.a;
+  encode(id, e.data, s.data);
+  s.a.size = s.data.size();
+  return b_->put(id, s);
+}
+
+int
+compress_backend::remove(extent_protocol::extentid_t id)
+{
+  return b_->remove(id);
+}
+
+void
+compress_backend::ids(std::vector<extent_protocol::extentid_t> &ids)
+{
+  b_->ids(ids);
+}
+
+int
+compress_backend::read(extent_protocol::extentid_t id, unsigned int off,
+                       unsigned int len, std::string &buf)
+{
+  std::string h;
+  int r = b_->read(id, 0, HDR, h);
+  if (r != extent_protocol::OK)
+    return r;
+  if (!has_header(h))
+    return b_->read(id, off, len, buf);
+  if (h[4] == MODE_RAW)
+    return b_->read(id, HDR + off, len, buf);
+  extent_entry e;
+  r = get(id, e);
+  if (r != extent_protocol::OK)
+    return r;
+  if (off < e.data.size())
+    buf.assign(e.data, off, len);
+  else
+    buf.clear();
+  return extent_protocol::OK;
+}
+
+int
+compress_backend::copy(extent_protocol::extentid_t src,
+                       extent_protocol::extentid_t dst,
+                       unsigned long long version, extent_protocol::attr &a)
+{
+  int r = b_->copy(src, dst, version, a);
+  if (r == extent_protocol::OK)
+    r = getattr(dst, a);
+  return r;
+}
+
+int
+compress_backend::snapshot()
+{
+  return b_->snapshot();
+}
+
+void
+compress_backend::stats(std::string &out)
+{
+  char buf[1024];
+  {
+    ScopedLock ml(&m_);
+    snprintf(buf, sizeof(buf),
+        "compression threshold %u bytes\n"
+        "puts below it %llu, bypassed as incompressible %llu\n"
+        "compressed %llu of %llu tried, %llu bytes to %llu (ratio %.2f)\n"
+        "cpu: compressing %.1f ms (%.2f us each), "
+        "decompressing %.1f ms (%.2f us each over %llu)\n",
+        threshold_, small_, bypassed_, compressed_, tried_, in_, out_,
+        out_ ? (double) in_ / out_ : 1.0,
+        compress_ns_ / 1e6, tried_ ? compress_ns_ / 1e3 / tried_ : 0.0,
+        decompress_ns_ / 1e6, decoded_ ? decompress_ns_ / 1e3 / decoded_ : 0.0,
+        decoded_);
+  }
+  std::string under;
+  b_->stats(under);
+  out = buf;
+  if (!under.empty())
+    out += "stored in:\n" + under;
+}
@@ -0,0 +1,63 @@
+// transparent compression of extent payloads over another backend
+
+#ifndef extent_compress_h
+#define extent_compress_h
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "extent_backend.h"
+
+// stores extents of at least threshold bytes in the backend beneath
+// compressed with a small built-in LZ77 codec, when that saves an
+// eighth or more. a compressed extent starts with a header that raw
+// data never does (raw data that happens to is stored under a header
+// too), so anything already in the backend reads back unchanged.
+// sizes reported up are always those of the uncompressed data.
+//
+// data that does not compress is noticed and skipped: after each
+// failed attempt the next 1, 2, 4, ... up to 256 extents of the same
+// file are stored as they are, and one that compresses again resets
+// the count. files share ADAPT slots of this state by hash, so one
+// file of random data does not stop the rest being compressed.
+class compress_backend : public extent_backend {
+ public:
+  compress_backend(extent_backend *b, unsigned int threshold);
+  ~compress_backend();
+
+  int get(extent_protocol::extentid_t id, extent_entry &e);
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int put(extent_protocol::extentid_t id, const extent_entry &e);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &ids);
+  // ranges of raw extents come straight from the backend
+  int read(extent_protocol::extentid_t id, unsigned int off,
+           unsigned int len, std::string &buf);
+  // copies the stored form without decompressing it
+  int copy(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+           unsigned long long version, extent_protocol::attr &a);
+  void stats(std::string &out);
+  int snapshot();
+
+ private:
+  extent_backend *b_;
+  const unsigned int threshold_;
+
+  pthread_mutex_t m_; // protects the fields below
+  enum { ADAPT = 1024 };
+  struct adapt {
+    unsigned int skip, backoff;
+  } adapt_[ADAPT];
+  adapt &adapt_of(extent_protocol::extentid_t id);
+  unsigned long long small_, bypassed_, tried_, compressed_;
+  unsigned long long in_, out_; // bytes before and after, of those tried
+  unsigned long long decoded_;
+  unsigned long long compress_ns_, decompress_ns_; // thread cpu time
+
+  bool attempt(extent_protocol::extentid_t id);
+  void encode(extent_protocol::extentid_t id, const std::string &data,
+              std::string &out);
+  int decode(const std::string &stored, std::string &data);
+};
+
+#endif
@@ -0,0 +1,336 @@
+// in-memory extent backend that stores each distinct payload once
+
+#include "extent_dedup.h"
+#include "extent_hash.h"
+#include "rpc/slock.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+namespace {
+  inline unsigned long long rotl(unsigned long long x, int r)
+  {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  // MurmurHash3_x64_128, seed 0: some 5 GB/s, so a 1K block costs
+  // a fraction of a microsecond against tens for the RPC carrying it
+  void hash128(const std::string &s, unsigned long long out[2])
+  {
+    const unsigned char *data = (const unsigned char *) s.data();
+    size_t len = s.size(), nblocks = len / 16;
+    const unsigned long long c1 = 0x87c37b91114253d5ULL;
+    const unsigned long long c2 = 0x4cf5ad432745937fULL;
+    unsigned long long h1 = 0, h2 = 0;
+
+    for (size_t i = 0; i < nblocks; i++) {
+      unsigned long long k1, k2;
+      memcpy(&k1, data + i * 16, 8);
+      memcpy(&k2, data + i * 16 + 8, 8);
+      k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+      h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+      k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+      h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = data + nblocks * 16;
+    unsigned long long k1 = 0, k2 = 0;
+    switch (len & 15) {
+    case 15: k2 ^= (unsigned long long) tail[14] << 48;
+    case 14: k2 ^= (unsigned long long) tail[13] << 40;
+    case 13: k2 ^= (unsigned long long) tail[12] << 32;
+    case 12: k2 ^= (unsigned long long) tail[11] << 24;
+    case 11: k2 ^= (unsigned long long) tail[10] << 16;
+    case 10: k2 ^= (unsigned long long) tail[9] << 8;
+    case 9:  k2 ^= (unsigned long long) tail[8];
+             k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+    case 8:  k1 ^= (unsigned long long) tail[7] << 56;
+    case 7:  k1 ^= (unsigned long long) tail[6] << 48;
+    case 6:  k1 ^= (unsigned long long) tail[5] << 40;
+    case 5:  k1 ^= (unsigned long long) tail[4] << 32;
+    case 4:  k1 ^= (unsigned long long) tail[3] << 24;
+    case 3:  k1 ^= (unsigned long long) tail[2] << 16;
+    case 2:  k1 ^= (unsigned long long) tail[1] << 8;
+    case 1:  k1 ^= (unsigned long long) tail[0];
+             k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+  }
+
+  unsigned long long now_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+}
+
+dedup_backend::dedup_backend()
+{
+  for (int i = 0; i < NSTRIPES; i++) {
+    stripe &s = stripes_[i];
+    assert(pthread_mutex_init(&s.m, NULL) == 0);
+    s.payloads = s.bytes = 0;
+    s.puts = s.hits = s.collisions = 0;
+    s.hashed = s.hash_ns = 0;
+  }
+}
+
+dedup_backend::~dedup_backend()
+{
+  std::vector<extent_protocol::extentid_t> ids;
+  index_.keys(ids);
+  for (unsigned int i = 0; i < ids.size(); i++)
+    remove(ids[i]);
+}
+
+// a reference to a payload holding data, new or shared
+dedup_backend::payload *
+dedup_backend::intern(const std::string &data)
+{
+  unsigned long long start = now_ns();
+  unsigned long long h[2];
+  hash128(data, h);
+  unsigned long long took = now_ns() - start;
+
+  stripe &s = stripe_of(h);
+  std::pair<unsigned long long, unsigned long long> key(h[0], h[1]);
+  ScopedLock sl(&s.m);
+  s.puts++;
+  s.hashed += data.size();
+  s.hash_ns += took;
+  std::map<std::pair<unsigned long long, unsigned long long>, payload *>::iterator
+    i = s.table.find(key);
+  if (i != s.table.end()) {
+    if (i->second->data == data) {
+      i->second->refs++;
+      s.hits++;
+      return i->second;
+    }
+    s.collisions++;
+  }
+  payload *p = new payload;
+  p->h[0] = h[0];
+  p->h[1] = h[1];
+  p->refs = 1;
+  p->shared = i == s.table.end();
+  p->data = data;
+  if (p->shared)
+    s.table[key] = p;
+  s.payloads++;
+  s.bytes += data.size();
+  return p;
+}
+
+void
+dedup_backend::hold(payload *p)
+{
+  stripe &s = stripe_of(p->h);
+  ScopedLock sl(&s.m);
+  p->refs++;
+}
+
+void
+dedup_backend::drop(payload *p)
+{
+  stripe &s = stripe_of(p->h);
+  {
+    ScopedLock sl(&s.m);
+    if (--p->refs > 0)
+      return;
+    if (p->shared)
+      s.table.erase(std::make_pair(p->h[0], p->h[1]));
+    s.payloads--;
+    s.bytes -= p->data.size();
+  }
+  delete p;
+}
+
+namespace {
+  struct swap_ref {
+    swap_ref(const dedup_backend::ref &xr) : r(xr), old(NULL) {}
+    bool operator()(dedup_backend::ref &v, bool found) {
+      if (found)
+        old = v.p;
+      v = r;
+      return true;
+    }
+    dedup_backend::ref r;
+    dedup_backend::payload *old;
+  };
+}
+
+// point id at p, which the caller holds a reference to for it
+void
+dedup_backend::install(extent_protocol::extentid_t id, payload *p,
+                       const extent_protocol::attr &a)
+{
+  ref r;
+  r.p = p;
+  r.a = a;
+  r.a.size = p->data.size();
+  swap_ref f(r);
+  index_.update(id, f);
+  if (f.old != NULL)
+    drop(f.old);
+}
+
+namespace {
+  struct copy_out {
+    copy_out(extent_entry &xe) : e(xe) {}
+    void operator()(const dedup_backend::ref &r) {
+      e.data = r.p->data;
+      e.a = r.a;
+    }
+    extent_entry &e;
+  };
+
+  struct copy_attr {
+    copy_attr(extent_protocol::attr &xa) : a(xa) {}
+    void operator()(const dedup_backend::ref &r) { a = r.a; }
+    extent_protocol::attr &a;
+  };
+
+  struct copy_range {
+    copy_range(unsigned int xoff, unsigned int xlen, std::string &xbuf)
+      : off(xoff), len(xlen), buf(xbuf) {}
+    void operator()(const dedup_backend::ref &r) {
+      if (off < r.p->data.size())
+        buf.assign(r.p->data, off, len);
+      else
+        buf.clear();
+    }
+    unsigned int off, len;
+    std::string &buf;
+  };
+}
+
+// src's payload and attr, with a reference taken while the index
+// still guarantees one
+struct dedup_backend::share {
+  share(dedup_backend *xb) : b(xb), p(NULL) {}
+  void operator()(const ref &r) {
+    b->hold(r.p);
+    p = r.p;
+    a = r.a;
+  }
+  dedup_backend *b;
+  payload *p;
+  extent_protocol::attr a;
+};
+
+int
+dedup_backend::get(extent_protocol::extentid_t id, extent_entry &e)
+{
+  copy_out f(e);
+  return index_.peek(id, f) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int
+dedup_backend::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
+{
+  copy_attr f(a);
+  return index_.peek(id, f) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int
+dedup_backend::read(extent_protocol::extentid_t id, unsigned int off,
+                    unsigned int len, std::string &buf)
+{
+  copy_range f(off, len, buf);
+  return index_.peek(id, f) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int
+dedup_backend::put(extent_protocol::extentid_t id, const extent_entry &e)
+{
+  install(id, intern(e.data), e.a);
+  return extent_protocol::OK;
+}
+
+int
+dedup_backend::remove(extent_protocol::extentid_t id)
+{
+  ref r;
+  if (!index_.remove(id, &r))
+    return extent_protocol::NOENT;
+  drop(r.p);
+  return extent_protocol::OK;
+}
+
+void
+dedup_backend::ids(std::vector<extent_protocol::extentid_t> &ids)
+{
+  index_.keys(ids);
+}
+
+int
+dedup_backend::copy(extent_protocol::extentid_t src,
+                    extent_protocol::extentid_t dst, unsigned long long version,
+                    extent_protocol::attr &a)
+{
+  share f(this);
+  if (!index_.peek(src, f))
+    return extent_protocol::NOENT;
+  f.a.mtime = f.a.ctime = time(NULL);
+  f.a.version = version;
+  install(dst, f.p, f.a);
+  a = f.a;
+  return extent_protocol::OK;
+}
+
+namespace {
+  struct add_size {
+    add_size() : bytes(0) {}
+    void operator()(const dedup_backend::ref &r) { bytes += r.a.size; }
+    unsigned long long bytes;
+  };
+}
+
+void
+dedup_backend::stats(std::string &out)
+{
+  unsigned long long payloads = 0, stored = 0, puts = 0, hits = 0;
+  unsigned long long collisions = 0, hashed = 0, hash_ns = 0, tables = 0;
+  for (int i = 0; i < NSTRIPES; i++) {
+    stripe &s = stripes_[i];
+    ScopedLock sl(&s.m);
+    payloads += s.payloads;
+    stored += s.bytes;
+    puts += s.puts;
+    hits += s.hits;
+    collisions += s.collisions;
+    hashed += s.hashed;
+    hash_ns += s.hash_ns;
+    tables += s.table.size();
+  }
+  std::vector<extent_protocol::extentid_t> ids;
+  index_.keys(ids);
+  add_size f;
+  for (unsigned int i = 0; i < ids.size(); i++)
+    index_.peek(ids[i], f);
+
+  // what sharing costs: a payload header and hash table node apiece
+  unsigned long long overhead = payloads * sizeof(payload) + tables * 64;
+  char buf[1024];
+  snprintf(buf, sizeof(buf),
+      "extents %llu, %llu bytes\n"
+      "payloads %llu, %llu bytes stored (dedup ratio %.2f)\n"
+      "saved %lld bytes, %lld net of %llu bytes of payload headers\n"
+      "puts %llu, shared %llu (%.1f%%), hash collisions %llu\n"
+      "hashing %llu bytes took %.1f ms (%.0f ns per put, %.2f GB/s)\n",
+      (unsigned long long) ids.size(), f.bytes,
+      payloads, stored, stored ? (double) f.bytes / stored : 1.0,
+      (long long) (f.bytes - stored),
+      (long long) (f.bytes - stored - overhead), overhead,
+      puts, hits, puts ? 100.0 * hits / puts : 0.0, collisions,
+      hashed, hash_ns / 1e6, puts ? (double) hash_ns / puts : 0.0,
+      hash_ns ? (double) hashed / hash_ns : 0.0);
+  out = buf;
+}
@@ -0,0 +1,78 @@
+// in-memory extent backend that stores each distinct payload once
+
+#ifndef extent_dedup_h
+#define extent_dedup_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include "extent_backend.h"
+#include "extent_store.h"
+
+// extents with identical data share one copy of it. each payload is
+// filed under a 128-bit MurmurHash3 of its bytes and counts the
+// extents that refer to it; a put whose data hashes to a payload
+// already held, and compares equal to it, takes another reference
+// instead of storing the bytes again, and the last reference to go
+// frees the payload. two different payloads with the same hash are
+// both kept, the second outside the hash table, unshared.
+//
+// a payload is never changed once stored, so lookups copy out of it
+// under the index shard's read lock alone, as in the slab backend. a
+// copy (the server's clone) only adds a reference.
+class dedup_backend : public extent_backend {
+ public:
+  dedup_backend();
+  ~dedup_backend();
+
+  int get(extent_protocol::extentid_t id, extent_entry &e);
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int put(extent_protocol::extentid_t id, const extent_entry &e);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &ids);
+  int read(extent_protocol::extentid_t id, unsigned int off,
+           unsigned int len, std::string &buf);
+  int copy(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+           unsigned long long version, extent_protocol::attr &a);
+  void stats(std::string &out);
+
+  struct payload {
+    unsigned long long h[2];
+    unsigned int refs;
+    bool shared; // filed in the hash table
+    std::string data;
+  };
+  struct ref {
+    ref() : p(NULL) {}
+    payload *p;
+    extent_protocol::attr a;
+  };
+
+ private:
+  extent_table<ref> index_;
+
+  // the payloads, split by hash; each stripe's lock also covers the
+  // reference counts of its payloads and its share of the counters
+  enum { NSTRIPES = 64 };
+  struct stripe {
+    pthread_mutex_t m;
+    std::map<std::pair<unsigned long long, unsigned long long>, payload *> table;
+    unsigned long long payloads, bytes; // distinct payloads held
+    unsigned long long puts, hits, collisions;
+    unsigned long long hashed, hash_ns; // bytes hashed, time spent on it
+  };
+  stripe stripes_[NSTRIPES];
+
+  stripe &stripe_of(const unsigned long long h[2]) {
+    return stripes_[h[0] % NSTRIPES];
+  }
+  struct share;
+  payload *intern(const std::string &data);
+  void hold(payload *p);
+  void drop(payload *p);
+  void install(extent_protocol::extentid_t id, payload *p,
+               const extent_protocol::attr &a);
+};
+
+#endif
@@ -0,0 +1,29 @@
+// hash and checksum functions shared by the extent code
+
+#include "extent_hash.h"
+#include <pthread.h>
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_init()
+{
+  for (unsigned int i = 0; i < 256; i++) {
+    unsigned int c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+unsigned int
+crc32(unsigned int crc, const void *buf, size_t n)
+{
+  pthread_once(&crc_once, crc_init);
+  const unsigned char *p = (const unsigned char *) buf;
+  crc = ~crc;
+  while (n--)
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
@@ -0,0 +1,25 @@
+// hash and checksum functions shared by the extent code
+
+#ifndef extent_hash_h
+#define extent_hash_h
+
+#include <stddef.h>
+
+// 64-bit finalizer from MurmurHash3: yfs ids differ mostly in their
+// low bits (inum) or high bits (block number), so every bit of the
+// input moves about half the bits of the output
+inline unsigned long long
+fmix64(unsigned long long h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// CRC-32 (IEEE) of buf, continuing from crc; start with 0
+unsigned int crc32(unsigned int crc, const void *buf, size_t n);
+
+#endif
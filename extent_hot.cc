@@ -0,0 +1,195 @@
+// which extents and which clients carry the extent server's load
+
+#include "extent_hot.h"
+#include "extent_store.h"
+#include "rpc/slock.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+topk::topk(unsigned int k, unsigned int width)
+  : k_(k < NSTRIPES ? 1 : k / NSTRIPES), width_(width < 1 ? 1 : width),
+    total_(0)
+{
+  for (int i = 0; i < NSTRIPES; i++) {
+    assert(pthread_mutex_init(&stripes_[i].m, NULL) == 0);
+    stripes_[i].heap.reserve(k_);
+  }
+  sketch_ = new unsigned long long[DEPTH * width_];
+  memset(sketch_, 0, DEPTH * width_ * sizeof(sketch_[0]));
+}
+
+topk::~topk()
+{
+  delete [] sketch_;
+}
+
+void
+topk::swap(stripe &s, unsigned int i, unsigned int j)
+{
+  std::swap(s.heap[i], s.heap[j]);
+  s.at[s.heap[i].key] = i;
+  s.at[s.heap[j].key] = j;
+}
+
+void
+topk::sift_up(stripe &s, unsigned int i)
+{
+  while (i > 0 && s.heap[(i - 1) / 2].count > s.heap[i].count) {
+    swap(s, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void
+topk::sift_down(stripe &s, unsigned int i)
+{
+  for (;;) {
+    unsigned int least = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < s.heap.size() && s.heap[l].count < s.heap[least].count)
+      least = l;
+    if (r < s.heap.size() && s.heap[r].count < s.heap[least].count)
+      least = r;
+    if (least == i)
+      return;
+    swap(s, i, least);
+    i = least;
+  }
+}
+
+// the sketch's rows index by h1 + row * h2, two halves of one hash
+void
+topk::add(unsigned long long key, unsigned long long w)
+{
+  if (w == 0)
+    return;
+  unsigned long long h = extent_store::hash(key);
+  unsigned int h1 = h, h2 = (h >> 32) | 1;
+  for (int row = 0; row < DEPTH; row++)
+    __atomic_add_fetch(&sketch_[row * width_ + (h1 + row * h2) % width_], w,
+                       __ATOMIC_RELAXED);
+  __atomic_add_fetch(&total_, w, __ATOMIC_RELAXED);
+
+  stripe &s = stripes_[h % NSTRIPES];
+  ScopedLock sl(&s.m);
+  std::map<unsigned long long, unsigned int>::iterator i = s.at.find(key);
+  if (i != s.at.end()) {
+    s.heap[i->second].count += w;
+    sift_down(s, i->second);
+  } else if (s.heap.size() < k_) {
+    counter c = { key, w, 0 };
+    s.heap.push_back(c);
+    s.at[key] = s.heap.size() - 1;
+    sift_up(s, s.heap.size() - 1);
+  } else {
+    // take over the smallest counter
+    counter &c = s.heap[0];
+    s.at.erase(c.key);
+    c.key = key;
+    c.error = c.count;
+    c.count += w;
+    s.at[key] = 0;
+    sift_down(s, 0);
+  }
+}
+
+unsigned long long
+topk::estimate(unsigned long long key)
+{
+  unsigned long long h = extent_store::hash(key);
+  unsigned int h1 = h, h2 = (h >> 32) | 1;
+  unsigned long long est = 0;
+  for (int row = 0; row < DEPTH; row++) {
+    unsigned long long v = __atomic_load_n(
+        &sketch_[row * width_ + (h1 + row * h2) % width_], __ATOMIC_RELAXED);
+    if (row == 0 || v < est)
+      est = v;
+  }
+  return est;
+}
+
+namespace {
+  bool heavier(const topk::item &a, const topk::item &b)
+  {
+    return a.count > b.count || (a.count == b.count && a.key < b.key);
+  }
+}
+
+void
+topk::top(unsigned int n, std::vector<item> &out)
+{
+  out.clear();
+  for (int i = 0; i < NSTRIPES; i++) {
+    ScopedLock sl(&stripes_[i].m);
+    for (unsigned int j = 0; j < stripes_[i].heap.size(); j++) {
+      const counter &c = stripes_[i].heap[j];
+      item it = { c.key, c.count, c.count - c.error };
+      out.push_back(it);
+    }
+  }
+  // the sketch is read after the counters, so it has seen at least
+  // as much of each key as they have
+  for (unsigned int i = 0; i < out.size(); i++)
+    out[i].count = std::min(out[i].count, estimate(out[i].key));
+  std::sort(out.begin(), out.end(), heavier);
+  if (out.size() > n)
+    out.resize(n);
+}
+
+unsigned long long
+topk::total()
+{
+  return __atomic_load_n(&total_, __ATOMIC_RELAXED);
+}
+
+hot_tracker::hot_tracker(unsigned int k, unsigned int width)
+  : extent_ops_(k, width), extent_bytes_(k, width),
+    client_ops_(k, width), client_bytes_(k, width)
+{
+}
+
+void
+hot_tracker::note(unsigned int client, extent_protocol::extentid_t id,
+               unsigned long long bytes)
+{
+  extent_ops_.add(id, 1);
+  extent_bytes_.add(id, bytes);
+  client_ops_.add(client, 1);
+  client_bytes_.add(client, bytes);
+}
+
+namespace {
+  void list(const char *what, bool extents, topk &t, unsigned int n,
+            std::string &out)
+  {
+    std::vector<topk::item> items;
+    t.top(n, items);
+    unsigned long long total = t.total();
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s (of %llu):\n", what, total);
+    out += buf;
+    for (unsigned int i = 0; i < items.size(); i++) {
+      const topk::item &it = items[i];
+      char label[64];
+      if (extents)
+        snprintf(label, sizeof(label), "%llu (file %llu block %llu)", it.key,
+                 extent_protocol::file_of(it.key), it.key >> 32);
+      else
+        snprintf(label, sizeof(label), "client %llu", it.key);
+      snprintf(buf, sizeof(buf), "  %-40s %14llu %5.1f%%  (at least %llu)\n",
+               label, it.count, total ? 100.0 * it.count / total : 0.0,
+               it.least);
+      out += buf;
+    }
+  }
+}
+
+void
+hot_tracker::report(unsigned int n, std::string &out)
+{
+  out.clear();
+  list("extents by calls", true, extent_ops_, n, out);
+  list("extents by bytes", true, extent_bytes_, n, out);
+  list("clients by calls", false, client_ops_, n, out);
+  list("clients by bytes", false, client_bytes_, n, out);
+}
@@ -0,0 +1,76 @@
+// which extents and which clients carry the extent server's load
+
+#ifndef extent_hot_h
+#define extent_hot_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include "extent_protocol.h"
+
+// the heaviest keys of a weighted stream, in fixed memory. keys are
+// split by hash over stripes, each a Space-Saving summary with its
+// share of k counters: a key not yet counted takes over the smallest
+// counter, inheriting its count as its possible overcount. so every
+// key heavier than its stripe's total over the stripe's counters is
+// listed, with a count high by at most what it inherited. a
+// count-min sketch beside the summaries, bumped without locks, gives
+// a second upper bound, usually tighter for keys that took over a
+// counter late.
+class topk {
+ public:
+  topk(unsigned int k, unsigned int width);
+  ~topk();
+
+  void add(unsigned long long key, unsigned long long w);
+
+  struct item {
+    unsigned long long key;
+    unsigned long long count; // at most this
+    unsigned long long least; // and at least this
+  };
+  // the n heaviest keys listed, heaviest first
+  void top(unsigned int n, std::vector<item> &out);
+  unsigned long long total();
+
+ private:
+  enum { NSTRIPES = 8, DEPTH = 4 };
+  struct counter {
+    unsigned long long key, count, error;
+  };
+  struct stripe {
+    pthread_mutex_t m;
+    std::vector<counter> heap; // min-heap by count
+    std::map<unsigned long long, unsigned int> at; // key to heap index
+  };
+  stripe stripes_[NSTRIPES];
+  const unsigned int k_;
+
+  const unsigned int width_;
+  unsigned long long *sketch_; // DEPTH rows of width_ counters
+  unsigned long long total_;
+
+  void swap(stripe &s, unsigned int i, unsigned int j);
+  void sift_up(stripe &s, unsigned int i);
+  void sift_down(stripe &s, unsigned int i);
+  unsigned long long estimate(unsigned long long key);
+};
+
+// the extent ids and client nonces behind the most calls and the
+// most bytes, each tracked by its own topk
+class hot_tracker {
+ public:
+  hot_tracker(unsigned int k, unsigned int width);
+
+  // a call from client touching id and moving bytes either way
+  void note(unsigned int client, extent_protocol::extentid_t id,
+            unsigned long long bytes);
+  // the n heaviest of each, as text
+  void report(unsigned int n, std::string &out);
+
+ private:
+  topk extent_ops_, extent_bytes_, client_ops_, client_bytes_;
+};
+
+#endif
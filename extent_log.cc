@@ -0,0 +1,783 @@
+// log-structured persistent extent backend
+
+#include "extent_log.h"
+#include "extent_hash.h"
+#include "rpc/slock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+
+#define REC_MAGIC 0x79667367 // "yfsg"
+#define CKPT_MAGIC 0x7966636b // "yfck"
+
+enum { REC_PUT = 1, REC_DEL = 2 };
+
+// on-disk record header, in host byte order; data follows it
+struct rec_hdr {
+  unsigned int magic;
+  unsigned int crc; // of everything after this field, data included
+  unsigned long long id;
+  unsigned int type;
+  unsigned int len;
+  unsigned int atime;
+  unsigned int mtime;
+  unsigned int ctime;
+  unsigned int size;
+  unsigned long long version;
+};
+
+struct ckpt_hdr {
+  unsigned int magic;
+  unsigned int crc; // of the entries
+  unsigned long long count;
+  unsigned long long off; // the log up to seg/off is in the checkpoint
+  unsigned int seg;
+  unsigned int pad;
+};
+
+struct ckpt_ent {
+  unsigned long long id;
+  unsigned long long off;
+  unsigned int seg;
+  unsigned int len;
+  unsigned int atime;
+  unsigned int mtime;
+  unsigned int ctime;
+  unsigned int size;
+  unsigned long long version;
+};
+
+// a checkpoint is due after this much log or this much time
+#define CKPT_SECONDS 30
+// a segment is cleaned once less than this percentage of it is live
+#define CLEAN_LIVE_PCT 50
+
+static unsigned int
+rec_crc(const rec_hdr &h, const char *data)
+{
+  const char *p = (const char *) &h;
+  unsigned int crc = crc32(0, p + 2*sizeof(unsigned int),
+                           sizeof(h) - 2*sizeof(unsigned int));
+  return crc32(crc, data, h.len);
+}
+
+// full-length positioned i/o; false on error or end of file
+static bool
+preadv_all(int fd, struct iovec *iov, int n, unsigned long long off)
+{
+  while (n > 0) {
+    ssize_t r = preadv(fd, iov, n, off);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    off += r;
+    while (n > 0 && (size_t) r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+  return true;
+}
+
+static bool
+pwritev_all(int fd, struct iovec *iov, int n, unsigned long long off)
+{
+  while (n > 0) {
+    ssize_t r = pwritev(fd, iov, n, off);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    off += r;
+    while (n > 0 && (size_t) r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+  return true;
+}
+
+static void
+sync_dir(const std::string &dir)
+{
+  int fd = open(dir.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+static void *
+cleanerthread(void *x)
+{
+  log_backend *b = (log_backend *) x;
+  b->cleaner();
+  return 0;
+}
+
+log_backend::log_backend(std::string dir, unsigned long long segmax, bool sync)
+  : dir_(dir), segmax_(segmax), sync_(sync), active_(0), activeseg_(NULL),
+    appended_(0), syncing_(false), synced_(0), stop_(false),
+    ckpt_appended_(0), ckpt_seg_(0), ckpt_time_(time(NULL))
+{
+  assert(pthread_rwlock_init(&segs_l_, NULL) == 0);
+  assert(pthread_mutex_init(&log_m_, NULL) == 0);
+  assert(pthread_mutex_init(&sync_m_, NULL) == 0);
+  assert(pthread_cond_init(&sync_c_, NULL) == 0);
+  assert(pthread_mutex_init(&clean_m_, NULL) == 0);
+  assert(pthread_cond_init(&clean_c_, NULL) == 0);
+
+  if (!recover()) {
+    fprintf(stderr, "log_backend: cannot open log in %s\n", dir_.c_str());
+    exit(1);
+  }
+
+  int r = pthread_create(&th_, NULL, &cleanerthread, (void *) this);
+  assert (r == 0);
+}
+
+log_backend::~log_backend()
+{
+  {
+    ScopedLock cl(&clean_m_);
+    stop_ = true;
+    assert(pthread_cond_signal(&clean_c_) == 0);
+  }
+  assert(pthread_join(th_, NULL) == 0);
+  checkpoint();
+
+  std::map<unsigned int, segment *>::iterator i;
+  for (i = segs_.begin(); i != segs_.end(); i++) {
+    close(i->second->fd);
+    delete i->second;
+  }
+}
+
+std::string
+log_backend::segpath(unsigned int seg)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/seg.%08u", seg);
+  return dir_ + name;
+}
+
+namespace {
+  // stores a new location, handing back the one it replaced
+  struct swap_loc {
+    swap_loc(const log_backend::loc &xl) : l(xl), found(false) {}
+    bool operator()(log_backend::loc &cur, bool xfound) {
+      std::swap(cur, l);
+      found = xfound;
+      return true;
+    }
+    log_backend::loc l;
+    bool found;
+  };
+}
+
+// append one record and point the index at it. OP_MOVE copies a live
+// record and OP_KEEPDEL a tombstone out of a segment being cleaned;
+// both write nothing if the extent changed since. lsn is where the
+// record ends, for durable(), or 0 if nothing was written.
+int
+log_backend::append(int op, extent_protocol::extentid_t id,
+                    const extent_protocol::attr &a, const std::string &data,
+                    unsigned long long &lsn, const loc *at)
+{
+  rec_hdr h;
+  h.magic = REC_MAGIC;
+  h.id = id;
+  h.type = (op == OP_PUT || op == OP_MOVE) ? REC_PUT : REC_DEL;
+  h.len = h.type == REC_PUT ? data.size() : 0;
+  h.atime = a.atime;
+  h.mtime = a.mtime;
+  h.ctime = a.ctime;
+  h.size = a.size;
+  h.version = a.version;
+  h.crc = rec_crc(h, data.data());
+
+  struct iovec iov[2];
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = (void *) data.data();
+  iov[1].iov_len = h.len;
+  unsigned long long reclen = sizeof(h) + h.len;
+
+  lsn = 0;
+  ScopedLock ml(&log_m_);
+
+  loc cur;
+  bool exists = index_.get(id, cur);
+  if (op == OP_DEL && !exists)
+    return extent_protocol::NOENT;
+  if (op == OP_MOVE && (!exists || cur.seg != at->seg || cur.off != at->off))
+    return extent_protocol::OK;
+  if (op == OP_KEEPDEL && exists)
+    return extent_protocol::OK;
+
+  if (activeseg_->size > 0 && activeseg_->size + reclen > segmax_) {
+    if (roll() != extent_protocol::OK)
+      return extent_protocol::IOERR;
+  }
+
+  unsigned long long off = activeseg_->size;
+  if (!pwritev_all(activeseg_->fd, iov, h.len ? 2 : 1, off)) {
+    perror("log_backend::append");
+    return extent_protocol::IOERR;
+  }
+  activeseg_->size += reclen;
+  appended_ += reclen;
+  lsn = appended_;
+
+  if (h.type == REC_PUT) {
+    loc l;
+    l.seg = active_;
+    l.off = off;
+    l.len = h.len;
+    l.a = a;
+    activeseg_->live += reclen;
+    swap_loc f(l);
+    index_.update(id, f);
+    if (f.found)
+      forget(f.l);
+  } else if (exists) {
+    index_.remove(id);
+    forget(cur);
+  }
+  return extent_protocol::OK;
+}
+
+// the record at l is no longer live. caller holds log_m_.
+void
+log_backend::forget(const loc &l)
+{
+  assert(pthread_rwlock_rdlock(&segs_l_) == 0);
+  std::map<unsigned int, segment *>::iterator i = segs_.find(l.seg);
+  if (i != segs_.end())
+    i->second->live -= sizeof(rec_hdr) + l.len;
+  assert(pthread_rwlock_unlock(&segs_l_) == 0);
+}
+
+// seal the active segment and start the next one. everything in the
+// sealed segment is synced first, so only the active segment ever
+// holds unsynced records. caller holds log_m_.
+int
+log_backend::roll()
+{
+  if (activeseg_ && fdatasync(activeseg_->fd) < 0) {
+    perror("log_backend::roll fdatasync");
+    return extent_protocol::IOERR;
+  }
+
+  unsigned int n = activeseg_ ? active_ + 1 : active_;
+  int fd = open(segpath(n).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("log_backend::roll open");
+    return extent_protocol::IOERR;
+  }
+  sync_dir(dir_);
+
+  segment *s = new segment();
+  s->fd = fd;
+  s->size = 0;
+  s->live = 0;
+  assert(pthread_rwlock_wrlock(&segs_l_) == 0);
+  segs_[n] = s;
+  assert(pthread_rwlock_unlock(&segs_l_) == 0);
+  active_ = n;
+  activeseg_ = s;
+  return extent_protocol::OK;
+}
+
+// wait until everything up to lsn is on disk. one caller at a time
+// issues the fdatasync, covering whatever has been appended by then;
+// the others wait for it rather than issuing their own.
+int
+log_backend::durable(unsigned long long lsn)
+{
+  ScopedLock sl(&sync_m_);
+  while (synced_ < lsn) {
+    if (syncing_) {
+      assert(pthread_cond_wait(&sync_c_, &sync_m_) == 0);
+      continue;
+    }
+    syncing_ = true;
+    assert(pthread_mutex_unlock(&sync_m_) == 0);
+
+    unsigned long long target;
+    int fd;
+    {
+      ScopedLock ml(&log_m_);
+      target = appended_;
+      fd = dup(activeseg_->fd);
+    }
+    bool ok = fd >= 0 && fdatasync(fd) == 0;
+    if (fd >= 0)
+      close(fd);
+
+    assert(pthread_mutex_lock(&sync_m_) == 0);
+    syncing_ = false;
+    if (ok && target > synced_)
+      synced_ = target;
+    assert(pthread_cond_broadcast(&sync_c_) == 0);
+    if (!ok) {
+      perror("log_backend::durable");
+      return extent_protocol::IOERR;
+    }
+  }
+  return extent_protocol::OK;
+}
+
+int
+log_backend::get(extent_protocol::extentid_t id, extent_entry &e)
+{
+  int r = extent_protocol::OK;
+  assert(pthread_rwlock_rdlock(&segs_l_) == 0);
+  loc l;
+  if (!index_.get(id, l)) {
+    r = extent_protocol::NOENT;
+  } else {
+    std::map<unsigned int, segment *>::iterator i = segs_.find(l.seg);
+    rec_hdr h;
+    e.data.resize(l.len);
+    struct iovec iov[2];
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = l.len ? &e.data[0] : NULL;
+    iov[1].iov_len = l.len;
+    if (i == segs_.end() || !preadv_all(i->second->fd, iov, 2, l.off) ||
+        h.magic != REC_MAGIC || h.id != id || h.len != l.len ||
+        h.crc != rec_crc(h, e.data.data())) {
+      fprintf(stderr, "log_backend::get: bad record for %llu in segment %u "
+              "at %llu\n", id, l.seg, l.off);
+      r = extent_protocol::IOERR;
+    }
+    e.a = l.a;
+  }
+  assert(pthread_rwlock_unlock(&segs_l_) == 0);
+  return r;
+}
+
+int
+log_backend::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
+{
+  loc l;
+  if (!index_.get(id, l))
+    return extent_protocol::NOENT;
+  a = l.a;
+  return extent_protocol::OK;
+}
+
+int
+log_backend::put(extent_protocol::extentid_t id, const extent_entry &e)
+{
+  unsigned long long lsn;
+  int r = append(OP_PUT, id, e.a, e.data, lsn);
+  if (r == extent_protocol::OK && sync_)
+    r = durable(lsn);
+  return r;
+}
+
+int
+log_backend::remove(extent_protocol::extentid_t id)
+{
+  unsigned long long lsn;
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  int r = append(OP_DEL, id, a, std::string(), lsn);
+  if (r == extent_protocol::OK && sync_)
+    r = durable(lsn);
+  return r;
+}
+
+void
+log_backend::ids(std::vector<extent_protocol::extentid_t> &ids)
+{
+  index_.keys(ids);
+}
+
+// rebuild the index from the newest checkpoint and the log after it,
+// then start a fresh active segment
+bool
+log_backend::recover()
+{
+  mkdir(dir_.c_str(), 0755);
+  DIR *d = opendir(dir_.c_str());
+  if (d == NULL)
+    return false;
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    unsigned int n;
+    char extra;
+    if (sscanf(de->d_name, "seg.%u%c", &n, &extra) != 1)
+      continue;
+    int fd = open(segpath(n).c_str(), O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      perror("log_backend::recover");
+      closedir(d);
+      return false;
+    }
+    segment *s = new segment();
+    s->fd = fd;
+    s->size = st.st_size;
+    s->live = 0;
+    segs_[n] = s;
+  }
+  closedir(d);
+
+  unsigned int seg = 0;
+  unsigned long long off = 0;
+  bool ckpt = load_checkpoint(seg, off);
+  if (!ckpt && !segs_.empty())
+    seg = segs_.begin()->first;
+
+  std::map<unsigned int, segment *>::iterator i;
+  for (i = segs_.lower_bound(seg); i != segs_.end(); i++) {
+    std::map<unsigned int, segment *>::iterator next = i;
+    next++;
+    replay(i->first, i->first == seg ? off : 0, next == segs_.end());
+  }
+
+  std::vector<extent_protocol::extentid_t> ids;
+  index_.keys(ids);
+  for (unsigned int k = 0; k < ids.size(); k++) {
+    loc l;
+    assert(index_.get(ids[k], l));
+    i = segs_.find(l.seg);
+    if (i == segs_.end()) {
+      fprintf(stderr, "log_backend: extent %llu lost with segment %u\n",
+              ids[k], l.seg);
+      index_.remove(ids[k]);
+      continue;
+    }
+    i->second->live += sizeof(rec_hdr) + l.len;
+  }
+  printf("log_backend: %s: %d segments, %llu extents%s\n", dir_.c_str(),
+         (int) segs_.size(), (unsigned long long) index_.size(),
+         ckpt ? " (from checkpoint)" : "");
+
+  active_ = segs_.empty() ? 1 : segs_.rbegin()->first + 1;
+  ckpt_seg_ = seg;
+  ScopedLock ml(&log_m_);
+  return roll() == extent_protocol::OK;
+}
+
+bool
+log_backend::load_checkpoint(unsigned int &seg, unsigned long long &off)
+{
+  std::string path = dir_ + "/checkpoint";
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  ckpt_hdr h;
+  std::vector<ckpt_ent> ents;
+  bool ok = false;
+  struct iovec iov[1];
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  if (preadv_all(fd, iov, 1, 0) && h.magic == CKPT_MAGIC) {
+    ents.resize(h.count);
+    iov[0].iov_base = ents.empty() ? NULL : &ents[0];
+    iov[0].iov_len = h.count * sizeof(ckpt_ent);
+    ok = (h.count == 0 || preadv_all(fd, iov, 1, sizeof(h))) &&
+      crc32(0, iov[0].iov_base, iov[0].iov_len) == h.crc;
+  }
+  close(fd);
+  if (!ok) {
+    fprintf(stderr, "log_backend: ignoring damaged %s\n", path.c_str());
+    return false;
+  }
+
+  for (unsigned long long k = 0; k < h.count; k++) {
+    loc l;
+    l.seg = ents[k].seg;
+    l.off = ents[k].off;
+    l.len = ents[k].len;
+    l.a.atime = ents[k].atime;
+    l.a.mtime = ents[k].mtime;
+    l.a.ctime = ents[k].ctime;
+    l.a.size = ents[k].size;
+    l.a.version = ents[k].version;
+    index_.put(ents[k].id, l);
+  }
+  seg = h.seg;
+  off = h.off;
+  return true;
+}
+
+// apply the records of segment seg from off on. a damaged record ends
+// the replay of the segment; in the last segment that is just a write
+// torn by a crash, and the segment is cut back to before it.
+void
+log_backend::replay(unsigned int seg, unsigned long long off, bool last)
+{
+  segment *s = segs_[seg];
+  std::string data;
+  while (off < s->size) {
+    rec_hdr h;
+    struct iovec iov[2];
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    bool ok = off + sizeof(h) <= s->size && preadv_all(s->fd, iov, 1, off) &&
+      h.magic == REC_MAGIC && off + sizeof(h) + h.len <= s->size;
+    if (ok) {
+      data.resize(h.len);
+      iov[1].iov_base = h.len ? &data[0] : NULL;
+      iov[1].iov_len = h.len;
+      ok = (h.len == 0 || preadv_all(s->fd, iov + 1, 1, off + sizeof(h))) &&
+        h.crc == rec_crc(h, data.data());
+    }
+    if (!ok) {
+      if (last) {
+        fprintf(stderr, "log_backend: truncating torn tail of segment %u at "
+                "%llu\n", seg, off);
+        if (ftruncate(s->fd, off) == 0)
+          s->size = off;
+      } else {
+        fprintf(stderr, "log_backend: damaged record in segment %u at %llu, "
+                "skipping the rest of it\n", seg, off);
+      }
+      return;
+    }
+
+    if (h.type == REC_PUT) {
+      loc l;
+      l.seg = seg;
+      l.off = off;
+      l.len = h.len;
+      l.a.atime = h.atime;
+      l.a.mtime = h.mtime;
+      l.a.ctime = h.ctime;
+      l.a.size = h.size;
+      l.a.version = h.version;
+      index_.put(h.id, l);
+    } else {
+      index_.remove(h.id);
+    }
+    off += sizeof(h) + h.len;
+  }
+}
+
+// write the whole index to the checkpoint file, tagged with the log
+// position it reflects
+int
+log_backend::checkpoint()
+{
+  ckpt_hdr h;
+  std::vector<ckpt_ent> ents;
+  unsigned long long lsn;
+  {
+    // nothing touches the index without log_m_
+    ScopedLock ml(&log_m_);
+    if (appended_ == ckpt_appended_)
+      return extent_protocol::OK;
+    h.seg = active_;
+    h.off = activeseg_->size;
+    lsn = appended_;
+
+    std::vector<extent_protocol::extentid_t> ids;
+    index_.keys(ids);
+    ents.resize(ids.size());
+    for (unsigned int k = 0; k < ids.size(); k++) {
+      loc l;
+      assert(index_.get(ids[k], l));
+      ents[k].id = ids[k];
+      ents[k].off = l.off;
+      ents[k].seg = l.seg;
+      ents[k].len = l.len;
+      ents[k].atime = l.a.atime;
+      ents[k].mtime = l.a.mtime;
+      ents[k].ctime = l.a.ctime;
+      ents[k].size = l.a.size;
+      ents[k].version = l.a.version;
+    }
+  }
+
+  // the checkpoint must not point at records that could still be lost
+  if (durable(lsn) != extent_protocol::OK)
+    return extent_protocol::IOERR;
+
+  h.magic = CKPT_MAGIC;
+  h.count = ents.size();
+  h.pad = 0;
+  h.crc = crc32(0, ents.empty() ? NULL : &ents[0], ents.size() * sizeof(ckpt_ent));
+
+  std::string tmp = dir_ + "/checkpoint.tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  struct iovec iov[2];
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = ents.empty() ? NULL : &ents[0];
+  iov[1].iov_len = ents.size() * sizeof(ckpt_ent);
+  bool ok = fd >= 0 && pwritev_all(fd, iov, 2, 0) && fsync(fd) == 0;
+  if (fd >= 0)
+    close(fd);
+  if (!ok || rename(tmp.c_str(), (dir_ + "/checkpoint").c_str()) < 0) {
+    perror("log_backend::checkpoint");
+    return extent_protocol::IOERR;
+  }
+  sync_dir(dir_);
+
+  ScopedLock ml(&log_m_);
+  ckpt_appended_ = lsn;
+  ckpt_seg_ = h.seg;
+  ckpt_time_ = time(NULL);
+  return extent_protocol::OK;
+}
+
+void
+log_backend::cleaner()
+{
+  while (1) {
+    {
+      ScopedLock cl(&clean_m_);
+      if (stop_)
+        return;
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += 1;
+      pthread_cond_timedwait(&clean_c_, &clean_m_, &ts);
+      if (stop_)
+        return;
+    }
+
+    bool due;
+    {
+      ScopedLock ml(&log_m_);
+      due = appended_ - ckpt_appended_ >= segmax_ ||
+        (appended_ != ckpt_appended_ && time(NULL) - ckpt_time_ >= CKPT_SECONDS);
+    }
+    if (due)
+      checkpoint();
+
+    while (!stop_ && clean_one())
+      ;
+  }
+}
+
+// clean the sealed segment with the smallest live fraction, if any is
+// under CLEAN_LIVE_PCT. returns whether it cleaned one.
+bool
+log_backend::clean_one()
+{
+  unsigned int victim = 0;
+  double best = CLEAN_LIVE_PCT / 100.0;
+  {
+    ScopedLock ml(&log_m_);
+    assert(pthread_rwlock_rdlock(&segs_l_) == 0);
+    std::map<unsigned int, segment *>::iterator i;
+    for (i = segs_.begin(); i != segs_.end(); i++) {
+      if (i->first == active_)
+        continue;
+      double frac = i->second->size ?
+        (double) i->second->live / i->second->size : 0;
+      if (frac < best) {
+        best = frac;
+        victim = i->first;
+      }
+    }
+    assert(pthread_rwlock_unlock(&segs_l_) == 0);
+  }
+  if (victim == 0)
+    return false;
+  return clean(victim) == extent_protocol::OK;
+}
+
+// copy the live records of seg to the head of the log and delete it.
+// a tombstone is kept while an older segment could still hold a record
+// it deletes, or while no checkpoint covers it.
+int
+log_backend::clean(unsigned int seg)
+{
+  segment *s;
+  bool older;
+  unsigned int ckpt_seg;
+  {
+    ScopedLock ml(&log_m_);
+    ckpt_seg = ckpt_seg_;
+  }
+  assert(pthread_rwlock_rdlock(&segs_l_) == 0);
+  s = segs_[seg];
+  older = segs_.begin()->first < seg;
+  assert(pthread_rwlock_unlock(&segs_l_) == 0);
+
+  unsigned long long off = 0, lsn = 0, moved = 0;
+  std::string data;
+  while (off < s->size) {
+    rec_hdr h;
+    struct iovec iov[2];
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    bool ok = preadv_all(s->fd, iov, 1, off) && h.magic == REC_MAGIC;
+    if (ok) {
+      data.resize(h.len);
+      iov[1].iov_base = h.len ? &data[0] : NULL;
+      iov[1].iov_len = h.len;
+      ok = (h.len == 0 || preadv_all(s->fd, iov + 1, 1, off + sizeof(h))) &&
+        h.crc == rec_crc(h, data.data());
+    }
+    if (!ok) {
+      fprintf(stderr, "log_backend::clean: damaged record in segment %u at "
+              "%llu, leaving the segment alone\n", seg, off);
+      return extent_protocol::IOERR;
+    }
+
+    extent_protocol::attr a;
+    a.atime = h.atime;
+    a.mtime = h.mtime;
+    a.ctime = h.ctime;
+    a.size = h.size;
+    a.version = h.version;
+    unsigned long long l = 0;
+    int r = extent_protocol::OK;
+    if (h.type == REC_PUT) {
+      loc at;
+      at.seg = seg;
+      at.off = off;
+      r = append(OP_MOVE, h.id, a, data, l, &at);
+    } else if (older || seg >= ckpt_seg) {
+      r = append(OP_KEEPDEL, h.id, a, data, l);
+    }
+    if (r != extent_protocol::OK)
+      return r;
+    if (l) {
+      lsn = l;
+      moved += sizeof(h) + h.len;
+    }
+    off += sizeof(h) + h.len;
+  }
+
+  if (lsn && durable(lsn) != extent_protocol::OK)
+    return extent_protocol::IOERR;
+
+  assert(pthread_rwlock_wrlock(&segs_l_) == 0);
+  segs_.erase(seg);
+  assert(pthread_rwlock_unlock(&segs_l_) == 0);
+  close(s->fd);
+  unlink(segpath(seg).c_str());
+  printf("log_backend: cleaned segment %u, moved %llu of %llu bytes\n",
+         seg, moved, s->size);
+  delete s;
+  return extent_protocol::OK;
+}
@@ -0,0 +1,104 @@
+// log-structured persistent extent backend
+
+#ifndef extent_log_h
+#define extent_log_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include <time.h>
+#include "extent_backend.h"
+#include "extent_store.h"
+
+// every put and remove is appended as a record to the active segment
+// file (seg.NNNNNNNN in the log directory); an in-memory index maps
+// each extent to its latest record. segments roll over at segmax
+// bytes and are never written again. a cleaner thread copies the
+// live records out of mostly-dead segments and deletes them, and
+// periodically writes the index to a checkpoint file so that startup
+// only has to replay the log written after it.
+//
+// with sync set, put and remove return only after an fdatasync that
+// covers their record; concurrent callers share one fdatasync.
+class log_backend : public extent_backend {
+ public:
+  log_backend(std::string dir, unsigned long long segmax, bool sync);
+  ~log_backend();
+
+  int get(extent_protocol::extentid_t id, extent_entry &e);
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int put(extent_protocol::extentid_t id, const extent_entry &e);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &ids);
+
+  void cleaner();
+
+  // where an extent's latest record lives
+  struct loc {
+    unsigned int seg;
+    unsigned int len;       // data bytes after the record header
+    unsigned long long off; // of the record header in the segment
+    extent_protocol::attr a;
+  };
+
+ private:
+  struct segment {
+    int fd;
+    unsigned long long size;
+    long long live; // bytes of records the index still points at
+  };
+
+  std::string dir_;
+  const unsigned long long segmax_;
+  const bool sync_;
+
+  extent_table<loc> index_;
+
+  // segs_ only changes under the write lock; readers hold the read
+  // lock from index lookup to pread so a cleaned segment cannot vanish
+  // under them
+  pthread_rwlock_t segs_l_;
+  std::map<unsigned int, segment *> segs_;
+
+  // log_m_ serializes appends and the index updates that go with them
+  pthread_mutex_t log_m_;
+  unsigned int active_;
+  segment *activeseg_;
+  unsigned long long appended_; // bytes appended since startup
+
+  // group commit
+  pthread_mutex_t sync_m_;
+  pthread_cond_t sync_c_;
+  bool syncing_;
+  unsigned long long synced_;
+
+  // cleaner and checkpoints
+  pthread_mutex_t clean_m_;
+  pthread_cond_t clean_c_;
+  bool stop_;
+  pthread_t th_;
+  unsigned long long ckpt_appended_; // appended_ at the last checkpoint
+  unsigned int ckpt_seg_; // active segment when it was taken
+  time_t ckpt_time_;
+
+  // what append() is asked to do
+  enum { OP_PUT, OP_DEL, OP_MOVE, OP_KEEPDEL };
+
+  std::string segpath(unsigned int seg);
+  int append(int op, extent_protocol::extentid_t id,
+             const extent_protocol::attr &a, const std::string &data,
+             unsigned long long &lsn, const loc *at = NULL);
+  int roll();
+  void forget(const loc &l);
+  int durable(unsigned long long lsn);
+
+  bool recover();
+  bool load_checkpoint(unsigned int &seg, unsigned long long &off);
+  void replay(unsigned int seg, unsigned long long off, bool last);
+  int checkpoint();
+  bool clean_one();
+  int clean(unsigned int seg);
+};
+
+#endif
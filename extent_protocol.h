@@ -9,20 +9,91 @@ class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR, FBIG};
+  // WRONGSHARD: the extent is not on this server by its shard map;
+  // the caller's map is out of date
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, FBIG, NOTMODIFIED, CONFLICT,
+                  WRONGSHARD };
   enum rpc_numbers {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    setattr,
+    read,
+    write,
+    append,
+    stat,
+    getwithattr,
+    removetree,
+    getifchanged,
+    putifversion,
+    report,
+    snapshot,
+    truncate,
+    readfile,
+    clone,
+    hotspots,
+    listfiles,
+    listblocks,
+    handoff,
+    release,
+    getmap,
+    setmap,
+    pullfile,
+    // streamed (rpcs::reg_stream) readfile and file-wide write
+    readstream,
+    writestream
   };
   static const unsigned int maxextent = 8192*1000;
+  // how many bytes of a file each of its blocks holds; a block may be
+  // shorter only if it is the last, and an absent block is a hole
+  static const unsigned int blocksize = 1024;
+
+  // the extents of one file share the low 32 bits of their ids; the
+  // high 32 bits number its blocks
+  static extentid_t file_of(extentid_t id) { return id & 0xffffffffULL; }
+  // yfs sets bit 31 in file inums and clears it in directory inums; a
+  // directory's extent reads "self child name child name ..."
+  static bool is_dir(extentid_t id) { return !(id & 0x80000000ULL); }
 
   struct attr {
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    // changes on every update and is never reused for the same id,
+    // not even across server restarts or remove and re-create
+    unsigned long long version;
+  };
+
+  // an extent's data and attributes, as returned by getwithattr
+  struct content {
+    std::string data;
+    attr a;
+  };
+
+  // what a removetree call deleted
+  struct reclaimed {
+    unsigned int files;   // files and directories
+    unsigned int extents;
+    unsigned long long bytes;
+  };
+
+  // totals over all the extents of one file
+  struct filestat {
+    unsigned long long size;
+    unsigned int nblocks;
+  };
+
+  // which servers share the extents, kept by the servers and fetched
+  // by clients; epoch goes up with every change, and 0 means a lone
+  // server that has never been given a map. while a shard added last
+  // is being moved in, old names the shards from before it.
+  struct shardmap {
+    unsigned long long epoch;
+    unsigned int stripe; // blocks per run, 0 for whole files
+    std::vector<std::string> shards;
+    std::vector<std::string> old;
   };
 };
 
@@ -33,6 +104,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.version;
   return u;
 }
 
@@ -43,6 +115,77 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.version;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::content &c)
+{
+  u >> c.data;
+  u >> c.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::content &c)
+{
+  m << c.data;
+  m << c.a;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::reclaimed &r)
+{
+  u >> r.files;
+  u >> r.extents;
+  u >> r.bytes;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::reclaimed r)
+{
+  m << r.files;
+  m << r.extents;
+  m << r.bytes;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::filestat &s)
+{
+  u >> s.size;
+  u >> s.nblocks;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::filestat s)
+{
+  m << s.size;
+  m << s.nblocks;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::shardmap &m)
+{
+  u >> m.epoch;
+  u >> m.stripe;
+  u >> m.shards;
+  u >> m.old;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::shardmap &s)
+{
+  m << s.epoch;
+  m << s.stripe;
+  m << s.shards;
+  m << s.old;
   return m;
 }
 
@@ -0,0 +1,173 @@
+// shared, marshalled replies to extent reads
+
+#include "extent_rcache.h"
+#include "extent_store.h"
+#include "rpc/slock.h"
+#include <stdio.h>
+
+reply_cache::reply_cache(unsigned long long budget)
+  : budget_(budget / NSTRIPES), hits_(0), misses_(0), coalesced_(0),
+    invalidations_(0), evictions_(0)
+{
+  for (int i = 0; i < NSTRIPES; i++) {
+    assert(pthread_mutex_init(&stripes_[i].m, NULL) == 0);
+    assert(pthread_cond_init(&stripes_[i].c, NULL) == 0);
+    stripes_[i].bytes = 0;
+  }
+  assert(pthread_mutex_init(&stat_m_, NULL) == 0);
+}
+
+reply_cache::~reply_cache()
+{
+  for (int i = 0; i < NSTRIPES; i++) {
+    stripe &s = stripes_[i];
+    while (!s.table.empty())
+      unlist(s, s.table.begin());
+  }
+}
+
+reply_cache::stripe &
+reply_cache::stripe_of(extent_protocol::extentid_t id)
+{
+  return stripes_[extent_store::hash(id) % NSTRIPES];
+}
+
+void
+reply_cache::release(flight *f)
+{
+  if (--f->refs == 0)
+    delete f;
+}
+
+// take i out of the table, and its reply out of the cache; the
+// stripe lock is held
+void
+reply_cache::unlist(stripe &s, std::map<key, flight *>::iterator i)
+{
+  flight *f = i->second;
+  if (f->cached) {
+    s.lru.erase(f->lru);
+    s.bytes -= f->rep.size();
+    f->cached = false;
+  }
+  s.table.erase(i);
+  release(f);
+}
+
+// NULL if r and rep hold the answer, from the cache or another
+// caller's lookup; otherwise the flight the caller must land
+reply_cache::flight *
+reply_cache::join(extent_protocol::extentid_t id, int kind, int &r,
+                  prepacked &rep)
+{
+  stripe &s = stripe_of(id);
+  key k(id, kind);
+  ScopedLock sl(&s.m);
+  std::map<key, flight *>::iterator i = s.table.find(k);
+  if (i == s.table.end()) {
+    flight *f = new flight;
+    f->ready = false;
+    f->refs = 2; // the table's and the caller's
+    f->cached = false;
+    s.table[k] = f;
+    ScopedLock stl(&stat_m_);
+    misses_++;
+    return f;
+  }
+
+  flight *f = i->second;
+  if (f->ready) {
+    s.lru.splice(s.lru.begin(), s.lru, f->lru);
+    r = f->r;
+    rep = f->rep;
+    ScopedLock stl(&stat_m_);
+    hits_++;
+    return NULL;
+  }
+  f->refs++;
+  while (!f->ready)
+    assert(pthread_cond_wait(&s.c, &s.m) == 0);
+  r = f->r;
+  rep = f->rep;
+  release(f);
+  ScopedLock stl(&stat_m_);
+  coalesced_++;
+  return NULL;
+}
+
+// the lookup for f is done: answer its waiters and, if it is still
+// the current one for its key and succeeded, keep the reply
+void
+reply_cache::land(extent_protocol::extentid_t id, int kind, flight *f, int r,
+                  const prepacked &rep)
+{
+  stripe &s = stripe_of(id);
+  key k(id, kind);
+  ScopedLock sl(&s.m);
+  f->r = r;
+  f->rep = rep;
+  f->ready = true;
+  assert(pthread_cond_broadcast(&s.c) == 0);
+
+  std::map<key, flight *>::iterator i = s.table.find(k);
+  if (i != s.table.end() && i->second == f) {
+    if (r != extent_protocol::OK || (unsigned long long) rep.size() > budget_ / 4) {
+      unlist(s, i);
+    } else {
+      s.lru.push_front(k);
+      f->lru = s.lru.begin();
+      f->cached = true;
+      s.bytes += rep.size();
+      unsigned long long evicted = 0;
+      while (s.bytes > budget_) {
+        unlist(s, s.table.find(s.lru.back()));
+        evicted++;
+      }
+      if (evicted) {
+        ScopedLock stl(&stat_m_);
+        evictions_ += evicted;
+      }
+    }
+  }
+  release(f);
+}
+
+void
+reply_cache::invalidate(extent_protocol::extentid_t id)
+{
+  stripe &s = stripe_of(id);
+  ScopedLock sl(&s.m);
+  std::map<key, flight *>::iterator i = s.table.lower_bound(key(id, 0));
+  unsigned long long n = 0;
+  while (i != s.table.end() && i->first.first == id) {
+    unlist(s, i++);
+    n++;
+  }
+  if (n) {
+    ScopedLock stl(&stat_m_);
+    invalidations_ += n;
+  }
+}
+
+void
+reply_cache::stats(std::string &out)
+{
+  unsigned long long entries = 0, bytes = 0;
+  for (int i = 0; i < NSTRIPES; i++) {
+    ScopedLock sl(&stripes_[i].m);
+    entries += stripes_[i].lru.size();
+    bytes += stripes_[i].bytes;
+  }
+  char buf[512];
+  ScopedLock stl(&stat_m_);
+  unsigned long long reads = hits_ + misses_ + coalesced_;
+  snprintf(buf, sizeof(buf),
+      "reply cache: %llu replies, %llu bytes of %llu\n"
+      "  reads %llu: cached %llu, coalesced %llu, looked up %llu "
+      "(%.1f%% shared)\n"
+      "  invalidated %llu, evicted %llu\n",
+      entries, bytes, budget_ * NSTRIPES, reads, hits_, coalesced_, misses_,
+      reads ? 100.0 * (hits_ + coalesced_) / reads : 0.0,
+      invalidations_, evictions_);
+  out = buf;
+}
@@ -0,0 +1,80 @@
+// shared, marshalled replies to extent reads
+
+#ifndef extent_rcache_h
+#define extent_rcache_h
+
+#include <string>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include "extent_protocol.h"
+
+// coalesces concurrent reads of the same extent and keeps their
+// marshalled replies for the next ones. the first read of an id (in
+// one reply format, its kind) looks it up and marshalls the reply;
+// reads that arrive meanwhile wait for that one instead of doing the
+// same work, and all of them send the same bytes. a successful reply
+// then stays, least recently used first out of budget bytes, until
+// invalidate() says the extent changed. a read in flight when its
+// extent changes still answers its waiters but is not kept.
+class reply_cache {
+ public:
+  reply_cache(unsigned long long budget);
+  ~reply_cache();
+
+  // kind's reply for id, from the cache, from a lookup in flight, or
+  // from fill(rep), which returns the status and marshalls the reply
+  template<class F> int get(extent_protocol::extentid_t id, int kind,
+                            F &fill, prepacked &rep);
+  // id has changed; call once the change is made
+  void invalidate(extent_protocol::extentid_t id);
+  void stats(std::string &out);
+
+ private:
+  typedef std::pair<extent_protocol::extentid_t, int> key;
+  struct flight {
+    bool ready;
+    int r;
+    prepacked rep;
+    int refs; // the table's, while listed in it, and one per waiter
+    bool cached;
+    std::list<key>::iterator lru;
+  };
+
+  enum { NSTRIPES = 64 };
+  struct stripe {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    std::map<key, flight *> table;
+    std::list<key> lru; // cached replies, most recently used first
+    unsigned long long bytes;
+  };
+  stripe stripes_[NSTRIPES];
+  const unsigned long long budget_; // per stripe
+
+  pthread_mutex_t stat_m_;
+  unsigned long long hits_, misses_, coalesced_, invalidations_, evictions_;
+
+  stripe &stripe_of(extent_protocol::extentid_t id);
+  flight *join(extent_protocol::extentid_t id, int kind, int &r,
+               prepacked &rep);
+  void land(extent_protocol::extentid_t id, int kind, flight *f, int r,
+            const prepacked &rep);
+  void unlist(stripe &s, std::map<key, flight *>::iterator i);
+  static void release(flight *f);
+};
+
+template<class F> int
+reply_cache::get(extent_protocol::extentid_t id, int kind, F &fill,
+                 prepacked &rep)
+{
+  int r;
+  flight *f = join(id, kind, r, rep);
+  if (f == NULL)
+    return r;
+  r = fill(rep);
+  land(id, kind, f, r, rep);
+  return r;
+}
+
+#endif
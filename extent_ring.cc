@@ -0,0 +1,50 @@
+// where extents live when they are spread over several servers
+
+#include "extent_ring.h"
+#include "extent_hash.h"
+#include <stdio.h>
+
+namespace {
+  // FNV-1a, for shard names
+  unsigned long long strhash(const std::string &s)
+  {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for (unsigned int i = 0; i < s.size(); i++) {
+      h ^= (unsigned char) s[i];
+      h *= 0x100000001b3ULL;
+    }
+    return h;
+  }
+}
+
+void
+extent_ring::build(const std::vector<std::string> &names)
+{
+  points_.clear();
+  for (unsigned int i = 0; i < names.size(); i++) {
+    for (int v = 0; v < VNODES; v++) {
+      char point[80];
+      snprintf(point, sizeof(point), "%s#%d", names[i].c_str(), v);
+      points_[fmix64(strhash(point))] = i;
+    }
+  }
+}
+
+unsigned int
+extent_ring::owner(unsigned long long key) const
+{
+  std::map<unsigned long long, unsigned int>::const_iterator it =
+    points_.lower_bound(fmix64(key));
+  if (it == points_.end())
+    it = points_.begin();
+  return it->second;
+}
+
+unsigned long long
+extent_ring::key_of(extent_protocol::extentid_t eid, unsigned int stripe)
+{
+  extent_protocol::extentid_t f = extent_protocol::file_of(eid);
+  if (stripe == 0)
+    return f;
+  return (((eid >> 32) / stripe) << 32) | f;
+}
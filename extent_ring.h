@@ -0,0 +1,35 @@
+// where extents live when they are spread over several servers
+
+#ifndef extent_ring_h
+#define extent_ring_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include "extent_protocol.h"
+
+// a consistent hash ring over the shards of a shard map. each shard
+// takes VNODES points, placed by its name, so that every client and
+// server builds the same ring from the same names however the list is
+// ordered, and adding a shard moves only the keys that land on its
+// points.
+class extent_ring {
+ public:
+  enum { VNODES = 64 };
+
+  // points for names[i] say i
+  void build(const std::vector<std::string> &names);
+  bool empty() const { return points_.empty(); }
+  // the index of the shard that holds key
+  unsigned int owner(unsigned long long key) const;
+
+  // what places eid: its file, or, with stripe blocks to a run, its
+  // file and which run of its blocks
+  static unsigned long long key_of(extent_protocol::extentid_t eid,
+                                   unsigned int stripe);
+
+ private:
+  std::map<unsigned long long, unsigned int> points_;
+};
+
+#endif
@@ -1,6 +1,9 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "slock.h"
+#include "method_thread.h"
+#include "jsl_log.h"
 #include <sstream>
 #include <stdio.h>
 #include <unistd.h>
@@ -8,94 +11,1291 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <algorithm>
+#include <sys/time.h>
+#include <stdlib.h>
 
-extent_server::extent_server() {}
+extent_server::extent_server()
+  : nmoved(0)
+{
+  // EXTENT_BACKEND picks where extents are kept; see extent_backend.h
+  backend = extent_backend::create(getenv("EXTENT_BACKEND"));
+  if (backend == NULL)
+    exit(1);
+  // EXTENT_REPLY_CACHE_MB bounds the marshalled replies kept for reads
+  int mb = 64;
+  char *env = getenv("EXTENT_REPLY_CACHE_MB");
+  if (env != NULL && atoi(env) >= 0)
+    mb = atoi(env);
+  replies = new reply_cache((unsigned long long) mb << 20);
+  // EXTENT_HOT_K is how many extents and clients each hotspot summary
+  // can hold at once; 0 turns the summaries off
+  int k = 256;
+  env = getenv("EXTENT_HOT_K");
+  if (env != NULL && atoi(env) >= 0)
+    k = atoi(env);
+  hot = k > 0 ? new hot_tracker(k, 8 * k) : NULL;
+  for (int i = 0; i < NSTRIPES; i++) {
+    assert(pthread_mutex_init(&stripes[i], NULL) == 0);
+    assert(pthread_mutex_init(&file_stripes[i], NULL) == 0);
+  }
+
+  assert(pthread_mutex_init(&version_m, NULL) == 0);
+  assert(pthread_mutex_init(&fileids_m, NULL) == 0);
+  assert(pthread_mutex_init(&peers_m, NULL) == 0);
+  assert(pthread_mutex_init(&move_m, NULL) == 0);
+  assert(pthread_cond_init(&move_c, NULL) == 0);
+  pthread_rwlockattr_t attr;
+  assert(pthread_rwlockattr_init(&attr) == 0);
+#ifdef __GLIBC__
+  // a waiting setmap must not starve behind a steady stream of calls
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  assert(pthread_rwlock_init(&map_l, &attr) == 0);
+  assert(pthread_rwlockattr_destroy(&attr) == 0);
+  map.epoch = 0;
+  map.stripe = 0;
 
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  last_version = (now.tv_sec * 1000000ULL + now.tv_usec) << 12;
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+  std::vector<extent_protocol::extentid_t> ids;
+  backend->ids(ids);
+  for (unsigned int i = 0; i < ids.size(); i++) {
+    extent_protocol::attr a;
+    if (backend->getattr(ids[i], a) == extent_protocol::OK) {
+      account(ids[i], false, 0, true, a.size);
+      if (a.version > last_version)
+        last_version = a.version;
+    }
+  }
+}
+
+unsigned long long
+extent_server::next_version()
 {
-  printf("extent_server::put(%llu, %s);\n", id, buf.data());
-  store[id] = buf;
-  if (attr_store.count(id) == 0)
-  { 
-      extent_protocol::attr nattr;      
-      attr_store[id] = nattr;
+  ScopedLock vl(&version_m);
+  return ++last_version;
+}
+
+pthread_mutex_t *
+extent_server::stripe(extent_protocol::extentid_t id)
+{
+  return &stripes[extent_store::hash(id) % NSTRIPES];
+}
+
+namespace {
+  // account's change to a file's entry: its blocks and count, and its
+  // size as far as it can be told without reading another block.
+  // probe is set to the block that now ends the file, if one does
+  struct apply_change {
+    apply_change(unsigned int xb, bool xexisted, unsigned int xold,
+                 bool xexists, unsigned int xnew)
+      : b(xb), existed(xexisted), exists(xexists), oldsize(xold),
+        newsize(xnew), empty(false), created(false), probe(false) {}
+    bool operator()(file_entry &fe, bool found) {
+      if (exists)
+        fe.blocks.insert(b);
+      else
+        fe.blocks.erase(b);
+      fe.st.nblocks = fe.blocks.size();
+      if (fe.blocks.empty()) {
+        empty = true;
+        return false;
+      }
+      if (!found) {
+        fe.st.size = 0;
+        created = true;
+      }
+      unsigned long long bs = extent_protocol::blocksize;
+      unsigned long long end = exists ? b * bs + newsize : 0;
+      if (end > fe.st.size) {
+        fe.st.size = end;
+      } else if (existed && b * bs + oldsize == fe.st.size &&
+                 end < fe.st.size) {
+        fe.st.size = end;
+        std::set<unsigned int>::iterator it = fe.blocks.end();
+        if (*--it == b && it != fe.blocks.begin())
+          --it;
+        if (*it != b) {
+          last = *it;
+          probe = true;
+        }
+      }
+      return true;
+    }
+    unsigned int b;
+    bool existed, exists;
+    unsigned int oldsize, newsize;
+    bool empty, created, probe;
+    unsigned int last;
+  };
+
+  struct raise_size {
+    raise_size(unsigned long long xend) : end(xend) {}
+    bool operator()(file_entry &fe, bool found) {
+      if (found)
+        fe.st.size = std::max(fe.st.size, end);
+      return found;
     }
+    unsigned long long end;
+  };
 
-    attr_store[id].size = buf.size();
-    attr_store[id].atime = time(NULL);
-    attr_store[id].mtime = time(NULL);
-    attr_store[id].ctime = time(NULL);
+  struct copy_totals {
+    copy_totals(extent_protocol::filestat &xst) : st(xst) {}
+    void operator()(const file_entry &fe) { st = fe.st; }
+    extent_protocol::filestat &st;
+  };
 
-  return extent_protocol::OK;
+  struct copy_blocks {
+    copy_blocks(extent_protocol::extentid_t xf, unsigned long long xfrom,
+                std::vector<extent_protocol::extentid_t> &xout)
+      : f(xf), from(xfrom), out(xout) {}
+    void operator()(const file_entry &fe) {
+      std::set<unsigned int>::const_iterator it =
+        from > 0xffffffffULL ? fe.blocks.end() : fe.blocks.lower_bound(from);
+      for (; it != fe.blocks.end(); it++)
+        out.push_back(((extent_protocol::extentid_t) *it << 32) | f);
+    }
+    extent_protocol::extentid_t f;
+    unsigned long long from;
+    std::vector<extent_protocol::extentid_t> &out;
+  };
+}
+
+// apply a change to one extent, which existed with oldsize before and
+// exists with newsize after, to the entry of the file it belongs to.
+// the file's size is where its last block ends; when that block
+// shrinks or goes, the highest block left is read for the new end.
+void
+extent_server::account(extent_protocol::extentid_t id, bool existed,
+                       unsigned int oldsize, bool exists, unsigned int newsize)
+{
+  extent_protocol::extentid_t f = extent_protocol::file_of(id);
+  ScopedLock fl(&file_stripes[extent_store::hash(f) % NSTRIPES]);
+  apply_change c(id >> 32, existed, oldsize, exists, newsize);
+  files.update(f, c);
+  if (c.empty) {
+    files.remove(f);
+    ScopedLock il(&fileids_m);
+    fileids.erase(f);
+    return;
+  }
+  if (c.created) {
+    ScopedLock il(&fileids_m);
+    fileids.insert(f);
+  }
+  extent_protocol::attr a;
+  if (c.probe &&
+      backend->getattr(((extent_protocol::extentid_t) c.last << 32) | f, a) ==
+      extent_protocol::OK) {
+    raise_size r((unsigned long long) c.last * extent_protocol::blocksize +
+                 a.size);
+    files.update(f, r);
+  }
+}
+
+// the size and block count of file f
+bool
+extent_server::totals(extent_protocol::extentid_t f,
+                      extent_protocol::filestat &st)
+{
+  copy_totals c(st);
+  return files.peek(f, c);
+}
+
+// the current size of id, or false if it does not exist; callers hold
+// id's stripe so it cannot change before they account for their update
+bool
+extent_server::oldsize(extent_protocol::extentid_t id, unsigned int &size)
+{
+  extent_protocol::attr a;
+  if (backend->getattr(id, a) != extent_protocol::OK)
+    return false;
+  size = a.size;
+  return true;
+}
+
+
+// count a call on id that moved bytes of extent data either way
+void extent_server::touched(extent_protocol::extentid_t id,
+                            unsigned long long bytes)
+{
+  if (hot)
+    hot->note(rpcs::caller(), id, bytes);
+}
+
+int extent_server::put(extent_protocol::extentid_t id, std::string buf,
+                       extent_protocol::attr &a)
+{
+  jsl_log(JSL_DBG_4, "extent_server::put(%llu, %lu bytes)\n", id,
+          buf.size());
+  touched(id, buf.size());
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK)
+    return r;
+  ScopedLock sl(stripe(id));
+  return store(id, buf, a);
 }
 
-int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
+// replace id's contents with buf; the caller holds id's stripe
+int extent_server::store(extent_protocol::extentid_t id, std::string &buf,
+                         extent_protocol::attr &a)
 {
-  printf("extent_server::get(%llu) = ", id);
-  if (store.count(id) > 0)
+  extent_entry e;
+  e.a.size = buf.size();
+  e.a.atime = time(NULL);
+  e.a.mtime = time(NULL);
+  e.a.ctime = time(NULL);
+  e.a.version = next_version();
+  e.data.swap(buf);
+
+  unsigned int old = 0;
+  bool existed = oldsize(id, old);
+  int r = backend->put(id, e);
+  replies->invalidate(id);
+  if (r == extent_protocol::OK) {
+    account(id, existed, old, true, e.a.size);
+    a = e.a;
+  }
+  return r;
+}
+
+namespace {
+  // marshall the replies the reply cache keeps, in the formats the
+  // client unmarshalls a std::string and a content from
+  enum { GET, GETWITHATTR };
+
+  struct get_reply {
+    get_reply(extent_backend *xb, extent_protocol::extentid_t xid)
+      : b(xb), id(xid) {}
+    int operator()(prepacked &rep) {
+      extent_entry e;
+      int r = b->get(id, e);
+      marshall m;
+      if (r == extent_protocol::OK)
+        m << e.data;
+      else
+        m << std::string();
+      rep = prepacked(m);
+      return r;
+    }
+    extent_backend *b;
+    extent_protocol::extentid_t id;
+  };
+
+  struct getwithattr_reply {
+    getwithattr_reply(extent_backend *xb, extent_protocol::extentid_t xid)
+      : b(xb), id(xid) {}
+    int operator()(prepacked &rep) {
+      extent_entry e;
+      memset(&e.a, 0, sizeof(e.a));
+      int r = b->get(id, e);
+      extent_protocol::content c;
+      c.data.swap(e.data);
+      c.a = e.a;
+      marshall m;
+      m << c;
+      rep = prepacked(m);
+      return r;
+    }
+    extent_backend *b;
+    extent_protocol::extentid_t id;
+  };
+
+  // what get and getwithattr reply with when they refuse a call
+  void empty_reply(int kind, prepacked &rep)
   {
-    buf = store[id];    
-    printf("%s\n", buf.c_str());
+    marshall m;
+    if (kind == GET) {
+      m << std::string();
+    } else {
+      extent_protocol::content c;
+      memset(&c.a, 0, sizeof(c.a));
+      m << c;
+    }
+    rep = prepacked(m);
   }
-  else
+}
+
+int extent_server::get(extent_protocol::extentid_t id, prepacked &rep)
+{
+  jsl_log(JSL_DBG_4, "extent_server::get(%llu)\n", id);
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK) {
+    empty_reply(GET, rep);
+    return r;
+  }
+  get_reply f(backend, id);
+  r = replies->get(id, GET, f, rep);
+  touched(id, rep.size());
+  return r;
+}
+
+int extent_server::getwithattr(extent_protocol::extentid_t id, prepacked &rep)
+{
+  jsl_log(JSL_DBG_4, "extent_server::getwithattr(%llu)\n", id);
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK) {
+    empty_reply(GETWITHATTR, rep);
+    return r;
+  }
+  getwithattr_reply f(backend, id);
+  r = replies->get(id, GETWITHATTR, f, rep);
+  touched(id, rep.size());
+  return r;
+}
+
+int extent_server::getifchanged(extent_protocol::extentid_t id,
+                                unsigned long long version, prepacked &rep)
+{
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK) {
+    empty_reply(GETWITHATTR, rep);
+    return r;
+  }
+  // the attr lookup is cheap; only fetch the data if it has changed
+  extent_protocol::content c;
+  r = backend->getattr(id, c.a);
+  if (r == extent_protocol::OK && c.a.version == version)
   {
-    printf("not found\n");
-    return extent_protocol::NOENT;
+    jsl_log(JSL_DBG_4,
+            "extent_server::getifchanged(%llu, %llu) = not modified\n",
+            id, version);
+    marshall m;
+    m << c;
+    rep = prepacked(m);
+    touched(id, 0);
+    return extent_protocol::NOTMODIFIED;
   }
-  
-  return extent_protocol::OK;
+  getwithattr_reply f(backend, id);
+  r = replies->get(id, GETWITHATTR, f, rep);
+  touched(id, rep.size());
+  return r;
+}
+
+// id's data and attr, straight from the backend
+int extent_server::lookup(extent_protocol::extentid_t id,
+                          extent_protocol::content &c)
+{
+  extent_entry e;
+  int r = backend->get(id, e);
+  if (r == extent_protocol::OK)
+  {
+    c.data.swap(e.data);
+    c.a = e.a;
+  }
+  return r;
+}
+
+int extent_server::putifversion(extent_protocol::extentid_t id,
+                                unsigned long long version, std::string buf,
+                                extent_protocol::content &c)
+{
+  touched(id, buf.size());
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK)
+    return r;
+  ScopedLock sl(stripe(id));
+  r = backend->getattr(id, c.a);
+  if (r != extent_protocol::OK && r != extent_protocol::NOENT)
+    return r;
+  bool match = r == extent_protocol::OK ? c.a.version == version : version == 0;
+  if (!match) {
+    jsl_log(JSL_DBG_4, "extent_server::putifversion(%llu, %llu) = conflict\n",
+            id, version);
+    if (r == extent_protocol::NOENT)
+      return r;
+    r = lookup(id, c);
+    return r == extent_protocol::OK ? extent_protocol::CONFLICT : r;
+  }
+  jsl_log(JSL_DBG_4, "extent_server::putifversion(%llu, %llu)\n", id,
+          version);
+  return store(id, buf, c.a);
 }
 
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
-  printf("extent_server::getattr(%llu).size = ", id);
+  touched(id, 0);
   a.size = 0;
   a.atime = 0;
   a.mtime = 0;
   a.ctime = 0;
+  a.version = 0;
 
-  if (attr_store.count(id) > 0)
-  {
-    printf("%d\n", attr_store[id].size);
-    a.size = attr_store[id].size;
-    a.atime = attr_store[id].atime;
-    a.mtime = attr_store[id].mtime;
-    a.ctime = attr_store[id].ctime;
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK)
+    return r;
+  r = backend->getattr(id, a);
+  jsl_log(JSL_DBG_4, "extent_server::getattr(%llu) = %d, size %u\n", id, r,
+          a.size);
+  return r;
+
+  
+}
+
+// only the size is taken from a; the data is cut or zero-filled to match
+int extent_server::setattr(extent_protocol::extentid_t id, extent_protocol::attr a,
+                           extent_protocol::attr &out)
+{
+  jsl_log(JSL_DBG_4, "extent_server::setattr(%llu,  size: %d)\n", id,
+          a.size);
+  touched(id, 0);
+
+  if (a.size > extent_protocol::maxextent)
+    return extent_protocol::FBIG;
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK)
+    return r;
+  ScopedLock sl(stripe(id));
+  return resize(id, a.size, false, out);
+}
+
+// cut or zero-fill id to size, creating it if create is set; the
+// caller holds id's stripe
+int extent_server::resize(extent_protocol::extentid_t id, unsigned int size,
+                          bool create, extent_protocol::attr &out)
+{
+  extent_protocol::attr a;
+  int r = backend->getattr(id, a);
+  bool existed = r == extent_protocol::OK;
+  if (r != extent_protocol::OK && !(r == extent_protocol::NOENT && create))
+    return r;
+  if (existed && a.size == size) {
+    out = a;
     return extent_protocol::OK;
   }
-  else
-  {
-    printf("not found\n");
+  unsigned int old = existed ? a.size : 0;
+  r = backend->resize(id, size, create, next_version(), a);
+  replies->invalidate(id);
+  if (r == extent_protocol::OK) {
+    account(id, existed, old, true, size);
+    out = a;
+  }
+  return r;
+}
+
+
+int extent_server::remove(extent_protocol::extentid_t id, int &)
+{
+  touched(id, 0);
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK)
+    return r;
+  unsigned int old;
+  r = remove_one(id, old);
+  return r == extent_protocol::NOENT ? extent_protocol::OK : r;
+}
+
+// remove one extent, handing back its size
+int extent_server::remove_one(extent_protocol::extentid_t id, unsigned int &size)
+{
+  ScopedLock sl(stripe(id));
+  if (!oldsize(id, size))
     return extent_protocol::NOENT;
+  int r = backend->remove(id);
+  replies->invalidate(id);
+  if (r == extent_protocol::OK)
+    account(id, true, size, false, 0);
+  return r;
+}
+
+// remove the blocks of file f
+int extent_server::remove_file(extent_protocol::extentid_t f,
+                               extent_protocol::reclaimed &rec)
+{
+  std::vector<extent_protocol::extentid_t> ids;
+  blocks_of(f, ids);
+  if (ids.empty())
+    return extent_protocol::NOENT;
+  for (unsigned int i = 0; i < ids.size(); i++) {
+    unsigned int size;
+    int r = remove_one(ids[i], size);
+    if (r == extent_protocol::NOENT)
+      continue;
+    if (r != extent_protocol::OK)
+      return r;
+    rec.extents++;
+    rec.bytes += size;
   }
+  rec.files++;
+  return extent_protocol::OK;
+}
 
-  
+// remove f and, if it is a directory, everything reachable from it.
+// seen guards against a directory that lists itself or an ancestor.
+int extent_server::remove_tree(extent_protocol::extentid_t f,
+                               extent_protocol::reclaimed &rec,
+                               std::set<extent_protocol::extentid_t> &seen)
+{
+  if (!seen.insert(f).second)
+    return extent_protocol::OK;
+  if (extent_protocol::is_dir(f)) {
+    extent_entry e;
+    int r = backend->get(f, e);
+    if (r != extent_protocol::OK)
+      return r;
+    std::istringstream is(e.data);
+    extent_protocol::extentid_t self, child;
+    std::string name;
+    is >> self;
+    while (is >> child >> name) {
+      r = remove_tree(extent_protocol::file_of(child), rec, seen);
+      if (r != extent_protocol::OK && r != extent_protocol::NOENT)
+        return r;
+    }
+  }
+  return remove_file(f, rec);
+}
+
+int extent_server::removetree(extent_protocol::extentid_t id,
+                              extent_protocol::reclaimed &rec)
+{
+  rec.files = 0;
+  rec.extents = 0;
+  rec.bytes = 0;
+  touched(id, 0);
+  map_ref mr(this);
+  int r = admit_file(id);
+  if (r != extent_protocol::OK)
+    return r;
+  std::set<extent_protocol::extentid_t> seen;
+  r = remove_tree(extent_protocol::file_of(id), rec, seen);
+  jsl_log(JSL_DBG_4, "extent_server::removetree(%llu) = %d: %u files, "
+          "%u extents, %llu bytes\n", id, r, rec.files, rec.extents,
+          rec.bytes);
+  return r;
+}
+
+// the ids of the blocks file f has from block from on, in block order
+void extent_server::blocks_of(extent_protocol::extentid_t f,
+                              std::vector<extent_protocol::extentid_t> &out,
+                              unsigned long long from)
+{
+  out.clear();
+  copy_blocks c(f, from, out);
+  files.peek(f, c);
+}
+
+// make dst's file a copy of src's, block for block. each block goes
+// through the backend's copy, so the data never leaves the server and
+// holes stay holes. blocks are replaced one at a time, so while the
+// clone runs dst mixes blocks of both files; dst's blocks that src
+// does not have are removed only once every block of src is in.
+int extent_server::clone(extent_protocol::extentid_t src,
+                         extent_protocol::extentid_t dst,
+                         extent_protocol::filestat &st)
+{
+  extent_protocol::extentid_t f = extent_protocol::file_of(src);
+  extent_protocol::extentid_t g = extent_protocol::file_of(dst);
+  jsl_log(JSL_DBG_4, "extent_server::clone(%llu, %llu)\n", f, g);
+  touched(src, 0);
+  map_ref mr(this);
+  int r = admit_file(src);
+  if (r == extent_protocol::OK)
+    r = admit_file(dst);
+  if (r != extent_protocol::OK)
+    return r;
+  std::vector<extent_protocol::extentid_t> from, old;
+  blocks_of(f, from);
+  if (from.empty())
+    return extent_protocol::NOENT;
+  if (f == g) {
+    totals(f, st);
+    return extent_protocol::OK;
+  }
+  blocks_of(g, old);
+
+  std::set<extent_protocol::extentid_t> copied;
+  for (unsigned int i = 0; i < from.size(); i++) {
+    extent_protocol::extentid_t id = (from[i] & ~0xffffffffULL) | g;
+    ScopedLock sl(stripe(id));
+    unsigned int osize = 0;
+    bool existed = oldsize(id, osize);
+    extent_protocol::attr a;
+    r = backend->copy(from[i], id, next_version(), a);
+    replies->invalidate(id);
+    if (r == extent_protocol::NOENT)
+      continue; // src lost the block meanwhile
+    if (r != extent_protocol::OK)
+      return r;
+    account(id, existed, osize, true, a.size);
+    copied.insert(id);
+  }
+  for (unsigned int i = 0; i < old.size(); i++) {
+    unsigned int osize;
+    if (copied.count(old[i]) == 0)
+      remove_one(old[i], osize);
+  }
+  if (!totals(g, st))
+    return extent_protocol::NOENT;
+  return extent_protocol::OK;
+}
+
+int extent_server::read(extent_protocol::extentid_t id, unsigned int off,
+                        unsigned int len, std::string &buf)
+{
+  jsl_log(JSL_DBG_4, "extent_server::read(%llu, %u, %u)\n", id, off, len);
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK)
+    return r;
+  r = backend->read(id, off, len, buf);
+  touched(id, buf.size());
+  return r;
+}
+
+int extent_server::write(extent_protocol::extentid_t id, unsigned int off,
+                         std::string buf, extent_protocol::attr &a)
+{
+  jsl_log(JSL_DBG_4, "extent_server::write(%llu, %u, %lu)\n", id, off,
+          buf.size());
+  touched(id, buf.size());
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK)
+    return r;
+  ScopedLock sl(stripe(id));
+  unsigned int old = 0;
+  bool existed = oldsize(id, old);
+  r = backend->write(id, off, buf, false, next_version(), a);
+  replies->invalidate(id);
+  if (r == extent_protocol::OK)
+    account(id, existed, old, true, a.size);
+  return r;
+}
+
+int extent_server::append(extent_protocol::extentid_t id, std::string buf,
+                          extent_protocol::attr &a)
+{
+  jsl_log(JSL_DBG_4, "extent_server::append(%llu, %lu)\n", id, buf.size());
+  touched(id, buf.size());
+  map_ref mr(this);
+  int r = admit(id);
+  if (r != extent_protocol::OK)
+    return r;
+  ScopedLock sl(stripe(id));
+  unsigned int old = 0;
+  bool existed = oldsize(id, old);
+  r = backend->write(id, 0, buf, true, next_version(), a);
+  replies->invalidate(id);
+  if (r == extent_protocol::OK)
+    account(id, existed, old, true, a.size);
+  return r;
+}
+
+// size and block count of the file id belongs to
+int extent_server::stat(extent_protocol::extentid_t id,
+                        extent_protocol::filestat &st)
+{
+  touched(id, 0);
+  map_ref mr(this);
+  int r = admit_file(id);
+  if (r != extent_protocol::OK)
+    return r;
+  if (!totals(extent_protocol::file_of(id), st))
+    return extent_protocol::NOENT;
+  jsl_log(JSL_DBG_4, "extent_server::stat(%llu) = %llu bytes in %u blocks\n",
+          id, st.size, st.nblocks);
+  return extent_protocol::OK;
+}
+
+// set the size of the file id belongs to. blocks past the new end go
+// and the block holding it is cut or zero-filled to end there, which
+// also creates it if it was a hole; nothing else is written, so the
+// blocks in between of a file that grows stay holes.
+int extent_server::truncate(extent_protocol::extentid_t id,
+                            unsigned long long size,
+                            extent_protocol::filestat &st)
+{
+  extent_protocol::extentid_t f = extent_protocol::file_of(id);
+  jsl_log(JSL_DBG_4, "extent_server::truncate(%llu, %llu)\n", f, size);
+  touched(id, 0);
+  unsigned long long last = size == 0 ? 0 : (size - 1) / extent_protocol::blocksize;
+  if (last > 0xffffffffULL)
+    return extent_protocol::FBIG;
+  map_ref mr(this);
+  int r = admit_file(id);
+  if (r != extent_protocol::OK)
+    return r;
+  if (!totals(f, st))
+    return extent_protocol::NOENT;
+
+  std::vector<extent_protocol::extentid_t> past;
+  blocks_of(f, past, last + 1);
+  for (unsigned int i = 0; i < past.size(); i++) {
+    unsigned int osize;
+    r = remove_one(past[i], osize);
+    if (r != extent_protocol::OK && r != extent_protocol::NOENT)
+      return r;
+  }
+
+  extent_protocol::extentid_t lid = (last << 32) | f;
+  ScopedLock sl(stripe(lid));
+  extent_protocol::attr a;
+  r = resize(lid, size - last * extent_protocol::blocksize, true, a);
+  if (r != extent_protocol::OK)
+    return r;
+  totals(f, st);
+  return extent_protocol::OK;
+}
+
+// up to len bytes of the file id belongs to, from byte off, as laid
+// out over its blocks. holes and the unwritten tails of short blocks
+// read as zeros; the reply is short only at the end of the file.
+int extent_server::readfile(extent_protocol::extentid_t id,
+                            unsigned long long off, unsigned int len,
+                            std::string &buf)
+{
+  extent_protocol::extentid_t f = extent_protocol::file_of(id);
+  jsl_log(JSL_DBG_4, "extent_server::readfile(%llu, %llu, %u)\n", f, off,
+          len);
+  // a striped file is read a run at a time, from the run's shard
+  map_ref mr(this);
+  int r = admit(((off / extent_protocol::blocksize) << 32) | f);
+  if (r != extent_protocol::OK)
+    return r;
+  extent_protocol::filestat st;
+  bool found = totals(f, st);
+  touched(id, found && off < st.size ? std::min((unsigned long long) len,
+                                                st.size - off) : 0);
+  if (!found)
+    return extent_protocol::NOENT;
+  buf.clear();
+  if (off >= st.size)
+    return extent_protocol::OK;
+  if (len > st.size - off)
+    len = st.size - off;
+  buf.reserve(len);
+  while (buf.size() < len) {
+    unsigned long long pos = off + buf.size();
+    unsigned long long b = pos / extent_protocol::blocksize;
+    unsigned int boff = pos - b * extent_protocol::blocksize;
+    unsigned int want = std::min((unsigned long long) len - buf.size(),
+                                 (unsigned long long) extent_protocol::blocksize - boff);
+    std::string part;
+    r = backend->read((b << 32) | f, boff, want, part);
+    if (r != extent_protocol::OK && r != extent_protocol::NOENT)
+      return r;
+    buf += part;
+    buf.resize(buf.size() + want - part.size(), '\0');
+  }
+  return extent_protocol::OK;
+}
+
+int extent_server::writefile(extent_protocol::extentid_t id,
+                             unsigned long long off, const std::string &buf)
+{
+  extent_protocol::extentid_t f = extent_protocol::file_of(id);
+  size_t done = 0;
+  while (done < buf.size()) {
+    unsigned long long pos = off + done;
+    unsigned long long b = pos / extent_protocol::blocksize;
+    if (b > 0xffffffffULL)
+      return extent_protocol::FBIG;
+    unsigned int boff = pos - b * extent_protocol::blocksize;
+    unsigned int want = std::min((unsigned long long) buf.size() - done,
+                                 (unsigned long long) extent_protocol::blocksize - boff);
+    extent_protocol::attr a;
+    int r = write((b << 32) | f, boff, buf.substr(done, want), a);
+    if (r != extent_protocol::OK)
+      return r;
+    done += want;
+  }
+  return extent_protocol::OK;
+}
+
+namespace {
+  class read_stream : public stream_handler {
+   public:
+    read_stream(extent_server *xes, extent_protocol::extentid_t xid,
+                unsigned long long xoff, unsigned long long xlen)
+      : es(xes), id(xid), off(xoff), left(xlen), status(extent_protocol::OK) {}
+    // short only at the end of the file
+    int read(std::string &chunk, bool &eof) {
+      unsigned int want = std::min(left,
+                                   (unsigned long long) rpc_const::stream_chunk);
+      status = es->readfile(id, off, want, chunk);
+      if (status != extent_protocol::OK)
+        chunk.clear();
+      off += chunk.size();
+      left -= chunk.size();
+      eof = status != extent_protocol::OK || chunk.size() < want || left == 0;
+      return 0;
+    }
+    int close() { return status; }
+   private:
+    extent_server *es;
+    extent_protocol::extentid_t id;
+    unsigned long long off, left;
+    int status;
+  };
+
+  class write_stream : public stream_handler {
+   public:
+    write_stream(extent_server *xes, extent_protocol::extentid_t xid,
+                 unsigned long long xoff)
+      : es(xes), id(xid), off(xoff), status(extent_protocol::OK) {}
+    int write(const std::string &chunk) {
+      if (status == extent_protocol::OK)
+        status = es->writefile(id, off, chunk);
+      if (status == extent_protocol::OK)
+        off += chunk.size();
+      return status;
+    }
+    int close() { return status; }
+   private:
+    extent_server *es;
+    extent_protocol::extentid_t id;
+    unsigned long long off;
+    int status;
+  };
+}
+
+stream_handler *
+extent_server::readstream(const std::string arg)
+{
+  extent_protocol::extentid_t id;
+  unsigned long long off, len;
+  if (sscanf(arg.c_str(), "%llu %llu %llu", &id, &off, &len) != 3)
+    return NULL;
+  jsl_log(JSL_DBG_4, "extent_server::readstream(%llu, %llu, %llu)\n", id,
+          off, len);
+  return new read_stream(this, id, off, len);
+}
+
+stream_handler *
+extent_server::writestream(const std::string arg)
+{
+  extent_protocol::extentid_t id;
+  unsigned long long off;
+  if (sscanf(arg.c_str(), "%llu %llu", &id, &off) != 2)
+    return NULL;
+  jsl_log(JSL_DBG_4, "extent_server::writestream(%llu, %llu)\n", id, off);
+  return new write_stream(this, id, off);
 }
 
-int extent_server::setattr(extent_protocol::extentid_t id, extent_protocol::attr a)
+int extent_server::report(int, std::string &out)
 {
-  printf("extent_server::setattr(%llu,  size: %d):  ", id, a.size);
+  std::string rc;
+  backend->stats(out);
+  replies->stats(rc);
+  out += rc;
+  return extent_protocol::OK;
+}
 
-  if (attr_store.count(id) > 0)
+int extent_server::hotspots(unsigned int n, std::string &out)
+{
+  if (hot == NULL) {
+    out = "hotspots: not tracked (EXTENT_HOT_K=0)\n";
+    return extent_protocol::OK;
+  }
+  hot->report(n > 0 ? n : 10, out);
+  return extent_protocol::OK;
+}
+
+// fileids is ordered, so a page starts where the last one ended
+int extent_server::listfiles(extent_protocol::extentid_t from,
+                             unsigned int max,
+                             std::vector<extent_protocol::extentid_t> &out)
+{
+  out.clear();
+  ScopedLock il(&fileids_m);
+  std::set<extent_protocol::extentid_t>::iterator it = fileids.lower_bound(from);
+  for (; it != fileids.end() && out.size() < max; it++)
+    out.push_back(*it);
+  return extent_protocol::OK;
+}
+
+int extent_server::listblocks(extent_protocol::extentid_t id,
+                              std::vector<extent_protocol::extentid_t> &out)
+{
+  blocks_of(extent_protocol::file_of(id), out);
+  return extent_protocol::OK;
+}
+
+int extent_server::handoff(extent_protocol::extentid_t id,
+                           extent_protocol::content &c)
+{
+  jsl_log(JSL_DBG_4, "extent_server::handoff(%llu)\n", id);
+  return lookup(id, c);
+}
+
+int extent_server::release(extent_protocol::extentid_t id, int &)
+{
+  jsl_log(JSL_DBG_4, "extent_server::release(%llu)\n", id);
+  unsigned int old;
+  int r = remove_one(id, old);
+  return r == extent_protocol::NOENT ? extent_protocol::OK : r;
+}
+
+// store id as handed off by its old shard, attr and all, unless it is
+// here already (CONFLICT). the version counter is pushed past the
+// adopted version, so later changes to id here still move it forward.
+int extent_server::adopt(extent_protocol::extentid_t id,
+                         extent_protocol::content &c)
+{
+  jsl_log(JSL_DBG_4, "extent_server::adopt(%llu, %lu)\n", id,
+          c.data.size());
+  ScopedLock sl(stripe(id));
+  unsigned int old;
+  if (oldsize(id, old))
+    return extent_protocol::CONFLICT;
   {
-    printf("success. old size was %d\n", attr_store[id].size);
+    ScopedLock vl(&version_m);
+    if (c.a.version > last_version)
+      last_version = c.a.version;
+  }
+  extent_entry e;
+  e.a = c.a;
+  e.a.size = c.data.size();
+  e.data.swap(c.data);
+  int r = backend->put(id, e);
+  replies->invalidate(id);
+  if (r == extent_protocol::OK)
+    account(id, false, 0, true, e.a.size);
+  return r;
+}
 
-    attr_store[id].size = a.size;
+extent_server::map_ref::map_ref(extent_server *xes)
+  : es(xes)
+{
+  assert(pthread_rwlock_rdlock(&es->map_l) == 0);
+}
+
+extent_server::map_ref::~map_ref()
+{
+  assert(pthread_rwlock_unlock(&es->map_l) == 0);
+}
+
+// the caller holds map_l for writing
+void extent_server::install(const extent_protocol::shardmap &m,
+                            const std::string &name)
+{
+  map = m;
+  self = name;
+  ring.build(map.shards);
+  oldring.build(map.old);
+}
+
+// whether this is a shard that the map adds, still taking its share
+// from the old ones; the caller holds a map_ref
+bool extent_server::incoming()
+{
+  return !map.old.empty() &&
+    std::find(map.old.begin(), map.old.end(), self) == map.old.end();
+}
+
+// OK if id is this server's under the map, once it has been moved in
+// from its old shard if it is due to be; the caller holds a map_ref
+int extent_server::admit(extent_protocol::extentid_t id)
+{
+  if (map.epoch == 0)
     return extent_protocol::OK;
+  unsigned long long key = extent_ring::key_of(id, map.stripe);
+  if (map.shards[ring.owner(key)] != self)
+    return extent_protocol::WRONGSHARD;
+  if (!incoming())
+    return extent_protocol::OK;
+  return pull(key);
+}
+
+// the same, for a call on the whole file id belongs to; a striped
+// file has blocks on every shard, and each answers for its own
+int extent_server::admit_file(extent_protocol::extentid_t id)
+{
+  if (map.stripe != 0)
+    return extent_protocol::OK;
+  return admit(id);
+}
+
+rpcc *extent_server::peer(const std::string &name)
+{
+  ScopedLock pl(&peers_m);
+  std::map<std::string, rpcc *>::iterator it = peers.find(name);
+  if (it != peers.end())
+    return it->second;
+  sockaddr_in dst;
+  make_sockaddr(name.c_str(), &dst);
+  rpcc *cl = new rpcc(dst);
+  if (cl->bind() != 0) {
+    printf("extent_server: cannot reach shard %s\n", name.c_str());
+    delete cl;
+    return NULL;
   }
+  peers[name] = cl;
+  return cl;
+}
+
+// move key in if it has not been yet, or wait for whoever is moving
+// it; it counts as moved only once every extent of it is here. the
+// caller holds a map_ref.
+int extent_server::pull(unsigned long long key)
+{
+  {
+    ScopedLock ml(&move_m);
+    while (moving.count(key))
+      assert(pthread_cond_wait(&move_c, &move_m) == 0);
+    if (moved.count(key))
+      return extent_protocol::OK;
+    moving.insert(key);
+  }
+  int r = move_in(key);
+  ScopedLock ml(&move_m);
+  moving.erase(key);
+  if (r == extent_protocol::OK)
+    moved.insert(key);
   else
+    printf("extent_server: moving in %llu failed: %d\n", key, r);
+  assert(pthread_cond_broadcast(&move_c) == 0);
+  return r;
+}
+
+// copy the extents of key here from the shard that held it under the
+// old map, and remove them there. one that is here already was copied
+// by an earlier try that then failed to remove it, and stays.
+int extent_server::move_in(unsigned long long key)
+{
+  std::string from = map.old[oldring.owner(key)];
+  int r = push(from);
+  if (r != extent_protocol::OK)
+    return r;
+  rpcc *src = peer(from);
+  std::vector<extent_protocol::extentid_t> ids;
+  if (src == NULL ||
+      src->call(extent_protocol::listblocks, key, ids) != extent_protocol::OK)
+    return extent_protocol::IOERR;
+  for (unsigned int i = 0; i < ids.size(); i++) {
+    if (extent_ring::key_of(ids[i], map.stripe) != key)
+      continue;
+    extent_protocol::content c;
+    r = src->call(extent_protocol::handoff, ids[i], c);
+    if (r == extent_protocol::NOENT)
+      continue;
+    if (r != extent_protocol::OK)
+      return extent_protocol::IOERR;
+    r = adopt(ids[i], c);
+    if (r != extent_protocol::OK && r != extent_protocol::CONFLICT)
+      return r;
+    int x;
+    if (src->call(extent_protocol::release, ids[i], x) != extent_protocol::OK)
+      return extent_protocol::IOERR;
+    ScopedLock ml(&move_m);
+    nmoved++;
+  }
+  return extent_protocol::OK;
+}
+
+// give the old shard name the map, if setmap could not; until it has
+// it, it may still take calls on what moves here, so nothing is moved
+// from it. the caller holds a map_ref.
+int extent_server::push(const std::string &name)
+{
   {
-    printf("not found\n");
-    return extent_protocol::NOENT;
+    ScopedLock ml(&move_m);
+    if (behind.count(name) == 0)
+      return extent_protocol::OK;
   }
-  
+  rpcc *cl = peer(name);
+  int x;
+  if (cl == NULL ||
+      cl->call(extent_protocol::setmap, map, name, x) != extent_protocol::OK)
+    return extent_protocol::IOERR;
+  ScopedLock ml(&move_m);
+  behind.erase(name);
+  return extent_protocol::OK;
 }
 
+// move in every key of file f that is due here; the caller holds a
+// map_ref
+int extent_server::pull_file(extent_protocol::extentid_t f)
+{
+  std::set<unsigned long long> keys;
+  if (map.stripe == 0) {
+    keys.insert(f);
+  } else {
+    for (unsigned int i = 0; i < map.old.size(); i++) {
+      rpcc *src = peer(map.old[i]);
+      std::vector<extent_protocol::extentid_t> ids;
+      if (src == NULL ||
+          src->call(extent_protocol::listblocks, f, ids) != extent_protocol::OK)
+        return extent_protocol::IOERR;
+      for (unsigned int j = 0; j < ids.size(); j++)
+        keys.insert(extent_ring::key_of(ids[j], map.stripe));
+    }
+  }
+  int r = extent_protocol::OK;
+  std::set<unsigned long long>::iterator it;
+  for (it = keys.begin(); it != keys.end(); it++) {
+    if (map.shards[ring.owner(*it)] != self)
+      continue;
+    int pr = pull(*it);
+    if (pr != extent_protocol::OK)
+      r = pr;
+  }
+  return r;
+}
 
-int extent_server::remove(extent_protocol::extentid_t id, int &)
+int extent_server::getmap(int, extent_protocol::shardmap &m)
+{
+  map_ref mr(this);
+  m = map;
+  return extent_protocol::OK;
+}
+
+int extent_server::setmap(extent_protocol::shardmap m, std::string name, int &)
 {
-  store.erase(id);
+  assert(pthread_rwlock_wrlock(&map_l) == 0);
+  if (m.epoch <= map.epoch) {
+    bool same = m.epoch == map.epoch && m.stripe == map.stripe &&
+      m.shards == map.shards && m.old == map.old && name == self;
+    assert(pthread_rwlock_unlock(&map_l) == 0);
+    return same ? extent_protocol::OK : extent_protocol::CONFLICT;
+  }
+  bool adds = !m.old.empty() &&
+    std::find(m.old.begin(), m.old.end(), name) == m.old.end();
+  extent_protocol::shardmap was = map;
+  std::string wasself = self;
+  install(m, name);
+  if (adds) {
+    // this server takes no calls until the old shards have the map,
+    // and they get it in the order listed; of two servers added at
+    // once from the same map, the first old shard refuses one, and
+    // that one is left as it was
+    for (unsigned int i = 0; i < m.old.size(); i++) {
+      rpcc *cl = peer(m.old[i]);
+      int x;
+      int r = cl == NULL ? (int) extent_protocol::RPCERR :
+        cl->call(extent_protocol::setmap, m, m.old[i], x);
+      if (r == extent_protocol::OK)
+        continue;
+      if (i == 0) {
+        install(was, wasself);
+        assert(pthread_rwlock_unlock(&map_l) == 0);
+        printf("extent_server::setmap(%llu): %s refused it: %d\n", m.epoch,
+               m.old[i].c_str(), r);
+        return r == extent_protocol::CONFLICT ? extent_protocol::CONFLICT :
+          extent_protocol::RPCERR;
+      }
+      ScopedLock ml(&move_m);
+      behind.insert(m.old[i]);
+    }
+    ScopedLock ml(&move_m);
+    moved.clear();
+    nmoved = 0;
+  }
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  printf("extent_server::setmap(%llu) as %s: %lu shards, %lu old\n", m.epoch,
+         name.c_str(), m.shards.size(), m.old.size());
+  if (adds)
+    method_thread(this, true, &extent_server::rebalance);
   return extent_protocol::OK;
 }
 
+int extent_server::pullfile(extent_protocol::extentid_t id,
+                            unsigned long long epoch, int &)
+{
+  map_ref mr(this);
+  if (map.epoch != epoch)
+    return extent_protocol::WRONGSHARD;
+  if (!incoming())
+    return extent_protocol::OK;
+  return pull_file(extent_protocol::file_of(id));
+}
+
+// one walk over the files of the old shards, moving in what is due
+// here; false if anything could not be listed or moved
+bool extent_server::rebalance_pass()
+{
+  std::vector<std::string> old;
+  {
+    map_ref mr(this);
+    old = map.old;
+  }
+  bool clean = true;
+  for (unsigned int s = 0; s < old.size(); s++) {
+    rpcc *src = peer(old[s]);
+    if (src == NULL) {
+      clean = false;
+      continue;
+    }
+    extent_protocol::extentid_t from = 0;
+    for (;;) {
+      std::vector<extent_protocol::extentid_t> files;
+      if (src->call(extent_protocol::listfiles, from, 256U, files) !=
+          extent_protocol::OK) {
+        clean = false;
+        break;
+      }
+      if (files.empty())
+        break;
+      for (unsigned int i = 0; i < files.size(); i++) {
+        map_ref mr(this);
+        if (!incoming())
+          return true;
+        if (pull_file(files[i]) != extent_protocol::OK)
+          clean = false;
+      }
+      from = files.back() + 1;
+    }
+  }
+  return clean;
+}
+
+// the rebalancing thread: move in this server's share from the old
+// shards, over again until a walk finds nothing left to move, then
+// set the map that no longer lists them as old. the old shards take
+// no calls on what moves once they have the map, so nothing can come
+// back to them meanwhile.
+void extent_server::rebalance()
+{
+  while (!rebalance_pass())
+    sleep(1);
+
+  assert(pthread_rwlock_wrlock(&map_l) == 0);
+  extent_protocol::shardmap done = map;
+  done.epoch++;
+  done.old.clear();
+  install(done, self);
+  assert(pthread_rwlock_unlock(&map_l) == 0);
+  {
+    ScopedLock ml(&move_m);
+    printf("extent_server: rebalanced as %s, %llu extents moved\n",
+           self.c_str(), nmoved);
+    moved.clear();
+    behind.clear();
+  }
+
+  // the others route by the map they have, which differs from this
+  // one only in its epoch and old list; passing it on just lets the
+  // clients that ask them see the rebalance is over
+  for (unsigned int i = 0; i < done.shards.size(); i++) {
+    if (done.shards[i] == self)
+      continue;
+    for (int tries = 0; tries < 10; tries++) {
+      rpcc *cl = peer(done.shards[i]);
+      int x;
+      if (cl != NULL && cl->call(extent_protocol::setmap, done,
+                                 done.shards[i], x) == extent_protocol::OK)
+        break;
+      sleep(1);
+    }
+  }
+}
+
+int extent_server::snapshot(int, int &)
+{
+  int r = backend->snapshot();
+  printf("extent_server::snapshot() = %d\n", r);
+  return r;
+}
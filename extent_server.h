@@ -5,22 +5,200 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
 #include "extent_protocol.h"
+#include "extent_backend.h"
+#include "extent_rcache.h"
+#include "extent_hot.h"
+#include "extent_ring.h"
+
+// what extent_server keeps of a file: its totals and the numbers of
+// the blocks it has, so nothing needs to search the backend for them
+struct file_entry {
+  extent_protocol::filestat st;
+  std::set<unsigned int> blocks;
+};
 
 class extent_server {
 
 private:
-    std::map<extent_protocol::extentid_t, std::string> store;
-    std::map<extent_protocol::extentid_t, extent_protocol::attr> attr_store;
+    extent_backend *backend;
+    // the marshalled replies of get, getwithattr and getifchanged;
+    // every change to an extent invalidates its own
+    reply_cache *replies;
+    // the extents and clients behind the most calls and bytes; NULL
+    // when EXTENT_HOT_K is 0
+    hot_tracker *hot;
+    void touched(extent_protocol::extentid_t id, unsigned long long bytes);
+
+    // serialize the read-modify-write calls on any one extent
+    enum { NSTRIPES = 64 };
+    pthread_mutex_t stripes[NSTRIPES];
+    pthread_mutex_t *stripe(extent_protocol::extentid_t id);
+
+    // per-file totals and blocks, kept up to date as extents change and
+    // rebuilt from the backend at startup
+    extent_table<file_entry> files;
+    pthread_mutex_t file_stripes[NSTRIPES];
+    void account(extent_protocol::extentid_t id, bool existed,
+                 unsigned int oldsize, bool exists, unsigned int newsize);
+    bool totals(extent_protocol::extentid_t f, extent_protocol::filestat &st);
+    bool oldsize(extent_protocol::extentid_t id, unsigned int &size);
+
+    // versions come from one counter that starts each run above both
+    // every version on disk and the start time in microseconds shifted
+    // up 12 bits, so a removed extent's version is not handed out again
+    pthread_mutex_t version_m;
+    unsigned long long last_version;
+    unsigned long long next_version();
+
+    int lookup(extent_protocol::extentid_t id, extent_protocol::content &);
+    int store(extent_protocol::extentid_t id, std::string &buf,
+              extent_protocol::attr &a);
+    int resize(extent_protocol::extentid_t id, unsigned int size, bool create,
+               extent_protocol::attr &);
+    int remove_one(extent_protocol::extentid_t id, unsigned int &size);
+    int remove_file(extent_protocol::extentid_t f, extent_protocol::reclaimed &);
+    void blocks_of(extent_protocol::extentid_t f,
+                   std::vector<extent_protocol::extentid_t> &,
+                   unsigned long long from = 0);
+    int remove_tree(extent_protocol::extentid_t f, extent_protocol::reclaimed &,
+                    std::set<extent_protocol::extentid_t> &seen);
+
+    // the files held, in order, for listfiles to page through
+    pthread_mutex_t fileids_m;
+    std::set<extent_protocol::extentid_t> fileids;
+
+    // the shard map, as given by setmap, and this server's name in it.
+    // the calls on extents hold map_l for reading from their check
+    // through their work, so a new map waits them out.
+    extent_protocol::shardmap map;
+    std::string self;
+    extent_ring ring, oldring;
+    pthread_rwlock_t map_l;
+    class map_ref {
+     public:
+      map_ref(extent_server *xes);
+      ~map_ref();
+     private:
+      extent_server *es;
+    };
+    void install(const extent_protocol::shardmap &m, const std::string &name);
+    bool incoming();
+    int admit(extent_protocol::extentid_t id);
+    int admit_file(extent_protocol::extentid_t id);
+
+    // the other shards, by name
+    pthread_mutex_t peers_m;
+    std::map<std::string, rpcc *> peers;
+    rpcc *peer(const std::string &name);
+
+    // while this server is the shard added last, keys that have moved
+    // here, or are moving, and the old shards that may not have the
+    // map yet, which nothing is taken from until they do
+    pthread_mutex_t move_m;
+    pthread_cond_t move_c;
+    std::set<unsigned long long> moved, moving;
+    std::set<std::string> behind;
+    unsigned long long nmoved;
+    int pull(unsigned long long key);
+    int move_in(unsigned long long key);
+    int pull_file(extent_protocol::extentid_t f);
+    int push(const std::string &name);
+    int adopt(extent_protocol::extentid_t id, extent_protocol::content &c);
+    void rebalance();
+    bool rebalance_pass();
 
 public:
     extent_server();
 
-    int put(extent_protocol::extentid_t id, std::string, int &);
-    int get(extent_protocol::extentid_t id, std::string &);
+    // once a shard map is set, the calls on extents answer WRONGSHARD
+    // for those it places on another server, and the calls on whole
+    // files do too where a file is not striped over the shards
+
+    // the mutating calls reply with the extent's attr after the change
+    int put(extent_protocol::extentid_t id, std::string, extent_protocol::attr &);
+    // replies to concurrent reads of one extent are shared, and kept
+    // until it changes; they unmarshall as a std::string and a content
+    int get(extent_protocol::extentid_t id, prepacked &);
+    int getwithattr(extent_protocol::extentid_t id, prepacked &);
+    // NOTMODIFIED, with only the attr filled in, if id is still at
+    // version; otherwise the same as getwithattr
+    int getifchanged(extent_protocol::extentid_t id, unsigned long long version,
+                     prepacked &);
+    // put only if id is at version, or absent for version 0. replies
+    // with the new attr, or CONFLICT and the current data and attr
+    int putifversion(extent_protocol::extentid_t id, unsigned long long version,
+                     std::string buf, extent_protocol::content &);
     int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
-    int setattr(extent_protocol::extentid_t id, extent_protocol::attr);
+    int setattr(extent_protocol::extentid_t id, extent_protocol::attr,
+                extent_protocol::attr &);
     int remove(extent_protocol::extentid_t id, int &);
+    int read(extent_protocol::extentid_t id, unsigned int off,
+             unsigned int len, std::string &);
+    int write(extent_protocol::extentid_t id, unsigned int off,
+              std::string buf, extent_protocol::attr &);
+    int append(extent_protocol::extentid_t id, std::string buf,
+               extent_protocol::attr &);
+    int stat(extent_protocol::extentid_t id, extent_protocol::filestat &);
+    // set the size of id's file, touching only its last block; the
+    // blocks of a file that grows are left as holes
+    int truncate(extent_protocol::extentid_t id, unsigned long long size,
+                 extent_protocol::filestat &);
+    // read id's file across its blocks, with holes as zeros
+    int readfile(extent_protocol::extentid_t id, unsigned long long off,
+                 unsigned int len, std::string &);
+    // write buf into id's file from byte off, block by block as write
+    // does
+    int writefile(extent_protocol::extentid_t id, unsigned long long off,
+                  const std::string &buf);
+    // readfile and writefile streamed, for files of any size: a chunk
+    // at a time, so neither side holds more than one. the argument is
+    // "id off len" to read and "id off" to write; close() returns the
+    // call's status, and the write of a chunk that fails returns it.
+    stream_handler *readstream(const std::string arg);
+    stream_handler *writestream(const std::string arg);
+    // delete every block of the file id belongs to or, for a directory,
+    // everything under it as well
+    int removetree(extent_protocol::extentid_t id, extent_protocol::reclaimed &);
+    // replace the file dst belongs to with a copy of src's, made on
+    // the server
+    int clone(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+              extent_protocol::filestat &);
+    // a text account of the backend: memory use, cache counters
+    int report(int, std::string &);
+    // have the backend write a snapshot in the background
+    int snapshot(int, int &);
+    // the n extents and clients behind the most calls and the most
+    // bytes since the server started, as text. kept with every call,
+    // whether or not the per-call log (EXTENT_DEBUG) is on.
+    int hotspots(unsigned int n, std::string &);
+
+    // for moving extents between shards: up to max of the files held,
+    // in order from file from on; the blocks id's file has here; id's
+    // data and attr; and remove id. none of them checks the shard map.
+    int listfiles(extent_protocol::extentid_t from, unsigned int max,
+                  std::vector<extent_protocol::extentid_t> &);
+    int listblocks(extent_protocol::extentid_t id,
+                   std::vector<extent_protocol::extentid_t> &);
+    int handoff(extent_protocol::extentid_t id, extent_protocol::content &);
+    int release(extent_protocol::extentid_t id, int &);
+
+    // the shard map; epoch 0 until one is set
+    int getmap(int, extent_protocol::shardmap &);
+    // take m as the shard map, with this server as name in it. a lower
+    // epoch than the map held is refused, and so is another map of the
+    // same epoch (CONFLICT). a server that m adds takes its share of
+    // the extents from the old shards: it passes m on to them first,
+    // then moves the extents over in the background, and at the end
+    // sets a map one epoch on without them listed as old.
+    int setmap(extent_protocol::shardmap m, std::string name, int &);
+    // move in whatever of id's file is due here now, so that every
+    // block of it can be found where the map of epoch puts it;
+    // WRONGSHARD if the map is no longer at epoch
+    int pullfile(extent_protocol::extentid_t id, unsigned long long epoch,
+                 int &);
 };
 
 #endif 
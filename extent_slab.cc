@@ -0,0 +1,993 @@
+// size-classed slab storage for in-memory extents
+
+#include "extent_slab.h"
+#include "rpc/slock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define CHUNK (256 << 10)
+// the chunk descriptor sits at the start of its chunk, slots follow
+#define CHUNK_HDR 64
+// the largest extent kept in a slot
+#define MAXDATA 8192
+// a slot on its chunk's free list has this length; the next free slot
+// is kept in atime
+#define FREE 0xffffffffU
+#define NONE 0xffffffffU
+// a snapshot file is this, then every extent as its slot header and
+// data, then a header with len FREE, the extent count in id and the
+// data bytes in version
+#define SNAP_MAGIC 0x7966736eULL // "yfsn"
+
+struct slot_hdr {
+  unsigned long long id;
+  unsigned long long version;
+  unsigned int len;
+  unsigned int atime;
+  unsigned int mtime;
+  unsigned int ctime;
+};
+
+struct slab_backend::chunk {
+  sclass *cls;
+  unsigned int nslots;
+  unsigned int live;     // slots handed out and not yet given back
+  unsigned int top;      // slots at or above top have never been used
+  unsigned int freelist;
+  bool draining;         // being emptied by compaction, takes no slots
+  chunk *prev, *next;    // on cls->partial
+
+  char *slot(unsigned int i) { return (char *) this + CHUNK_HDR + i * cls->size; }
+  unsigned int index(char *p) { return (p - (char *) this - CHUNK_HDR) / cls->size; }
+};
+
+static slot_hdr *
+hdr(char *p)
+{
+  return (slot_hdr *) p;
+}
+
+// the len of a slot that take() handed out is filled in last, outside
+// the class lock, and compaction reads it under that lock to tell a
+// filled slot from one still being filled. the release store makes
+// the rest of the slot visible to compaction's acquire load.
+static void
+set_len(char *p, unsigned int len)
+{
+  __atomic_store_n(&hdr(p)->len, len, __ATOMIC_RELEASE);
+}
+
+static unsigned int
+filled_len(char *p)
+{
+  return __atomic_load_n(&hdr(p)->len, __ATOMIC_ACQUIRE);
+}
+
+static void
+attr_of(const slot_hdr *h, extent_protocol::attr &a)
+{
+  a.atime = h->atime;
+  a.mtime = h->mtime;
+  a.ctime = h->ctime;
+  a.size = h->len;
+  a.version = h->version;
+}
+
+static void *
+compactorthread(void *x)
+{
+  slab_backend *b = (slab_backend *) x;
+  b->compactor();
+  return 0;
+}
+
+static void *
+snapshotthread(void *x)
+{
+  slab_backend *b = (slab_backend *) x;
+  b->snapshotter();
+  return 0;
+}
+
+slab_backend::slab_backend(std::string snapfile, int every)
+  : large_n_(0), large_bytes_(0), moved_(0), released_(0), stop_(false),
+    snapping_(false), frozen_(NULL), snapfile_(snapfile), every_(every),
+    snapwanted_(false), snaps_(0), snap_extents_(0), snap_bytes_(0),
+    snap_ms_(0)
+{
+  assert(sizeof(chunk) <= CHUNK_HDR && sizeof(slot_hdr) == 32);
+  assert(pthread_mutex_init(&large_m_, NULL) == 0);
+  assert(pthread_mutex_init(&stat_m_, NULL) == 0);
+  assert(pthread_mutex_init(&compact_m_, NULL) == 0);
+  assert(pthread_cond_init(&compact_c_, NULL) == 0);
+  assert(pthread_rwlock_init(&snap_l_, NULL) == 0);
+  assert(pthread_mutex_init(&snap_m_, NULL) == 0);
+  assert(pthread_cond_init(&snap_c_, NULL) == 0);
+
+  // data sizes of 0 to 112 in steps of 16, then four classes per
+  // power of two; a slot adds the header, so yfs's 1K blocks and other
+  // power-of-two extents fill theirs exactly
+  std::vector<unsigned int> sizes;
+  for (unsigned int s = 0; s < 128; s += 16)
+    sizes.push_back(s);
+  for (unsigned int p = 128; p < MAXDATA; p *= 2) {
+    for (int q = 4; q < 8; q++)
+      sizes.push_back(p * q / 4);
+  }
+  sizes.push_back(MAXDATA);
+  for (unsigned int i = 0; i < sizes.size(); i++) {
+    sclass *c = new sclass;
+    assert(pthread_mutex_init(&c->m, NULL) == 0);
+    c->size = sizeof(slot_hdr) + sizes[i];
+    c->partial = NULL;
+    c->payload = c->live = 0;
+    classes_.push_back(c);
+  }
+
+  if (!snapfile_.empty() && !restore())
+    exit(1);
+
+  int r = pthread_create(&th_, NULL, &compactorthread, (void *) this);
+  assert (r == 0);
+  if (!snapfile_.empty()) {
+    r = pthread_create(&snapth_, NULL, &snapshotthread, (void *) this);
+    assert (r == 0);
+  }
+}
+
+slab_backend::~slab_backend()
+{
+  {
+    ScopedLock cl(&compact_m_);
+    stop_ = true;
+    assert(pthread_cond_signal(&compact_c_) == 0);
+  }
+  assert(pthread_join(th_, NULL) == 0);
+  if (!snapfile_.empty()) {
+    {
+      ScopedLock sl(&snap_m_);
+      assert(pthread_cond_signal(&snap_c_) == 0);
+    }
+    assert(pthread_join(snapth_, NULL) == 0);
+  }
+
+  std::vector<extent_protocol::extentid_t> all;
+  index_.keys(all);
+  for (unsigned int i = 0; i < all.size(); i++) {
+    char *p;
+    if (index_.remove(all[i], &p))
+      release(p);
+  }
+  for (unsigned int i = 0; i < classes_.size(); i++) {
+    sclass *c = classes_[i];
+    while (!c->chunks.empty())
+      dropchunk(c, c->chunks.back());
+    assert(pthread_mutex_destroy(&c->m) == 0);
+    delete c;
+  }
+}
+
+// the class whose slots hold len bytes of data, -1 if none does
+int
+slab_backend::class_of(unsigned int len)
+{
+  if (len > MAXDATA)
+    return -1;
+  unsigned int need = len + sizeof(slot_hdr);
+  int lo = 0, hi = classes_.size() - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (classes_[mid]->size < need)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+namespace {
+  void unlink(slab_backend::sclass *c, slab_backend::chunk *k)
+  {
+    if (k->prev)
+      k->prev->next = k->next;
+    else
+      c->partial = k->next;
+    if (k->next)
+      k->next->prev = k->prev;
+    k->prev = k->next = NULL;
+  }
+
+  void link(slab_backend::sclass *c, slab_backend::chunk *k)
+  {
+    k->prev = NULL;
+    k->next = c->partial;
+    if (c->partial)
+      c->partial->prev = k;
+    c->partial = k;
+  }
+}
+
+// a fresh chunk, aligned to CHUNK so a slot finds its chunk by masking
+slab_backend::chunk *
+slab_backend::newchunk(sclass *c)
+{
+  char *m = (char *) mmap(0, 2 * CHUNK, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m == MAP_FAILED) {
+    perror("slab_backend: mmap");
+    return NULL;
+  }
+  char *base = (char *) (((unsigned long) m + CHUNK - 1) & ~(unsigned long) (CHUNK - 1));
+  if (base > m)
+    munmap(m, base - m);
+  munmap(base + CHUNK, m + CHUNK - base);
+
+  chunk *k = (chunk *) base;
+  k->cls = c;
+  k->nslots = (CHUNK - CHUNK_HDR) / c->size;
+  k->live = k->top = 0;
+  k->freelist = NONE;
+  k->draining = false;
+  c->chunks.push_back(k);
+  link(c, k);
+  return k;
+}
+
+void
+slab_backend::dropchunk(sclass *c, chunk *k)
+{
+  if (!k->draining && k->live < k->nslots)
+    unlink(c, k);
+  c->chunks.erase(std::find(c->chunks.begin(), c->chunks.end(), k));
+  munmap(k, CHUNK);
+}
+
+// hand out a slot for len bytes. it stays marked free until the
+// caller fills in its header, so compaction leaves it alone.
+char *
+slab_backend::take(sclass *c, unsigned int len)
+{
+  chunk *k = c->partial;
+  if (k == NULL && (k = newchunk(c)) == NULL)
+    return NULL;
+  unsigned int i;
+  if (k->freelist != NONE) {
+    i = k->freelist;
+    k->freelist = hdr(k->slot(i))->atime;
+  } else {
+    i = k->top++;
+  }
+  char *p = k->slot(i);
+  hdr(p)->len = FREE;
+  if (++k->live == k->nslots)
+    unlink(c, k);
+  c->live++;
+  c->payload += len;
+  return p;
+}
+
+void
+slab_backend::give(sclass *c, char *p)
+{
+  chunk *k = (chunk *) ((unsigned long) p & ~(unsigned long) (CHUNK - 1));
+  slot_hdr *h = hdr(p);
+  c->payload -= h->len;
+  c->live--;
+  h->len = FREE;
+  h->atime = k->freelist;
+  k->freelist = k->index(p);
+  bool wasfull = k->live-- == k->nslots;
+  // a draining chunk is compaction's to drop or put back, once it has
+  // moved what it can
+  if (k->draining)
+    return;
+  if (k->live == 0 && c->chunks.size() > 1) {
+    dropchunk(c, k);
+  } else if (wasfull) {
+    link(c, k);
+  }
+}
+
+char *
+slab_backend::alloc(unsigned int len)
+{
+  int ci = class_of(len);
+  if (ci < 0) {
+    char *p = (char *) malloc(sizeof(slot_hdr) + len);
+    if (p != NULL) {
+      ScopedLock ll(&large_m_);
+      large_n_++;
+      large_bytes_ += len;
+    }
+    return p;
+  }
+  sclass *c = classes_[ci];
+  ScopedLock cl(&c->m);
+  return take(c, len);
+}
+
+void
+slab_backend::release(char *p)
+{
+  unsigned int len = hdr(p)->len;
+  int ci = class_of(len);
+  if (ci < 0) {
+    free(p);
+    ScopedLock ll(&large_m_);
+    large_n_--;
+    large_bytes_ -= len;
+    return;
+  }
+  sclass *c = classes_[ci];
+  ScopedLock cl(&c->m);
+  give(c, p);
+}
+
+namespace {
+  struct copy_out {
+    copy_out(extent_entry &xe) : e(xe) {}
+    void operator()(char *const &p) {
+      const slot_hdr *h = hdr(p);
+      e.data.assign(p + sizeof(slot_hdr), h->len);
+      attr_of(h, e.a);
+    }
+    extent_entry &e;
+  };
+
+  struct copy_attr {
+    copy_attr(extent_protocol::attr &xa) : a(xa) {}
+    void operator()(char *const &p) { attr_of(hdr(p), a); }
+    extent_protocol::attr &a;
+  };
+
+  struct copy_range {
+    copy_range(unsigned int xoff, unsigned int xlen, std::string &xbuf)
+      : off(xoff), len(xlen), buf(xbuf) {}
+    void operator()(char *const &p) {
+      unsigned int n = hdr(p)->len;
+      if (off < n)
+        buf.assign(p + sizeof(slot_hdr) + off, std::min(len, n - off));
+      else
+        buf.clear();
+    }
+    unsigned int off, len;
+    std::string &buf;
+  };
+
+  // the data and times of a slot into a fresh one for len bytes; the
+  // header's len is left for the caller to fill in last
+  struct dup_slot {
+    dup_slot(char *xp, unsigned int xlen) : p(xp), len(xlen), copied(false) {}
+    void operator()(char *const &s) {
+      const slot_hdr *h = hdr(s);
+      if (h->len != len)
+        return;
+      memcpy(p + sizeof(slot_hdr), s + sizeof(slot_hdr), len);
+      hdr(p)->atime = h->atime;
+      copied = true;
+    }
+    char *p;
+    unsigned int len;
+    bool copied;
+  };
+
+  // as much of a slot's data as fits into a fresh one of size bytes,
+  // zero-filling the rest
+  struct cut_slot {
+    cut_slot(char *xp, unsigned int xsize) : p(xp), size(xsize) {}
+    void operator()(char *const &s) {
+      const slot_hdr *h = hdr(s);
+      unsigned int n = std::min(h->len, size);
+      memcpy(p + sizeof(slot_hdr), s + sizeof(slot_hdr), n);
+      memset(p + sizeof(slot_hdr) + n, 0, size - n);
+      hdr(p)->atime = h->atime;
+    }
+    char *p;
+    unsigned int size;
+  };
+
+  // the first change to an id during a snapshot records what it was
+  struct keep_first {
+    keep_first(char *xold) : old(xold), kept(false) {}
+    bool operator()(char *&v, bool found) {
+      if (found)
+        return false;
+      v = old;
+      kept = true;
+      return true;
+    }
+    char *old;
+    bool kept;
+  };
+
+  // old was id's slot (or NULL for none) until a change made while a
+  // snapshot is being written. true if the snapshot now owns it.
+  bool
+  keep(extent_table<char *> *frozen, extent_protocol::extentid_t id,
+       char *old)
+  {
+    keep_first f(old);
+    frozen->update(id, f);
+    return f.kept && old != NULL;
+  }
+
+  // a filled-in slot in as id's current one. during a snapshot
+  // (frozen non-NULL) the slot it replaces is kept aside under the
+  // same index lock, so the snapshot sees either the old slot in the
+  // index or the new one with the old in frozen.
+  struct swap_in {
+    swap_in(extent_protocol::extentid_t xid, char *xp,
+            extent_table<char *> *xfrozen)
+      : id(xid), p(xp), old(NULL), frozen(xfrozen), kept(false) {}
+    bool operator()(char *&v, bool found) {
+      if (found)
+        old = v;
+      v = p;
+      if (frozen != NULL)
+        kept = keep(frozen, id, old);
+      return true;
+    }
+    extent_protocol::extentid_t id;
+    char *p, *old;
+    extent_table<char *> *frozen;
+    bool kept;
+  };
+
+  // remove's counterpart of swap_in
+  struct take_out {
+    take_out(extent_protocol::extentid_t xid, extent_table<char *> *xfrozen)
+      : id(xid), old(NULL), frozen(xfrozen), kept(false) {}
+    void operator()(char *&v) {
+      old = v;
+      if (frozen != NULL)
+        kept = keep(frozen, id, old);
+    }
+    extent_protocol::extentid_t id;
+    char *old;
+    extent_table<char *> *frozen;
+    bool kept;
+  };
+
+  // compaction's move: only if the extent is still in the slot it
+  // was copied from
+  struct relocate {
+    relocate(char *xfrom, char *xto) : from(xfrom), to(xto) {}
+    bool operator()(char *&v, bool found) {
+      if (!found || v != from)
+        return false;
+      v = to;
+      return true;
+    }
+    char *from, *to;
+  };
+}
+
+int
+slab_backend::get(extent_protocol::extentid_t id, extent_entry &e)
+{
+  copy_out f(e);
+  return index_.peek(id, f) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int
+slab_backend::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
+{
+  copy_attr f(a);
+  return index_.peek(id, f) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int
+slab_backend::read(extent_protocol::extentid_t id, unsigned int off,
+                   unsigned int len, std::string &buf)
+{
+  copy_range f(off, len, buf);
+  return index_.peek(id, f) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+int
+slab_backend::put(extent_protocol::extentid_t id, const extent_entry &e)
+{
+  char *p = alloc(e.data.size());
+  if (p == NULL)
+    return extent_protocol::IOERR;
+  memcpy(p + sizeof(slot_hdr), e.data.data(), e.data.size());
+  slot_hdr *h = hdr(p);
+  h->id = id;
+  h->version = e.a.version;
+  h->atime = e.a.atime;
+  h->mtime = e.a.mtime;
+  h->ctime = e.a.ctime;
+  set_len(p, e.data.size());
+  publish(id, p);
+  return extent_protocol::OK;
+}
+
+// make the filled-in slot p id's current one
+void
+slab_backend::publish(extent_protocol::extentid_t id, char *p)
+{
+  assert(pthread_rwlock_rdlock(&snap_l_) == 0);
+  swap_in f(id, p, snapping_ ? frozen_ : NULL);
+  index_.update(id, f);
+  assert(pthread_rwlock_unlock(&snap_l_) == 0);
+  if (f.old && !f.kept)
+    release(f.old);
+}
+
+// slot to slot, without an extent_entry in between. the slot is
+// allocated before src's is looked at, since allocating may not wait
+// for a class lock under the index lock; if src has changed size in
+// between, it is tried again.
+int
+slab_backend::copy(extent_protocol::extentid_t src,
+                   extent_protocol::extentid_t dst, unsigned long long version,
+                   extent_protocol::attr &a)
+{
+  for (;;) {
+    extent_protocol::attr sa;
+    if (getattr(src, sa) != extent_protocol::OK)
+      return extent_protocol::NOENT;
+    char *p = alloc(sa.size);
+    if (p == NULL)
+      return extent_protocol::IOERR;
+    dup_slot f(p, sa.size);
+    bool found = index_.peek(src, f);
+    if (!f.copied) {
+      // release() finds the slot's class by its len
+      set_len(p, sa.size);
+      release(p);
+      if (!found)
+        return extent_protocol::NOENT;
+      continue;
+    }
+    slot_hdr *h = hdr(p);
+    h->id = dst;
+    h->version = version;
+    h->mtime = h->ctime = time(NULL);
+    set_len(p, sa.size);
+    attr_of(h, a);
+    publish(dst, p);
+    return extent_protocol::OK;
+  }
+}
+
+// slot to slot as well; the new slot is allocated first for the same
+// reason as in copy, but needs no retry since it is sized by the
+// result, not by the slot it is filled from
+int
+slab_backend::resize(extent_protocol::extentid_t id, unsigned int size,
+                     bool create, unsigned long long version,
+                     extent_protocol::attr &a)
+{
+  char *p = alloc(size);
+  if (p == NULL)
+    return extent_protocol::IOERR;
+  cut_slot f(p, size);
+  if (!index_.peek(id, f)) {
+    if (!create) {
+      set_len(p, size);
+      release(p);
+      return extent_protocol::NOENT;
+    }
+    memset(p + sizeof(slot_hdr), 0, size);
+    hdr(p)->atime = time(NULL);
+  }
+  slot_hdr *h = hdr(p);
+  h->id = id;
+  h->version = version;
+  h->mtime = h->ctime = time(NULL);
+  set_len(p, size);
+  attr_of(h, a);
+  publish(id, p);
+  return extent_protocol::OK;
+}
+
+int
+slab_backend::remove(extent_protocol::extentid_t id)
+{
+  assert(pthread_rwlock_rdlock(&snap_l_) == 0);
+  take_out f(id, snapping_ ? frozen_ : NULL);
+  bool found = index_.erase(id, f);
+  assert(pthread_rwlock_unlock(&snap_l_) == 0);
+  if (!found)
+    return extent_protocol::NOENT;
+  if (!f.kept)
+    release(f.old);
+  return extent_protocol::OK;
+}
+
+void
+slab_backend::ids(std::vector<extent_protocol::extentid_t> &ids)
+{
+  index_.keys(ids);
+}
+
+// empty the sparsest chunks of c into the rest of its chunks, once
+// at least a quarter of the class and two chunks' worth of slots are
+// free. only as many chunks are chosen as the others have room for,
+// so unless puts race for that room no new chunk gets mapped.
+unsigned long long
+slab_backend::compact(sclass *c)
+{
+  std::vector<chunk *> victims;
+  {
+    ScopedLock cl(&c->m);
+    unsigned long long total = 0, room = 0;
+    std::vector<std::pair<unsigned int, chunk *> > cands;
+    for (unsigned int i = 0; i < c->chunks.size(); i++) {
+      chunk *k = c->chunks[i];
+      if (k->draining)
+        continue;
+      total += k->nslots;
+      room += k->nslots - k->live;
+      cands.push_back(std::make_pair(k->live, k));
+    }
+    if (cands.empty() || room * 4 < total || room < 2 * cands[0].second->nslots)
+      return 0;
+    std::sort(cands.begin(), cands.end());
+    unsigned long long moving = 0;
+    for (unsigned int i = 0; i < cands.size(); i++) {
+      chunk *k = cands[i].second;
+      if (k->live * 2 > k->nslots)
+        break;
+      unsigned long long left = room - (k->nslots - k->live);
+      if (moving + k->live > left)
+        break;
+      room = left;
+      moving += k->live;
+      if (k->live < k->nslots)
+        unlink(c, k);
+      k->draining = true;
+      victims.push_back(k);
+    }
+  }
+
+  unsigned long long moved = 0;
+  for (unsigned int v = 0; v < victims.size(); v++) {
+    chunk *k = victims[v];
+    ScopedLock cl(&c->m);
+    // take() never picks a draining chunk, so top stays put
+    unsigned int top = k->top;
+    for (unsigned int i = 0; i < top && k->live > 0; i++) {
+      char *from = k->slot(i);
+      unsigned int len = filled_len(from);
+      if (len == FREE)
+        continue;
+      char *to = take(c, len);
+      if (to == NULL)
+        break;
+      memcpy(to, from, c->size);
+      relocate f(from, to);
+      if (index_.update(hdr(from)->id, f)) {
+        moved++;
+        give(c, from);
+      } else {
+        give(c, to);
+      }
+    }
+    if (k->live == 0) {
+      dropchunk(c, k);
+      ScopedLock sl(&stat_m_);
+      released_++;
+      continue;
+    }
+    // a slot that lost its move to a put, or was still being filled,
+    // keeps k in use; it takes allocations again until a later pass
+    k->draining = false;
+    if (k->live < k->nslots)
+      link(c, k);
+  }
+  ScopedLock sl(&stat_m_);
+  moved_ += moved;
+  return moved;
+}
+
+unsigned long long
+slab_backend::compact()
+{
+  unsigned long long moved = 0;
+  for (unsigned int i = 0; i < classes_.size(); i++)
+    moved += compact(classes_[i]);
+  return moved;
+}
+
+void
+slab_backend::compactor()
+{
+  while (1) {
+    {
+      ScopedLock cl(&compact_m_);
+      if (stop_)
+        return;
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += 1;
+      pthread_cond_timedwait(&compact_c_, &compact_m_, &ts);
+      if (stop_)
+        return;
+    }
+    unsigned long long n = compact();
+    if (n > 0)
+      printf("slab_backend: compaction moved %llu extents\n", n);
+  }
+}
+
+void
+slab_backend::memory(slab_stats &st)
+{
+  memset(&st, 0, sizeof(st));
+  for (unsigned int i = 0; i < classes_.size(); i++) {
+    sclass *c = classes_[i];
+    ScopedLock cl(&c->m);
+    for (unsigned int j = 0; j < c->chunks.size(); j++) {
+      chunk *k = c->chunks[j];
+      st.free += (unsigned long long) (k->nslots - k->live) * c->size;
+      st.chunkpad += CHUNK - (unsigned long long) k->nslots * c->size;
+    }
+    st.chunks += c->chunks.size();
+    st.extents += c->live;
+    st.payload += c->payload;
+    st.headers += c->live * sizeof(slot_hdr);
+    st.slack += c->live * (c->size - sizeof(slot_hdr)) - c->payload;
+  }
+  {
+    ScopedLock ll(&large_m_);
+    st.large = large_n_;
+    st.extents += large_n_;
+    st.payload += large_bytes_;
+    st.headers += large_n_ * sizeof(slot_hdr);
+  }
+  {
+    ScopedLock sl(&stat_m_);
+    st.moved = moved_;
+    st.released = released_;
+  }
+  st.index = index_.footprint();
+}
+
+void
+slab_backend::stats(std::string &out)
+{
+  slab_stats st;
+  memory(st);
+  unsigned long long over = st.headers + st.slack + st.free + st.chunkpad +
+    st.index;
+  char buf[1024];
+  snprintf(buf, sizeof(buf),
+      "extents %llu (%llu large)\n"
+      "payload %llu\n"
+      "overhead %llu (%.1f%% of payload)\n"
+      "  headers %llu\n"
+      "  slack %llu\n"
+      "  free slots %llu\n"
+      "  chunk padding %llu\n"
+      "  index %llu\n"
+      "chunks %llu (%llu bytes)\n"
+      "compaction moved %llu extents, released %llu chunks\n",
+      st.extents, st.large, st.payload, over,
+      st.payload ? 100.0 * over / st.payload : 0.0,
+      st.headers, st.slack, st.free, st.chunkpad, st.index,
+      st.chunks, st.chunks * CHUNK, st.moved, st.released);
+  out = buf;
+  if (snapfile_.empty())
+    return;
+  ScopedLock sl(&snap_m_);
+  snprintf(buf, sizeof(buf),
+      "snapshots %llu to %s; last %llu extents, %llu bytes in %llu ms\n",
+      snaps_, snapfile_.c_str(), snap_extents_, snap_bytes_, snap_ms_);
+  out += buf;
+}
+
+int
+slab_backend::snapshot()
+{
+  if (snapfile_.empty())
+    return extent_protocol::IOERR;
+  ScopedLock sl(&snap_m_);
+  snapwanted_ = true;
+  assert(pthread_cond_signal(&snap_c_) == 0);
+  return extent_protocol::OK;
+}
+
+void
+slab_backend::snapshotter()
+{
+  while (1) {
+    {
+      ScopedLock sl(&snap_m_);
+      while (!stop_ && !snapwanted_) {
+        if (every_ <= 0) {
+          assert(pthread_cond_wait(&snap_c_, &snap_m_) == 0);
+          continue;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += every_;
+        if (pthread_cond_timedwait(&snap_c_, &snap_m_, &ts) == ETIMEDOUT)
+          snapwanted_ = true;
+      }
+      if (stop_)
+        return;
+      snapwanted_ = false;
+    }
+    writesnap();
+  }
+}
+
+namespace {
+  // id's slot, unless a change since the snapshot began has put what
+  // it was in frozen. asked under the index lock that changes record
+  // into frozen under, so the two agree.
+  struct snap_slot {
+    snap_slot(extent_protocol::extentid_t xid, extent_table<char *> *xfrozen,
+              std::string &xbuf)
+      : id(xid), frozen(xfrozen), buf(xbuf), changed(false) {}
+    void operator()(char *const &p) {
+      changed = frozen->has(id);
+      if (!changed)
+        buf.assign(p, sizeof(slot_hdr) + hdr(p)->len);
+    }
+    extent_protocol::extentid_t id;
+    extent_table<char *> *frozen;
+    std::string &buf;
+    bool changed;
+  };
+}
+
+// freeze the extents as they are now and write them to the snapshot
+// file. an id's slot in the index is its frozen contents unless
+// frozen_ says otherwise, and frozen_ also holds the ids removed since.
+int
+slab_backend::writesnap()
+{
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  assert(pthread_rwlock_wrlock(&snap_l_) == 0);
+  frozen_ = new extent_table<char *>();
+  snapping_ = true;
+  assert(pthread_rwlock_unlock(&snap_l_) == 0);
+
+  std::vector<extent_protocol::extentid_t> ids, gone;
+  index_.keys(ids);
+  std::sort(ids.begin(), ids.end());
+
+  std::string tmp = snapfile_ + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  bool ok = f != NULL;
+  unsigned long long magic = SNAP_MAGIC, n = 0, bytes = 0;
+  if (ok)
+    ok = fwrite(&magic, sizeof(magic), 1, f) == 1;
+  std::string buf;
+  for (unsigned int i = 0; ok && i < ids.size(); i++) {
+    snap_slot c(ids[i], frozen_, buf);
+    if (!index_.peek(ids[i], c) || c.changed) {
+      // changed or removed since; frozen_ has what it was, if anything
+      char *p;
+      if (!frozen_->get(ids[i], p) || p == NULL)
+        continue;
+      buf.assign(p, sizeof(slot_hdr) + hdr(p)->len);
+    }
+    ok = fwrite(buf.data(), buf.size(), 1, f) == 1;
+    n++;
+    bytes += buf.size() - sizeof(slot_hdr);
+  }
+  frozen_->keys(gone);
+  for (unsigned int i = 0; ok && i < gone.size(); i++) {
+    char *p;
+    if (std::binary_search(ids.begin(), ids.end(), gone[i]) ||
+        !frozen_->get(gone[i], p) || p == NULL)
+      continue;
+    ok = fwrite(p, sizeof(slot_hdr) + hdr(p)->len, 1, f) == 1;
+    n++;
+    bytes += hdr(p)->len;
+  }
+  if (ok) {
+    slot_hdr t;
+    memset(&t, 0, sizeof(t));
+    t.len = FREE;
+    t.id = n;
+    t.version = bytes;
+    ok = fwrite(&t, sizeof(t), 1, f) == 1 && fflush(f) == 0 &&
+      fsync(fileno(f)) == 0;
+  }
+  if (f != NULL && fclose(f) != 0)
+    ok = false;
+  if (ok && rename(tmp.c_str(), snapfile_.c_str()) < 0)
+    ok = false;
+  if (ok) {
+    std::string dir = ".";
+    size_t slash = snapfile_.rfind('/');
+    if (slash != std::string::npos)
+      dir = snapfile_.substr(0, slash + 1);
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  } else {
+    perror("slab_backend: snapshot");
+    unlink(tmp.c_str());
+  }
+
+  assert(pthread_rwlock_wrlock(&snap_l_) == 0);
+  extent_table<char *> *frozen = frozen_;
+  frozen_ = NULL;
+  snapping_ = false;
+  assert(pthread_rwlock_unlock(&snap_l_) == 0);
+  frozen->keys(gone);
+  for (unsigned int i = 0; i < gone.size(); i++) {
+    char *p;
+    if (frozen->get(gone[i], p) && p != NULL)
+      release(p);
+  }
+  delete frozen;
+
+  if (!ok)
+    return extent_protocol::IOERR;
+  gettimeofday(&end, NULL);
+  unsigned long long ms = (end.tv_sec - start.tv_sec) * 1000ULL +
+    (end.tv_usec - start.tv_usec) / 1000;
+  printf("slab_backend: snapshot of %llu extents, %llu bytes in %llu ms\n",
+         n, bytes, ms);
+  ScopedLock sl(&snap_m_);
+  snaps_++;
+  snap_extents_ = n;
+  snap_bytes_ = bytes;
+  snap_ms_ = ms;
+  return extent_protocol::OK;
+}
+
+// load the snapshot file, if there is one. false if it is unreadable
+// or incomplete.
+bool
+slab_backend::restore()
+{
+  FILE *f = fopen(snapfile_.c_str(), "r");
+  if (f == NULL)
+    return true;
+  unsigned long long magic = 0, n = 0, bytes = 0;
+  bool ok = fread(&magic, sizeof(magic), 1, f) == 1 && magic == SNAP_MAGIC;
+  extent_entry e;
+  while (ok) {
+    slot_hdr h;
+    if (fread(&h, sizeof(h), 1, f) != 1) {
+      ok = false;
+      break;
+    }
+    if (h.len == FREE) {
+      ok = h.id == n && h.version == bytes;
+      break;
+    }
+    e.data.resize(h.len);
+    if (h.len > 0 && fread(&e.data[0], h.len, 1, f) != 1) {
+      ok = false;
+      break;
+    }
+    e.a.atime = h.atime;
+    e.a.mtime = h.mtime;
+    e.a.ctime = h.ctime;
+    e.a.size = h.len;
+    e.a.version = h.version;
+    if (put(h.id, e) != extent_protocol::OK)
+      ok = false;
+    n++;
+    bytes += h.len;
+  }
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "slab_backend: snapshot %s is damaged\n",
+            snapfile_.c_str());
+    return false;
+  }
+  printf("slab_backend: restored %llu extents, %llu bytes from %s\n", n,
+         bytes, snapfile_.c_str());
+  return true;
+}
@@ -0,0 +1,132 @@
+// size-classed slab storage for in-memory extents
+
+#ifndef extent_slab_h
+#define extent_slab_h
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "extent_backend.h"
+#include "extent_store.h"
+
+// what the slab allocator is holding, in bytes unless noted
+struct slab_stats {
+  unsigned long long extents;
+  unsigned long long payload;  // extent data
+  unsigned long long headers;  // the per-extent slot headers
+  unsigned long long slack;    // rounding a slot up to its size class
+  unsigned long long free;     // unused slots in allocated chunks
+  unsigned long long chunkpad; // chunk headers and tail ends
+  unsigned long long index;    // the id -> slot hash table
+  unsigned long long large;    // extents too big for a slot, malloced alone
+  unsigned long long chunks;
+  unsigned long long moved;    // slots relocated by compaction so far
+  unsigned long long released; // chunks compaction has given back
+};
+
+// extents are kept in fixed-size slots packed into 256K chunks of one
+// size class each, instead of in a heap-allocated string apiece. a
+// slot is a 32-byte header (id, length, times, version) followed by
+// the data; data sizes of the classes are a quarter power of two
+// apart, so rounding up wastes at most about a fifth of a slot. extents too big for the
+// largest class get their own malloc. the index maps each id to its
+// slot.
+//
+// slots are never written after they are published: a put fills a
+// fresh slot, swaps it into the index and frees the old one, so
+// lookups copy out under the index shard's read lock alone. a
+// compactor thread notices classes whose chunks have gone sparse,
+// moves the live slots out of the emptiest chunks into the others and
+// unmaps the chunks it emptied.
+//
+// with a snapshot file named, the backend starts out with what the
+// file holds, and snapshot() (or, with every set, a timer) writes a
+// point-in-time copy of all extents to it. taking the snapshot only
+// flips a flag under a lock that puts and removes hold shared; while
+// a snapshotter thread streams the extents out, the first put or
+// remove of each id keeps the slot it replaces aside for the
+// snapshot instead of freeing it, under the index lock it changes the
+// id under, so the snapshot never sees a new slot without the old. the file is written beside the old
+// one and renamed over it when complete.
+class slab_backend : public extent_backend {
+ public:
+  slab_backend(std::string snapfile = "", int every = 0);
+  ~slab_backend();
+
+  int get(extent_protocol::extentid_t id, extent_entry &e);
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int put(extent_protocol::extentid_t id, const extent_entry &e);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &ids);
+  // served from the slot without copying the whole extent
+  int read(extent_protocol::extentid_t id, unsigned int off,
+           unsigned int len, std::string &buf);
+  // slot to slot
+  int copy(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+           unsigned long long version, extent_protocol::attr &a);
+  int resize(extent_protocol::extentid_t id, unsigned int size, bool create,
+             unsigned long long version, extent_protocol::attr &a);
+  void stats(std::string &out);
+  int snapshot();
+
+  void memory(slab_stats &st);
+  // compact every class that is worth it; returns slots moved
+  unsigned long long compact();
+  void compactor();
+  void snapshotter();
+
+  struct chunk;
+  struct sclass {
+    pthread_mutex_t m;
+    unsigned int size;
+    chunk *partial; // chunks with free slots that take allocations
+    std::vector<chunk *> chunks;
+    unsigned long long payload;
+    unsigned long long live;
+  };
+
+ private:
+  extent_table<char *> index_;
+  std::vector<sclass *> classes_;
+
+  pthread_mutex_t large_m_;
+  unsigned long long large_n_, large_bytes_;
+
+  pthread_mutex_t stat_m_;
+  unsigned long long moved_, released_;
+
+  pthread_mutex_t compact_m_;
+  pthread_cond_t compact_c_;
+  bool stop_;
+  pthread_t th_;
+
+  // puts and removes hold snap_l_ shared; starting and ending a
+  // snapshot take it exclusively
+  pthread_rwlock_t snap_l_;
+  bool snapping_;
+  // what each id changed since the snapshot began was at the time;
+  // NULL if it did not exist
+  extent_table<char *> *frozen_;
+  const std::string snapfile_;
+  const int every_;
+  pthread_mutex_t snap_m_; // protects the fields below
+  pthread_cond_t snap_c_;
+  bool snapwanted_;
+  pthread_t snapth_;
+  unsigned long long snaps_, snap_extents_, snap_bytes_, snap_ms_;
+
+  int class_of(unsigned int len);
+  char *alloc(unsigned int len);
+  void release(char *p);
+  // slot management, under the class lock
+  char *take(sclass *c, unsigned int len);
+  void give(sclass *c, char *p);
+  void publish(extent_protocol::extentid_t id, char *p);
+  chunk *newchunk(sclass *c);
+  void dropchunk(sclass *c, chunk *k);
+  unsigned long long compact(sclass *c);
+  bool restore();
+  int writesnap();
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <iostream>
 #include "extent_server.h"
+#include "jsl_log.h"
 
 // Main loop of extent server
 
@@ -24,6 +25,12 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
+  // EXTENT_DEBUG=4 logs every call; hotspots needs no logging at all
+  char *debug_env = getenv("EXTENT_DEBUG");
+  if(debug_env != NULL){
+    jsl_set_debug(atoi(debug_env));
+  }
+
   rpcs server(atoi(argv[1]), count);
   extent_server ls;
 
@@ -31,6 +38,32 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::setattr, &ls, &extent_server::setattr);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::append, &ls, &extent_server::append);
+  server.reg(extent_protocol::stat, &ls, &extent_server::stat);
+  server.reg(extent_protocol::getwithattr, &ls, &extent_server::getwithattr);
+  server.reg(extent_protocol::removetree, &ls, &extent_server::removetree);
+  server.reg(extent_protocol::getifchanged, &ls, &extent_server::getifchanged);
+  server.reg(extent_protocol::putifversion, &ls, &extent_server::putifversion);
+  server.reg(extent_protocol::report, &ls, &extent_server::report);
+  server.reg(extent_protocol::snapshot, &ls, &extent_server::snapshot);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::readfile, &ls, &extent_server::readfile);
+  server.reg(extent_protocol::clone, &ls, &extent_server::clone);
+  server.reg(extent_protocol::hotspots, &ls, &extent_server::hotspots);
+  server.reg(extent_protocol::listfiles, &ls, &extent_server::listfiles);
+  server.reg(extent_protocol::listblocks, &ls, &extent_server::listblocks);
+  server.reg(extent_protocol::handoff, &ls, &extent_server::handoff);
+  server.reg(extent_protocol::release, &ls, &extent_server::release);
+  server.reg(extent_protocol::getmap, &ls, &extent_server::getmap);
+  server.reg(extent_protocol::setmap, &ls, &extent_server::setmap);
+  server.reg(extent_protocol::pullfile, &ls, &extent_server::pullfile);
+  server.reg_stream(extent_protocol::readstream, &ls,
+                    &extent_server::readstream);
+  server.reg_stream(extent_protocol::writestream, &ls,
+                    &extent_server::writestream);
 
   while(1)
     sleep(1000);
@@ -0,0 +1,341 @@
+// concurrent in-memory table keyed by extent id
+
+#ifndef extent_store_h
+#define extent_store_h
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <assert.h>
+#include "extent_protocol.h"
+#include "extent_hash.h"
+
+// extent_table is split into shards, each an open-addressing hash
+// table with linear probing behind its own reader/writer lock, so
+// lookups of different extents never contend and lookups of the same
+// extent only share a read lock. values are copied in and out under
+// the shard lock; callers never hold a pointer into the table.
+template<class V>
+class extent_table {
+ public:
+  typedef extent_protocol::extentid_t key_t;
+
+  extent_table(int nshards = 64);
+  ~extent_table();
+
+  // copy the value for id into v
+  bool get(key_t id, V &v);
+  // call f(v) on the value in place under the shard's read lock, for
+  // callers that need only part of it
+  template<class F> bool peek(key_t id, F &f);
+  bool has(key_t id);
+  // insert or overwrite
+  void put(key_t id, const V &v);
+  // erase id, handing its value to *old if wanted
+  bool remove(key_t id, V *old = NULL);
+  // erase id, first calling f(v) on its value under the shard's write
+  // lock
+  template<class F> bool erase(key_t id, F &f);
+  // read-modify-write under the shard's write lock. f(v, found) may
+  // change the current value in place; for an absent id v starts out
+  // default-constructed and is inserted only if f returns true.
+  // returns what f returned.
+  template<class F> bool update(key_t id, F &f);
+  // ids currently in the table; a snapshot, not a consistent cut
+  void keys(std::vector<key_t> &ids);
+  unsigned long long size();
+  // bytes the table itself occupies, values included
+  unsigned long long footprint();
+
+  static unsigned long long hash(key_t id);
+
+ private:
+  enum { EMPTY, FULL, DELETED };
+  struct slot {
+    slot() : state(EMPTY), id(0) {}
+    int state;
+    key_t id;
+    V v;
+  };
+  struct shard {
+    pthread_rwlock_t l;
+    std::vector<slot> slots; // size is a power of two
+    unsigned long long used; // FULL slots
+    unsigned long long dead; // DELETED slots
+  };
+
+  int nshards_;
+  shard *shards_;
+
+  shard &shard_of(unsigned long long h) { return shards_[(h >> 40) % nshards_]; }
+  long find(shard &s, key_t id, unsigned long long h);
+  long insert_pos(shard &s, key_t id, unsigned long long h);
+  void grow(shard &s);
+
+  extent_table(const extent_table &);
+  extent_table &operator=(const extent_table &);
+};
+
+// the value kept per extent by extent_server: data and attributes live
+// in one entry so every operation is a single lookup
+struct extent_entry {
+  std::string data;
+  extent_protocol::attr a;
+};
+
+typedef extent_table<extent_entry> extent_store;
+
+template<class V>
+extent_table<V>::extent_table(int nshards) : nshards_(nshards)
+{
+  assert(nshards_ > 0);
+  shards_ = new shard[nshards_];
+  for (int i = 0; i < nshards_; i++) {
+    assert(pthread_rwlock_init(&shards_[i].l, NULL) == 0);
+    shards_[i].slots.resize(16);
+    shards_[i].used = shards_[i].dead = 0;
+  }
+}
+
+template<class V>
+extent_table<V>::~extent_table()
+{
+  for (int i = 0; i < nshards_; i++)
+    assert(pthread_rwlock_destroy(&shards_[i].l) == 0);
+  delete [] shards_;
+}
+
+template<class V> unsigned long long
+extent_table<V>::hash(key_t id)
+{
+  return fmix64(id);
+}
+
+// index of id's slot, or -1. caller holds the shard lock.
+template<class V> long
+extent_table<V>::find(shard &s, key_t id, unsigned long long h)
+{
+  unsigned long mask = s.slots.size() - 1;
+  for (unsigned long i = h & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+    slot &sl = s.slots[i];
+    if (sl.state == EMPTY)
+      return -1;
+    if (sl.state == FULL && sl.id == id)
+      return i;
+  }
+  return -1;
+}
+
+// index where id lives or should be inserted. caller holds the shard
+// write lock and has made room.
+template<class V> long
+extent_table<V>::insert_pos(shard &s, key_t id, unsigned long long h)
+{
+  unsigned long mask = s.slots.size() - 1;
+  long tomb = -1;
+  for (unsigned long i = h & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+    slot &sl = s.slots[i];
+    if (sl.state == EMPTY)
+      return tomb >= 0 ? tomb : (long) i;
+    if (sl.state == DELETED) {
+      if (tomb < 0)
+        tomb = i;
+    } else if (sl.id == id) {
+      return i;
+    }
+  }
+  assert(tomb >= 0);
+  return tomb;
+}
+
+// rehash once live plus deleted slots pass 3/4 of the shard; doubles
+// the shard only when it is mostly live, otherwise just sweeps the
+// tombstones out
+template<class V> void
+extent_table<V>::grow(shard &s)
+{
+  if ((s.used + s.dead + 1) * 4 < s.slots.size() * 3)
+    return;
+  unsigned long n = s.slots.size();
+  if ((s.used + 1) * 2 >= n)
+    n *= 2;
+  std::vector<slot> old(n);
+  old.swap(s.slots);
+  s.dead = 0;
+  unsigned long mask = n - 1;
+  for (unsigned long j = 0; j < old.size(); j++) {
+    if (old[j].state != FULL)
+      continue;
+    unsigned long i = hash(old[j].id) & mask;
+    while (s.slots[i].state == FULL)
+      i = (i + 1) & mask;
+    slot &sl = s.slots[i];
+    sl.state = FULL;
+    sl.id = old[j].id;
+    std::swap(sl.v, old[j].v);
+  }
+}
+
+template<class V> bool
+extent_table<V>::get(key_t id, V &v)
+{
+  unsigned long long h = hash(id);
+  shard &s = shard_of(h);
+  assert(pthread_rwlock_rdlock(&s.l) == 0);
+  long i = find(s, id, h);
+  if (i >= 0)
+    v = s.slots[i].v;
+  assert(pthread_rwlock_unlock(&s.l) == 0);
+  return i >= 0;
+}
+
+template<class V> template<class F> bool
+extent_table<V>::peek(key_t id, F &f)
+{
+  unsigned long long h = hash(id);
+  shard &s = shard_of(h);
+  assert(pthread_rwlock_rdlock(&s.l) == 0);
+  long i = find(s, id, h);
+  if (i >= 0)
+    f((const V &) s.slots[i].v);
+  assert(pthread_rwlock_unlock(&s.l) == 0);
+  return i >= 0;
+}
+
+template<class V> bool
+extent_table<V>::has(key_t id)
+{
+  unsigned long long h = hash(id);
+  shard &s = shard_of(h);
+  assert(pthread_rwlock_rdlock(&s.l) == 0);
+  long i = find(s, id, h);
+  assert(pthread_rwlock_unlock(&s.l) == 0);
+  return i >= 0;
+}
+
+template<class V> void
+extent_table<V>::put(key_t id, const V &v)
+{
+  unsigned long long h = hash(id);
+  shard &s = shard_of(h);
+  assert(pthread_rwlock_wrlock(&s.l) == 0);
+  grow(s);
+  slot &sl = s.slots[insert_pos(s, id, h)];
+  if (sl.state != FULL) {
+    if (sl.state == DELETED)
+      s.dead--;
+    s.used++;
+    sl.state = FULL;
+    sl.id = id;
+  }
+  sl.v = v;
+  assert(pthread_rwlock_unlock(&s.l) == 0);
+}
+
+template<class V> bool
+extent_table<V>::remove(key_t id, V *old)
+{
+  unsigned long long h = hash(id);
+  shard &s = shard_of(h);
+  assert(pthread_rwlock_wrlock(&s.l) == 0);
+  long i = find(s, id, h);
+  if (i >= 0) {
+    slot &sl = s.slots[i];
+    if (old)
+      std::swap(*old, sl.v);
+    sl.v = V();
+    sl.state = DELETED;
+    s.used--;
+    s.dead++;
+  }
+  assert(pthread_rwlock_unlock(&s.l) == 0);
+  return i >= 0;
+}
+
+template<class V> template<class F> bool
+extent_table<V>::erase(key_t id, F &f)
+{
+  unsigned long long h = hash(id);
+  shard &s = shard_of(h);
+  assert(pthread_rwlock_wrlock(&s.l) == 0);
+  long i = find(s, id, h);
+  if (i >= 0) {
+    slot &sl = s.slots[i];
+    f(sl.v);
+    sl.v = V();
+    sl.state = DELETED;
+    s.used--;
+    s.dead++;
+  }
+  assert(pthread_rwlock_unlock(&s.l) == 0);
+  return i >= 0;
+}
+
+template<class V> template<class F> bool
+extent_table<V>::update(key_t id, F &f)
+{
+  unsigned long long h = hash(id);
+  shard &s = shard_of(h);
+  assert(pthread_rwlock_wrlock(&s.l) == 0);
+  long i = find(s, id, h);
+  bool stored;
+  if (i >= 0) {
+    stored = f(s.slots[i].v, true);
+  } else {
+    V v = V();
+    stored = f(v, false);
+    if (stored) {
+      grow(s);
+      slot &sl = s.slots[insert_pos(s, id, h)];
+      if (sl.state == DELETED)
+        s.dead--;
+      s.used++;
+      sl.state = FULL;
+      sl.id = id;
+      std::swap(sl.v, v);
+    }
+  }
+  assert(pthread_rwlock_unlock(&s.l) == 0);
+  return stored;
+}
+
+template<class V> void
+extent_table<V>::keys(std::vector<key_t> &ids)
+{
+  ids.clear();
+  for (int k = 0; k < nshards_; k++) {
+    shard &s = shards_[k];
+    assert(pthread_rwlock_rdlock(&s.l) == 0);
+    for (unsigned long i = 0; i < s.slots.size(); i++) {
+      if (s.slots[i].state == FULL)
+        ids.push_back(s.slots[i].id);
+    }
+    assert(pthread_rwlock_unlock(&s.l) == 0);
+  }
+}
+
+template<class V> unsigned long long
+extent_table<V>::size()
+{
+  unsigned long long n = 0;
+  for (int k = 0; k < nshards_; k++) {
+    assert(pthread_rwlock_rdlock(&shards_[k].l) == 0);
+    n += shards_[k].used;
+    assert(pthread_rwlock_unlock(&shards_[k].l) == 0);
+  }
+  return n;
+}
+
+template<class V> unsigned long long
+extent_table<V>::footprint()
+{
+  unsigned long long n = nshards_ * sizeof(shard);
+  for (int k = 0; k < nshards_; k++) {
+    assert(pthread_rwlock_rdlock(&shards_[k].l) == 0);
+    n += shards_[k].slots.capacity() * sizeof(slot);
+    assert(pthread_rwlock_unlock(&shards_[k].l) == 0);
+  }
+  return n;
+}
+
+#endif
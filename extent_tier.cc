@@ -0,0 +1,396 @@
+// memory-budgeted extent backend that spills to disk
+
+#include "extent_tier.h"
+#include "rpc/slock.h"
+#include <stdio.h>
+
+// what a resident extent is charged beyond its data: the slot header
+// and index entry of the in-memory backend
+#define OVERHEAD 64
+
+static unsigned long long
+cost(unsigned int size)
+{
+  return size + OVERHEAD;
+}
+
+tier_backend::tier_backend(extent_backend *hot, extent_backend *cold,
+                           unsigned long long budget)
+  : hot_(hot), cold_(cold), budget_(budget), resident_(0), a1in_bytes_(0),
+    hits_(0), misses_(0), ghosthits_(0), evictions_(0), spills_(0),
+    spillfails_(0)
+{
+  for (int i = 0; i < NSTRIPES; i++)
+    assert(pthread_mutex_init(&stripes_[i], NULL) == 0);
+  assert(pthread_mutex_init(&m_, NULL) == 0);
+
+  // whatever hot starts out with, say from a snapshot
+  std::vector<extent_protocol::extentid_t> ids;
+  hot_->ids(ids);
+  for (unsigned int i = 0; i < ids.size(); i++) {
+    extent_protocol::attr a;
+    if (hot_->getattr(ids[i], a) != extent_protocol::OK)
+      continue;
+    ScopedLock ml(&m_);
+    entry &en = entries_[ids[i]];
+    en.where = COLD;
+    en.size = a.size;
+    en.incold = false;
+    admit(ids[i], en);
+  }
+  evict();
+}
+
+tier_backend::~tier_backend()
+{
+  delete hot_;
+  delete cold_;
+}
+
+pthread_mutex_t *
+tier_backend::stripe(extent_protocol::extentid_t id)
+{
+  return &stripes_[extent_store::hash(id) % NSTRIPES];
+}
+
+std::list<extent_protocol::extentid_t> *
+tier_backend::list_of(int where)
+{
+  switch (where) {
+  case A1IN: return &a1in_;
+  case AM: return &am_;
+  case DIRS: return &dirs_;
+  case A1OUT: return &a1out_;
+  default: return NULL;
+  }
+}
+
+// the calls below are made with m_ held
+void
+tier_backend::unlist(entry &en)
+{
+  std::list<extent_protocol::extentid_t> *l = list_of(en.where);
+  if (l != NULL)
+    l->erase(en.it);
+  if (en.where == A1IN)
+    a1in_bytes_ -= cost(en.size);
+}
+
+void
+tier_backend::enlist(extent_protocol::extentid_t id, entry &en, int where)
+{
+  en.where = where;
+  std::list<extent_protocol::extentid_t> *l = list_of(where);
+  if (l != NULL) {
+    l->push_front(id);
+    en.it = l->begin();
+  }
+  if (where == A1IN)
+    a1in_bytes_ += cost(en.size);
+}
+
+// en has just been brought into memory
+void
+tier_backend::admit(extent_protocol::extentid_t id, entry &en)
+{
+  int where = A1IN;
+  if (extent_protocol::is_dir(id)) {
+    where = DIRS;
+  } else if (en.where == A1OUT) {
+    where = AM;
+    ghosthits_++;
+  }
+  unlist(en);
+  enlist(id, en, where);
+  resident_ += cost(en.size);
+}
+
+void
+tier_backend::touch(extent_protocol::extentid_t id)
+{
+  ScopedLock ml(&m_);
+  hits_++;
+  std::map<extent_protocol::extentid_t, entry>::iterator i = entries_.find(id);
+  if (i == entries_.end())
+    return;
+  entry &en = i->second;
+  if (en.where == AM || en.where == DIRS) {
+    std::list<extent_protocol::extentid_t> *l = list_of(en.where);
+    l->splice(l->begin(), *l, en.it);
+  }
+}
+
+// bring an extent that missed in memory back from the cold backend
+int
+tier_backend::fault(extent_protocol::extentid_t id, extent_entry &e)
+{
+  {
+    ScopedLock sl(stripe(id));
+    int r = hot_->get(id, e);
+    if (r == extent_protocol::OK) {
+      touch(id);
+      return r;
+    }
+    {
+      ScopedLock ml(&m_);
+      std::map<extent_protocol::extentid_t, entry>::iterator i =
+        entries_.find(id);
+      if (i == entries_.end() || resident(i->second.where))
+        return extent_protocol::NOENT;
+    }
+    r = cold_->get(id, e);
+    if (r != extent_protocol::OK)
+      return r;
+    r = hot_->put(id, e);
+    if (r != extent_protocol::OK)
+      return r;
+    ScopedLock ml(&m_);
+    entry &en = entries_[id];
+    misses_++;
+    en.incold = true;
+    admit(id, en);
+  }
+  evict();
+  return extent_protocol::OK;
+}
+
+int
+tier_backend::get(extent_protocol::extentid_t id, extent_entry &e)
+{
+  int r = hot_->get(id, e);
+  if (r == extent_protocol::OK)
+    touch(id);
+  else if (r == extent_protocol::NOENT)
+    r = fault(id, e);
+  return r;
+}
+
+int
+tier_backend::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
+{
+  int r = hot_->getattr(id, a);
+  if (r == extent_protocol::OK) {
+    touch(id);
+  } else if (r == extent_protocol::NOENT) {
+    extent_entry e;
+    r = fault(id, e);
+    if (r == extent_protocol::OK)
+      a = e.a;
+  }
+  return r;
+}
+
+int
+tier_backend::read(extent_protocol::extentid_t id, unsigned int off,
+                   unsigned int len, std::string &buf)
+{
+  int r = hot_->read(id, off, len, buf);
+  if (r == extent_protocol::OK) {
+    touch(id);
+  } else if (r == extent_protocol::NOENT) {
+    extent_entry e;
+    r = fault(id, e);
+    if (r == extent_protocol::OK) {
+      if (off < e.data.size())
+        buf = e.data.substr(off, len);
+      else
+        buf.clear();
+    }
+  }
+  return r;
+}
+
+int
+tier_backend::put(extent_protocol::extentid_t id, const extent_entry &e)
+{
+  {
+    ScopedLock sl(stripe(id));
+    int r = hot_->put(id, e);
+    if (r != extent_protocol::OK)
+      return r;
+    bool stale;
+    {
+      ScopedLock ml(&m_);
+      std::map<extent_protocol::extentid_t, entry>::iterator i =
+        entries_.find(id);
+      if (i == entries_.end()) {
+        entry en;
+        en.where = COLD;
+        en.size = 0;
+        en.incold = false;
+        i = entries_.insert(std::make_pair(id, en)).first;
+      }
+      entry &en = i->second;
+      stale = en.incold;
+      en.incold = false;
+      if (resident(en.where)) {
+        resident_ += cost(e.data.size());
+        resident_ -= cost(en.size);
+        if (en.where == A1IN) {
+          a1in_bytes_ += cost(e.data.size());
+          a1in_bytes_ -= cost(en.size);
+        }
+        en.size = e.data.size();
+        if (en.where == AM || en.where == DIRS) {
+          std::list<extent_protocol::extentid_t> *l = list_of(en.where);
+          l->splice(l->begin(), *l, en.it);
+        }
+      } else {
+        en.size = e.data.size();
+        admit(id, en);
+      }
+    }
+    if (stale)
+      cold_->remove(id);
+  }
+  evict();
+  return extent_protocol::OK;
+}
+
+int
+tier_backend::remove(extent_protocol::extentid_t id)
+{
+  ScopedLock sl(stripe(id));
+  bool inmem, incold;
+  {
+    ScopedLock ml(&m_);
+    std::map<extent_protocol::extentid_t, entry>::iterator i =
+      entries_.find(id);
+    if (i == entries_.end())
+      return extent_protocol::NOENT;
+    entry &en = i->second;
+    unlist(en);
+    inmem = resident(en.where);
+    incold = en.incold;
+    if (inmem)
+      resident_ -= cost(en.size);
+    entries_.erase(i);
+  }
+  if (inmem)
+    hot_->remove(id);
+  if (incold)
+    cold_->remove(id);
+  return extent_protocol::OK;
+}
+
+void
+tier_backend::ids(std::vector<extent_protocol::extentid_t> &ids)
+{
+  ScopedLock ml(&m_);
+  ids.clear();
+  std::map<extent_protocol::extentid_t, entry>::iterator i;
+  for (i = entries_.begin(); i != entries_.end(); i++)
+    ids.push_back(i->first);
+}
+
+// move one extent out to the cold backend if memory is over budget.
+// the victim is the a1in tail while a1in holds more than its quarter
+// of the budget, else the am tail, and a directory only if nothing
+// else is in memory. returns false when there is nothing (more) to do.
+bool
+tier_backend::evict_one()
+{
+  extent_protocol::extentid_t id;
+  int from;
+  {
+    ScopedLock ml(&m_);
+    if (resident_ <= budget_)
+      return false;
+    std::list<extent_protocol::extentid_t> *l;
+    if (!a1in_.empty() && (a1in_bytes_ > budget_ / 4 || am_.empty()))
+      l = &a1in_;
+    else if (!am_.empty())
+      l = &am_;
+    else if (!dirs_.empty())
+      l = &dirs_;
+    else
+      return false;
+    id = l->back();
+    entry &en = entries_[id];
+    from = en.where;
+    unlist(en);
+    en.where = EVICTING;
+  }
+
+  ScopedLock sl(stripe(id));
+  bool incold;
+  {
+    ScopedLock ml(&m_);
+    std::map<extent_protocol::extentid_t, entry>::iterator i =
+      entries_.find(id);
+    // removed, or taken back into a list, while we waited for the stripe
+    if (i == entries_.end() || i->second.where != EVICTING)
+      return true;
+    incold = i->second.incold;
+  }
+  extent_entry e;
+  int r = hot_->get(id, e);
+  if (r == extent_protocol::OK && !incold)
+    r = cold_->put(id, e);
+  if (r == extent_protocol::OK)
+    r = hot_->remove(id);
+
+  ScopedLock ml(&m_);
+  entry &en = entries_[id];
+  if (r != extent_protocol::OK) {
+    if (spillfails_++ == 0)
+      fprintf(stderr, "tier_backend: cannot spill extent %llu\n", id);
+    enlist(id, en, from);
+    return false;
+  }
+  evictions_++;
+  if (!incold)
+    spills_++;
+  en.incold = true;
+  resident_ -= cost(en.size);
+  if (from != A1IN) {
+    enlist(id, en, COLD);
+    return true;
+  }
+  // remember a1in's evictions for twice as many extents as are in
+  // memory, so one touched again soon goes to am. 2Q keeps half that,
+  // but here every id has an entry anyway and a ghost costs a list
+  // node, and the wider window lets a working set somewhat bigger than
+  // a1in earn its place in am.
+  enlist(id, en, A1OUT);
+  while (a1out_.size() > 2 * (a1in_.size() + am_.size() + dirs_.size()) + 1) {
+    entries_[a1out_.back()].where = COLD;
+    a1out_.pop_back();
+  }
+  return true;
+}
+
+void
+tier_backend::evict()
+{
+  while (evict_one())
+    ;
+}
+
+void
+tier_backend::stats(std::string &out)
+{
+  char buf[1024];
+  {
+    ScopedLock ml(&m_);
+    unsigned long long lookups = hits_ + misses_;
+    snprintf(buf, sizeof(buf),
+        "budget %llu\n"
+        "resident %llu (%llu extents of %llu)\n"
+        "  a1in %llu, am %llu, directories %llu, a1out %llu\n"
+        "hits %llu, misses %llu (%.1f%% hit), a1out hits %llu\n"
+        "evictions %llu, spilled %llu, spill failures %llu\n",
+        budget_, resident_,
+        (unsigned long long) (a1in_.size() + am_.size() + dirs_.size()),
+        (unsigned long long) entries_.size(),
+        (unsigned long long) a1in_.size(), (unsigned long long) am_.size(),
+        (unsigned long long) dirs_.size(), (unsigned long long) a1out_.size(),
+        hits_, misses_, lookups ? 100.0 * hits_ / lookups : 0.0, ghosthits_,
+        evictions_, spills_, spillfails_);
+  }
+  std::string hot;
+  hot_->stats(hot);
+  out = buf;
+  if (!hot.empty())
+    out += "memory:\n" + hot;
+}
@@ -0,0 +1,78 @@
+// memory-budgeted extent backend that spills to disk
+
+#ifndef extent_tier_h
+#define extent_tier_h
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include "extent_backend.h"
+
+// keeps at most budget bytes of extents in an in-memory backend (hot)
+// and evicts the rest to a disk backend (cold), faulting them back in
+// when they are next read or written. eviction follows 2Q: an extent
+// first comes in on a FIFO (a1in); only one that is touched again
+// while it is still remembered after eviction (a1out, ids only) joins
+// the LRU of frequently used extents (am). a scan therefore flushes
+// a1in, not the working set in am. a1in holds about a quarter of the
+// budget. directory extents sit on their own LRU and are evicted only
+// when no file block is left to go.
+//
+// the cold copy of an extent faulted back in is kept until the extent
+// changes, so evicting it again unchanged costs no write. the cold
+// backend is a cache: it is created empty and nothing in it outlives
+// the tier.
+class tier_backend : public extent_backend {
+ public:
+  tier_backend(extent_backend *hot, extent_backend *cold,
+               unsigned long long budget);
+  ~tier_backend();
+
+  int get(extent_protocol::extentid_t id, extent_entry &e);
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int put(extent_protocol::extentid_t id, const extent_entry &e);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &ids);
+  int read(extent_protocol::extentid_t id, unsigned int off,
+           unsigned int len, std::string &buf);
+  void stats(std::string &out);
+
+ private:
+  enum { A1IN, AM, DIRS, EVICTING, A1OUT, COLD };
+  struct entry {
+    int where;
+    std::list<extent_protocol::extentid_t>::iterator it; // on where's list
+    unsigned int size;
+    bool incold; // the cold backend has the current contents
+  };
+
+  extent_backend *hot_, *cold_;
+  const unsigned long long budget_;
+
+  // one id at a time moves between the tiers
+  enum { NSTRIPES = 64 };
+  pthread_mutex_t stripes_[NSTRIPES];
+  pthread_mutex_t *stripe(extent_protocol::extentid_t id);
+
+  // the policy state and counters
+  pthread_mutex_t m_;
+  std::map<extent_protocol::extentid_t, entry> entries_;
+  std::list<extent_protocol::extentid_t> a1in_, am_, dirs_, a1out_;
+  unsigned long long resident_, a1in_bytes_;
+  unsigned long long hits_, misses_, ghosthits_, evictions_, spills_;
+  unsigned long long spillfails_;
+
+  static bool resident(int where) { return where != A1OUT && where != COLD; }
+  std::list<extent_protocol::extentid_t> *list_of(int where);
+  void unlist(entry &en);
+  void enlist(extent_protocol::extentid_t id, entry &en, int where);
+  void admit(extent_protocol::extentid_t id, entry &en);
+  void touch(extent_protocol::extentid_t id);
+  int fault(extent_protocol::extentid_t id, extent_entry &e);
+  bool evict_one();
+  void evict();
+};
+
+#endif
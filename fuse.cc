@@ -40,18 +40,13 @@ getattr(yfs_client::inum inum, struct stat &st)
      if(ret != yfs_client::OK)
        return ret;
 
-     size_t sz;
-     ret = yfs->getsize(inum, sz);
-     if(ret != yfs_client::OK)
-       return ret;
-
      st.st_mode = S_IFREG | 0666;
      st.st_nlink = 1;
      st.st_atime = info.atime;
      st.st_mtime = info.mtime;
      st.st_ctime = info.ctime;
-     st.st_size = sz;
-     printf("   getattr -> %lu\n", sz);
+     st.st_size = info.size;
+     printf("   getattr -> %llu\n", info.size);
    } else {
      yfs_client::dirinfo info;
      ret = yfs->getdir(inum, info);
@@ -117,7 +112,7 @@ fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
   yfs_client::status ret = yfs->read(ino, size, off, out);
 
   if (ret == yfs_client::OK)
-    fuse_reply_buf(req, out.data(), size);
+    fuse_reply_buf(req, out.data(), out.size());
   else
     fuse_reply_err(req, ENOSYS);
 
@@ -318,7 +313,7 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
   printf("YFS returned %d\n", ret);
   if(ret != yfs_client::OK)
   {    
-    fuse_reply_err(req, ENOSYS);
+    fuse_reply_err(req, ret == yfs_client::EXIST ? EEXIST : ENOSYS);
     return;
   }
   
@@ -374,6 +369,55 @@ fuseserver_statfs(fuse_req_t req)
   fuse_reply_statfs(req, &buf);
 }
 
+// this fuse version has no ioctl or copy_file_range, so a clone is
+// asked for with an extended attribute: setting user.yfs.clone on a
+// file to another file's inode number makes it a copy of that file,
+// made on the extent server:
+//   touch b && setfattr -n user.yfs.clone -v $(stat -c %i a) b
+// likewise user.yfs.addshard, set on any file to an extent server's
+// host:port, takes that server on as one more shard:
+//   setfattr -n user.yfs.addshard -v 127.0.0.1:5000 .
+void
+#ifdef __APPLE__
+fuseserver_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                    const char *value, size_t size, int flags,
+                    uint32_t position)
+#else
+fuseserver_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                    const char *value, size_t size, int flags)
+#endif
+{
+  printf("fuseserver_setxattr(%lu, %s)\n", ino, name);
+  if (strcmp(name, "user.yfs.addshard") == 0) {
+    yfs_client::status r = yfs->add_shard(std::string(value, size));
+    if (r == yfs_client::OK)
+      fuse_reply_err(req, 0);
+    else if (r == yfs_client::RPCERR)
+      fuse_reply_err(req, EHOSTUNREACH);
+    else
+      fuse_reply_err(req, EBUSY);
+    return;
+  }
+  if (strcmp(name, "user.yfs.clone") != 0) {
+    fuse_reply_err(req, ENOTSUP);
+    return;
+  }
+  std::string v(value, size);
+  char *end;
+  unsigned long long src = strtoull(v.c_str(), &end, 10);
+  if (v.empty() || *end != '\0') {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  yfs_client::status r = yfs->clone(src, ino);
+  if (r == yfs_client::OK)
+    fuse_reply_err(req, 0);
+  else if (r == yfs_client::NOENT)
+    fuse_reply_err(req, ENOENT);
+  else
+    fuse_reply_err(req, EIO);
+}
+
 struct fuse_lowlevel_ops fuseserver_oper;
 
 int
@@ -389,7 +433,7 @@ main(int argc, char *argv[])
   setvbuf(stdout, NULL, _IONBF, 0);
 
   if(argc != 4){
-    fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server> <port-lock-server>\n");
+    fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server[,port...]> <port-lock-server>\n");
     exit(1);
   }
   mountpoint = argv[1];
@@ -413,6 +457,7 @@ main(int argc, char *argv[])
   fuseserver_oper.unlink     = fuseserver_unlink;
   fuseserver_oper.mkdir      = fuseserver_mkdir;
   fuseserver_oper.rmdir      = fuseserver_rmdir;
+  fuseserver_oper.setxattr   = fuseserver_setxattr;
 
   const char *fuse_argv[20];
   int fuse_argc = 0;
@@ -4,18 +4,34 @@
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <string.h>
 
 #include "method_thread.h"
 #include "connection.h"
 #include "slock.h"
 #include "pollmgr.h"
 #include "jsl_log.h"
+#include "gettime.h"
 
 #define MAX_PDU (10<<20) //maximum PDF is 10M
+#define RBUF_SZ (64<<10) //per-connection receive buffer
 
+//heartbeat frames carry a single opcode byte after the size word, so
+//they can never be confused with an RPC whose header is much larger
+#define HB_PDU_SZ ((int)(sizeof(int)+1))
+#define HB_PING 1
+#define HB_PONG 2
+
+static int
+elapsed_ms(const struct timespec &start, const struct timespec &end)
+{
+	return (end.tv_sec - start.tv_sec)*1000 + 
+		(end.tv_nsec - start.tv_nsec)/1000000;
+}
 
 connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+: mgr_(m1), fd_(f1), dead_(false), rbuf_(NULL), rbuf_len_(0), waiters_(0), 
+	refno_(1),lossy_(l1), hb_interval_(0), hb_maxmiss_(0), hb_missed_(0)
 {
 
 	int flags = fcntl(fd_, F_GETFL, NULL);
@@ -28,6 +44,9 @@ connection::connection(chanmgr *m1, int f1, int l1)
 	assert(pthread_cond_init(&send_wait_,0)==0);
 	assert(pthread_cond_init(&send_complete_,0)==0);
 
+	rbuf_ = (char *)malloc(RBUF_SZ);
+	assert(rbuf_);
+
 	PollMgr::Instance()->add_callback(fd_, CB_RDONLY, this);
 }
 
@@ -40,6 +59,7 @@ connection::~connection()
 	assert(pthread_cond_destroy(&send_complete_) == 0);
 	if (rpdu_.buf)
 		free(rpdu_.buf);
+	free(rbuf_);
 	assert(!wpdu_.buf);
 	close(fd_);
 }
@@ -51,6 +71,14 @@ connection::incref()
 	refno_++;
 }
 
+bool
+connection::peer(struct sockaddr_in *sin)
+{
+	socklen_t len = sizeof(*sin);
+	return getpeername(fd_, (struct sockaddr *)sin, &len) == 0 &&
+		sin->sin_family == AF_INET;
+}
+
 bool
 connection::isdead()
 {
@@ -66,6 +94,9 @@ connection::closeconn()
 		if (!dead_) {
 			dead_ = true;
 			shutdown(fd_,SHUT_RDWR);
+			//senders stuck behind a peer that stopped reading
+			pthread_cond_broadcast(&send_complete_);
+			pthread_cond_broadcast(&send_wait_);
 		}else{
 			return;
 		}
@@ -101,6 +132,86 @@ connection::ref()
 	return refno_;
 }
 
+void
+connection::set_heartbeat(int interval, int maxmiss)
+{
+	{
+		ScopedLock ml(&m_);
+		if (hb_interval_ || interval <= 0)
+			return;
+		hb_interval_ = interval;
+		hb_maxmiss_ = maxmiss > 0 ? maxmiss : 1;
+		hb_missed_ = 0;
+		clock_gettime(CLOCK_REALTIME, &hb_last_);
+	}
+	HeartbeatMgr::Instance()->add(this, interval);
+}
+
+void
+connection::stop_heartbeat()
+{
+	{
+		ScopedLock ml(&m_);
+		if (!hb_interval_)
+			return;
+	}
+	HeartbeatMgr::Instance()->remove(this);
+}
+
+//called by the heartbeat thread every tick.
+//returns false once the peer has missed too many heartbeats
+bool
+connection::heartbeat(const struct timespec &now)
+{
+	ScopedLock ml(&m_);
+	if (dead_)
+		return true;
+	if (elapsed_ms(hb_last_, now) < hb_interval_)
+		return true;
+	if (hb_missed_ >= hb_maxmiss_) {
+		jsl_log(JSL_DBG_1, "connection::heartbeat fd_ %d peer missed %d heartbeats\n",
+				fd_, hb_missed_);
+		return false;
+	}
+	hb_missed_++;
+	hb_last_ = now;
+	send_hb(HB_PING);
+	return true;
+}
+
+void
+connection::heartbeat_failed()
+{
+	closeconn();
+	mgr_->conn_dead(this);
+}
+
+//assumes m_ is held. never blocks: if a pdu is being written, the
+//heartbeat is simply skipped since the peer will be busy reading it
+void
+connection::send_hb(char op)
+{
+	if (dead_ || wpdu_.buf)
+		return;
+	hb_pdu_[sizeof(int)] = op;
+	wpdu_.buf = hb_pdu_;
+	wpdu_.sz = HB_PDU_SZ;
+	wpdu_.solong = 0;
+	if (!writepdu()) {
+		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
+		dead_ = true;
+		pthread_cond_broadcast(&send_complete_);
+	} else if (wpdu_.solong < wpdu_.sz) {
+		//write_cb finishes the frame and releases wpdu_
+		PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
+		return;
+	}
+	wpdu_.solong = wpdu_.sz = 0;
+	wpdu_.buf = NULL;
+	if (waiters_ > 0)
+		pthread_cond_broadcast(&send_wait_);
+}
+
 bool
 connection::send(char *b, int sz)
 {
@@ -152,8 +263,11 @@ void
 connection::write_cb(int s)
 {
 	ScopedLock ml(&m_);
-	assert(!dead_);
 	assert(fd_ == s);
+	if (dead_) {
+		//closeconn() raced with us, block_remove_fd will clean up
+		return;
+	}
 	if (wpdu_.sz == 0) {
 		PollMgr::Instance()->del_callback(fd_,CB_WRONLY);
 		return;
@@ -166,6 +280,14 @@ connection::write_cb(int s)
 		if (wpdu_.solong < wpdu_.sz) {
 			return;
 		}
+		if (wpdu_.buf == hb_pdu_) {
+			//heartbeat frames have no sender waiting for them
+			wpdu_.solong = wpdu_.sz = 0;
+			wpdu_.buf = NULL;
+			if (waiters_ > 0)
+				pthread_cond_broadcast(&send_wait_);
+			return;
+		}
 	} 
 	pthread_cond_signal(&send_complete_);
 }
@@ -181,7 +303,15 @@ connection::read_cb(int s)
 	}
 
 	bool succ = true;
-	if (!rpdu_.buf || rpdu_.solong < rpdu_.sz) {
+	if (rpdu_.buf && rpdu_.solong == rpdu_.sz) {
+		//chanmgr turned this pdu down last time, offer it again
+		//before reading anything more
+		if (!deliver()) 
+			return;
+	} 
+	if (rpdu_.buf) {
+		succ = readbig();
+	} else {
 		succ = readpdu();
 	}
 
@@ -189,15 +319,68 @@ connection::read_cb(int s)
 		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
 		dead_ = true;
 		pthread_cond_signal(&send_complete_);
+		return;
 	}
 
-	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
-		if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
-			//chanmgr has successfully consumed the pdu
-			rpdu_.buf = NULL;
-			rpdu_.sz = rpdu_.solong = 0;
-		}
+	if (hb_interval_) {
+		//any traffic from the peer proves it is alive
+		clock_gettime(CLOCK_REALTIME, &hb_last_);
+		hb_missed_ = 0;
+	}
+
+	if (rpdu_.buf && rpdu_.solong == rpdu_.sz) 
+		deliver();
+}
+
+//offer again the pdus chanmgr turned down, along with those read in
+//behind them. the socket may have nothing more to say, so the next
+//read_cb() could be a long way off.
+void
+connection::redeliver()
+{
+	ScopedLock ml(&m_);
+	if (dead_)
+		return;
+	if (rpdu_.buf) {
+		if (rpdu_.solong < rpdu_.sz || !deliver())
+			return;
+	}
+	if (!parse()) {
+		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
+		dead_ = true;
+		pthread_cond_signal(&send_complete_);
+	}
+}
+
+//hand the complete pdu in rpdu_ to chanmgr. returns false and keeps
+//it if chanmgr could not take it now.
+bool
+connection::deliver()
+{
+	if (!mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz))
+		return false;
+	//chanmgr has successfully consumed the pdu
+	rpdu_.buf = NULL;
+	rpdu_.sz = rpdu_.solong = 0;
+	return true;
+}
+
+//receive the rest of a pdu too big for rbuf_ straight into its own
+//buffer
+bool
+connection::readbig()
+{
+	int n = read(fd_, rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
+	if (n < 0 && errno == EAGAIN)
+		return true;
+	if (n <= 0) {
+		free(rpdu_.buf);
+		rpdu_.buf = NULL;
+		rpdu_.sz = rpdu_.solong = 0;
+		return false;
 	}
+	rpdu_.solong += n;
+	return true;
 }
 
 bool
@@ -224,60 +407,73 @@ connection::writepdu()
 	return true;
 }
 
+//read whatever the socket holds into rbuf_ with a single read() and
+//hand up every complete pdu in it
 bool
 connection::readpdu()
 {
-	if (!rpdu_.sz) {
-		int sz, sz1;
-		int n = read(fd_, &sz1, sizeof(sz1));
-
-		if (n == 0) {
+	if (rbuf_len_ < RBUF_SZ) {
+		int n = read(fd_, rbuf_ + rbuf_len_, RBUF_SZ - rbuf_len_);
+		if (n == 0 || (n < 0 && errno != EAGAIN))
 			return false;
-		}
-
-		if (n < 0) {
-			assert(errno!=EAGAIN);
-			return false;
-		}
-
-		if (n >0 && n!= sizeof(sz)) {
-			jsl_log(JSL_DBG_OFF, "connection::readpdu short read of sz\n");
-			return false;
-		}
+		if (n > 0)
+			rbuf_len_ += n;
+	}
+	return parse();
+}
 
+//hand up the complete pdus in rbuf_ until chanmgr turns one down.
+//small pdus are copied out of rbuf_; the head of a pdu larger than
+//rbuf_ moves to rpdu_ and the rest of it is read straight into place
+//by readbig().
+bool
+connection::parse()
+{
+	int off = 0;
+	while (rbuf_len_ - off >= (int)sizeof(int)) {
+		int sz1, sz;
+		bcopy(rbuf_ + off, &sz1, sizeof(sz1));
 		sz = ntohl(sz1);
 
-		if (sz > MAX_PDU) {
+		if (sz > MAX_PDU || sz < (int)sizeof(sz)) {
 			char *tmpb = (char *)&sz1;
 			jsl_log(JSL_DBG_2, "connection::readpdu read pdu TOO BIG %d network order=%x %x %x %x %x\n", sz, 
 					sz1, tmpb[0],tmpb[1],tmpb[2],tmpb[3]);
 			return false;
 		}
 
+		int have = rbuf_len_ - off;
+		if (sz > have && sz <= RBUF_SZ) 
+			break; //wait for the rest of a small pdu
+
+		if (sz == HB_PDU_SZ) {
+			if (rbuf_[off + sizeof(int)] == HB_PING)
+				send_hb(HB_PONG);
+			off += sz;
+			continue;
+		}
+
 		rpdu_.sz = sz;
-		assert(rpdu_.buf == NULL);
-		rpdu_.buf = (char *)malloc(sz+sizeof(sz));
+		rpdu_.buf = (char *)malloc(sz);
 		assert(rpdu_.buf);
-		bcopy(&sz1,rpdu_.buf,sizeof(sz));
-		rpdu_.solong = sizeof(sz);
-	}
+		rpdu_.solong = sz < have ? sz : have;
+		bcopy(rbuf_ + off, rpdu_.buf, rpdu_.solong);
+		off += rpdu_.solong;
 
-	int n = read(fd_, rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
-	if (n <= 0) {
-		if (errno == EAGAIN)
-			return true;
-		if (rpdu_.buf)
-			free(rpdu_.buf);
-		rpdu_.buf = NULL;
-		rpdu_.sz = rpdu_.solong = 0;
-		return (errno == EAGAIN);
+		if (rpdu_.solong < rpdu_.sz || !deliver()) 
+			break;
 	}
-	rpdu_.solong += n;
+
+	rbuf_len_ -= off;
+	if (rbuf_len_ > 0 && off > 0)
+		memmove(rbuf_, rbuf_ + off, rbuf_len_);
 	return true;
 }
 
-tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest) 
-: mgr_(m1), lossy_(lossytest)
+tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest, int hb_interval,
+		int hb_maxmiss, int nlisteners) 
+: mgr_(m1), lossy_(lossytest), hb_interval_(hb_interval), 
+	hb_maxmiss_(hb_maxmiss), gc_next_(0)
 {
 
 	assert(pthread_mutex_init(&m_,NULL) == 0);
@@ -287,117 +483,128 @@ tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest)
 	sin.sin_family = AF_INET;
 	sin.sin_port = htons(port);
 
-	tcp_ = socket(AF_INET, SOCK_STREAM, 0);
-	if(tcp_ < 0){
-		perror("tcpsconn::tcpsconn accept_loop socket:");
-		assert(0);
-	}
+	if (nlisteners < 1)
+		nlisteners = 1;
+#ifndef SO_REUSEPORT
+	nlisteners = 1;
+#endif
 
-	int yes = 1;
-	setsockopt(tcp_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-	setsockopt(tcp_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	for (int i = 0; i < nlisteners; i++) {
+		int tcp = socket(AF_INET, SOCK_STREAM, 0);
+		if(tcp < 0){
+			perror("tcpsconn::tcpsconn accept_loop socket:");
+			assert(0);
+		}
 
-	if(bind(tcp_, (sockaddr *)&sin, sizeof(sin)) < 0){
-		perror("accept_loop tcp bind:");
-		assert(0);
-	}
+		int yes = 1;
+		setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+		//the kernel spreads incoming connections over the listeners
+		if (nlisteners > 1)
+			setsockopt(tcp, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+#endif
+
+		if(bind(tcp, (sockaddr *)&sin, sizeof(sin)) < 0){
+			perror("accept_loop tcp bind:");
+			assert(0);
+		}
 
-	if(listen(tcp_, 1000) < 0) {
-		perror("tcpsconn::tcpsconn listen:");
-		assert(0);
-	}
+		if(listen(tcp, 1000) < 0) {
+			perror("tcpsconn::tcpsconn listen:");
+			assert(0);
+		}
 
-	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d %d\n", port, 
-		sin.sin_port);
+		int flags = fcntl(tcp, F_GETFL, NULL);
+		flags |= O_NONBLOCK;
+		fcntl(tcp, F_SETFL, flags);
 
-	if (pipe(pipe_) < 0) {
-		perror("accept_loop pipe:");
-		assert(0);
+		tcp_.push_back(tcp);
 	}
 
-	int flags = fcntl(pipe_[0], F_GETFL, NULL);
-	flags |= O_NONBLOCK;
-	fcntl(pipe_[0], F_SETFL, flags);
+	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d %d (%d listeners)\n", 
+			port, sin.sin_port, nlisteners);
 
-	assert((th_ = method_thread(this, false, &tcpsconn::accept_conn)) != 0); 
+	for (unsigned int i = 0; i < tcp_.size(); i++)
+		PollMgr::Instance()->add_callback(tcp_[i], CB_RDONLY, this);
 }
 
 tcpsconn::~tcpsconn()
 {
-	assert(close(pipe_[1]) == 0);
-	assert(pthread_join(th_, NULL) == 0);
+	//after this no accept can be in progress
+	for (unsigned int i = 0; i < tcp_.size(); i++) {
+		PollMgr::Instance()->block_remove_fd(tcp_[i]);
+		close(tcp_[i]);
+	}
 
 	//close all the active connections
+	ScopedLock ml(&m_);
 	std::map<int, connection *>::iterator i;
 	for (i = conns_.begin(); i != conns_.end(); i++) {
+		i->second->stop_heartbeat();
 		i->second->closeconn();
 		i->second->decref();
 	}	
 }
 
+//called by PollMgr when a listening socket is readable: take every
+//connection waiting in its backlog
 void
-tcpsconn::process_accept()
-{
-	sockaddr_in sin;
-	socklen_t slen = sizeof(sin);
-	int s1 = accept(tcp_, (sockaddr *)&sin, &slen); 
-	if (s1 < 0) {
-		perror("tcpsconn::accept_conn error");
-		pthread_exit(NULL);
-	}
-
-	jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", 
-			s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-	connection *ch = new connection(mgr_, s1, lossy_);
-
-        // garbage collect all dead connections with refcount of 1
-        std::map<int, connection *>::iterator i;
-        for (i = conns_.begin(); i != conns_.end(); i++) {
-                if (i->second->isdead() && i->second->ref() == 1) {
-			jsl_log(JSL_DBG_2, "accept_loop garbage collected fd=%d\n",
-					i->second->channo());
-                        i->second->decref();
-                        conns_.erase(i);
-                }
-        }
+tcpsconn::read_cb(int tcp)
+{
+	ScopedLock ml(&m_);
+	int n = 0;
+	while (1) {
+		sockaddr_in sin;
+		socklen_t slen = sizeof(sin);
+		int s1 = accept(tcp, (sockaddr *)&sin, &slen); 
+		if (s1 < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				jsl_log(JSL_DBG_OFF, "tcpsconn::read_cb accept failure errno %d\n",
+						errno);
+			}
+			break;
+		}
+		if (s1 >= MAX_POLL_FDS) {
+			jsl_log(JSL_DBG_OFF, "tcpsconn::read_cb too many connections, "
+					"refusing fd=%d\n", s1);
+			close(s1);
+			continue;
+		}
 
-	conns_[ch->channo()] = ch;
+		jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", 
+				s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+		connection *ch = new connection(mgr_, s1, lossy_);
+		if (hb_interval_)
+			ch->set_heartbeat(hb_interval_, hb_maxmiss_);
+		conns_[ch->channo()] = ch;
+		n++;
+	}
+	gc(n + 1);
 }
 
+// garbage collect dead connections with refcount of 1, looking at
+// no more than max entries after where the last pass stopped, so
+// each accept pays for a bounded amount of the sweep
 void
-tcpsconn::accept_conn()
+tcpsconn::gc(int max)
 {
-	fd_set rfds;
-	int max_fd = pipe_[0] > tcp_ ? pipe_[0] : tcp_;
-
-	while (1) { 
-		FD_ZERO(&rfds);
-		FD_SET(pipe_[0], &rfds);
-		FD_SET(tcp_, &rfds);
-
-		int ret = select(max_fd+1, &rfds, NULL, NULL, NULL);
-
-		if (ret < 0) {
-			if (errno == EINTR) {
-				continue;
-			} else {
-				perror("accept_conn select:");
-				jsl_log(JSL_DBG_OFF, "tcpsconn::accept_conn failure errno %d\n",errno);
-				assert(0);
-	                }
-		}
-
-		if (FD_ISSET(pipe_[0], &rfds)) {
-			close(pipe_[0]);
-			close(tcp_);
-			return;
-		}
-		else if (FD_ISSET(tcp_, &rfds)) {
-			process_accept();
+	std::map<int, connection *>::iterator i = conns_.lower_bound(gc_next_);
+	for (int k = 0; k < max && !conns_.empty(); k++) {
+		if (i == conns_.end())
+			i = conns_.begin();
+		if (i->second->isdead() && i->second->ref() == 1) {
+			jsl_log(JSL_DBG_2, "accept_loop garbage collected fd=%d\n",
+					i->second->channo());
+			i->second->decref();
+			conns_.erase(i++);
 		} else {
-			assert(0);
+			i++;
 		}
 	}
+	gc_next_ = (i == conns_.end()) ? 0 : i->first;
 }
 
 connection *
@@ -418,3 +625,110 @@ connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
 }
 
 
+
+HeartbeatMgr *HeartbeatMgr::instance = NULL;
+static pthread_once_t hbmgr_is_initialized = PTHREAD_ONCE_INIT;
+
+void
+HeartbeatMgrInit()
+{
+	HeartbeatMgr::instance = new HeartbeatMgr();
+}
+
+HeartbeatMgr *
+HeartbeatMgr::Instance()
+{
+	pthread_once(&hbmgr_is_initialized, HeartbeatMgrInit);
+	return instance;
+}
+
+HeartbeatMgr::HeartbeatMgr() : tick_(0)
+{
+	assert(pthread_mutex_init(&m_, NULL) == 0);
+	assert(pthread_mutex_init(&cb_m_, NULL) == 0);
+	assert(pthread_cond_init(&changed_c_, NULL) == 0);
+	assert((th_ = method_thread(this, false, &HeartbeatMgr::wait_loop)) != 0);
+}
+
+HeartbeatMgr::~HeartbeatMgr()
+{
+	//never kill me!!!
+	assert(0);
+}
+
+void
+HeartbeatMgr::add(connection *c, int interval)
+{
+	ScopedLock ml(&m_);
+	if (conns_.count(c))
+		return;
+	c->incref();
+	conns_.insert(c);
+	if (!tick_ || interval < tick_) {
+		tick_ = interval;
+		pthread_cond_signal(&changed_c_);
+	}
+}
+
+void
+HeartbeatMgr::remove(connection *c)
+{
+	ScopedLock cl(&cb_m_);
+	ScopedLock ml(&m_);
+	if (conns_.erase(c))
+		c->decref();
+}
+
+void
+HeartbeatMgr::wait_loop()
+{
+	std::vector<connection *> snap;
+	struct timespec now, next;
+
+	while (1) {
+		{
+			ScopedLock ml(&m_);
+			if (!tick_) {
+				assert(pthread_cond_wait(&changed_c_, &m_) == 0);
+			} else {
+				clock_gettime(CLOCK_REALTIME, &now);
+				next.tv_sec = now.tv_sec + tick_/1000;
+				next.tv_nsec = now.tv_nsec + (tick_%1000)*1000000;
+				if (next.tv_nsec >= 1000000000) {
+					next.tv_sec++;
+					next.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&changed_c_, &m_, &next);
+			}
+			snap.clear();
+			std::set<connection *>::iterator i;
+			for (i = conns_.begin(); i != conns_.end(); i++) {
+				(*i)->incref();
+				snap.push_back(*i);
+			}
+		}
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		for (unsigned int i = 0; i < snap.size(); i++) {
+			connection *c = snap[i];
+			if (c->isdead()) {
+				//closed by its owner or by an i/o error; stop tracking it
+				ScopedLock ml(&m_);
+				if (conns_.erase(c))
+					c->decref();
+			} else if (!c->heartbeat(now)) {
+				ScopedLock cl(&cb_m_);
+				bool tracked;
+				{
+					ScopedLock ml(&m_);
+					tracked = conns_.erase(c) > 0;
+				}
+				if (tracked) {
+					c->heartbeat_failed();
+					c->decref();
+				}
+			}
+			c->decref();
+		}
+	}
+}
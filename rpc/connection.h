@@ -7,6 +7,9 @@
 #include <netinet/in.h>
 
 #include <map>
+#include <set>
+#include <vector>
+#include <time.h>
 
 #include "pollmgr.h"
 
@@ -14,7 +17,12 @@ class connection;
 
 class chanmgr {
 	public:
+		//false keeps the pdu with c, to be offered again by a
+		//c->redeliver() the chanmgr arranges once it has room
 		virtual bool got_pdu(connection *c, char *b, int sz) = 0;
+		//called by the heartbeat thread after it has closed c
+		//because the peer stopped answering heartbeats
+		virtual void conn_dead(connection *c) {}
 		virtual ~chanmgr() {}
 };
 
@@ -32,57 +40,113 @@ class connection : public aio_callback {
 		~connection();
 
 		int channo() { return fd_; }
+		//address of the other end; false if the socket has gone
+		bool peer(struct sockaddr_in *sin);
 		bool isdead();
 		void closeconn();
 
 		bool send(char *b, int sz);
 		void write_cb(int s);
 		void read_cb(int s);
+		void redeliver();
 
 		void incref();
 		void decref();
 		int ref();
 
+		//ping the peer whenever nothing has been received for interval
+		//ms and declare it dead after maxmiss unanswered pings
+		void set_heartbeat(int interval, int maxmiss);
+		void stop_heartbeat();
+		bool heartbeat(const struct timespec &now);
+		void heartbeat_failed();
+
 	private:
 
 		bool readpdu();
+		bool parse();
+		bool readbig();
+		bool deliver();
 		bool writepdu();
+		void send_hb(char op);
 
 		chanmgr *mgr_;
 		const int fd_;
 		bool dead_;
 
 		charbuf wpdu_;
-		charbuf rpdu_;
+		charbuf rpdu_; //pdu being handed up or received in place
+
+		//receive buffer holding the bytes read but not yet parsed
+		char *rbuf_;
+		int rbuf_len_;
 
 		int waiters_;
 		int refno_;
 		const int lossy_;
 
+		int hb_interval_;
+		int hb_maxmiss_;
+		int hb_missed_;
+		struct timespec hb_last_;
+		char hb_pdu_[sizeof(int)+1];
+
 		pthread_mutex_t m_;
 		pthread_mutex_t ref_m_;
 		pthread_cond_t send_complete_;
 		pthread_cond_t send_wait_;
 };
 
-class tcpsconn {
+// HeartbeatMgr owns one thread that walks the connections which
+// asked for heartbeats, pings the idle ones and closes those whose
+// peer has stopped answering
+class HeartbeatMgr {
 	public:
-		tcpsconn(chanmgr *m1, int port, int lossytest=0);
-		~tcpsconn();
+		HeartbeatMgr();
+		~HeartbeatMgr();
 
-		void accept_conn();
-	private:
+		static HeartbeatMgr *Instance();
+
+		void add(connection *c, int interval);
+		//the return guarantees that conn_dead() will never be
+		//called for c
+		void remove(connection *c);
+		void wait_loop();
 
+		static HeartbeatMgr *instance;
+
+	private:
 		pthread_mutex_t m_;
+		pthread_mutex_t cb_m_; // held while calling chanmgr::conn_dead
+		pthread_cond_t changed_c_;
 		pthread_t th_;
-		int pipe_[2];
 
-		int tcp_; //file desciptor for accepting connection
+		int tick_;
+		std::set<connection *> conns_;
+};
+
+class tcpsconn : public aio_callback {
+	public:
+		//nlisteners > 1 opens that many SO_REUSEPORT sockets on port
+		tcpsconn(chanmgr *m1, int port, int lossytest=0, int hb_interval=0,
+				int hb_maxmiss=0, int nlisteners=1);
+		~tcpsconn();
+
+		void read_cb(int fd);
+		void write_cb(int fd) { }
+	private:
+
+		pthread_mutex_t m_; // protect conns_
+
+		std::vector<int> tcp_; //file desciptors for accepting connection
 		chanmgr *mgr_;
 		int lossy_;
+		int hb_interval_;
+		int hb_maxmiss_;
 		std::map<int, connection *> conns_;
+		int gc_next_; //fd where the next garbage collection pass starts
 
-		void process_accept();
+		void gc(int max);
 };
 
 struct bundle {
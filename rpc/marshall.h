@@ -13,13 +13,14 @@
 #define MAXX(a,b) ((a>b)?a:b)
 
 struct req_header {
-	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
-		xid(x), proc(p), clt_nonce(c), srv_nonce(s), xid_rep(xi) {}
+	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0, int d = 0):
+		xid(x), proc(p), clt_nonce(c), srv_nonce(s), xid_rep(xi), deadline(d) {}
 	int xid;
 	int proc;
 	unsigned int clt_nonce;
 	unsigned int srv_nonce;
 	int xid_rep;
+	int deadline; // ms the caller is still willing to wait, 0 if unknown
 };
 
 struct reply_header {
@@ -91,6 +92,7 @@ class marshall {
 			pack((int)h.clt_nonce);
 			pack((int)h.srv_nonce);
 			pack(h.xid_rep);
+			pack(h.deadline);
 			_ind = saved_sz;
 		}
 
@@ -123,6 +125,51 @@ marshall& operator<<(marshall &, short);
 marshall& operator<<(marshall &, unsigned long long);
 marshall& operator<<(marshall &, const std::string &);
 
+// bytes marshalled once and shared by reference. a server that sends
+// the same answer to many calls packs it into a prepacked and replies
+// with copies of that; each reply then costs a single memcpy into its
+// send buffer. the bytes never change once packed, so copies may be
+// handed between threads freely.
+class prepacked {
+	private:
+		struct rep {
+			int refs;
+			std::string bytes;
+		};
+		rep *_r;
+
+		void hold() {
+			if (_r)
+				__atomic_add_fetch(&_r->refs, 1, __ATOMIC_RELAXED);
+		}
+		static void drop(rep *r) {
+			if (r && __atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0)
+				delete r;
+		}
+
+	public:
+		prepacked() : _r(NULL) {}
+		// what m holds so far, less its header
+		explicit prepacked(marshall &m) : _r(new rep) {
+			_r->refs = 1;
+			_r->bytes = m.get_content();
+		}
+		prepacked(const prepacked &p) : _r(p._r) { hold(); }
+		prepacked &operator=(const prepacked &p) {
+			rep *old = _r;
+			_r = p._r;
+			hold();
+			drop(old);
+			return *this;
+		}
+		~prepacked() { drop(_r); }
+
+		bool empty() const { return _r == NULL; }
+		const char *data() const { return _r ? _r->bytes.data() : NULL; }
+		int size() const { return _r ? _r->bytes.size() : 0; }
+};
+marshall& operator<<(marshall &, const prepacked &);
+
 class unmarshall {
 	private:
 		char *_buf;
@@ -181,6 +228,7 @@ class unmarshall {
 			unpack((int *)&h->clt_nonce);
 			unpack((int *)&h->srv_nonce);
 			unpack(&h->xid_rep);
+			unpack(&h->deadline);
 			_ind = RPC_HEADER_SZ;
 		}
 
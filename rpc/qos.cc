@@ -0,0 +1,297 @@
+#include "qos.h"
+#include "slock.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <sstream>
+
+// weights configured for an address are clamped to this
+static const int max_weight = 64;
+// clients idle this long with nothing owed are forgotten
+static const double idle_secs = 60;
+
+//the buckets refill by the monotonic clock, which setting the time of
+//day does not move
+static double
+now_secs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+qos::qos(double ops, double bytes, int burst_ms, int queue_max,
+		const char *weights)
+	: ops_rate_(ops), bytes_rate_(bytes), burst_(burst_ms / 1000.0),
+	queue_max_(queue_max < 1 ? 1 : queue_max), stopped_(false),
+	swept_(now_secs()), calls_(0), deferred_(0), refused_(0), waited_(0)
+{
+	assert(pthread_mutex_init(&m_, 0) == 0);
+	pthread_condattr_t attr;
+	assert(pthread_condattr_init(&attr) == 0);
+	assert(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0);
+	assert(pthread_cond_init(&c_, &attr) == 0);
+	assert(pthread_condattr_destroy(&attr) == 0);
+
+	std::istringstream is(weights ? weights : "");
+	std::string one;
+	while (std::getline(is, one, ',')) {
+		size_t eq = one.find('=');
+		struct in_addr a;
+		if (eq == std::string::npos ||
+				inet_aton(one.substr(0, eq).c_str(), &a) == 0) {
+			fprintf(stderr, "qos: ignoring weight '%s'\n", one.c_str());
+			continue;
+		}
+		weights_[a.s_addr] = std::min(std::max(atoi(one.c_str() + eq + 1), 1),
+				max_weight);
+	}
+}
+
+qos::~qos()
+{
+	assert(pthread_mutex_destroy(&m_) == 0);
+	assert(pthread_cond_destroy(&c_) == 0);
+}
+
+//a client's state, made with full buckets at weight 1 if it is new
+qos::client &
+qos::lookup(unsigned int clt, double now)
+{
+	std::map<unsigned int, client>::iterator it = clients_.find(clt);
+	if (it != clients_.end()) {
+		refill(it->second, now);
+		return it->second;
+	}
+	client &cl = clients_[clt];
+	cl.weight = 1;
+	cl.ops.rate = ops_rate_;
+	cl.bytes.rate = bytes_rate_;
+	cl.ops.tokens = std::max(cl.ops.rate * burst_, 1.0);
+	cl.bytes.tokens = std::max(cl.bytes.rate * burst_, 1.0);
+	cl.last = cl.seen = now;
+	cl.calls = cl.deferred = cl.refused = cl.bytes_in = 0;
+	cl.waited = cl.maxwait = 0;
+	return cl;
+}
+
+void
+qos::refill(client &cl, double now)
+{
+	double dt = now - cl.last;
+	if (dt <= 0)
+		return;
+	bucket *b[2] = { &cl.ops, &cl.bytes };
+	for (int i = 0; i < 2; i++) {
+		if (b[i]->rate == 0)
+			continue;
+		b[i]->tokens = std::min(b[i]->tokens + b[i]->rate * dt,
+				std::max(b[i]->rate * burst_, 1.0));
+	}
+	cl.last = now;
+}
+
+//seconds until cl's buckets are both positive again
+double
+qos::ready_in(const client &cl)
+{
+	double wait = 0;
+	const bucket *b[2] = { &cl.ops, &cl.bytes };
+	for (int i = 0; i < 2; i++) {
+		if (b[i]->rate > 0 && b[i]->tokens <= 0)
+			wait = std::max(wait, -b[i]->tokens / b[i]->rate + 1e-6);
+	}
+	return wait;
+}
+
+void
+qos::take(client &cl, int sz)
+{
+	if (cl.ops.rate > 0)
+		cl.ops.tokens -= 1;
+	if (cl.bytes.rate > 0)
+		cl.bytes.tokens -= sz;
+}
+
+qos::verdict
+qos::admit(unsigned int clt, int sz, void *job)
+{
+	ScopedLock ml(&m_);
+	double now = now_secs();
+	client &cl = lookup(clt, now);
+	cl.seen = now;
+	cl.calls++;
+	cl.bytes_in += sz;
+	calls_++;
+	if (cl.waiting.empty() && ready_in(cl) == 0) {
+		take(cl, sz);
+		return RUN;
+	}
+	if (cl.waiting.size() >= queue_max_) {
+		cl.refused++;
+		refused_++;
+		return REFUSE;
+	}
+	pending p = { job, sz, now };
+	cl.waiting.push_back(p);
+	cl.deferred++;
+	deferred_++;
+	if (cl.waiting.size() == 1) {
+		backlog_.push_back(clt);
+		assert(pthread_cond_signal(&c_) == 0);
+	}
+	return DEFER;
+}
+
+void
+qos::charge(unsigned int clt, int sz)
+{
+	ScopedLock ml(&m_);
+	client &cl = lookup(clt, now_secs());
+	if (cl.bytes.rate > 0)
+		cl.bytes.tokens -= sz;
+}
+
+void
+qos::bind(unsigned int clt, const struct in_addr &addr)
+{
+	ScopedLock ml(&m_);
+	std::map<in_addr_t, int>::iterator it = weights_.find(addr.s_addr);
+	set_weight(clt, it == weights_.end() ? 1 : it->second);
+}
+
+//m_ is held
+void
+qos::set_weight(unsigned int clt, int weight)
+{
+	client &cl = lookup(clt, now_secs());
+	cl.weight = weight;
+	cl.ops.rate = ops_rate_ * weight;
+	cl.bytes.rate = bytes_rate_ * weight;
+	//a client waiting may be ready sooner now
+	assert(pthread_cond_signal(&c_) == 0);
+}
+
+//backlogged clients are served round robin, one call each, so a
+//client's turn does not depend on how much it has queued
+void *
+qos::next()
+{
+	ScopedLock ml(&m_);
+	while (!stopped_) {
+		double now = now_secs();
+		double wait = 1.0;
+		for (unsigned int n = backlog_.size(); n > 0; n--) {
+			unsigned int clt = backlog_.front();
+			backlog_.pop_front();
+			client &cl = lookup(clt, now);
+			double d = ready_in(cl);
+			if (d > 0) {
+				backlog_.push_back(clt);
+				wait = std::min(wait, d);
+				continue;
+			}
+			pending p = cl.waiting.front();
+			cl.waiting.pop_front();
+			if (!cl.waiting.empty())
+				backlog_.push_back(clt);
+			take(cl, p.sz);
+			double w = now - p.arrived;
+			cl.waited += w;
+			cl.maxwait = std::max(cl.maxwait, w);
+			waited_ += w;
+			return p.job;
+		}
+		if (now - swept_ > idle_secs)
+			sweep(now);
+
+		double until = now + wait;
+		struct timespec ts;
+		ts.tv_sec = (time_t) until;
+		ts.tv_nsec = (long) ((until - ts.tv_sec) * 1e9);
+		pthread_cond_timedwait(&c_, &m_, &ts);
+	}
+	return NULL;
+}
+
+//forget clients that have been idle a while and owe nothing; those
+//given a weight are kept, since they will not bind again
+void
+qos::sweep(double now)
+{
+	std::map<unsigned int, client>::iterator it = clients_.begin();
+	while (it != clients_.end()) {
+		client &cl = it->second;
+		refill(cl, now);
+		if (cl.waiting.empty() && cl.weight == 1 &&
+				now - cl.seen > idle_secs && ready_in(cl) == 0)
+			clients_.erase(it++);
+		else
+			it++;
+	}
+	swept_ = now;
+}
+
+void
+qos::stop()
+{
+	ScopedLock ml(&m_);
+	stopped_ = true;
+	assert(pthread_cond_broadcast(&c_) == 0);
+}
+
+bool
+qos::stopped()
+{
+	ScopedLock ml(&m_);
+	return stopped_;
+}
+
+void *
+qos::drain()
+{
+	ScopedLock ml(&m_);
+	while (!backlog_.empty()) {
+		client &cl = clients_[backlog_.front()];
+		if (cl.waiting.empty()) {
+			backlog_.pop_front();
+			continue;
+		}
+		void *job = cl.waiting.front().job;
+		cl.waiting.pop_front();
+		return job;
+	}
+	return NULL;
+}
+
+void
+qos::stats(std::string &out)
+{
+	ScopedLock ml(&m_);
+	char buf[256];
+	snprintf(buf, sizeof(buf),
+			"qos: %.0f calls/s and %.0f bytes/s per unit of weight (0 is "
+			"unlimited), burst %.0f ms, %u queued at most\n"
+			"  %llu calls, %llu deferred, %llu refused, %.1f ms waited "
+			"in all\n",
+			ops_rate_, bytes_rate_, burst_ * 1000, queue_max_, calls_,
+			deferred_, refused_, waited_ * 1000);
+	out = buf;
+	std::map<unsigned int, client>::iterator it;
+	for (it = clients_.begin(); it != clients_.end(); it++) {
+		client &cl = it->second;
+		snprintf(buf, sizeof(buf),
+				"  client %u weight %d: %llu calls, %llu bytes in, "
+				"%llu deferred (%.1f%%), %llu refused, waited %.2f ms avg "
+				"%.2f ms max, %u queued\n",
+				it->first, cl.weight, cl.calls, cl.bytes_in, cl.deferred,
+				cl.calls ? 100.0 * cl.deferred / cl.calls : 0.0, cl.refused,
+				cl.deferred ? cl.waited * 1000 / cl.deferred : 0.0,
+				cl.maxwait * 1000, (unsigned int) cl.waiting.size());
+		out += buf;
+	}
+}
@@ -0,0 +1,91 @@
+#ifndef qos_h
+#define qos_h
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include <list>
+#include <map>
+#include <string>
+
+// per-client token buckets in front of rpcs's dispatch pool, one for
+// requests and one for bytes, each refilled at its rate times the
+// client's weight and holding at most burst_ms worth. a request is
+// let through while both buckets are positive and takes what it
+// costs, so one bigger than the burst still goes, leaving a debt.
+// the rest wait in a queue per client, in arrival order, for a
+// scheduler to release them as their client's buckets refill; other
+// clients' requests are not held up behind them. a client with
+// queue_max requests waiting has any more turned away.
+class qos {
+	public:
+		// a rate of 0 leaves that bucket unlimited. weights is a
+		// comma-separated list of ip=weight, giving the clients
+		// from each address that share relative to the default of 1
+		qos(double ops, double bytes, int burst_ms, int queue_max,
+				const char *weights);
+		~qos();
+
+		enum verdict { RUN, DEFER, REFUSE };
+		// RUN if a request of sz bytes from clt may run now; DEFER
+		// if job has been queued behind clt's other waiting requests
+		// for next() to hand out later; REFUSE if clt's queue is full
+		verdict admit(unsigned int clt, int sz, void *job);
+		// bytes a request turned out to cost on top, such as its reply
+		void charge(unsigned int clt, int sz);
+		// clt has bound from addr: give it addr's weight
+		void bind(unsigned int clt, const struct in_addr &addr);
+		// block until some waiting job may run, and return it; NULL
+		// once stop() has been called
+		void *next();
+		void stop();
+		// jobs waiting when stop() was called, for their owner to free
+		void *drain();
+		bool stopped();
+
+		void stats(std::string &out);
+
+	private:
+		struct bucket {
+			double tokens;
+			double rate; // per second, for the client's weight
+		};
+		struct pending {
+			void *job;
+			int sz;
+			double arrived;
+		};
+		struct client {
+			bucket ops, bytes;
+			int weight;
+			double last; // when the buckets were last refilled
+			double seen; // when it last called
+			std::list<pending> waiting;
+			// for stats()
+			unsigned long long calls, deferred, refused, bytes_in;
+			double waited, maxwait; // seconds deferred calls spent queued
+		};
+
+		const double ops_rate_, bytes_rate_;
+		const double burst_; // seconds
+		const unsigned int queue_max_;
+		std::map<in_addr_t, int> weights_; // by address, network order
+
+		pthread_mutex_t m_;
+		pthread_cond_t c_;
+		std::map<unsigned int, client> clients_;
+		std::list<unsigned int> backlog_; // clients with calls waiting
+		bool stopped_;
+		double swept_;
+		// totals over every client, including those swept since
+		unsigned long long calls_, deferred_, refused_;
+		double waited_;
+
+		client &lookup(unsigned int clt, double now);
+		void refill(client &cl, double now);
+		double ready_in(const client &cl);
+		void take(client &cl, int sz);
+		void sweep(double now);
+		void set_weight(unsigned int clt, int weight);
+};
+
+#endif
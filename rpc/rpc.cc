@@ -69,6 +69,8 @@
 #include <netinet/tcp.h>
 #include <time.h>
 #include <netdb.h>
+#include <stdint.h>
+#include <unistd.h>
 
 #include "jsl_log.h"
 #include "gettime.h"
@@ -97,6 +99,22 @@ void set_rand_seed()
 	srandom((int)ts.tv_nsec^((int)getpid()));
 }
 
+// RPC_HEARTBEAT=interval[:maxmiss] turns on connection heartbeats,
+// interval in milliseconds
+static void
+heartbeat_env(int *interval, int *maxmiss)
+{
+	*interval = 0;
+	*maxmiss = 3;
+	char *hb_env = getenv("RPC_HEARTBEAT");
+	if (hb_env != NULL) {
+		*interval = atoi(hb_env);
+		char *m = index(hb_env, ':');
+		if (m != NULL)
+			*maxmiss = atoi(m+1);
+	}
+}
+
 rpcc::rpcc(sockaddr_in d, bool retrans) : 
 	dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0), 
 	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false)
@@ -120,6 +138,8 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
 		lossytest_ = atoi(loss_env);
 	}
 
+	heartbeat_env(&hb_interval_, &hb_maxmiss_);
+
 	//xid starts with 1 and latest received reply starts with 0
 	xid_rep_window_.push_back(0);
 
@@ -134,6 +154,7 @@ rpcc::~rpcc()
 	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n", 
 			clt_nonce_, chan_?chan_->channo():-1); 
 	if (chan_) {
+		chan_->stop_heartbeat();
 		chan_->closeconn();
 		chan_->decref();
 	}
@@ -158,6 +179,16 @@ rpcc::bind(TO to)
 	return ret;
 };
 
+void
+rpcc::set_heartbeat(int interval, int maxmiss)
+{
+	ScopedLock ml(&chan_m_);
+	hb_interval_ = interval;
+	hb_maxmiss_ = maxmiss;
+	if (chan_ && !chan_->isdead())
+		chan_->set_heartbeat(hb_interval_, hb_maxmiss_);
+}
+
 // Cancel all outstanding calls
 void
 rpcc::cancel(void)
@@ -184,12 +215,55 @@ rpcc::cancel(void)
   printf("rpcc::cancel: done\n");
 }
 
+// rpc handlers may not return negative values, so the stream procs
+// carry failures in their replies: stream_open answers sid 0, and
+// stream_read returns STREAM_MORE, STREAM_EOF or STREAM_FAILED.
+enum { STREAM_EOF = 0, STREAM_MORE = 1, STREAM_FAILED = 2 };
+
+int
+rpcc::stream_open(unsigned int proc, const std::string &arg, int &sid, TO to)
+{
+	int ret = call(rpc_const::stream_open, clt_nonce_, proc, arg, sid, to);
+	if (ret == 0 && sid == 0)
+		ret = rpc_const::stream_failure;
+	return ret;
+}
+
+int
+rpcc::stream_write(int sid, const std::string &chunk, TO to)
+{
+	int r;
+	int ret = call(rpc_const::stream_write, sid, chunk, r, to);
+	return ret < 0 ? ret : r;
+}
+
+int
+rpcc::stream_read(int sid, std::string &chunk, bool &eof, TO to)
+{
+	int ret = call(rpc_const::stream_read, sid, chunk, to);
+	if (ret < 0)
+		return ret;
+	if (ret == STREAM_FAILED)
+		return rpc_const::stream_failure;
+	eof = (ret == STREAM_EOF);
+	return 0;
+}
+
+int
+rpcc::stream_close(int sid, TO to)
+{
+	int r;
+	int ret = call(rpc_const::stream_close, sid, r, to);
+	return ret < 0 ? ret : r;
+}
+
 int
 rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		TO to)
 {
 
 	caller ca(0, &rep);
+	req_header h;
 	{
 		ScopedLock ml(&m_);
 
@@ -206,16 +280,16 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		ca.xid = xid_++;
 		calls_[ca.xid] = &ca;
 
-		req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front());
-		req.pack_req_header(h);
+		h = req_header(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front());
 	}
 
 
 	TO curr_to;
-	struct timespec now, nextdeadline, finaldeadline; 
+	struct timespec now, nextdeadline, finaldeadline, calldeadline; 
 
 	clock_gettime(CLOCK_REALTIME, &now);
 	add_timespec(now, to.to, &finaldeadline); 
+	calldeadline = finaldeadline;
 	curr_to.to = to_min.to;
 
 	bool transmit = true;
@@ -224,6 +298,14 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 	while (1) {
 
 		if (transmit) {
+			// tell the server how long we are still willing to wait,
+			// so it can skip the work once we have given up
+			clock_gettime(CLOCK_REALTIME, &now);
+			h.deadline = 1;
+			if (cmp_timespec(calldeadline, now) > 0)
+				h.deadline = MAXX(diff_timespec(calldeadline, now), 1);
+			req.pack_req_header(h);
+
 			get_refconn(&ch);
 			if (ch) {
 				if (reachable_) 
@@ -300,9 +382,13 @@ rpcc::get_refconn(connection **ch)
 {
 	ScopedLock ml(&chan_m_);
 	if (!chan_ || chan_->isdead()) {
-		if (chan_)
+		if (chan_) {
+			chan_->stop_heartbeat();
 			chan_->decref();
+		}
 		chan_ = connect_to_dst(dst_, this, lossytest_);
+		if (chan_ && hb_interval_)
+			chan_->set_heartbeat(hb_interval_, hb_maxmiss_);
 	}
 	if (ch && chan_) {
 		if (*ch) {
@@ -355,6 +441,26 @@ rpcc::got_pdu(connection *c, char *b, int sz)
 	return true;
 }
 
+//the heartbeat thread has given up on the server: instead of
+//letting the callers wait for their timeouts, fail them now.
+//callers that retransmit will reconnect on their next call
+void
+rpcc::conn_dead(connection *c)
+{
+	ScopedLock ml(&m_);
+	std::map<int,caller*>::iterator iter;
+	for (iter = calls_.begin(); iter != calls_.end(); iter++) {
+		caller *ca = iter->second;
+		ScopedLock cl(&ca->m);
+		if (!ca->done) {
+			jsl_log(JSL_DBG_2, "rpcc::conn_dead: fail xid %u\n", ca->xid);
+			ca->done = true;
+			ca->intret = rpc_const::timeout_failure;
+			assert(pthread_cond_signal(&ca->c) == 0);
+		}
+	}
+}
+
 // assumes thread holds mutex m
 void 
 rpcc::update_xid_rep(unsigned int xid)
@@ -383,12 +489,23 @@ compress:
 
 
 rpcs::rpcs(unsigned int p1, int count)
-  : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true)
+  : port_(p1), next_sid_(1), reaper_started_(false), reaper_stop_(false),
+	counting_(count), curr_counts_(count), 
+	expired_(0), expired_bytes_(0), lossytest_(0), reachable_ (true)
 {
 	assert(pthread_mutex_init(&procs_m_, 0) == 0);
 	assert(pthread_mutex_init(&count_m_, 0) == 0);
 	assert(pthread_mutex_init(&reply_window_m_, 0) == 0);
 	assert(pthread_mutex_init(&conss_m_, 0) == 0);
+	assert(pthread_mutex_init(&streams_m_, 0) == 0);
+	assert(pthread_mutex_init(&stalled_m_, 0) == 0);
+	pthread_condattr_t cattr;
+	assert(pthread_condattr_init(&cattr) == 0);
+	assert(pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) == 0);
+	assert(pthread_cond_init(&reaper_c_, &cattr) == 0);
+	assert(pthread_condattr_destroy(&cattr) == 0);
+	assert(pthread_cond_init(&room_c_, 0) == 0);
+	finished_ = 0;
 
 	set_rand_seed();
 	nonce_ = random();
@@ -399,18 +516,97 @@ rpcs::rpcs(unsigned int p1, int count)
 		lossytest_ = atoi(loss_env);
 	}
 
+	heartbeat_env(&hb_interval_, &hb_maxmiss_);
+
+	//RPC_STREAM_IDLE=n drops a stream n seconds after its last call,
+	//whether or not heartbeats notice its client going away
+	stream_idle_ = 300;
+	char *idle_env = getenv("RPC_STREAM_IDLE");
+	if (idle_env != NULL && atoi(idle_env) > 0)
+		stream_idle_ = atoi(idle_env);
+
 	reg(rpc_const::bind, this, &rpcs::rpcbind);
+	reg(rpc_const::stream_open, this, &rpcs::streamopen);
+	reg(rpc_const::stream_write, this, &rpcs::streamwrite);
+	reg(rpc_const::stream_read, this, &rpcs::streamread);
+	reg(rpc_const::stream_close, this, &rpcs::streamclose);
+	reg(rpc_const::qos_stats, this, &rpcs::qosstats);
 	dispatchpool_ = new ThrPool(10,false);
 
-	listener_ = new tcpsconn(this, port_, lossytest_);
+	//RPC_QOS_OPS=n and RPC_QOS_BYTES=n limit each client to n calls and
+	//n request and reply bytes a second, times its weight, allowing
+	//bursts of RPC_QOS_BURST_MS (default 100) worth and queueing at
+	//most RPC_QOS_QUEUE (default 256) calls per client past that.
+	//RPC_QOS_WEIGHTS=ip=n,... weights the clients at those addresses
+	qos_ = NULL;
+	char *ops_env = getenv("RPC_QOS_OPS");
+	char *bytes_env = getenv("RPC_QOS_BYTES");
+	char *burst_env = getenv("RPC_QOS_BURST_MS");
+	char *queue_env = getenv("RPC_QOS_QUEUE");
+	double ops = ops_env ? atof(ops_env) : 0;
+	double bytes = bytes_env ? atof(bytes_env) : 0;
+	if (ops > 0 || bytes > 0) {
+		qos_ = new qos(MAXX(ops, 0), MAXX(bytes, 0),
+				burst_env ? atoi(burst_env) : 100,
+				queue_env ? atoi(queue_env) : 256,
+				getenv("RPC_QOS_WEIGHTS"));
+		assert((qos_th_ = method_thread(this, false, &rpcs::qos_loop)) != 0);
+	}
+
+	//RPC_LISTENERS=n accepts on n SO_REUSEPORT sockets
+	int nlisteners = 1;
+	char *listeners_env = getenv("RPC_LISTENERS");
+	if (listeners_env != NULL)
+		nlisteners = atoi(listeners_env);
+
+	listener_ = new tcpsconn(this, port_, lossytest_, hb_interval_, hb_maxmiss_,
+			nlisteners);
 }
 
 rpcs::~rpcs()
 {
-	//must delete listener before dispatchpool
+	//must delete listener before dispatchpool, and stop feeding it
+	//deferred calls too
 	delete listener_;
+	if (qos_) {
+		qos_->stop();
+		{
+			ScopedLock sl(&stalled_m_);
+			finished_++;
+			assert(pthread_cond_broadcast(&room_c_) == 0);
+		}
+		assert(pthread_join(qos_th_, NULL) == 0);
+	}
 	delete dispatchpool_;
+	while (!stalled_.empty()) {
+		stalled_.front()->decref();
+		stalled_.pop_front();
+	}
+	if (qos_) {
+		void *v;
+		while ((v = qos_->drain()) != NULL) {
+			djob_t *j = (djob_t *)v;
+			j->conn->decref();
+			free(j->buf);
+			delete j;
+		}
+		delete qos_;
+	}
 	free_reply_window();
+
+	{
+		ScopedLock sl(&streams_m_);
+		reaper_stop_ = true;
+		assert(pthread_cond_signal(&reaper_c_) == 0);
+	}
+	if (reaper_started_)
+		assert(pthread_join(reaper_th_, NULL) == 0);
+	std::map<int, stream_t *>::iterator si;
+	for (si = streams_.begin(); si != streams_.end(); si++)
+		delete si->second;
+	std::map<int, stream_opener *>::iterator oi;
+	for (oi = stream_procs_.begin(); oi != stream_procs_.end(); oi++)
+		delete oi->second;
 }
 
 bool
@@ -423,14 +619,170 @@ rpcs::got_pdu(connection *c, char *b, int sz)
 
 	c->incref();
 	djob_t *j = new djob_t(c, b, sz);
-	bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
+	clock_gettime(CLOCK_REALTIME, &j->arrived);
+
+	//over its client's rate, the call waits in qos_ without holding
+	//up anyone else's, or is refused if too many already wait; binds
+	//always go straight through, taking the weight of their address
+	if (qos_) {
+		unmarshall req(b, sz);
+		req_header h;
+		req.unpack_req_header(&h);
+		char *b1;
+		int sz1;
+		req.take_buf(&b1, &sz1);
+		if (req.ok() && h.proc == (int) rpc_const::bind) {
+			struct sockaddr_in sin;
+			if (h.clt_nonce && c->peer(&sin))
+				qos_->bind(h.clt_nonce, sin.sin_addr);
+		} else if (req.ok()) {
+			switch (qos_->admit(h.clt_nonce, sz, j)) {
+			case qos::DEFER:
+				return true;
+			case qos::REFUSE:
+				j->refused = true;
+				break;
+			case qos::RUN:
+				break;
+			}
+		}
+	}
+
+	bool succ = dispatchpool_->addObjJob(this, &rpcs::work, j);
 	if (!succ || !reachable_) {
 		c->decref();
 		delete j;
 	}
+	if (!succ) {
+		//the connection keeps the pdu; a job finishing hands it back
+		ScopedLock sl(&stalled_m_);
+		c->incref();
+		stalled_.push_back(c);
+	}
 	return succ; 
 }
 
+void
+rpcs::work(djob_t *j)
+{
+	dispatch(j);
+	unstall();
+}
+
+//a worker has come free: let the connection that has waited longest
+//for one offer its pdus again
+void
+rpcs::unstall()
+{
+	connection *c;
+	{
+		ScopedLock sl(&stalled_m_);
+		finished_++;
+		if (qos_)
+			assert(pthread_cond_signal(&room_c_) == 0);
+		if (stalled_.empty())
+			return;
+		c = stalled_.front();
+		stalled_.pop_front();
+	}
+	c->redeliver();
+	c->decref();
+}
+
+//hand the calls qos_ deferred to the dispatch pool as they become due
+void
+rpcs::qos_loop()
+{
+	void *v;
+	while ((v = qos_->next()) != NULL) {
+		djob_t *j = (djob_t *)v;
+		//the pool is full: this call has waited its turn already, so
+		//keep it rather than make its client retransmit, and try
+		//again once a job has finished since the failed add
+		while (1) {
+			unsigned long long seen;
+			{
+				ScopedLock sl(&stalled_m_);
+				seen = finished_;
+			}
+			if (dispatchpool_->addObjJob(this, &rpcs::work, j))
+				break;
+			if (qos_->stopped()) {
+				j->conn->decref();
+				free(j->buf);
+				delete j;
+				return;
+			}
+			ScopedLock sl(&stalled_m_);
+			while (finished_ == seen)
+				assert(pthread_cond_wait(&room_c_, &stalled_m_) == 0);
+		}
+	}
+}
+
+//a client stopped answering heartbeats: drop our reference to its
+//connection and the replies it will never acknowledge, remembering
+//only the highest xid so at-most-once still holds if it comes back
+void
+rpcs::conn_dead(connection *c)
+{
+	std::vector<unsigned int> gone;
+	{
+		ScopedLock rwl(&conss_m_);
+		std::map<unsigned int, connection *>::iterator it = conns_.begin();
+		while (it != conns_.end()) {
+			if (it->second == c) {
+				gone.push_back(it->first);
+				c->decref();
+				conns_.erase(it++);
+			} else {
+				it++;
+			}
+		}
+	}
+
+	ScopedLock rwl(&reply_window_m_);
+	for (unsigned int i = 0; i < gone.size(); i++) {
+		std::map<unsigned int,std::list<reply_t> >::iterator clt;
+		clt = reply_window_.find(gone[i]);
+		if (clt == reply_window_.end())
+			continue;
+		std::list<reply_t>::iterator it;
+		unsigned int floor = 0;
+		for (it = clt->second.begin(); it != clt->second.end(); it++) {
+			if (it->xid > floor)
+				floor = it->xid;
+			free(it->buf);
+		}
+		jsl_log(JSL_DBG_2, "rpcs::conn_dead: reclaimed %d replies of client %u\n",
+				(int)clt->second.size(), gone[i]);
+		reply_window_.erase(clt);
+		xid_floor_[gone[i]] = floor;
+	}
+
+	//nobody is left to finish or close this client's streams
+	std::vector<stream_t *> orphans;
+	{
+		ScopedLock sl(&streams_m_);
+		std::map<int, stream_t *>::iterator it;
+		for (it = streams_.begin(); it != streams_.end(); it++) {
+			for (unsigned int i = 0; i < gone.size(); i++) {
+				if (it->second->clt_nonce == gone[i]) {
+					it->second->refs++;
+					orphans.push_back(it->second);
+					break;
+				}
+			}
+		}
+	}
+	for (unsigned int i = 0; i < orphans.size(); i++) {
+		jsl_log(JSL_DBG_2, "rpcs::conn_dead: dropping stream of client %u\n",
+				orphans[i]->clt_nonce);
+		stream_drop(orphans[i]);
+		stream_put(orphans[i]);
+	}
+}
+
 void
 rpcs::reg1(unsigned int proc, handler *h)
 {
@@ -440,6 +792,44 @@ rpcs::reg1(unsigned int proc, handler *h)
 	assert(procs_.count(proc) >= 1);
 }
 
+void
+rpcs::reg_stream1(unsigned int proc, stream_opener *o)
+{
+	ScopedLock sl(&streams_m_);
+	assert(stream_procs_.count(proc) == 0);
+	stream_procs_[proc] = o;
+}
+
+int
+rpcs::expired()
+{
+	ScopedLock cl(&count_m_);
+	return expired_;
+}
+
+static pthread_once_t caller_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t caller_key;
+
+static void
+caller_key_init(void)
+{
+	assert(pthread_key_create(&caller_key, NULL) == 0);
+}
+
+static void
+set_caller(unsigned int clt_nonce)
+{
+	pthread_once(&caller_key_once, caller_key_init);
+	assert(pthread_setspecific(caller_key, (void *) (uintptr_t) clt_nonce) == 0);
+}
+
+unsigned int
+rpcs::caller()
+{
+	pthread_once(&caller_key_once, caller_key_init);
+	return (unsigned int) (uintptr_t) pthread_getspecific(caller_key);
+}
+
 void
 rpcs::updatestat(unsigned int proc)
 {
@@ -465,6 +855,8 @@ rpcs::updatestat(unsigned int proc)
 		}
 		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %d total reply %d max per client %d\n", 
 				reply_window_.size(), totalrep, maxrep);
+		jsl_log(JSL_DBG_1, "EXPIRED: %d requests %lld bytes dropped unexecuted\n",
+				expired_, expired_bytes_);
 		curr_counts_ = counting_;
 	}
 }
@@ -474,6 +866,8 @@ rpcs::dispatch(djob_t *j)
 {
 	connection *c = j->conn;
 	unmarshall req(j->buf, j->sz);
+	struct timespec arrived = j->arrived;
+	bool refused = j->refused;
 	delete j;
 
 	req_header h;
@@ -486,6 +880,23 @@ rpcs::dispatch(djob_t *j)
 		return;
 	}
 
+	// has the caller given up while the request sat in the queue?
+	// nobody would read the reply, so don't do the work.
+	if (h.deadline > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (cmp_timespec(now, arrived) > 0 && 
+				diff_timespec(now, arrived) >= h.deadline) {
+			jsl_log(JSL_DBG_2, "rpcs::dispatch: drop expired rpc %u proc %x from clt %u\n",
+					h.xid, proc, h.clt_nonce);
+			ScopedLock cl(&count_m_);
+			expired_++;
+			expired_bytes_ += req.size();
+			c->decref();
+			return;
+		}
+	}
+
 	jsl_log(JSL_DBG_2,
 			"rpcs::dispatch: rpc %u (proc %x, last_rep %u) from clt %u for srv instance %u \n",
 			h.xid, proc, h.xid_rep, h.clt_nonce, h.srv_nonce);
@@ -504,6 +915,18 @@ rpcs::dispatch(djob_t *j)
 		return;
 	}
 
+	//qos_ turned it away; tell the client now rather than let it
+	//retransmit into the same full queue
+	if (refused) {
+		jsl_log(JSL_DBG_2, "rpcs::dispatch: qos refused rpc %u proc %x from clt %u\n",
+				h.xid, proc, h.clt_nonce);
+		rh.ret = rpc_const::qos_failure;
+		rep.pack_reply_header(rh);
+		c->send(rep.cstr(),rep.size());
+		c->decref();
+		return;
+	}
+
 	handler *f;
 	//is RPC proc a registered procedure?
 	{
@@ -521,6 +944,7 @@ rpcs::dispatch(djob_t *j)
 	rpcs::rpcstate_t stat;
 	char *b1;
 	int sz1;
+	bool saved;
 
 	if (h.clt_nonce) {
 		//have i seen this client before?
@@ -560,34 +984,41 @@ rpcs::dispatch(djob_t *j)
 				updatestat(proc);
 			}
 
+			set_caller(h.clt_nonce);
 			rh.ret = f->fn(req, rep);
+			set_caller(0);
 			assert(rh.ret >= 0 || 
 					rh.ret == rpc_const::unmarshal_args_failure);
 
 			rep.pack_reply_header(rh);
 			rep.take_buf(&b1,&sz1);
+			if (qos_)
+				qos_->charge(h.clt_nonce, sz1);
 
 			jsl_log(JSL_DBG_2,
 					"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
 					sz1, h.xid, proc, rh.ret, h.clt_nonce);
 
+			saved = false;
 			if (h.clt_nonce > 0) {
 				//only record replies for clients that require at-most-once logic
-				add_reply(h.clt_nonce, h.xid, b1, sz1);
+				saved = add_reply(h.clt_nonce, h.xid, b1, sz1);
 			}
 
 			// get the latest connection to the client
 			{
 				ScopedLock rwl(&conss_m_);
-				if (c->isdead() && c != conns_[h.clt_nonce]) {
+				std::map<unsigned int, connection *>::iterator it = 
+					conns_.find(h.clt_nonce);
+				if (c->isdead() && it != conns_.end() && c != it->second) {
 					c->decref();
-					c = conns_[h.clt_nonce];
+					c = it->second;
 					c->incref();
 				}
 			}
 
 			c->send(b1, sz1);
-			if (h.clt_nonce == 0) {
+			if (!saved) {
 				//reply is not added to at-most-once window, free it
 				free(b1);
 			}
@@ -608,7 +1039,7 @@ rpcs::dispatch(djob_t *j)
 	c->decref();
 }
 
-void
+bool
 rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
 		char *b, int sz)
 {
@@ -616,19 +1047,24 @@ rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
 	std::list<reply_t>::iterator it;
 
 	ScopedLock rwl(&reply_window_m_);		
-	assert(reply_window_.count(clt_nonce) != 0);
+	assert(reply_window_.count(clt_nonce) != 0 || xid_floor_.count(clt_nonce));
 
 
 	// find the placeholder for this reply 
 	it = reply_window_[clt_nonce].begin();
 	while (it != reply_window_[clt_nonce].end() && it->xid != xid)
 		it++;
+
+	if (it == reply_window_[clt_nonce].end()) {
+		//window was reclaimed by conn_dead() while we were running
+		assert(xid_floor_.count(clt_nonce));
+		return false;
+	}
 	
 	jsl_log(JSL_DBG_4, "rpcs:add_reply: found placeholder for xid %u's (placeholder's xid: %u, sz: %d) in client %u's window, current window size: %d\n", 
 		xid, it->xid, it->sz, clt_nonce, (int)reply_window_[clt_nonce].size());
 
 
-	assert(it != reply_window_[clt_nonce].end()); // there always should be a placeholder
 	assert(it->sz == -1); // this should be a placeholder, nothing more..
 
 	// updating placeholder with real data
@@ -638,6 +1074,7 @@ rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
 	jsl_log(JSL_DBG_4, "rpcs:add_reply: just populated xid %u's placeholder in client %u's Window, current window size: %d\n", 
 		it->xid, clt_nonce, (int)reply_window_[clt_nonce].size());
 
+	return true;
 }
 
 rpcs::rpcstate_t 
@@ -648,11 +1085,12 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
 	std::list<reply_t>::iterator it;
 
 	ScopedLock rwl(&reply_window_m_);
-	assert(reply_window_.count(clt_nonce) != 0);
-
 
 	if (reply_window_[clt_nonce].empty())
 	{
+		if (xid_floor_.count(clt_nonce) && xid <= xid_floor_[clt_nonce])
+			return FORGOTTEN;
+
 		jsl_log(JSL_DBG_4, "rpcs::checkduplicate_and_update client %u's reply_window is empty (size: %d). Return NEW\n",
 			 clt_nonce, (int)reply_window_[clt_nonce].size());
 
@@ -778,6 +1216,189 @@ rpcs::rpcbind(int a, int &r)
 	return 0;
 }
 
+int
+rpcs::qosstats(int a, std::string &out)
+{
+	if (qos_)
+		qos_->stats(out);
+	else
+		out = "qos: off\n";
+	return 0;
+}
+
+static time_t
+monotonic_secs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+//look up an open stream and take a reference to it
+rpcs::stream_t *
+rpcs::stream_get(int sid)
+{
+	ScopedLock sl(&streams_m_);
+	std::map<int, stream_t *>::iterator it = streams_.find(sid);
+	if (it == streams_.end())
+		return NULL;
+	it->second->refs++;
+	it->second->last = monotonic_secs();
+	return it->second;
+}
+
+//drop the streams nobody has called for stream_idle_ seconds, checking
+//a few times per period
+void
+rpcs::reap_loop()
+{
+	ScopedLock sl(&streams_m_);
+	while (!reaper_stop_) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += stream_idle_ > 4 ? stream_idle_ / 4 : 1;
+		pthread_cond_timedwait(&reaper_c_, &streams_m_, &ts);
+		if (reaper_stop_)
+			break;
+
+		time_t now = monotonic_secs();
+		std::vector<stream_t *> idle;
+		std::map<int, stream_t *>::iterator it;
+		for (it = streams_.begin(); it != streams_.end(); it++) {
+			//refs > 1 means a call is under way on it
+			if (it->second->refs == 1 &&
+					now - it->second->last >= stream_idle_) {
+				it->second->refs++;
+				idle.push_back(it->second);
+			}
+		}
+		if (idle.empty())
+			continue;
+		assert(pthread_mutex_unlock(&streams_m_) == 0);
+		for (unsigned int i = 0; i < idle.size(); i++) {
+			jsl_log(JSL_DBG_2, "rpcs::reap_loop: dropping idle stream %d of "
+					"client %u\n", idle[i]->sid, idle[i]->clt_nonce);
+			stream_drop(idle[i]);
+			stream_put(idle[i]);
+		}
+		assert(pthread_mutex_lock(&streams_m_) == 0);
+	}
+}
+
+void
+rpcs::stream_put(stream_t *st)
+{
+	bool last;
+	{
+		ScopedLock sl(&streams_m_);
+		last = (--st->refs == 0);
+	}
+	if (last)
+		delete st;
+}
+
+//unlink the stream so no new call can find it and close it, waiting
+//for a call already inside its handler. the caller still holds a
+//reference of its own.
+void
+rpcs::stream_drop(stream_t *st)
+{
+	{
+		ScopedLock ml(&st->m);
+		ScopedLock sl(&streams_m_);
+		if (st->closed)
+			return;
+		st->closed = true;
+		streams_.erase(st->sid);
+	}
+	stream_put(st); // the table's reference
+}
+
+int
+rpcs::streamopen(unsigned int clt_nonce, unsigned int proc, 
+		std::string arg, int &sid)
+{
+	stream_opener *o;
+	sid = 0;
+	{
+		ScopedLock sl(&streams_m_);
+		if (stream_procs_.count(proc) == 0) {
+			jsl_log(JSL_DBG_1, "rpcs::streamopen: unknown proc %u\n", proc);
+			return 0;
+		}
+		o = stream_procs_[proc];
+	}
+
+	stream_handler *h = o->open(arg);
+	if (h == NULL)
+		return 0;
+
+	stream_t *st = new stream_t(h, clt_nonce);
+	st->last = monotonic_secs();
+	ScopedLock sl(&streams_m_);
+	sid = st->sid = next_sid_++;
+	streams_[sid] = st;
+	if (!reaper_started_) {
+		reaper_started_ = true;
+		assert((reaper_th_ = method_thread(this, false, &rpcs::reap_loop)) != 0);
+	}
+	jsl_log(JSL_DBG_3, "rpcs::streamopen: proc %u stream %d client %u\n",
+			proc, sid, clt_nonce);
+	return 0;
+}
+
+int
+rpcs::streamwrite(int sid, std::string chunk, int &r)
+{
+	r = rpc_const::stream_failure;
+	stream_t *st = stream_get(sid);
+	if (st == NULL)
+		return 0;
+	{
+		ScopedLock ml(&st->m);
+		if (!st->closed)
+			r = st->h->write(chunk);
+	}
+	stream_put(st);
+	return 0;
+}
+
+int
+rpcs::streamread(int sid, std::string &chunk)
+{
+	stream_t *st = stream_get(sid);
+	if (st == NULL)
+		return STREAM_FAILED;
+	int ret = STREAM_FAILED;
+	{
+		ScopedLock ml(&st->m);
+		bool eof = false;
+		if (!st->closed && st->h->read(chunk, eof) >= 0)
+			ret = eof ? STREAM_EOF : STREAM_MORE;
+	}
+	stream_put(st);
+	if (ret == STREAM_FAILED)
+		chunk.clear();
+	return ret;
+}
+
+int
+rpcs::streamclose(int sid, int &r)
+{
+	r = rpc_const::stream_failure;
+	stream_t *st = stream_get(sid);
+	if (st == NULL)
+		return 0;
+	{
+		ScopedLock ml(&st->m);
+		if (!st->closed)
+			r = st->h->close();
+	}
+	stream_drop(st);
+	stream_put(st);
+	return 0;
+}
+
 void
 marshall::rawbyte(unsigned char x)
 {
@@ -859,6 +1480,13 @@ operator<<(marshall &m, const std::string &s)
 	return m;
 }
 
+marshall &
+operator<<(marshall &m, const prepacked &p)
+{
+	m.rawbytes(p.data(), p.size());
+	return m;
+}
+
 marshall &
 operator<<(marshall &m, unsigned long long x)
 {
@@ -9,6 +9,7 @@
 #include "thr_pool.h"
 #include "marshall.h"
 #include "connection.h"
+#include "qos.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -17,6 +18,15 @@
 class rpc_const {
 	public:
 		static const unsigned int bind = 1;   // handler number reserved for bind
+		// handler numbers reserved for streamed calls
+		static const unsigned int stream_open = 2;
+		static const unsigned int stream_write = 3;
+		static const unsigned int stream_read = 4;
+		static const unsigned int stream_close = 5;
+		// handler number reserved for rpcs's qos counters, as text
+		static const unsigned int qos_stats = 6;
+		// largest chunk a stream moves per RPC, well below MAX_PDU
+		static const int stream_chunk = 1<<20;
 		static const int timeout_failure = -1;
 		static const int unmarshal_args_failure = -2;
 		static const int unmarshal_reply_failure = -3;
@@ -24,6 +34,8 @@ class rpc_const {
 		static const int oldsrv_failure = -5;
 		static const int bind_failure = -6;
 		static const int cancel_failure = -7;
+		static const int stream_failure = -8;
+		static const int qos_failure = -9;
 };
 
 // rpc client endpoint.
@@ -58,6 +70,8 @@ class rpcc : public chanmgr {
 		int lossytest_;
 		bool retrans_;
 		bool reachable_;
+		int hb_interval_;
+		int hb_maxmiss_;
 
 		connection *chan_;
 
@@ -89,12 +103,30 @@ class rpcc : public chanmgr {
 		void set_reachable(bool r) { reachable_ = r; }
 		bool reachable() { return reachable_;}
 
+		//ping the server every interval ms when the connection is idle
+		//and fail pending calls after maxmiss unanswered pings
+		void set_heartbeat(int interval, int maxmiss = 3);
+
 		void cancel();
 
+		// streamed calls, for bodies too large to marshall in one PDU.
+		// stream_open() starts a call to a proc registered with
+		// rpcs::reg_stream(); the request body is then pushed with
+		// stream_write() and the reply body pulled with stream_read(),
+		// at most rpc_const::stream_chunk bytes at a time.
+		// stream_close() returns the handler's final status.
+		int stream_open(unsigned int proc, const std::string &arg, int &sid,
+				TO to = to_max);
+		int stream_write(int sid, const std::string &chunk, TO to = to_max);
+		int stream_read(int sid, std::string &chunk, bool &eof, 
+				TO to = to_max);
+		int stream_close(int sid, TO to = to_max);
+
 		int call1(unsigned int proc, 
 				marshall &req, unmarshall &rep, TO to);
 
 		bool got_pdu(connection *c, char *b, int sz);
+		void conn_dead(connection *c);
 
 
 		template<class R>
@@ -245,6 +277,33 @@ class handler {
 		virtual int fn(unmarshall &, marshall &) = 0;
 };
 
+// server side of one streamed call. rpcs creates it when the client
+// opens the stream, hands it the request body with write() and asks
+// read() for the reply body until it sets eof. each chunk should stay
+// under rpc_const::stream_chunk. the values write() and close() return
+// reach the client; a negative read() fails the client's stream_read()
+// with stream_failure. calls on one stream never overlap.
+class stream_handler {
+	public:
+		stream_handler() { }
+		virtual ~stream_handler() { }
+		virtual int write(const std::string &chunk) { 
+			return rpc_const::stream_failure; 
+		}
+		virtual int read(std::string &chunk, bool &eof) { 
+			eof = true; 
+			return 0; 
+		}
+		virtual int close() { return 0; }
+};
+
+class stream_opener {
+	public:
+		stream_opener() { }
+		virtual ~stream_opener() { }
+		virtual stream_handler *open(const std::string &arg) = 0;
+};
+
 
 // rpc server endpoint.
 class rpcs : public chanmgr {
@@ -278,8 +337,48 @@ class rpcs : public chanmgr {
 	// per client that that client hasn't acknowledged receiving yet.
 	std::map<unsigned int, std::list<reply_t> > reply_window_;
 
+	// clients whose reply window was reclaimed after their connection
+	// died: any xid at or below the floor is FORGOTTEN
+	std::map<unsigned int, unsigned int> xid_floor_;
+
+	// open streams
+	struct stream_t {
+		stream_t(stream_handler *xh, unsigned int n)
+			: h(xh), sid(0), clt_nonce(n), refs(1), closed(false), last(0) {
+			assert(pthread_mutex_init(&m, 0) == 0);
+		}
+		~stream_t() {
+			assert(pthread_mutex_destroy(&m) == 0);
+			delete h;
+		}
+		stream_handler *h;
+		int sid;
+		unsigned int clt_nonce;
+		int refs;
+		bool closed; // set under both m and streams_m_
+		time_t last; // monotonic seconds of the last call on it
+		pthread_mutex_t m; // serializes calls into h
+	};
+	std::map<int, stream_t *> streams_;
+	std::map<int, stream_opener *> stream_procs_;
+	int next_sid_;
+	pthread_mutex_t streams_m_; // protect streams_ and stream_procs_
+
+	stream_t *stream_get(int sid);
+	void stream_put(stream_t *st);
+	void stream_drop(stream_t *st);
+
+	// streams left without a call for stream_idle_ seconds are
+	// dropped by reaper_th_, started with the first stream
+	int stream_idle_;
+	bool reaper_started_;
+	bool reaper_stop_;
+	pthread_cond_t reaper_c_;
+	pthread_t reaper_th_;
+	void reap_loop();
+
 	void free_reply_window(void);
-	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+	bool add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
 
 	rpcstate_t checkduplicate_and_update(unsigned int clt_nonce, 
 			unsigned int xid, unsigned int rep_xid,
@@ -295,8 +394,14 @@ class rpcs : public chanmgr {
 	int curr_counts_;
 	std::map<int, int> counts_;
 
+	// requests dropped because their caller had already given up
+	int expired_;
+	long long expired_bytes_;
+
 	int lossytest_; 
 	bool reachable_;
+	int hb_interval_;
+	int hb_maxmiss_;
 
 	// map proc # to function
 	std::map<int, handler *> procs_;
@@ -310,30 +415,78 @@ class rpcs : public chanmgr {
 	protected:
 
 	struct djob_t {
-		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c) {}
+		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c),
+			refused(false) {}
 		char *buf;
 		int sz;
 		connection *conn;
+		struct timespec arrived;
+		bool refused; // by qos_: reply qos_failure without running it
 	};
 	void dispatch(djob_t *);
+	void work(djob_t *);
+
+	// connections holding a pdu got_pdu() turned down for want of
+	// room in dispatchpool_; each job that finishes offers one of
+	// them its turn again, and counts itself in finished_ to wake
+	// qos_th_ if it is waiting on room_c_ to do the same for a
+	// deferred call
+	std::list<connection *> stalled_;
+	pthread_mutex_t stalled_m_;
+	pthread_cond_t room_c_;
+	unsigned long long finished_;
+	void unstall();
 
 	// internal handler registration
 	void reg1(unsigned int proc, handler *);
+	void reg_stream1(unsigned int proc, stream_opener *);
 
 	ThrPool* dispatchpool_;
 	tcpsconn* listener_;
 
+	// per-client rate limits in front of dispatchpool_, NULL unless
+	// RPC_QOS_OPS or RPC_QOS_BYTES is set; qos_th_ feeds the calls it
+	// deferred to the pool as their clients' buckets refill. clients
+	// get the weight RPC_QOS_WEIGHTS gives their address when they bind
+	qos *qos_;
+	pthread_t qos_th_;
+	void qos_loop();
+
 	public:
 	rpcs(unsigned int port, int counts=0);
 	~rpcs();
 
 	//RPC handler for clients binding
 	int rpcbind(int a, int &r);
+	int qosstats(int a, std::string &out);
+
+	//RPC handlers behind rpcc::stream_*
+	int streamopen(unsigned int clt_nonce, unsigned int proc, 
+			std::string arg, int &sid);
+	int streamwrite(int sid, std::string chunk, int &r);
+	int streamclose(int sid, int &r);
+	int streamread(int sid, std::string &chunk);
 
 	void set_reachable(bool r) { reachable_ = r; }
 	bool reachable() { return reachable_;}
 
 	bool got_pdu(connection *c, char *b, int sz);
+	void conn_dead(connection *c);
+
+	// number of requests dropped unexecuted because they expired
+	int expired();
+
+	// the nonce of the client whose request the calling thread is
+	// running a handler for; 0 outside handlers and for clients that
+	// do without at-most-once
+	static unsigned int caller();
+
+	// register a streamed proc; sob->meth is called with the argument
+	// of each rpcc::stream_open() and returns the stream's handler, or
+	// NULL to refuse it
+	template<class S>
+		void reg_stream(unsigned int proc, S*, 
+				stream_handler *(S::*meth)(const std::string arg));
 
 	// register a handler
 	template<class S, class A1, class R>
@@ -595,6 +748,23 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 	reg1(proc, new h1(sob, meth));
 }
 
+template<class S> void
+rpcs::reg_stream(unsigned int proc, S*sob, 
+		stream_handler *(S::*meth)(const std::string arg))
+{
+	class o1 : public stream_opener {
+		private:
+			S * sob;
+			stream_handler *(S::*meth)(const std::string arg);
+		public:
+			o1(S *xsob, stream_handler *(S::*xmeth)(const std::string arg))
+				: sob(xsob), meth(xmeth) { }
+			stream_handler *open(const std::string &arg) {
+				return (sob->*meth)(arg);
+			}
+	};
+	reg_stream1(proc, new o1(sob, meth));
+}
 
 void make_sockaddr(const char *hostandport, struct sockaddr_in *dst);
 void make_sockaddr(const char *host, const char *port,
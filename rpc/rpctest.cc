@@ -27,8 +27,58 @@ class srv {
 		int handle_fast(const int a, int &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		int handle_sleep(const int a, int &r);
+		stream_handler *open_pattern(const std::string a);
 };
 
+// a streamed handler. the argument of stream_open() is the body length;
+// the request body must be that many pattern bytes, and the reply body
+// is the same pattern again, so neither side holds the whole thing.
+class pattern_stream : public stream_handler {
+	public:
+		pattern_stream(long long n) : len(n), in(0), out(0), bad(false) { }
+		int write(const std::string &chunk);
+		int read(std::string &chunk, bool &eof);
+		int close();
+		static char at(long long i) { return (char) (i * 7 % 251); }
+	private:
+		long long len;
+		long long in;
+		long long out;
+		bool bad;
+};
+
+int
+pattern_stream::write(const std::string &chunk)
+{
+	for (unsigned int i = 0; i < chunk.size(); i++) {
+		if (chunk[i] != at(in + i))
+			bad = true;
+	}
+	in += chunk.size();
+	return 0;
+}
+
+int
+pattern_stream::read(std::string &chunk, bool &eof)
+{
+	long long n = len - out;
+	if (n > rpc_const::stream_chunk)
+		n = rpc_const::stream_chunk;
+	chunk.resize(n);
+	for (long long i = 0; i < n; i++)
+		chunk[i] = at(out + i);
+	out += n;
+	eof = (out == len);
+	return 0;
+}
+
+int
+pattern_stream::close()
+{
+	return (bad || (in != 0 && in != len)) ? -1 : 0;
+}
+
 // a handler. a and b are arguments, r is the result.
 // there can be multiple arguments but only one result.
 // the caller also gets to see the int return value
@@ -65,6 +115,20 @@ srv::handle_bigrep(const int len, std::string &r)
 	return 0;
 }
 
+int
+srv::handle_sleep(const int ms, int &r)
+{
+	usleep(ms * 1000);
+	r = ms;
+	return 0;
+}
+
+stream_handler *
+srv::open_pattern(const std::string a)
+{
+	return new pattern_stream(atoll(a.c_str()));
+}
+
 srv service;
 
 void startserver()
@@ -74,6 +138,8 @@ void startserver()
 	server->reg(23, &service, &srv::handle_fast);
 	server->reg(24, &service, &srv::handle_slow);
 	server->reg(25, &service, &srv::handle_bigrep);
+	server->reg(26, &service, &srv::handle_sleep);
+	server->reg_stream(27, &service, &srv::open_pattern);
 }
 
 void
@@ -277,6 +343,259 @@ concurrent_test(int nt)
 	printf(" OK\n");
 }
 
+void
+heartbeat_test()
+{
+	printf("heartbeat_test\n");
+
+	// a peer that completes the tcp handshake but never answers,
+	// like a hung server process.
+	struct sockaddr_in silent;
+	memset(&silent, 0, sizeof(silent));
+	silent.sin_family = AF_INET;
+	silent.sin_addr.s_addr = inet_addr("127.0.0.1");
+	silent.sin_port = htons(port+1);
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	int yes = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	assert(bind(s, (sockaddr *)&silent, sizeof(silent)) == 0);
+	assert(listen(s, 10) == 0);
+
+	rpcc *c = new rpcc(silent);
+	c->set_heartbeat(100, 3);
+	time_t t0 = time(0);
+	int intret = c->bind(rpcc::to(20000));
+	time_t t1 = time(0);
+	assert(intret == rpc_const::timeout_failure && (t1 - t0) <= 2);
+	printf("   -- silent peer detected by heartbeat .. ok\n");
+	delete c;
+	close(s);
+
+	// heartbeats must not kill a healthy idle connection
+	c = new rpcc(dst);
+	c->set_heartbeat(100, 3);
+	assert(c->bind() == 0);
+	usleep(1000000);
+	int rep;
+	intret = c->call(23, 1, rep, rpcc::to(3000));
+	assert(intret == 0 && rep == 2);
+	printf("   -- idle connection kept alive .. ok\n");
+	delete c;
+	printf("heartbeat_test OK\n");
+}
+
+void *
+client4(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	int rep;
+	int ret = c->call(26, 1000, rep);
+	assert(ret == 0 && rep == 1000);
+	return 0;
+}
+
+void
+deadline_test()
+{
+	printf("deadline_test\n");
+
+	// occupy every dispatch thread so the next request has to queue
+	int nt = 10;
+	pthread_t th[nt];
+	for(int i = 0; i < nt; i++){
+		assert(pthread_create(&th[i], &attr, client4, (void *) clients[1]) == 0);
+	}
+	usleep(200000);
+
+	int expired = server->expired();
+	int rep;
+	int intret = clients[0]->call(23, 1, rep, rpcc::to(200));
+	assert(intret == rpc_const::timeout_failure);
+
+	for(int i = 0; i < nt; i++){
+		assert(pthread_join(th[i], NULL) == 0);
+	}
+	usleep(100000);
+	assert(server->expired() > expired);
+	printf("   -- queued request dropped after its caller gave up .. ok\n");
+	printf("deadline_test OK\n");
+}
+
+void *
+client5(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	int rep;
+	int ret = c->call(26, 5, rep, rpcc::to(15000));
+	assert(ret == 0 && rep == 5);
+	return 0;
+}
+
+void
+stall_test()
+{
+	printf("stall_test\n");
+
+	// more calls at once than the dispatch pool queues, all on one
+	// connection that sends nothing after them and never retransmits:
+	// those turned away must be taken up again as the workers free up
+	rpcc *c = new rpcc(dst, false);
+	assert(c->bind() == 0);
+	int nt = 1200;
+	pthread_t *th = new pthread_t[nt];
+	time_t t0 = time(0);
+	for(int i = 0; i < nt; i++){
+		assert(pthread_create(&th[i], &attr, client5, (void *) c) == 0);
+	}
+	for(int i = 0; i < nt; i++){
+		assert(pthread_join(th[i], NULL) == 0);
+	}
+	assert(time(0) - t0 < 10);
+	delete [] th;
+	delete c;
+	printf("   -- %d calls past a full dispatch queue .. ok\n", nt);
+	printf("stall_test OK\n");
+}
+
+void
+stream_test(rpcc *c)
+{
+	printf("stream_test\n");
+
+	// three times MAX_PDU, one chunk at a time
+	long long len = 30 << 20;
+	char lenbuf[32];
+	snprintf(lenbuf, sizeof(lenbuf), "%lld", len);
+
+	int sid;
+	int ret = c->stream_open(27, lenbuf, sid);
+	assert(ret == 0);
+	std::string chunk;
+	for (long long off = 0; off < len; off += rpc_const::stream_chunk) {
+		chunk.resize(rpc_const::stream_chunk);
+		for (int i = 0; i < rpc_const::stream_chunk; i++)
+			chunk[i] = pattern_stream::at(off + i);
+		ret = c->stream_write(sid, chunk);
+		assert(ret == 0);
+	}
+	bool eof = false;
+	long long got = 0;
+	while (!eof) {
+		ret = c->stream_read(sid, chunk, eof);
+		assert(ret == 0);
+		assert(chunk.size() <= (unsigned) rpc_const::stream_chunk);
+		for (unsigned int i = 0; i < chunk.size(); i++)
+			assert(chunk[i] == pattern_stream::at(got + i));
+		got += chunk.size();
+	}
+	assert(got == len);
+	ret = c->stream_close(sid);
+	assert(ret == 0);
+	printf("   -- 30M request and reply bodies streamed .. ok\n");
+
+	ret = c->stream_open(27, "10", sid);
+	assert(ret == 0);
+	ret = c->stream_write(sid, "oops");
+	assert(ret == 0);
+	ret = c->stream_close(sid);
+	assert(ret == -1);
+	ret = c->stream_write(sid, "oops");
+	assert(ret == rpc_const::stream_failure);
+	printf("   -- handler status returned by close .. ok\n");
+
+	ret = c->stream_open(99, "", sid);
+	assert(ret == rpc_const::stream_failure);
+	printf("   -- open of unregistered stream .. failed ok\n");
+
+	printf("stream_test OK\n");
+}
+
+void
+stream_idle_test()
+{
+	printf("stream_idle_test\n");
+
+	// a client that opens a stream and goes quiet, with no heartbeats
+	// to notice it, must not pin the stream forever
+	delete server;
+	assert(setenv("RPC_STREAM_IDLE", "1", 1) == 0);
+	startserver();
+	assert(unsetenv("RPC_STREAM_IDLE") == 0);
+
+	rpcc *c = new rpcc(dst);
+	assert(c->bind() == 0);
+	int sid;
+	assert(c->stream_open(27, "100", sid) == 0);
+	assert(c->stream_write(sid, std::string(10, pattern_stream::at(0))) >= 0);
+	usleep(2500000);
+	assert(c->stream_write(sid, "x") == rpc_const::stream_failure);
+	printf("   -- idle stream dropped .. ok\n");
+	delete c;
+	printf("stream_idle_test OK\n");
+}
+
+static int qos_ok, qos_refused;
+static pthread_mutex_t qos_m = PTHREAD_MUTEX_INITIALIZER;
+
+void *
+client6(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	int rep;
+	int ret = c->call(23, 1, rep, rpcc::to(5000));
+	assert(ret == 0 || ret == rpc_const::qos_failure);
+	assert(pthread_mutex_lock(&qos_m) == 0);
+	if (ret == 0)
+		qos_ok++;
+	else
+		qos_refused++;
+	assert(pthread_mutex_unlock(&qos_m) == 0);
+	return 0;
+}
+
+void
+qos_test()
+{
+	printf("qos_test\n");
+
+	// 10 calls a second at weight 3 from this address, with four
+	// queued at most: a burst of 40 runs a few, defers a few and
+	// turns the rest away at once
+	delete server;
+	assert(setenv("RPC_QOS_OPS", "10", 1) == 0);
+	assert(setenv("RPC_QOS_QUEUE", "4", 1) == 0);
+	assert(setenv("RPC_QOS_WEIGHTS", "127.0.0.1=3", 1) == 0);
+	startserver();
+	assert(unsetenv("RPC_QOS_OPS") == 0);
+	assert(unsetenv("RPC_QOS_QUEUE") == 0);
+	assert(unsetenv("RPC_QOS_WEIGHTS") == 0);
+
+	rpcc *c = new rpcc(dst);
+	assert(c->bind() == 0);
+	int nt = 40;
+	pthread_t th[nt];
+	for(int i = 0; i < nt; i++){
+		assert(pthread_create(&th[i], &attr, client6, (void *) c) == 0);
+	}
+	for(int i = 0; i < nt; i++){
+		assert(pthread_join(th[i], NULL) == 0);
+	}
+	assert(qos_ok + qos_refused == nt);
+	assert(qos_ok >= 5 && qos_refused > 0);
+	printf("   -- %d run, %d refused past a full queue .. ok\n", qos_ok,
+			qos_refused);
+
+	std::string st;
+	assert(c->call(rpc_const::qos_stats, 0, st) == 0);
+	assert(st.find("weight 3") != std::string::npos);
+	printf("   -- weight taken from the server's table .. ok\n");
+	delete c;
+
+	delete server;
+	startserver();
+	printf("qos_test OK\n");
+}
+
 void 
 lossy_test()
 {
@@ -459,6 +778,14 @@ main(int argc, char *argv[])
 
 		simple_tests(clients[0]);
 		concurrent_test(10);
+		heartbeat_test();
+		stream_test(clients[0]);
+		if (isserver) {
+			deadline_test();
+			stall_test();
+			stream_idle_test();
+			qos_test();
+		}
 		lossy_test();
 		if (isserver) {
 			failure_test();
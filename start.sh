@@ -51,9 +51,29 @@ fi
 
 unset RPC_LOSSY
 
-echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
-./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
-sleep 1
+# EXTENT_SHARDS=n starts n extent servers, which the yfs_clients
+# share the extents between
+if [ -z $EXTENT_SHARDS ]; then
+    EXTENT_SHARDS=1
+fi
+
+if [ $EXTENT_SHARDS -gt 1 ]; then
+    x=0
+    EXTENT_PORTS=""
+    while [ $x -lt $EXTENT_SHARDS ]; do
+      port=$[EXTENT_PORT+100+2*x]
+      x=$[x+1]
+      echo "starting ./extent_server $port > extent_server$x.log 2>&1 &"
+      ./extent_server $port > extent_server$x.log 2>&1 &
+      EXTENT_PORTS=$EXTENT_PORTS${EXTENT_PORTS:+,}$port
+    done
+    EXTENT_PORT=$EXTENT_PORTS
+    sleep 1
+else
+    echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
+    ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
+    sleep 1
+fi
 
 mkdir -p $YFSDIR1
 sleep 1
@@ -12,9 +12,10 @@
 #include <math.h>
 #include <algorithm>
 
-#define BLOCK_SIZE 1024.0
+#define BLOCK_SIZE ((double) extent_protocol::blocksize)
 
-yfs_client::yfs_client(std::string extent_dst, std::string lock_dst)
+yfs_client::yfs_client(std::string extent_dst, std::string lock_dst, bool cas)
+  : dircas(cas)
 {
   ec = new extent_client(extent_dst);
   lc = new lock_client_cache(lock_dst);
@@ -87,145 +88,88 @@ yfs_client::isdir(inum inum)
   return ! isfile(inum);
 }
 
+// Add (name, child) to parent's listing, or with add unset take name
+// out of it. found is the inum already listed under name, which makes
+// an add fail with EXIST. Without dircas the caller holds parent's lock;
+// with it the new listing is put only if parent has not changed since
+// it was read, and the edit is redone on the listing that won.
 int
-yfs_client::unlink(inum parent, const char* name, bool do_not_lock)
+yfs_client::dirchange(inum parent, const char* name, inum child, bool add,
+                      inum & found)
 {
-  // If do_not_lock is set, assumes parent lock is acquired
-  if (!do_not_lock) lc->acquire(parent);
-  yfs_client::inum inum;
-  yfs_client::status ret = lookup(yfs_client::f2i(parent), name, inum);
-  if (ret == extent_protocol::NOENT)
-  {
-    if (!do_not_lock) lc->release(parent);
-    return NOENT;
-  }
-  else if (ret != extent_protocol::OK)
-  {
-    if (!do_not_lock) lc->release(parent);
+  std::string val;
+  extent_protocol::attr a;
+  if (ec->get(parent, val, &a) != extent_protocol::OK)
     return IOERR;
-  } 
-  lc->acquire(inum);
-
 
-  yfs_client::status r = OK;
-  if (isdir(inum))
+  std::string target(name);
+  while (true)
   {
-
-    // First remove dir contents:
-    std::vector<yfs_client::dirent> v;
-    getdircontents_nonsafe(inum, v);
-
-    std::vector<yfs_client::dirent>::iterator it;
-    for (it = v.begin(); it < v.end(); it++)
+    std::istringstream is(val);
+    std::ostringstream os;
+    yfs_client::inum self;
+    is >> self;
+    os << self;
+    bool listed = false;
+    yfs_client::inum entry_inum;
+    std::string entry_name;
+    while (is >> entry_inum >> entry_name)
     {
-      yfs_client::dirent entry = *it;
-      if (unlink(inum, entry.name.c_str(), do_not_lock) != yfs_client::OK)
+      if (entry_name == target)
       {
-        r = IOERR;
-        break;
+        listed = true;
+        found = entry_inum;
+        if (!add)
+          continue;
       }
+      os << " " << entry_inum << " " << entry_name;
     }
-    if (r != OK)
-    {
-      lc->release(inum);
-      if (!do_not_lock) lc->release(parent);
-      return r;
-    }
-
-    // Remove directory itself
-    extent_protocol::status r = ec->remove(inum);
-    if (r == extent_protocol::OK)
-      r = OK;
-    else if (r == extent_protocol::NOENT)
-    {
-      r =  NOENT;
-      lc->release(inum);
-      if (!do_not_lock) lc->release(parent);
-      return r;
-    }
-    else
-    {
-      r = IOERR;
-      lc->release(inum);
-      if (!do_not_lock) lc->release(parent);
-      return r;
-    }
-  }
-  else
-  {
-    r = ec->remove(inum) != extent_protocol::OK;
-    if (r == extent_protocol::OK)
-      r = OK;
-    else if (r == extent_protocol::NOENT)
-    {
-      r = NOENT;
-      lc->release(inum);
-      if (!do_not_lock) lc->release(parent);      
-      return r;
-    }
-    else
-    {
-      r = IOERR;
-      lc->release(inum);
-      if (!do_not_lock) lc->release(parent);      
-      return r;
-    }
-
-    // Now remove next blocks for this file
-    int i = 1;
-    int64_t key = yfs_client::i2bi(inum, i);
-    extent_protocol::status r;
-    extent_protocol::attr a;
-    while ( (r = ec->getattr(key, a)) != extent_protocol::NOENT) 
-    {
-      if (r != extent_protocol::OK)
-      {
-        lc->release(inum);
-        if (!do_not_lock) lc->release(parent);
-        return IOERR; // unexpected error type;
-      }
+    if (add && listed)
+      return EXIST;
+    if (!add && !listed)
+      return NOENT;
+    if (add)
+      os << " " << child << " " << target;
 
-      if (ec->remove(inum) != extent_protocol::OK)
-      {
-        lc->release(inum);
-        if (!do_not_lock) lc->release(parent);
-        return IOERR;
-      }
-
-      i++;
-      key = yfs_client::i2bi(inum, i);
-    }
+    if (!dircas)
+      return ec->put(parent, os.str()) == extent_protocol::OK ? OK : IOERR;
 
+    extent_protocol::status r = ec->putifversion(parent, a.version, os.str(), val, a);
+    if (r == extent_protocol::OK)
+      return OK;
+    if (r != extent_protocol::CONFLICT)
+      return IOERR;
+    printf("    %llu changed under us, retrying\n", parent);
   }
+}
 
+int
+yfs_client::unlink(inum parent, const char* name, bool do_not_lock)
+{
+  // If do_not_lock is set, assumes parent lock is acquired
+  bool lockparent = !do_not_lock && !dircas;
+  if (lockparent) lc->acquire(parent);
 
-  // Now remove this entry from parents content
-  std::vector<yfs_client::dirent> v;
-  getdircontents_nonsafe(parent, v);
-
-  std::ostringstream os;
-  std::vector<yfs_client::dirent>::iterator it;
-  os << parent;
-  for (it = v.begin(); it < v.end(); it++)
-  {
-    yfs_client::dirent entry = *it;
-    if (entry.inum != inum)
-    {
-      os << " ";
-      os << entry.inum;
-      os << " ";
-      os << entry.name;
-    }
-  }
-  std::string contents(os.str());
-  ec->put(parent, trim(contents));
-  printf("New directory contents: %s\n", trim(contents).c_str());
+  // Take the entry out of the listing first, so nobody finds it while
+  // it is being deleted
+  yfs_client::inum inum;
+  yfs_client::status r = dirchange(parent, name, 0, false, inum);
+  if (lockparent) lc->release(parent);
+  if (r != OK)
+    return r;
 
+  // The extent server removes every block of a file, or a whole
+  // directory subtree, in one call
+  lc->acquire(inum);
+  extent_protocol::reclaimed rec;
+  extent_protocol::status er = ec->removetree(inum, rec);
   lc->release(inum);
-  if (!do_not_lock) lc->release(parent);
-
-  return r;
+  if (er != extent_protocol::OK && er != extent_protocol::NOENT)
+    return IOERR;
+  printf("    removed %u files, %u extents, %llu bytes\n", rec.files,
+         rec.extents, rec.bytes);
 
+  return OK;
 }
 
 int
@@ -241,8 +185,8 @@ yfs_client::getfile(inum inum, fileinfo &fin)
     goto release;
   }
 
-  size_t sz;
-  if (getsize(inum, sz) != OK)
+  extent_protocol::filestat st;
+  if (ec->stat(inum, st) != extent_protocol::OK)
   {
     r = IOERR;
     goto release;
@@ -252,7 +196,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
   fin.atime = a.atime;
   fin.mtime = a.mtime;
   fin.ctime = a.ctime;
-  fin.size = sz;
+  fin.size = st.size;
   printf("getfile %016llx -> sz %llu\n", inum, fin.size);
 
  release:
@@ -265,29 +209,12 @@ yfs_client::getsize(inum inum, size_t & size)
 {
   printf("YFS::getsize(%llu)\n", inum);
 
-  // -----------------------
-  // Calculate current size
-  // -----------------------
-  // First block size
-  extent_protocol::attr a;
-  if (ec->getattr(inum, a) != extent_protocol::OK) 
+  // the extent server keeps the total over all of the file's blocks
+  extent_protocol::filestat st;
+  if (ec->stat(inum, st) != extent_protocol::OK) 
     return IOERR;
 
-  size = a.size;
-
-  // Now add up next blocks sizes
-  int i = 1;
-  int64_t key = yfs_client::i2bi(inum, i);
-  extent_protocol::status r;
-  while ( (r = ec->getattr(key, a)) != extent_protocol::NOENT) 
-  {
-    if (r != extent_protocol::OK)
-      return IOERR; // unexpected error type;
-
-    size += a.size;
-    i++;
-    key = yfs_client::i2bi(inum, i);
-  }
+  size = st.size;
   return OK;
 
 }
@@ -298,153 +225,48 @@ yfs_client::setsize(inum inum, size_t target_size)
 
   printf("YFS::setsize(%llu, %lu)\n", inum, target_size);
 
-  // -----------------------
-  // Calculate current size
-  // -----------------------
-
-  // First block size
-  extent_protocol::attr a;
-  size_t size;
-  if (ec->getattr(inum, a) != extent_protocol::OK) 
+  // the server drops the blocks past the new end and cuts or extends
+  // the one holding it; a file that grows gets a hole, not zero blocks
+  if (ec->truncate(inum, target_size) != extent_protocol::OK)
     return IOERR;
 
-  size = a.size;
-  size_t last_block_size = a.size;
-
-  // Now add up next blocks sizes
-  int i = 1;
-  int64_t key = yfs_client::i2bi(inum, i);
-
-  extent_protocol::status r;
-  while ( (r = ec->getattr(key, a)) != extent_protocol::NOENT) 
-  {
-    if (r != extent_protocol::OK)
-      return IOERR; // unexpected error type;
-
-    size += a.size;
-    last_block_size = a.size;
-    i++;
-    key = yfs_client::i2bi(inum, i);
-  }
-
-  if (target_size > size)
-  {
-    // Expand size
-    int remaining_new_size = target_size - size;
-    int curr_block = i;
-    int avail_size = BLOCK_SIZE;
-
-    // Can we use some space from last block ?
-    if (last_block_size < BLOCK_SIZE)
-    {
-      curr_block = i - 1;
-      avail_size = BLOCK_SIZE - last_block_size;
-    }
-    
-    while (remaining_new_size > 0)
-    {
-      key = yfs_client::i2bi(inum, curr_block);
-      std::ostringstream os;
-      if (avail_size < BLOCK_SIZE)
-      {
-        // We are appending to an exisiting block, we need to fetch existing data
-        std::string val;
-        if (ec->get(key, val) != extent_protocol::OK) 
-          return IOERR;
-        os << val;        
-      }
-
-      // Let's fill up remaining space with 0
-      int new_data_size = std::min(avail_size, remaining_new_size);
-      char filler[new_data_size];
-      memset(filler, '\0', new_data_size);
-      os << filler;
-      if (ec->put(key, os.str().data()) != extent_protocol::OK) 
-        return IOERR;      
-
-      remaining_new_size -= new_data_size;
-
-      // For next iteration (new block)
-      avail_size = avail_size - BLOCK_SIZE;
-      curr_block++;
-    }
-    
-
-  }
-  else if (target_size < size)
-  {
-    printf("    truncating size from %lu to %lu\n", size, target_size);
-    // This one is easier, we iterate through current blocks
-    // until we reach desired size, then we remove remaining blocks
-    int curr_block = -1;
-    size_t remaining_size = target_size;
-    while (true)
-    {
-      printf("    remaining size %lu\n", remaining_size);
-      curr_block++;
-      yfs_client::inum key = yfs_client::i2bi(inum, curr_block);
-      extent_protocol::attr a;
-      extent_protocol::status r = ec->getattr(key, a);
-      if (r != extent_protocol::NOENT)
-      {
-        if (r != extent_protocol::OK)
-          return IOERR;
-
-        if (remaining_size <= 0) // we've already reached desired size, remove block
-        {
-          printf("    removing block %d\n", curr_block);
-          if (ec->remove(key) != extent_protocol::OK)
-            return IOERR;
-          continue;
-        }
-
-        if (a.size > remaining_size)
-        {
-          printf("    truncating block %d to %lu\n", curr_block, remaining_size);
-          // truncate this block 
-          std::string val;
-          if (ec->get(key, val) != extent_protocol::OK) 
-            return IOERR;
-
-          if (ec->put(key, val.substr(0, remaining_size)) != extent_protocol::OK)
-            return IOERR;
-
-        }
-        else
-        {
-          printf("    keeping block %d\n", curr_block);
-          // keep this block, but subtract from remaining size
-          remaining_size -= a.size;
-        }
+  return OK;
 
+}
 
-      }
-      else
-      {
-        printf("    reached last block (total blocks = %d)\n", curr_block);
-        break; // we've reached last block
-      }
-    }
+int
+yfs_client::clone(inum src, inum dst)
+{
+  printf("YFS::clone(%llu, %llu)\n", src, dst);
 
-  }
+  if (!isfile(src) || !isfile(dst))
+    return NOENT;
+  if (ec->clone(src, dst) != extent_protocol::OK)
+    return IOERR;
 
   return OK;
+}
 
+int
+yfs_client::add_shard(std::string dst)
+{
+  printf("YFS::add_shard(%s)\n", dst.c_str());
 
+  extent_protocol::status r = ec->add_shard(dst);
+  if (r == extent_protocol::RPCERR)
+    return RPCERR;
+  if (r != extent_protocol::OK)
+    return IOERR;
 
-
- 
+  return OK;
 }
 
 int
 yfs_client::updatetime(inum inum)
 {
   printf("Updating time for %llu\n", inum);
-  std::string firstblock;
-  if (ec->get(inum, firstblock) != extent_protocol::OK)
-    return IOERR;
-  
-  if (ec->put(inum, firstblock) != extent_protocol::OK)
+  // an empty write moves no data but stamps mtime and ctime
+  if (ec->write(inum, 0, std::string()) != extent_protocol::OK)
     return IOERR;
 
   return OK;  
@@ -456,69 +278,10 @@ yfs_client::write(inum inum, const char* c_contents, size_t size, off_t offset)
 {
   printf("YFS::write(%llu, %ld, %lu)\n", inum, offset, size);
 
-  // Determine the first block to write at
-  int start = (int)floor(offset / BLOCK_SIZE);
-
-  // Offset for first block
-  int first_offset = offset - (start * BLOCK_SIZE);
-  printf("    first block: %d, first_offset: %d\n", start, first_offset);
-
-  // Write to blocks
+  // the client splits it over the blocks, streaming large writes
   std::string contents(c_contents, size);
-  int remaining_size = size;
-
-  int curr_block = start;
-  int total_written = 0;
-  int i=0;
-  while (remaining_size > 0)
-  {
-    yfs_client::inum key = yfs_client::i2bi(inum, curr_block);
-    
-    // Get existing data in the block
-    std::string datastr;
-    int ret = ec->get(key, datastr);
-    if (ret != extent_protocol::OK && ret != extent_protocol::NOENT) {
-      return IOERR;
-    }
-
-    // determine how much of the buffer we want to copy
-    int written_bytes = std::min((int)(BLOCK_SIZE - first_offset), remaining_size);
-    printf("    writing %d bytes to block %d of inum %llu:\n", written_bytes, curr_block, inum);
-    printf("    contents.substring(%d, %d) of %lu\n", total_written, written_bytes,contents.size());
-
-    // allocate a tmp buffer to copy from
-    char tmp_buf[written_bytes];
-    memset(tmp_buf, '\0', written_bytes);
-    memcpy(tmp_buf, contents.data()+total_written, written_bytes);
-    
-    // allocate a buffer for complete data
-    size_t datasize = std::max((int)datastr.size(), first_offset+written_bytes);
-    char databuf[datasize];
-    memcpy(databuf, datastr.data(), datastr.size()); // copy exiting data
-    memcpy(databuf+first_offset, tmp_buf, written_bytes); // copy new data
-
-
-    // Create an std::string object
-    std::string value(databuf, datasize);
-
-
-    // just for output 
-    std::string sub(tmp_buf, written_bytes);
-    printf("%s\n", sub.c_str());
-
-    
-    ret = ec->put(key, value);
-    if (ret != extent_protocol::OK) {
-      return IOERR;
-    }
-    // update numbers
-    remaining_size -= written_bytes;
-    total_written += written_bytes;
-    first_offset = 0;    
-    curr_block++;
-    i++;
-
-  }
+  if (ec->writefile(inum, offset, contents) != extent_protocol::OK)
+    return IOERR;
 
   return OK;
 
@@ -529,46 +292,14 @@ int
 yfs_client::read(inum inum, size_t size, off_t offset, std::string& out)
 {
   printf("YFS::read(%llu, %ld, %lu)\n", inum, offset, size);
-  // Determine the first block to read from
-  int start = (int)floor(offset / BLOCK_SIZE);
-
-  // How many blocks?
-  int total_blocks = (int)ceil(size / BLOCK_SIZE);
-
-  // Offset for first block
-  int first_offset = offset - (start * BLOCK_SIZE);
-
 
-  // Read blocks
-  std::ostringstream os;
-  printf("   first block: %d, total_blocks: %d\n", start, total_blocks);  
-  for (int i = start; i<start+total_blocks-1;i++)
-  {
-    yfs_client::inum key = yfs_client::i2bi(inum, i);
-
-    std::string val;
-
-    int ret = ec->get(key, val);
-    if (ret == extent_protocol::NOENT)
-      break; // done
-    else if (ret != extent_protocol::OK)
-      return IOERR;
-
-    std::string substr;
-    if (first_offset != 0)
-      substr = val.substr(first_offset, BLOCK_SIZE - first_offset);
-    else
-      substr = val;
-
-
-    printf("    just read block number: %d (block unique key: %llu): %s\n", i, key, substr.data());
-    os << substr.data();
-    first_offset = 0;
-
-  }
+  // the server reads across the blocks, filling in holes with zeros
+  std::string data;
+  int ret = ec->readfile(inum, offset, size, data);
+  if (ret != extent_protocol::OK)
+    return IOERR;
 
-  printf("    file contents:%s\n", os.str().data());
-  out = os.str(); 
+  out.swap(data);
 
   return OK;
 
@@ -577,9 +308,11 @@ yfs_client::read(inum inum, size_t size, off_t offset, std::string& out)
 int
 yfs_client::getdircontents(inum parent, std::vector<dirent>& list)
 {
-  lc->acquire(parent);
+  // listings only ever change by whole-extent puts, so with dircas a
+  // plain get sees a consistent one
+  if (!dircas) lc->acquire(parent);
   int r =getdircontents_nonsafe(parent, list);
-  lc->release(parent);
+  if (!dircas) lc->release(parent);
   return r;
 
 }
@@ -622,39 +355,27 @@ yfs_client::getdircontents_nonsafe(inum parent, std::vector<dirent>& list)
 int
 yfs_client::createdir(inum parent, const char* name, inum & out)
 {
-  int r = OK;
-  
-  lc->acquire(parent);
-
   uint32_t fuse_number = rand() & ~0x80000000;  // ensure first bit is not set
   inum inum = yfs_client::f2i(fuse_number);
 
   // Serialize an empty directory
   std::ostringstream oss;
   oss << inum;
-  int ret = ec->put(inum, oss.str());
-  if (ret != extent_protocol::OK) {
-    lc->release(parent);
+  if (ec->put(inum, oss.str()) != extent_protocol::OK)
     return IOERR;
-  }
-  out = inum;
 
   // Append an entry to parent
-  std::string parent_dir;
-  ret = ec->get(parent, parent_dir);
-  std::ostringstream os;
-  os << parent_dir;
-  os << " ";
-  os << inum;
-  os << " ";
-  os << std::string(name);
-  std::string contents(os.str());
-  ret = ec->put(parent, trim(contents));
-  if (ret != extent_protocol::OK)
-    r = IOERR;
-
-  lc->release(parent);
-  return r;
+  if (!dircas) lc->acquire(parent);
+  yfs_client::inum existing;
+  int r = dirchange(parent, name, inum, true, existing);
+  if (!dircas) lc->release(parent);
+  if (r != OK)
+  {
+    ec->remove(inum);
+    return r;
+  }
+  out = inum;
+  return OK;
 }
 
 int
@@ -662,53 +383,33 @@ yfs_client::createnode(inum parent, const char* name, inum & out)
 {
 
   printf("YFS::createnode(parent=%llu, %s)\n", parent, name);
-  lc->acquire(parent);
 
-  // Let's check if node exists already
-  yfs_client::inum existing_num = 0;
-  yfs_client::status lookret = lookup(parent, name, existing_num);
+  // Serialize an empty file, then append an entry to parent
+  uint32_t fuse_number = rand() | 0x80000000; 
+  inum inum = yfs_client::f2i(fuse_number);
+  if (ec->put(inum, std::string()) != extent_protocol::OK)
+    return IOERR;
 
+  if (!dircas) lc->acquire(parent);
+  yfs_client::inum existing = 0;
+  int r = dirchange(parent, name, inum, true, existing);
+  if (!dircas) lc->release(parent);
 
-  int r = OK;
-  yfs_client::inum inum = existing_num;
-  if (lookret == yfs_client::NOENT)
+  if (r == EXIST)
   {
-    uint32_t fuse_number = rand() | 0x80000000; 
-    inum = yfs_client::f2i(fuse_number);
-  }
-  lc->acquire(inum);
-
-  // Serialize an empty file
-  std::string empty;
-  int ret = ec->put(inum, empty);
-  if (ret != extent_protocol::OK) {
-    r = IOERR;
+    // The name is taken: truncate that file instead
+    ec->remove(inum);
+    inum = existing;
+    lc->acquire(inum);
+    r = ec->put(inum, std::string()) == extent_protocol::OK ? OK : IOERR;
     lc->release(inum);
-    lc->release(parent);
-    return r;
   }
-  out = inum;
-
-
-  // Append an entry to parent if neccessary
-  if (lookret == yfs_client::NOENT)
+  else if (r != OK)
   {
-    std::string parent_dir;
-    ret = ec->get(parent, parent_dir);
-    std::ostringstream os;
-    os << parent_dir;
-    os << " ";
-    os << inum;
-    os << " ";
-    os << std::string(name);
-    std::string contents(os.str());
-    ret = ec->put(parent, trim(contents));
-    if (ret != extent_protocol::OK)
-      r = IOERR;
+    ec->remove(inum);
+    return r;
   }
-  lc->release(inum);
-  lc->release(parent);
-
+  out = inum;
   return r;
 }
 
@@ -57,11 +57,16 @@ static inline std::string &trim(std::string &s) {
   static inum n2i(std::string);
   static inum i2bi(inum, int);
   lock_client *lc;
+  // directory updates: compare-and-swap puts, or the parent's lock
+  bool dircas;
+  int dirchange(inum, const char*, inum, bool, inum&);
  public:
   static uint32_t i2f(inum); // converts a 64-bit inum to 32-bit fuse id
   static inum f2i(uint32_t); // converts a 32-bit fuse id to 64-bit inum
 
-  yfs_client(std::string, std::string);
+  // with dircas set, directory listings are updated with versioned
+  // puts that retry on conflict instead of under the directory's lock
+  yfs_client(std::string, std::string, bool dircas = true);
 
   bool isfile(inum);
   bool isdir(inum);
@@ -84,6 +89,10 @@ static inline std::string &trim(std::string &s) {
   int unlink(inum, const char*,  bool do_not_lock=false);
 
   int setsize(inum, size_t);
+  // make the second file a copy of the first, on the extent server
+  int clone(inum, inum);
+  // take one more extent server on as a shard, given as host:port
+  int add_shard(std::string);
   int getsize(inum, size_t &);
 };
 